@@ -57,6 +57,7 @@ static double CLOSE_TO_CV = 0;
 #include "bow/bagOfWords.h"
 
 #include "featureExtract/featureExtractor.h"
+#include "framePipeline.h"
 
 #include "ransac/ransac.h"
 
@@ -2984,8 +2985,6 @@ public:
         if (pSO)
             pSO->initImLoader(pImageLoader);
 
-        boost::scoped_ptr<CFeatureExtractor> pFeatureExtractor(CFeatureExtractor::makeFeatureExtractor(BOWSLAMPARAMS.Im, BOWSLAMPARAMS.Corner, BOWSLAMPARAMS.PatchDescriptor, BOWSLAMPARAMS.DescriptorSetClustering));
-
         pFrame = cvCreateImage(BOWSLAMPARAMS.Im.SIZE(), IPL_DEPTH_8U, BOWSLAMPARAMS.Im.IM_CHANNELS);
         pFrame->origin = 0;
 
@@ -3006,10 +3005,15 @@ public:
             }
         }
 
+        boost::scoped_ptr<CFramePipeline> pPipeline; //Stops and joins its threads if we exit early
+
         try {
             try {
                 DEBUGONLY(cvSetZero(pFrame));
 
+                if (BOWSLAMPARAMS.Im.IM_SOURCE != CImParams::eImageSim)
+                    pPipeline.reset(new CFramePipeline(BOWSLAMPARAMS, boost::bind(&CBoWSLAM::GetImageByIdx, this, pImageLoader, _2, _1)));
+
                 TTime nId = 0;
                 for (int nIdx = 0; nId != FINISHED; nIdx++) {
                     if (boost::filesystem::exists("quit")) {
@@ -3023,17 +3027,20 @@ public:
                             nId = nIdx;
                             pDS = pImageSimulator->getSimDescriptors(nId);
                         } else {
-                            nId = GetImageByIdx(pImageLoader, pFrame, nIdx);
-                            if (nId != FINISHED) {
-                                try {
-                                    pDS = pFeatureExtractor->getDescriptors(pFrame);
-                                } catch (...) {
+                            CFramePipeline::CFrame * pLoadedFrame = pPipeline->next(); //In the order they were loaded
+                            if (pLoadedFrame) {
+                                nId = pLoadedFrame->nId;
+                                cvCopy(pLoadedFrame->pIm, pFrame);
+                                std::swap(pDS, pLoadedFrame->pDS);
+                                const bool bFailed = pLoadedFrame->bFailed;
+                                pPipeline->release(pLoadedFrame);
+
+                                if (nIdx % 20 == 0)
+                                    pPipeline->pp();
+
+                                if (bFailed) {
                                     cout << "Image loader thread caught exception, attempting to continue...\n";
                                     cvSaveImage("bad.png", pFrame);
-                                    if (pDS) {
-                                        delete pDS;
-                                        pDS = 0;
-                                    }
                                     continue;
                                 }
                             }
@@ -4242,6 +4249,7 @@ double run(const bool bOutput, const char* szConfigFile, const char * szOtherCon
     }
 
     BOWSLAMPARAMS.BOW.DescriptorBinning.RADIUS = BOWSLAMPARAMS.PatchDescriptor.radius();
+    CMatchableDescriptors::setMatchingThreads(BOWSLAMPARAMS.TOTAL_CORES);
     BOWSLAMPARAMS.MULTI_RUNS = !bOutput; //Todo: Same for tune
     BOWSLAMPARAMS.TUNE_PARAMS = (szOtherConfig != 0);
 
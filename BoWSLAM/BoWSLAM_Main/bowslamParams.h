@@ -38,6 +38,8 @@ WRAPPERPARAMCLASS(BoWSLAM)
 	PARAM(DEPTH_THRESH, 0.01, 200, 0.2, "Threshhold where points become 'at infinity'. Points this far behind chosen cam also used." ) // Scale localisation error (in radians) by this to work out max depth before considered at infinity. High val will alllow many points reconstructed behind cam to be used.
 	PARAMB(EXTRAP, false, "Try extrapolating a link or 2 before giving up and starting a new map component. Constant velocity MM, uninformative scale. Sometimes helps.")
 	PARAM(READ_AHEAD_LIM, 0, 1000000, 3, "How far ahead can the image-loading thread get. SET LOW=0 FOR OUTPUTTING VIDEO FRAMES")
+	PARAM(EXTRACT_THREADS, 1, 64, 2, "Frames have features extracted by this many threads at once (each with its own feature extractor). Frames are still added to the BoW database and mapped in order.")
+	PARAM(PIPELINE_FRAMES, 1, 64, 4, "Max frames being loaded or having features extracted at once. Need at least EXTRACT_THREADS+1 to keep all the extraction threads busy.")
 	PARAMB(MULTI_RUNS, false, "Internal flag turning off output--tuning or something is happening")
 	PARAMB(TUNE_PARAMS, false, "Internal flag turning off output for tuning")
     CHILDCLASS(BOW, "Bag-of-Words")
@@ -64,7 +66,7 @@ WRAPPERPARAMCLASS(BoWSLAM)
 	CNumParam<int> TOTAL_CORES, FRAMERATE_MS;
 	CNumParam<double> DEPTH_THRESH;
 	CNumParam<bool> EXTRAP;
-	CNumParam<int> READ_AHEAD_LIM;
+	CNumParam<int> READ_AHEAD_LIM, EXTRACT_THREADS, PIPELINE_FRAMES;
 	CNumParamDerived<bool> MULTI_RUNS, TUNE_PARAMS;
 
 	PARAMCLASS(ConstrainScale)
@@ -0,0 +1,211 @@
+/* Code by Tom Botterill. Documentation and license at http://www.hilandtom.com/tombotterill/code */
+
+/*
+ * framePipeline.cpp
+ */
+
+#include "framePipeline.h"
+#include "featureExtract/featureExtractor.h"
+#include <boost/bind.hpp>
+#include <iostream>
+
+using namespace std;
+
+static boost::posix_time::ptime now()
+{
+	return boost::posix_time::microsec_clock::universal_time();
+}
+
+void CFramePipeline::CStageStats::add(const boost::posix_time::ptime & start, const boost::posix_time::ptime & end)
+{
+	dTotal += 1e-6*(double)(end - start).total_microseconds();
+	nCount++;
+}
+
+void CFramePipeline::CStageStats::pp(const char * szStage, const int nQueued) const
+{
+	cout << szStage << ": " << (nCount ? 1000.0*dTotal/nCount : 0.0) << "ms/frame";
+	if(nQueued >= 0)
+		cout << ", " << nQueued << " queued (max " << nMaxQueued << ")";
+	cout << endl;
+}
+
+CFramePipeline::CFramePipeline(const CBoWSLAMParams & BOWSLAMPARAMS, TLoadFn loadFn) : loadFn(loadFn), aFrames(BOWSLAMPARAMS.PIPELINE_FRAMES), nNextSeq(0), nFramesLoaded(-1), bStop(false), bLoadFailed(false)
+{
+	for(int i=0; i<(int)aFrames.size(); i++)
+	{
+		aFrames[i].pIm = cvCreateImage(BOWSLAMPARAMS.Im.SIZE(), IPL_DEPTH_8U, BOWSLAMPARAMS.Im.IM_CHANNELS);
+		aFrames[i].pIm->origin = 0;
+		aFrames[i].pDS = 0;
+		apFree.push_back(&aFrames[i]);
+	}
+
+	for(int i=0; i<BOWSLAMPARAMS.EXTRACT_THREADS; i++)
+		aExtractors.push_back(CFeatureExtractor::makeFeatureExtractor(BOWSLAMPARAMS.Im, BOWSLAMPARAMS.Corner, BOWSLAMPARAMS.PatchDescriptor, BOWSLAMPARAMS.DescriptorSetClustering));
+
+	threads.create_thread(boost::bind(&CFramePipeline::loadFrames, this));
+	for(int i=0; i<(int)aExtractors.size(); i++)
+		threads.create_thread(boost::bind(&CFramePipeline::extractFrames, this, &aExtractors[i]));
+}
+
+CFramePipeline::~CFramePipeline()
+{
+	stop();
+	threads.join_all();
+
+	for(int i=0; i<(int)aFrames.size(); i++)
+	{
+		delete aFrames[i].pDS;
+		cvReleaseImage(&aFrames[i].pIm);
+	}
+}
+
+void CFramePipeline::stop()
+{
+	boost::mutex::scoped_lock lock(mxPipeline);
+	bStop = true;
+	cvFree.notify_all();
+	cvLoaded.notify_all();
+	cvExtracted.notify_all();
+}
+
+void CFramePipeline::loadFrames()
+{
+	for(int nIdx=0; ; nIdx++)
+	{
+		CFrame * pFrame = 0;
+		{
+			boost::mutex::scoped_lock lock(mxPipeline);
+			while(apFree.empty() && !bStop)
+				cvFree.wait(lock);
+			if(bStop)
+				return;
+			pFrame = apFree.back();
+			apFree.pop_back();
+		}
+
+		const boost::posix_time::ptime loadStart = now();
+		int nId = -1;
+		bool bFailed = false;
+		CException loadException;
+		try
+		{
+			nId = loadFn(nIdx, pFrame->pIm);
+		}
+		catch(CException pEx)
+		{
+			bFailed = true;
+			loadException = pEx;
+		}
+		catch(...)
+		{
+			bFailed = true;
+			loadException = CException("Unknown exception caught loading a frame");
+		}
+
+		boost::mutex::scoped_lock lock(mxPipeline);
+		if(nId == -1 || bFailed)
+		{
+			//Deliver the frames before this one, then next() rethrows on the consumer's thread
+			bLoadFailed = bFailed;
+			loaderException = loadException;
+			apFree.push_back(pFrame);
+			nFramesLoaded = nIdx;
+			cvLoaded.notify_all();
+			cvExtracted.notify_all();
+			return;
+		}
+
+		pFrame->nSeq = nIdx;
+		pFrame->nId = nId;
+		pFrame->loaded = now();
+		loadStats.add(loadStart, pFrame->loaded);
+		qLoaded.push(pFrame);
+		extractQueueStats.queued(qLoaded.size());
+		cvLoaded.notify_one();
+	}
+}
+
+void CFramePipeline::extractFrames(CFeatureExtractor * pExtractor)
+{
+	for(;;)
+	{
+		CFrame * pFrame = 0;
+		{
+			boost::mutex::scoped_lock lock(mxPipeline);
+			while(qLoaded.empty() && nFramesLoaded < 0 && !bStop)
+				cvLoaded.wait(lock);
+			if(bStop || qLoaded.empty())
+				return;
+			pFrame = qLoaded.front();
+			qLoaded.pop();
+		}
+
+		pFrame->extractStart = now();
+		pFrame->pDS = 0;
+		pFrame->bFailed = false;
+		try
+		{
+			pFrame->pDS = pExtractor->getDescriptors(pFrame->pIm);
+		}
+		catch(...)
+		{
+			pFrame->bFailed = true;
+		}
+		pFrame->extracted = now();
+
+		boost::mutex::scoped_lock lock(mxPipeline);
+		extractQueueStats.add(pFrame->loaded, pFrame->extractStart);
+		extractStats.add(pFrame->extractStart, pFrame->extracted);
+		mExtracted[pFrame->nSeq] = pFrame;
+		deliveryQueueStats.queued(mExtracted.size());
+		if(pFrame->nSeq == nNextSeq)
+			cvExtracted.notify_all();
+	}
+}
+
+CFramePipeline::CFrame * CFramePipeline::next()
+{
+	boost::mutex::scoped_lock lock(mxPipeline);
+	for(;;)
+	{
+		if(bStop)
+			return 0;
+		if(nNextSeq == nFramesLoaded)
+		{
+			if(bLoadFailed)
+				throw loaderException;
+			return 0;
+		}
+
+		std::map<int, CFrame *>::iterator pNext = mExtracted.find(nNextSeq);
+		if(pNext != mExtracted.end())
+		{
+			CFrame * pFrame = pNext->second;
+			mExtracted.erase(pNext);
+			nNextSeq++;
+			deliveryQueueStats.add(pFrame->extracted, now());
+			return pFrame;
+		}
+		cvExtracted.wait(lock);
+	}
+}
+
+void CFramePipeline::release(CFrame * pFrame)
+{
+	delete pFrame->pDS;
+	pFrame->pDS = 0;
+
+	boost::mutex::scoped_lock lock(mxPipeline);
+	apFree.push_back(pFrame);
+	cvFree.notify_one();
+}
+
+void CFramePipeline::pp()
+{
+	boost::mutex::scoped_lock lock(mxPipeline);
+	loadStats.pp("Load", -1);
+	extractQueueStats.pp("Wait for extraction", qLoaded.size());
+	extractStats.pp("Extract", -1);
+	deliveryQueueStats.pp("Wait for earlier frames", mExtracted.size());
+}
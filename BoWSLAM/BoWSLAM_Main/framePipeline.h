@@ -0,0 +1,100 @@
+/* Code by Tom Botterill. Documentation and license at http://www.hilandtom.com/tombotterill/code */
+
+/*
+ * framePipeline.h
+ *
+ * Loads frames and extracts their features in parallel, and delivers them (with their descriptors) in the order
+ * they were loaded. One thread loads frames (the image source loads one at a time anyway), and EXTRACT_THREADS
+ * threads extract features, each with its own feature extractor. At most PIPELINE_FRAMES frames are in flight:
+ * the loader blocks until the consumer releases one, so it can't get far ahead.
+ */
+
+#ifndef FRAMEPIPELINE_H_
+#define FRAMEPIPELINE_H_
+
+#include "util/exception.h"
+#include "util/opencv.h"
+#include "geom/geom.h"
+#include "description/descriptor.h"
+#include "bowslamParams.h"
+#include <boost/noncopyable.hpp>
+#include <boost/function.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <vector>
+#include <queue>
+#include <map>
+
+class CFeatureExtractor;
+
+class CFramePipeline : boost::noncopyable
+{
+public:
+	typedef boost::function<int (int nIdx, IplImage * pIm)> TLoadFn; //Load the nIdx'th frame into pIm. Returns its id, or -1 when there are no more frames
+
+	class CFrame
+	{
+		friend class CFramePipeline;
+		int nSeq;
+		boost::posix_time::ptime loaded, extractStart, extracted;
+	public:
+		int nId;
+		IplImage * pIm;
+		CDescriptorSet * pDS; //Take it before releasing the frame, or it's deleted
+		bool bFailed; //Feature extraction threw
+	};
+
+private:
+	//Time in each stage, and the most frames waiting at each queue
+	class CStageStats
+	{
+		double dTotal;
+		int nCount, nMaxQueued;
+	public:
+		CStageStats() : dTotal(0), nCount(0), nMaxQueued(0) {}
+		void add(const boost::posix_time::ptime & start, const boost::posix_time::ptime & end);
+		void queued(const int nQueued) { if(nQueued > nMaxQueued) nMaxQueued = nQueued; }
+		void pp(const char * szStage, const int nQueued) const; //nQueued=-1 for stages without a queue
+	};
+
+	TLoadFn loadFn;
+	boost::ptr_vector<CFeatureExtractor> aExtractors;
+	std::vector<CFrame> aFrames;
+
+	boost::mutex mxPipeline;
+	boost::condition_variable cvFree, cvLoaded, cvExtracted;
+	std::vector<CFrame *> apFree;
+	std::queue<CFrame *> qLoaded;
+	std::map<int, CFrame *> mExtracted; //By sequence number, until they're next
+	int nNextSeq, nFramesLoaded; //nFramesLoaded is -1 until the loader finishes
+	bool bStop;
+	bool bLoadFailed; //loadFn threw loaderException; next() rethrows it after the frames before it
+	CException loaderException;
+	CStageStats loadStats, extractQueueStats, extractStats, deliveryQueueStats;
+
+	boost::thread_group threads;
+
+	void loadFrames();
+	void extractFrames(CFeatureExtractor * pExtractor);
+
+public:
+	CFramePipeline(const CBoWSLAMParams & BOWSLAMPARAMS, TLoadFn loadFn);
+	~CFramePipeline(); //Stops loading and extraction, and deletes any descriptors not delivered
+
+	//Blocks until the next frame is ready. Returns 0 when there are no more, or rethrows the exception if loading a frame threw
+	CFrame * next();
+
+	//Call when finished with a frame so its image can be reused
+	void release(CFrame * pFrame);
+
+	//Stop early; next() then returns 0
+	void stop();
+
+	//Print queue depths and average time per stage
+	void pp();
+};
+
+#endif /* FRAMEPIPELINE_H_ */
@@ -9,6 +9,10 @@
 #include <boost/smart_ptr.hpp>
 #include "time/SpeedTest.h"
 #include "util/cout_TS.h"
+#include <fstream>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <typeinfo>
 
 #ifndef __GNUC__
 #include <windows.h>
@@ -25,6 +29,9 @@ using namespace std;
 
 #define INVALID_WORD (unsigned int)-1
 
+#define BOW_FILE_MAGIC 0x57426f43 //"CoBW"
+#define BOW_FILE_VERSION 2
+
 #define DEBUG_CHECKIDX(i) //{if(IS_DEBUG) CHECK(i>MAX_WORDS || i<0, "CBoW::CBoW::CBoWDictionary: Index check failed");}
 
 //Setup statics:
@@ -43,8 +50,6 @@ void CBoW::setupIntIntLogCache() {
 
 double CBoW::adIntLogCache[INT_LOG_CACHE_LIM] = {};
 int CBoW::anIntLogCache[INTINT_LOG_CACHE_LIM] = {};
-int CBoW::nCache_i = -1;
-int CBoW::nLog_i = -1;
 COUNTHITS(int CBoW::nHit = 0; int CBoW::nMiss = 0; int CBoW::nCache = 0);
 //int CBoW::CBoWWordBag::BF_LEVEL = 4; //What level do we use for smart BF matching?
 //int CBoW::CBoWWordBag::BF_NN = 3; //return 2-2 and 3-3 corr's
@@ -168,6 +173,9 @@ CBoW::CBoWDictionary::CBoWDictionary(const CCluster * pParentCluster, CDescripto
     //memset(anWordLevelCounts, 0, sizeof(int)*nLevel);
     setZero(anWordLevelCounts, nLevel);
 
+    if (nLevel == BOWCLUSTERPARAMS.LEVELS)
+        CDescriptorSet::setClusteringThreads(BINNING_PARAMS.CLUSTER_THREADS);
+
     /*boost::scoped_ptr<CClusterSet>*/ pClusters = pDescriptors->Cluster(nClusters, pParentCluster);
     CHECK(!pClusters->Assigned(), "CBoW::CBoW::CBoWDictionary: Descriptors not assigned to centres");
 
@@ -317,6 +325,9 @@ void CBoW::RecreateWB() {
     } else
         (this->*pfn_RecreateWordBags)(vImages.begin(), vImages.end(), wordWeightBarrier);
 
+    if (useInvertedFile())
+        buildInvertedFile(); //Needs the final word weights, so after all the threads have finished
+
     testCorrespondences();
     //DEBUGONLY(testCorrespondences());
 
@@ -609,6 +620,9 @@ void CBoW::ReplaceDictionary_int(CBoW::CBoWDictionary ** ppNewDictionary) {
 
     const int LEVELS = PARAMS.BOWClustering.LEVELS;
 
+    delete pFrozenDictionary;
+    pFrozenDictionary = 0;
+
     if (pDictionary) {
         delete pDictionary;
         pDictionary = 0;
@@ -616,6 +630,9 @@ void CBoW::ReplaceDictionary_int(CBoW::CBoWDictionary ** ppNewDictionary) {
     pDictionary = *ppNewDictionary;
     *ppNewDictionary = 0;
 
+    if (PARAMS.FROZEN_DICTIONARY)
+        pFrozenDictionary = new CBoWFrozenDictionary(pDictionary, LEVELS);
+
     const int * anWordCounts = pDictionary->WordCountArray();
     cout << anWordCounts[LEVELS - 1] << " words in total. ";
     if (anWordCounts[LEVELS - 1])
@@ -672,6 +689,7 @@ CBoW::CBoWWord::CBoWWord(CCluster * pCluster) {
     if(IS_DEBUG) CHECK(!pDescriptor, "CBoW::CBoWWord::CBoWWord: No cluster centre");
 
     nTotalOccurances = 0; //how many images does it occur in
+    nDescriptorCount = 0;
 }
 
 CBoW::CBoWNodeWord::CBoWNodeWord(CCluster * pCluster, const CBoW::CBoWDictionary::CGetClusterNum & getClusterCount, int nLevel, const int * anLevelWordCounts_in, const CBOWParams::CDescriptorBinningParams & BINNING_PARAMS, const CBOWParams::CBOWClusteringParams & BOWCLUSTERPARAMS, CClusterDrawer ** ppDrawCS)
@@ -679,6 +697,10 @@ CBoW::CBoWNodeWord::CBoWNodeWord(CCluster * pCluster, const CBoW::CBoWDictionary
     pSubDictionary = new CBoW::CBoWDictionary(pCluster, pCluster->Members(), getClusterCount, nLevel, anLevelWordCounts_in, BINNING_PARAMS, BOWCLUSTERPARAMS, ppDrawCS);
 }
 
+CBoW::CBoWWord::CBoWWord(const CDescriptor * pDescriptor, int nTotalFrequency) : pDescriptor(pDescriptor), nTotalFrequency(nTotalFrequency), nTotalOccurances(0), nDescriptorCount(0), bIOwnMyDescriptor(true) {
+    if(IS_DEBUG) CHECK(!pDescriptor, "CBoW::CBoWWord::CBoWWord: No centre descriptor");
+}
+
 CBoW::CBoWWord::~CBoWWord() {
     if (bIOwnMyDescriptor)
         delete pDescriptor;
@@ -719,19 +741,6 @@ void CBoW::CBoWDictionary::LookupWordAllLevels(const CDescriptor * pDescriptor,
         cout << endl;*/
 
         pClosestWord = findBinaryChop(pClosestDesc, Words.begin(), Words.size());
-
-        DEBUGONLY(
-                static int s_nWordsNotFound = 0, s_nWordsFound = 0;
-        if (IS_DEBUG && !pClosestWord)
-                s_nWordsNotFound++;
-                //cout << "Warning: word not found. Maybe its cluster was too small\n";
-        else
-            s_nWordsFound++;
-
-            if (s_nWordsNotFound > s_nWordsFound / 5) {
-            cout << "Warning: " << s_nWordsNotFound << " words not found, " << s_nWordsFound << " words total. Prob from clusters being too small\n";
-        }
-        )
     }
 
     if (nLevel > 0) {
@@ -819,16 +828,6 @@ CBoW::CBoWWord * CBoW::CBoWDictionary::ClosestWord(const CDescriptor * pDescript
             dShortestDistance = dThisDist;
             nClosestWord = nWord;
         }
-
-        static int nShow100 = 5;
-        if (nShow100 > 0) {
-            if (nShow100 == 5)
-                cout << "Distances: ";
-            cout << dThisDist << ' ';
-            if (nShow100 == 1) cout << '\n';
-
-            nShow100--;
-        }
     }
     if (nClosestWord == INVALID_WORD) return 0;
     //if(IS_DEBUG) CHECK(nClosestWord==INVALID_WORD, "CBoW::CBoWDictionary::ClosestWord: No word found");
@@ -853,7 +852,570 @@ CBoW::CBoWDictionary::~CBoWDictionary() {
     delete pClusters;
 }
 
+void CBoW::CBoWDictionary::getLeafWords(CDynArray<CBoWDictionary *> & apLeafDictionaries, CDynArray<CBoWWord *> & apLeafWords) {
+    for (CDynArray<CBoWWord *>::iterator ppWord = Words.begin(); ppWord < Words.end(); ppWord++) {
+        if (nLevel == 1) {
+            apLeafDictionaries.push_back(this);
+            apLeafWords.push_back(*ppWord);
+        } else
+            static_cast<CBoWNodeWord *> (*ppWord)->SubDictionary()->getLeafWords(apLeafDictionaries, apLeafWords);
+    }
+}
+
+void CBoW::CBoWDictionary::replaceWord(CBoWWord * pOldWord, const CDynArray<CBoWWord *> & apNewWords) {
+    if(IS_DEBUG) CHECK(nLevel != 1, "CBoW::CBoWDictionary::replaceWord: Can only replace bottom-level words");
+
+    for (CDynArray<CBoWWord *>::iterator ppWord = Words.begin(); ppWord < Words.end(); ppWord++) {
+        if (*ppWord == pOldWord) {
+            Words.erase(ppWord);
+            for (CDynArray<CBoWWord *>::const_iterator ppNewWord = apNewWords.begin(); ppNewWord < apNewWords.end(); ppNewWord++)
+                Words.push_back(*ppNewWord);
+
+            std::sort(Words.begin(), Words.end(), CBoWWord::sortWordsByDescPtr);
+            return;
+        }
+    }
+    THROW("CBoW::CBoWDictionary::replaceWord: Word not in this dictionary");
+}
+
+//Recompute word counts at each level after words are split or dropped
+
+const int * CBoW::CBoWDictionary::recountWords() {
+    setZero(anWordLevelCounts, nLevel);
+    anWordLevelCounts[0] = Words.size();
+    if (nLevel > 1) {
+        for (CDynArray<CBoWWord *>::iterator ppWord = Words.begin(); ppWord < Words.end(); ppWord++) {
+            const int * anWordCountsBelow = static_cast<CBoWNodeWord *> (*ppWord)->SubDictionary()->recountWords();
+            for (int nEachLevel = 1; nEachLevel < nLevel; nEachLevel++)
+                anWordLevelCounts[nEachLevel] += anWordCountsBelow[nEachLevel - 1];
+        }
+    }
+    return anWordLevelCounts;
+}
+
+//Saved file format (native byte order):
+//Header: magic, version, LEVELS, word bag settings, descriptor type tag and size, whether postings are saved, number of image slots
+//Dictionaries in preorder: word count, then for each word its total frequency, occurance and descriptor counts, centre descriptor,
+//then either its postings (bottom level) or its sub-dictionary. Words are numbered in the order they're saved.
+//Image slots in vImages order, so postings' image indices still apply: id (DONT_ADD if erased), descriptor count, word bag at each
+//level (word number, frequency, weight, location count and locations for each word), brute-force matching list, then the descriptors.
+//Descriptors are saved without their vtable ptr, so only plain-data descriptor types can be saved.
+
+template<typename T>
+static T readFromMap(const char *& pData, const char * pDataEnd) {
+    CHECK(pData + sizeof (T) > pDataEnd, "CBoW::load: File truncated");
+    T val;
+    memcpy(&val, pData, sizeof (T));
+    pData += sizeof (T);
+    return val;
+}
+
+static const char * skipInMap(const char *& pData, const char * pDataEnd, const int nBytes) {
+    CHECK(nBytes < 0 || pData + nBytes > pDataEnd, "CBoW::load: File truncated");
+    const char * pStart = pData;
+    pData += nBytes;
+    return pStart;
+}
+
+template<typename T>
+static void writeToFile(std::ostream & file, const T & val) {
+    file.write((const char *) &val, sizeof (T));
+}
+
+//Descriptor types with the same size mustn't load as each other
+static std::string descriptorTypeTag(const CDescriptor * pDesc) {
+    return typeid (*pDesc).name();
+}
+
+static int descriptorPayloadSize(const CDescriptor * pDesc) {
+    return pDesc->size() - (int) sizeof (void *);
+}
+
+static void writeDescriptor(std::ostream & file, const CDescriptor * pDesc) {
+    file.write(pDesc->ptr(), descriptorPayloadSize(pDesc));
+}
+
+//Copy the payload over a clone of the prototype, so we get the right vtable
+static CDescriptor * readDescriptor(const char *& pData, const char * pDataEnd, const CDescriptor * pPrototype) {
+    const int nPayload = descriptorPayloadSize(pPrototype);
+    const char * pPayload = skipInMap(pData, pDataEnd, nPayload);
+
+    CDescriptor * pDesc = pPrototype->clone();
+    memcpy(pDesc->ptr(), pPayload, nPayload);
+
+    pDesc->assignToCluster(0, MAX_ALLOWED_DIST); //Saved cluster ptr is meaningless now
+    return pDesc;
+}
+
+template<typename TWord>
+static TWord * wordFromId(const CDynArray<TWord *> & apWordsById, const int nWordId) {
+    CHECK(nWordId < 0 || nWordId >= apWordsById.size(), "CBoW::load: Bad word number in file");
+    return apWordsById[nWordId];
+}
+
+void CBoW::CBoWDictionary::save(std::ostream & file, std::map<const CBoWWord *, int> & wordIds) const {
+    writeToFile<int>(file, Words.size());
+
+    for (CDynArray<CBoWWord *>::const_iterator ppWord = Words.begin(); ppWord != Words.end(); ppWord++) {
+        const CBoWWord * pWord = *ppWord;
+        const int nWordId = (int) wordIds.size();
+        wordIds[pWord] = nWordId;
+
+        writeToFile<int>(file, pWord->TotalFrequency());
+        writeToFile<int>(file, pWord->TotalOccurances());
+        writeToFile<int>(file, pWord->DescriptorCount());
+        writeDescriptor(file, pWord->Descriptor());
+
+        if (nLevel > 1)
+            static_cast<const CBoWNodeWord *> (pWord)->SubDictionary()->save(file, wordIds);
+        else {
+            const CBoWWord::CPostingList & postings = pWord->Postings();
+            writeToFile<int>(file, postings.size());
+            writeToFile<int>(file, postings.lastImageIdx());
+            writeToFile<int>(file, (int) (postings.encodedEnd() - postings.encodedBegin()));
+            file.write((const char *) postings.encodedBegin(), postings.encodedEnd() - postings.encodedBegin());
+        }
+    }
+}
+
+CBoW::CBoWDictionary::CBoWDictionary(const char *& pData, const char * pDataEnd, int nLevel_in, const CDescriptor * pPrototype, CDynArray<CBoWWord *> & apWordsById)
+: nLevel(nLevel_in), nFirstWordIdx(0), anWordLevelCounts(0), pClusters(0) {
+    CHECK(nLevel <= 0 || nLevel >= MAX_BOW_LEVELS, "CBoW::CBoWDictionary: Bad level in file");
+
+    const int nWords = readFromMap<int>(pData, pDataEnd);
+    CHECK(nWords < 0, "CBoW::CBoWDictionary: Bad word count in file");
+
+    anWordLevelCounts = new int[nLevel];
+    setZero(anWordLevelCounts, nLevel);
+    anWordLevelCounts[0] = nWords;
+
+    Words.reserve(nWords);
+
+    for (int nWord = 0; nWord < nWords; nWord++) {
+        const int nTotalFrequency = readFromMap<int>(pData, pDataEnd);
+        const int nTotalOccurances = readFromMap<int>(pData, pDataEnd);
+        const int nDescriptorCount = readFromMap<int>(pData, pDataEnd);
+        const CDescriptor * pCentre = readDescriptor(pData, pDataEnd, pPrototype);
+
+        CBoWWord * pWord = 0;
+        if (nLevel == 1) {
+            pWord = new CBoWWord(pCentre, nTotalFrequency);
+            apWordsById.push_back(pWord);
+
+            const int nPostings = readFromMap<int>(pData, pDataEnd);
+            const int nLastImageIdx = readFromMap<int>(pData, pDataEnd);
+            const int nBytes = readFromMap<int>(pData, pDataEnd);
+            pWord->mapPostings((const unsigned char *) skipInMap(pData, pDataEnd, nBytes), nBytes, nPostings, nLastImageIdx);
+        } else {
+            const int nWordId = apWordsById.size();
+            apWordsById.push_back(0); //Numbered before its sub-dictionary's words
+
+            CBoWDictionary * pSubDictionary = new CBoWDictionary(pData, pDataEnd, nLevel - 1, pPrototype, apWordsById);
+            pWord = new CBoWNodeWord(pCentre, nTotalFrequency, pSubDictionary);
+            apWordsById[nWordId] = pWord;
+
+            const int * anWordCountsBelow = pSubDictionary->WordCountArray();
+            for (int nEachLevel = 1; nEachLevel < nLevel; nEachLevel++)
+                anWordLevelCounts[nEachLevel] += anWordCountsBelow[nEachLevel - 1];
+        }
+        pWord->setCounts(nTotalOccurances, nDescriptorCount);
+        Words.push_back(pWord);
+    }
+
+    std::sort(Words.begin(), Words.end(), CBoW::CBoWWord::sortWordsByDescPtr);
+}
+
+CBoW::CBoWWordBag::CBoWImageWord::CBoWImageWord(CBoWWord * pWord_in, int nFrequency_in, int nWeight_in, const char *& pData, const char * pDataEnd) : pWord(pWord_in), nFrequency(nFrequency_in), nWeight(nWeight_in) {
+    CHECK(nFrequency < 1 || nWeight < 0, "CBoW::load: Bad word in file");
+
+    aLocations.pLoc = 0;
+    const int nLocations = readFromMap<int>(pData, pDataEnd);
+    CHECK(nLocations != 0 && (nLocations != nFrequency || nFrequency > LOCATION_STORE_LIM), "CBoW::load: Bad location count in file");
+
+    if (nLocations == 1)
+        aLocations = readFromMap<CLocation>(pData, pDataEnd);
+    else if (nLocations > 1) {
+        aLocations.pLoc = new CLocation[nLocations == 2 ? 2 : LOCATION_STORE_LIM]; //Sizes as IncrementFrequency allocates
+        for (int i = 0; i < nLocations; i++)
+            aLocations.pLoc[i] = readFromMap<CLocation>(pData, pDataEnd);
+    }
+}
+
+void CBoW::CBoWWordBag::save(std::ostream & file, const std::map<const CBoWWord *, int> & wordIds) const {
+    const int LEVELS = pParent->PARAMS.BOWClustering.LEVELS;
+
+    writeToFile<int>(file, nId);
+    writeToFile<int>(file, nDescriptorCount);
+
+    for (int nLevel = 0; nLevel < LEVELS; nLevel++) {
+        writeToFile<int>(file, aWords[nLevel].size());
+        for (TWordBag::const_iterator pImWord = aWords[nLevel].begin(); pImWord != aWords[nLevel].end(); pImWord++) {
+            writeToFile<int>(file, wordIds.find(pImWord->Word())->second);
+            writeToFile<int>(file, pImWord->FrequencyInImage());
+            writeToFile<int>(file, pImWord->Weight());
+
+            const int nLocations = pImWord->locationCount();
+            writeToFile<int>(file, nLocations);
+            for (int i = 0; i < nLocations; i++)
+                writeToFile<CLocation>(file, pImWord->Location(i));
+        }
+    }
+
+    writeToFile<int>(file, aDescriptorWordsBF.size());
+    for (CDynArray<CBoWWordDescMatch>::const_iterator pMatch = aDescriptorWordsBF.begin(); pMatch != aDescriptorWordsBF.end(); pMatch++) {
+        writeToFile<int>(file, wordIds.find(pMatch->Word())->second);
+        writeToFile<int>(file, pMatch->DescriptorSetIdx());
+    }
+
+    {
+        boost::mutex::scoped_lock lock(pParent->mxMappedDescriptors);
+        if (pMappedDescriptors && !pDescriptors) { //Not needed since we were loaded, so still just bytes
+            file.write(pMappedDescriptors, nDescriptorCount * descriptorPayloadSize(pParent->pMappedPrototype->get_const(0)));
+            return;
+        }
+    }
+    for (int i = 0; i < nDescriptorCount; i++)
+        writeDescriptor(file, pDescriptors->get_const(i));
+}
+
+CBoW::CBoWWordBag::CBoWWordBag(const char *& pData, const char * pDataEnd, const CBoW * pParent_in, int nId_in, const CDynArray<CBoWWord *> & apWordsById) : pParent(pParent_in), aWords(0), pDescriptors(0), nDescriptorCount(0), pMappedDescriptors(0), nId(nId_in) {
+    const int LEVELS = pParent->PARAMS.BOWClustering.LEVELS;
+    const CDescriptor * pPrototype = pParent->pMappedPrototype->get_const(0);
+
+    nDescriptorCount = readFromMap<int>(pData, pDataEnd);
+    CHECK(nDescriptorCount <= 0, "CBoW::load: Bad image in file");
+
+    aWords = new TWordBag[LEVELS];
+    try {
+        for (int nLevel = 0; nLevel < LEVELS; nLevel++) {
+            const int nWords = readFromMap<int>(pData, pDataEnd);
+            CHECK(nWords < 0 || nWords > nDescriptorCount, "CBoW::load: Bad word bag in file");
+            aWords[nLevel].reserve(nWords);
+
+            for (int nWord = 0; nWord < nWords; nWord++) {
+                CBoWWord * pWord = wordFromId(apWordsById, readFromMap<int>(pData, pDataEnd));
+                const int nFrequency = readFromMap<int>(pData, pDataEnd);
+                const int nWeight = readFromMap<int>(pData, pDataEnd);
+                aWords[nLevel].push_back(CBoWImageWord(pWord, nFrequency, nWeight, pData, pDataEnd));
+            }
+            std::sort(aWords[nLevel].begin(), aWords[nLevel].end(), WordPointerSort()); //Word ptrs are different from when saved
+        }
+
+        const int nBFWords = readFromMap<int>(pData, pDataEnd);
+        CHECK(nBFWords < 0 || nBFWords > nDescriptorCount, "CBoW::load: Bad brute-force matching list in file");
+        aDescriptorWordsBF.reserve(nBFWords);
+        for (int i = 0; i < nBFWords; i++) {
+            const CBoWWord * pWord = wordFromId(apWordsById, readFromMap<int>(pData, pDataEnd));
+            const int nDescIdx = readFromMap<int>(pData, pDataEnd);
+            CHECK(nDescIdx < 0 || nDescIdx >= nDescriptorCount, "CBoW::load: Bad brute-force matching list in file");
+            aDescriptorWordsBF.push_back(CBoWWordDescMatch(pWord, nDescIdx));
+        }
+        std::sort(aDescriptorWordsBF.begin(), aDescriptorWordsBF.end(), CBoWWordDescMatch::CBoWWordDescMatchSort());
+
+        pMappedDescriptors = skipInMap(pData, pDataEnd, nDescriptorCount * descriptorPayloadSize(pPrototype));
+    } catch (...) {
+        for (int nLevel = 0; nLevel < LEVELS; nLevel++)
+            for (TWordBag::iterator pImWord = aWords[nLevel].begin(); pImWord < aWords[nLevel].end(); pImWord++)
+                pImWord->DestroyLoc();
+        delete [] aWords;
+        throw;
+    }
+}
+
+//Copy a loaded image's descriptors out of the mapped file into its own arena, when they're first needed
+void CBoW::CBoWWordBag::materialiseDescriptors() const {
+    boost::mutex::scoped_lock lock(pParent->mxMappedDescriptors);
+    if (pDescriptors)
+        return;
+
+    const CDescriptor * pPrototype = pParent->pMappedPrototype->get_const(0);
+    const int nSize = pPrototype->size(), nPayload = descriptorPayloadSize(pPrototype);
+
+    CDescriptorSet * pDS = pParent->pMappedPrototype->makeNewDS(nDescriptorCount);
+    CDescriptorArena * pArena = pDS->arena();
+    const char * pPayload = pMappedDescriptors;
+    for (int i = 0; i < nDescriptorCount; i++, pPayload += nPayload) {
+        CDescriptor * pDesc = (CDescriptor *) pArena->alloc(nSize);
+        memcpy((void *) pDesc, pPrototype, nSize); //vtable ptr
+        memcpy(pDesc->ptr(), pPayload, nPayload);
+        pDesc->assignToCluster(0, MAX_ALLOWED_DIST);
+        pDS->Push(pDesc);
+    }
+    pDescriptors = pDS;
+}
+
+void CBoW::save(const char * szFilename) {
+    READ_LOCK;
+
+    CHECK(!pDictionary, "CBoW::save: No dictionary yet, nothing worth saving");
+
+    const CDescriptor * pPrototype = pMappedPrototype ? pMappedPrototype->get_const(0) : 0;
+    for (constImIt ppIm = vImages.begin(); ppIm != vImages.end() && !pPrototype; ppIm++)
+        if (*ppIm)
+            pPrototype = (*ppIm)->DescriptorSet()->get_const(0);
+    CHECK(!pPrototype, "CBoW::save: No images");
+    CHECK(!pPrototype->plainData(), "CBoW::save: Descriptors must be plain data to be saved (they'd be saved with pointers into this process)");
+
+    std::ofstream file(szFilename, std::ios::binary | std::ios::out | std::ios::trunc);
+    CHECK(!file.is_open(), "CBoW::save: Cannot open file for writing");
+
+    const std::string typeTag = descriptorTypeTag(pPrototype);
+
+    writeToFile<int>(file, BOW_FILE_MAGIC);
+    writeToFile<int>(file, BOW_FILE_VERSION);
+    writeToFile<int>(file, PARAMS.BOWClustering.LEVELS);
+    writeToFile<int>(file, PARAMS.COMP_METHOD);
+    writeToFile<int>(file, PARAMS.WB_WEIGHT_METHOD);
+    writeToFile<int>(file, PARAMS.COMPACT_WORD_BAGS ? 1 : 0);
+    writeToFile<int>(file, PARAMS.BOWClustering.BRUTEFORCE_MATCHING_LEVEL());
+    writeToFile<int>(file, (int) typeTag.size());
+    file.write(typeTag.c_str(), typeTag.size());
+    writeToFile<int>(file, pPrototype->size());
+    writeToFile<int>(file, useInvertedFile() ? 1 : 0);
+    writeToFile<int>(file, vImages.size_th());
+
+    std::map<const CBoWWord *, int> wordIds;
+    pDictionary->save(file, wordIds);
+
+    for (constImIt ppIm = vImages.begin(); ppIm != vImages.end(); ppIm++) {
+        if (*ppIm)
+            (*ppIm)->save(file, wordIds);
+        else
+            writeToFile<int>(file, DONT_ADD); //erased
+    }
+
+    CHECK(!file.good(), "CBoW::save: Error writing file");
+}
+
+void CBoW::load(const char * szFilename, const CDescriptorSet * pPrototype) {
+    CHECK(!pPrototype || !pPrototype->Count(), "CBoW::load: Need a non-empty prototype descriptor set");
+    const CDescriptor * pPrototypeDesc = pPrototype->get_const(0);
+    CHECK(!pPrototypeDesc->plainData(), "CBoW::load: Only plain-data descriptors can be loaded");
+
+    MX_NO_DELETE_WHILE_CLUSTER_IN_SEPERATE_THREAD;
+    WRITE_LOCK;
+
+    CHECK(pDictionary || vImages.Count() || bClustering || pMappedFile, "CBoW::load: Can only load into an empty CBoW");
+
+    try {
+        boost::interprocess::file_mapping mappedFile(szFilename, boost::interprocess::read_only);
+        pMappedFile = new boost::interprocess::mapped_region(mappedFile, boost::interprocess::read_only); //Still valid once mappedFile is closed
+    } catch (boost::interprocess::interprocess_exception &) {
+        THROW("CBoW::load: Cannot map file");
+    }
+
+    const char * pData = (const char *) pMappedFile->get_address();
+    const char * pDataEnd = pData + pMappedFile->get_size();
+
+    CHECK(readFromMap<int>(pData, pDataEnd) != BOW_FILE_MAGIC, "CBoW::load: Not a saved CBoW file");
+    CHECK(readFromMap<int>(pData, pDataEnd) != BOW_FILE_VERSION, "CBoW::load: Unsupported file version");
+    CHECK(readFromMap<int>(pData, pDataEnd) != PARAMS.BOWClustering.LEVELS, "CBoW::load: File was saved with a different number of levels");
+    CHECK(readFromMap<int>(pData, pDataEnd) != PARAMS.COMP_METHOD, "CBoW::load: File was saved with a different COMP_METHOD");
+    CHECK(readFromMap<int>(pData, pDataEnd) != PARAMS.WB_WEIGHT_METHOD, "CBoW::load: File was saved with a different WB_WEIGHT_METHOD");
+    CHECK(readFromMap<int>(pData, pDataEnd) != (PARAMS.COMPACT_WORD_BAGS ? 1 : 0), "CBoW::load: File was saved with a different COMPACT_WORD_BAGS");
+    CHECK(readFromMap<int>(pData, pDataEnd) != PARAMS.BOWClustering.BRUTEFORCE_MATCHING_LEVEL(), "CBoW::load: File was saved with a different brute-force matching level");
+
+    const int nTagLength = readFromMap<int>(pData, pDataEnd);
+    const char * szTag = skipInMap(pData, pDataEnd, nTagLength);
+    CHECK(std::string(szTag, nTagLength) != descriptorTypeTag(pPrototypeDesc), "CBoW::load: File was saved with a different descriptor type");
+    CHECK(readFromMap<int>(pData, pDataEnd) != pPrototypeDesc->size(), "CBoW::load: File was saved with a different descriptor size");
+
+    const bool bSavedPostings = readFromMap<int>(pData, pDataEnd) != 0;
+    const int nImageSlots = readFromMap<int>(pData, pDataEnd);
+    CHECK(nImageSlots < 0, "CBoW::load: Bad image count in file");
+
+    pMappedPrototype = pPrototype->makeNewDS(1);
+    pMappedPrototype->Push(pPrototypeDesc->clone());
+
+    CDynArray<CBoWWord *> apWordsById;
+    pDictionary = new CBoWDictionary(pData, pDataEnd, PARAMS.BOWClustering.LEVELS, pPrototypeDesc, apWordsById);
+
+    for (int nSlot = 0; nSlot < nImageSlots; nSlot++) {
+        const int nId = readFromMap<int>(pData, pDataEnd);
+        if (nId == DONT_ADD)
+            vImages.PushErased();
+        else {
+            CHECK(vImages.exists(nId), "CBoW::load: Repeated image id in file");
+            vImages.Push(new CBoWWordBag(pData, pDataEnd, this, nId, apWordsById));
+        }
+    }
+    CHECK(pData != pDataEnd, "CBoW::load: Trailing data in file");
+
+    if (PARAMS.FROZEN_DICTIONARY)
+        pFrozenDictionary = new CBoWFrozenDictionary(pDictionary, PARAMS.BOWClustering.LEVELS);
+
+    if (useInvertedFile() && !bSavedPostings) //Saved without an inverted file. Word bags are already weighted, so this is quick
+        buildInvertedFile();
+
+    nNextClusterCount = doubleToInt(vImages.totalDescriptorCount() * PARAMS.BOWClustering.RECLUSTER_FREQUENCY);
+
+    resetBeforeRecreateWB();
+    doOR();
+
+    RELEASE_WRITE_LOCK;
+}
+
+#define FROZEN_BLOCK_ALIGN 64 //cache line
+#define FROZEN_STRIDE_ALIGN 16
+
+CBoW::CBoWFrozenDictionary::CBoWFrozenDictionary(const CBoWDictionary * pDictionary, const int LEVELS) : LEVELS(LEVELS), nStride(0) {
+    if(IS_DEBUG) CHECK(!pDictionary || pDictionary->Level() != LEVELS, "CBoWFrozenDictionary: Bad dictionary");
+
+    aapWords = new CDynArray<CBoWWord *>[LEVELS];
+    aaChildren = new CDynArray<CChildRange>[LEVELS];
+    apBlockMem = new char *[LEVELS];
+    apBlocks = new char *[LEVELS];
+    setZero(apBlockMem, LEVELS);
+    setZero(apBlocks, LEVELS);
+
+    //Breadth-first, so each word's children are adjacent in the level below
+    for (CDynArray<CBoWWord *>::const_iterator ppWord = pDictionary->Words.begin(); ppWord != pDictionary->Words.end(); ppWord++)
+        aapWords[0].push_back(*ppWord);
+
+    for (int nLevel = 0; nLevel < LEVELS - 1; nLevel++) {
+        aaChildren[nLevel].reserve(aapWords[nLevel].size());
+        for (int nWord = 0; nWord < (int) aapWords[nLevel].size(); nWord++) {
+            const CBoWDictionary * pSubDictionary = static_cast<const CBoWNodeWord *> (aapWords[nLevel][nWord])->SubDictionary();
+            const CDynArray<CBoWWord *> & subWords = pSubDictionary->Words;
+
+            aaChildren[nLevel].push_back(CChildRange(aapWords[nLevel + 1].size(), subWords.size()));
+            for (CDynArray<CBoWWord *>::const_iterator ppWord = subWords.begin(); ppWord != subWords.end(); ppWord++)
+                aapWords[nLevel + 1].push_back(*ppWord);
+        }
+    }
+
+    if (aapWords[0].size() == 0)
+        return;
+
+    //Descriptors are flat objects (see CDescriptor::clone) so we can copy them whole, vtable ptr and all
+    const int nSize = aapWords[0][0]->Descriptor()->size();
+    nStride = FROZEN_STRIDE_ALIGN * ((nSize + FROZEN_STRIDE_ALIGN - 1) / FROZEN_STRIDE_ALIGN);
+
+    for (int nLevel = 0; nLevel < LEVELS; nLevel++) {
+        const int nWords = aapWords[nLevel].size();
+        apBlockMem[nLevel] = new char[nWords * nStride + FROZEN_BLOCK_ALIGN];
+        apBlocks[nLevel] = (char *) (((size_t) apBlockMem[nLevel] + FROZEN_BLOCK_ALIGN - 1) & ~(size_t) (FROZEN_BLOCK_ALIGN - 1));
+
+        for (int nWord = 0; nWord < nWords; nWord++) {
+            const CDescriptor * pCentre = aapWords[nLevel][nWord]->Descriptor();
+            CHECK(pCentre->size() != nSize, "CBoWFrozenDictionary: Centres of different types");
+            memcpy(apBlocks[nLevel] + nWord * nStride, (const void *) pCentre, nSize);
+        }
+    }
+}
+
+CBoW::CBoWFrozenDictionary::~CBoWFrozenDictionary() {
+    for (int nLevel = 0; nLevel < LEVELS; nLevel++)
+        delete [] apBlockMem[nLevel]; //Copies of centres don't own anything, so no destructors to call
+
+    delete [] apBlockMem;
+    delete [] apBlocks;
+    delete [] aapWords;
+    delete [] aaChildren;
+}
+
+//Same words as CBoWDictionary::LookupWordAllLevels with no cluster hints. Level by level, so the block of
+//descriptors descends together and each level's centres are reused while they're still cached
+
+void CBoW::CBoWFrozenDictionary::LookupWordsAllLevels(const CDescriptorSet * pDescriptors, const int * anDescIdx, const int nCount, CBoWWord ** aWordPaths, const CDescriptor::TDist RADIUS) const {
+    ARRAY(CChildRange, aCandidates, nCount); //Where each descriptor's next word is
+    for (int i = 0; i < nCount; i++)
+        aCandidates[i] = CChildRange(0, aapWords[0].size());
+
+    for (int nLevel = 0; nLevel < LEVELS; nLevel++) {
+        const char * pBlock = apBlocks[nLevel];
+        const CDescriptor::TDist nMaxDist = (nLevel == LEVELS - 1) ? RADIUS : MAX_ALLOWED_DIST;
+
+        for (int i = 0; i < nCount; i++) {
+            CBoWWord ** apWords = aWordPaths + anDescIdx[i] * LEVELS;
+            CChildRange & candidates = aCandidates[i];
+
+            CDescriptor::TDist nClosestDist = nMaxDist;
+            const int nClosest = (candidates.nChildren > 0) ? pDescriptors->get_const(anDescIdx[i])->closestInBlock(pBlock + candidates.nFirstChild * nStride, candidates.nChildren, nStride, nClosestDist) : -1;
+
+            if (nClosest < 0) {
+                apWords[nLevel] = 0;
+                candidates.nChildren = 0; //so 0 at every level below too
+                continue;
+            }
+
+            const int nWord = candidates.nFirstChild + nClosest;
+            apWords[nLevel] = aapWords[nLevel][nWord];
+
+            if (nLevel < LEVELS - 1)
+                candidates = aaChildren[nLevel][nWord];
+        }
+    }
+}
+
+size_t CBoW::CBoWFrozenDictionary::memoryUsage() const {
+    size_t nBytes = sizeof (*this);
+    for (int nLevel = 0; nLevel < LEVELS; nLevel++) {
+        nBytes += aapWords[nLevel].capacity() * sizeof (CBoWWord *) + aaChildren[nLevel].capacity() * sizeof (CChildRange);
+        if (apBlockMem[nLevel])
+            nBytes += aapWords[nLevel].size() * nStride + FROZEN_BLOCK_ALIGN;
+    }
+    return nBytes;
+}
+
+size_t CBoW::CBoWDictionary::memoryUsage(size_t & nPostingBytes) const {
+    size_t nBytes = sizeof (*this) + nLevel * sizeof (int) + Words.capacity() * sizeof (CBoWWord *);
+
+    for (CDynArray<CBoWWord *>::const_iterator ppWord = Words.begin(); ppWord != Words.end(); ppWord++) {
+        const CBoWWord * pWord = *ppWord;
+        nBytes += pWord->Descriptor()->size(); //Not always owned, but nearly always
+        nPostingBytes += pWord->Postings().bytes();
+
+        if (nLevel > 1) {
+            const CBoWNodeWord * pNodeWord = static_cast<const CBoWNodeWord *> (pWord);
+            nBytes += sizeof (CBoWNodeWord) + pNodeWord->SubDictionary()->memoryUsage(nPostingBytes);
+        } else
+            nBytes += sizeof (CBoWWord);
+    }
+    return nBytes;
+}
+
+size_t CBoW::CBoWWordBag::memoryUsage(size_t & nDescriptorBytes) const {
+    const int LEVELS = pParent->PARAMS.BOWClustering.LEVELS;
+    size_t nBytes = sizeof (*this) + LEVELS * sizeof (TWordBag) + aDescriptorWordsBF.capacity() * sizeof (CBoWWordDescMatch);
+
+    for (int nLevel = 0; nLevel < LEVELS; nLevel++) {
+        nBytes += aWords[nLevel].capacity() * sizeof (CBoWImageWord);
+        for (TWordBag::const_iterator pImWord = aWords[nLevel].begin(); pImWord != aWords[nLevel].end(); pImWord++)
+            nBytes += pImWord->locationBytes();
+    }
+
+    if (pDescriptors) //Otherwise still in the mapped file
+        for (int i = 0; i < pDescriptors->Count(); i++)
+            nDescriptorBytes += pDescriptors->get_const(i)->size() + sizeof (CDescriptor *);
+
+    return nBytes;
+}
+
+size_t CBoW::memoryUsage(bool bPrint) {
+    READ_LOCK;
+
+    size_t nPostingBytes = 0, nDescriptorBytes = 0, nWordBagBytes = 0;
+    const size_t nDictionaryBytes = pDictionary ? pDictionary->memoryUsage(nPostingBytes) : 0;
+    const size_t nFrozenBytes = pFrozenDictionary ? pFrozenDictionary->memoryUsage() : 0;
+
+    for (constImIt ppIm = vImages.begin(); ppIm != vImages.end(); ppIm++)
+        if (*ppIm)
+            nWordBagBytes += (*ppIm)->memoryUsage(nDescriptorBytes);
+
+    const size_t nTotal = nDictionaryBytes + nFrozenBytes + nPostingBytes + nWordBagBytes + nDescriptorBytes;
+
+    if (bPrint) {
+        const double MB = 1024 * 1024;
+        cout << "CBoW memory (MB), " << vImages.Count() << " images: dictionary " << nDictionaryBytes / MB << ", frozen dictionary " << nFrozenBytes / MB
+                << ", inverted file " << nPostingBytes / MB << ", word bags " << nWordBagBytes / MB << ", descriptors " << nDescriptorBytes / MB
+                << ", total " << nTotal / MB << endl;
+    }
+    return nTotal;
+}
+
 void CBoW::recreateDictionary() {
+
     ClusterDescriptorsIntoWords();
     //Clustering HASN'T NECESSARILY HAPPENED YET--may be happening in a seperate thread.
 }
@@ -881,39 +1443,22 @@ void CBoW::CBoWWordBag::RecreateWordBag() {
     const int BF_LEVEL = pParent->PARAMS.BOWClustering.BRUTEFORCE_MATCHING_LEVEL();
 
     //   //Re-map descriptors to words and insert into set
-    ARRAY(CBoWWord *, apWords, LEVELS);
     ARRAY(TWordSet, aWordSet, LEVELS);
 
-    ARRAY(const CDescriptor *, apClosestDescriptors, LEVELS);
+    TWordPaths aWordPaths;
+    quantise(aWordPaths);
 
-    aDescriptorWordsBF.clear();
-    const CBOWParams::CDescriptorBinningParams & pBinParams = pParent->PARAMS.DescriptorBinning;
-    for (int i = 0; i < pDescriptors->Count(); i++) {
-        const CDescriptor * pDescriptor = pDescriptors->get_const(i);
-
-        setZero(PTR(apClosestDescriptors), LEVELS);
-
-        CCluster const * pCluster = pDescriptor->assignment();
-        if (pCluster) {
-            int nChainLength = 1;
-            while (pCluster->parentCluster()) {
-                pCluster = pCluster->parentCluster();
-                nChainLength++;
-            }
+    const int nFirstStoredLevel = pParent->PARAMS.COMPACT_WORD_BAGS ? LEVELS - 1 : 0; //Upper levels aren't used for scoring
 
-            pCluster = pDescriptor->assignment();
-            for (int i = nChainLength - 1; pCluster; i--) {
-                if(IS_DEBUG) CHECK(!pCluster->Centre(), "Cluster has no centre");
-                apClosestDescriptors[i] = pCluster->Centre();
-                pCluster = pCluster->parentCluster();
-            }
-        }
-
-        pDic->LookupWordAllLevels(pDescriptor, LEVELS - 1, PTR(apWords), PTR(apClosestDescriptors), pBinParams);
+    const CDescriptorSet * pDS = DescriptorSet();
+    aDescriptorWordsBF.clear();
+    for (int i = 0; i < pDS->Count(); i++) {
+        const CDescriptor * pDescriptor = pDS->get_const(i);
+        CBoWWord * const * apWords = aWordPaths.begin() + i * LEVELS;
 
         if (apWords[LEVELS - 1]) //We might not find a place for this word if it's too far from any existing words, or in too big/small a cluster
         {
-            for (int nLevel = 0; nLevel < LEVELS; nLevel++) {
+            for (int nLevel = nFirstStoredLevel; nLevel < LEVELS; nLevel++) {
                 CLocation loc;
                 if (nLevel == LEVELS - 1 /*|| nLevel == LEVELS-2*/) //### If we add locations at other levels, also need to delete them! (see below...)
                     loc = pDescriptor->location(); //otherwise will be 0
@@ -966,6 +1511,96 @@ void CBoW::CBoWWordBag::RecreateWordBag() {
     cout << "WB count: " << aWords[LEVELS - 1].size() << endl;
 }
 
+#define QUANTISE_BLOCK_SIZE 64 //descriptors that descend the frozen dictionary together
+#define QUANTISE_MIN_JOB_SIZE 128 //Don't split smaller sets than this between threads
+
+void CBoW::CBoWWordBag::quantise(TWordPaths & aWordPaths) {
+    const int LEVELS = pParent->PARAMS.BOWClustering.LEVELS;
+    const CDescriptorSet * pDescriptors = DescriptorSet();
+    const int nDescriptors = pDescriptors->Count();
+    aWordPaths.resize(nDescriptors * LEVELS);
+
+    const int nJobs = max<int>(1, min<int>(pParent->PARAMS.QUERY_THREADS, nDescriptors / QUANTISE_MIN_JOB_SIZE));
+
+    boost::mutex::scoped_try_lock threadpoolLock(pParent->mxQueryThreadpool, boost::defer_lock);
+    if (nJobs > 1)
+        threadpoolLock.try_lock(); //If a query or another word bag has the threadpool just run in this thread
+
+    if (threadpoolLock.owns_lock()) {
+        const int NUM_DESCRIPTORS_PER_JOB = nDescriptors / nJobs;
+        for (int nJob = 0; nJob < nJobs; nJob++) {
+            const int nStart = nJob * NUM_DESCRIPTORS_PER_JOB;
+            const int nEnd = (nJob == nJobs - 1) ? nDescriptors : nStart + NUM_DESCRIPTORS_PER_JOB;
+
+            TNullaryFnObj fn = boost::bind(&CBoW::CBoWWordBag::quantise_Loop, this, nStart, nEnd, aWordPaths.begin());
+            pParent->pQueryThreadpool->addJob(fn);
+        }
+        pParent->pQueryThreadpool->waitForAll();
+
+        checkWBException();
+    } else
+        pParent->lookupWordPaths(pDescriptors, 0, nDescriptors, aWordPaths.begin());
+}
+
+//Each job writes its own range of aWordPaths, so no locking here
+
+void CBoW::CBoWWordBag::quantise_Loop(int nStart, int nEnd, CBoWWord ** aWordPaths) {
+    try {
+        pParent->lookupWordPaths(pDescriptors, nStart, nEnd, aWordPaths);
+    } catch (CException pEx) {
+        pWBException = pEx;
+    } catch (...) {
+        pWBException = CException("Unknown exception type caught in quantisation thread");
+    }
+}
+
+void CBoW::lookupWordPaths(const CDescriptorSet * pDescriptors, int nStart, int nEnd, CBoWWord ** aWordPaths) const {
+    const int LEVELS = PARAMS.BOWClustering.LEVELS;
+    int anUnhinted[QUANTISE_BLOCK_SIZE];
+
+    for (int nBlockStart = nStart; nBlockStart < nEnd; nBlockStart += QUANTISE_BLOCK_SIZE) {
+        const int nBlockEnd = min<int>(nBlockStart + QUANTISE_BLOCK_SIZE, nEnd);
+
+        int nUnhinted = 0;
+        for (int i = nBlockStart; i < nBlockEnd; i++) {
+            const CDescriptor * pDescriptor = pDescriptors->get_const(i);
+            if (!pDescriptor->assignment() && pFrozenDictionary) //No hints from clustering
+                anUnhinted[nUnhinted++] = i;
+            else
+                lookupWordPath(pDescriptor, aWordPaths + i * LEVELS);
+        }
+
+        if (nUnhinted)
+            pFrozenDictionary->LookupWordsAllLevels(pDescriptors, anUnhinted, nUnhinted, aWordPaths, PARAMS.DescriptorBinning.RADIUS);
+    }
+}
+
+//Use the clustering assignment (if any) as a shortcut down the tree
+
+void CBoW::lookupWordPath(const CDescriptor * pDescriptor, CBoWWord ** apWords) const {
+    const int LEVELS = PARAMS.BOWClustering.LEVELS;
+    ARRAY(const CDescriptor *, apClosestDescriptors, LEVELS);
+    setZero(PTR(apClosestDescriptors), LEVELS);
+
+    CCluster const * pCluster = pDescriptor->assignment();
+    if (pCluster) {
+        int nChainLength = 1;
+        while (pCluster->parentCluster()) {
+            pCluster = pCluster->parentCluster();
+            nChainLength++;
+        }
+
+        pCluster = pDescriptor->assignment();
+        for (int i = nChainLength - 1; pCluster; i--) {
+            if(IS_DEBUG) CHECK(!pCluster->Centre(), "Cluster has no centre");
+            apClosestDescriptors[i] = pCluster->Centre();
+            pCluster = pCluster->parentCluster();
+        }
+    }
+
+    pDictionary->LookupWordAllLevels(pDescriptor, LEVELS - 1, apWords, PTR(apClosestDescriptors), PARAMS.DescriptorBinning);
+}
+
 templateCompMethod
 void CBoW::CBoWWordBag::WeightWordBag()//TODO duplication
 {
@@ -1067,7 +1702,7 @@ bool isProb(double p) {
 
 //int CBoW::s_nLevels = -1;
 
-CBoW::CBoW(const CBOWParams & PARAMS) : PARAMS(PARAMS), anMinMatchStrength(0), pDictionary(0), pClusterThread(0), bDeleting(false), pDrawCS(0), pDrawCS_temp(0) {
+CBoW::CBoW(const CBOWParams & PARAMS) : PARAMS(PARAMS), anMinMatchStrength(0), pDictionary(0), pFrozenDictionary(0), pMappedFile(0), pMappedPrototype(0), pClusterThread(0), pQueryThreadpool(0), bDeleting(false), pDrawCS(0), pDrawCS_temp(0) {
     WRITE_LOCK;
     try {
         //TODO: Make library functions
@@ -1081,6 +1716,8 @@ CBoW::CBoW(const CBOWParams & PARAMS) : PARAMS(PARAMS), anMinMatchStrength(0), p
         pfn_getBoWMatches = apfn_getBoWMatches[PARAMS.COMP_METHOD];
         pfn_RecreateWordBags = apfn_RecreateWordBags[PARAMS.COMP_METHOD];
 
+        pQueryThreadpool = CThreadpool_base::makeThreadpool(PARAMS.QUERY_THREADS); //Threads live as long as we do, rather than being started for every query
+
         nNextClusterCount = 1; //Cluster as soon as we have some descriptors
 
         bClustering = false;
@@ -1114,20 +1751,27 @@ CBoW::~CBoW() {
     cout << "...locks obtained\n";
 
     cout << "Deleting dictionary...";
+    delete pFrozenDictionary;
+    pFrozenDictionary = 0;
     delete pDictionary;
     pDictionary = 0;
+    CDescriptorSet::deleteDS(&pMappedPrototype); //Loaded words' descriptors were cloned, so only postings point into the file
+    delete pMappedFile;
+    pMappedFile = 0;
     cout << "done deleting anMinMatchStrength...";
     delete [] anMinMatchStrength;
     anMinMatchStrength = 0;
+    delete pQueryThreadpool;
+    pQueryThreadpool = 0;
     cout << "done" << endl;
 
     RELEASE_WRITE_LOCK;
 }
 
 templateCompMethod
-void CBoW::CBoWWordBag::getBoWMatches_Loop(TBoWMatchVector *pvMatches, int nReturnMax, const int * anScoreAgainstBackground, constImIt imageIterBegin, constImIt imageIterEnd) {
+void CBoW::CBoWWordBag::getBoWMatches_Loop(TBoWMatchVector *pvMatches, int nReturnMax, int nPartitions, const int * anScoreAgainstBackground, constImIt imageIterBegin, constImIt imageIterEnd) {
     try {
-        getBoWMatches_Loop_int<eCompMethod > (pvMatches, nReturnMax, anScoreAgainstBackground, imageIterBegin, imageIterEnd);
+        getBoWMatches_Loop_int<eCompMethod > (pvMatches, nReturnMax, nPartitions, anScoreAgainstBackground, imageIterBegin, imageIterEnd);
     } catch (CException pEx) {
         pWBException = pEx;
     } catch (...) {
@@ -1135,13 +1779,14 @@ void CBoW::CBoWWordBag::getBoWMatches_Loop(TBoWMatchVector *pvMatches, int nRetu
     }
 }
 
+//pvMatches belongs to this partition only, so no locking here
 templateCompMethod
-void CBoW::CBoWWordBag::getBoWMatches_Loop_int(TBoWMatchVector *pvMatches, int nReturnMax, const int * anScoreAgainstBackground, constImIt imageIterBegin, constImIt imageIterEnd) {
+void CBoW::CBoWWordBag::getBoWMatches_Loop_int(TBoWMatchVector *pvMatches, int nReturnMax, int nPartitions, const int * anScoreAgainstBackground, constImIt imageIterBegin, constImIt imageIterEnd) {
     const int LEVELS = pParent->PARAMS.BOWClustering.LEVELS;
     int nNoMatch = pParent->anMinMatchStrength[LEVELS - 1];
 
     TSortedIntSet * pSubvecScores = (eCompMethod == CBOWParams::eVectorDistFast) ? new TSortedIntSet() : 0;
-    int nVecReturnMax = (pParent->PARAMS.FastVectorComparison.SUBVEC_CACHE_SIZE * nReturnMax) / pParent->PARAMS.QUERY_THREADS;
+    int nVecReturnMax = (pParent->PARAMS.FastVectorComparison.SUBVEC_CACHE_SIZE * nReturnMax) / nPartitions;
 
     for (constImIt imageIter = imageIterBegin; imageIter != imageIterEnd; imageIter++) {
         CBoWWordBag * pCompareAgainst = *imageIter;
@@ -1157,22 +1802,261 @@ void CBoW::CBoWWordBag::getBoWMatches_Loop_int(TBoWMatchVector *pvMatches, int n
         else
             nMatch = getBoWMatch<eCompMethod > (pCompareAgainst, anScoreAgainstBackground, pSubvecScores, nVecReturnMax);
 
-        if (nMatch > nNoMatch) {
-            boost::mutex::scoped_lock scoped_lock(mxQuery);
-            TBoWMatchVector::iterator last = pvMatches->end();
-            if ((int) pvMatches->size() < nReturnMax || (nMatch > (--last)->MatchStrength())) {
-                if ((int) pvMatches->size() >= nReturnMax)
-                    pvMatches->erase(last);
+        if (nMatch > nNoMatch)
+            insertMatch(pvMatches, nReturnMax, nNoMatch, pCompareAgainst->id(), nMatch);
+    }
+    delete pSubvecScores;
+}
+
+//Keep the nReturnMax best matches. nNoMatch becomes the weakest match once we have enough
+inline void CBoW::CBoWWordBag::insertMatch(TBoWMatchVector *pvMatches, int nReturnMax, int & nNoMatch, int nId, int nMatch) {
+    TBoWMatchVector::iterator last = pvMatches->end();
+    if ((int) pvMatches->size() < nReturnMax || (nMatch > (--last)->MatchStrength())) {
+        if ((int) pvMatches->size() >= nReturnMax)
+            pvMatches->erase(last);
+
+        CBoWMatch<int> Match(nId, nMatch);
+        pvMatches->insert(Match);
+
+        if ((int) pvMatches->size() >= nReturnMax)
+            nNoMatch = (--(pvMatches->end()))->MatchStrength();
+    }
+}
+
+//Inverted file query: accumulate min(query weight, image weight) over each query word's postings. This is
+//exactly the score NormalisedVectorCompare_int gives, but only touches images sharing a word with the query.
+void CBoW::CBoWWordBag::getBoWMatches_InvertedFile(TBoWMatchVector *pvMatches, int nReturnMax) const {
+    const int LEVELS = pParent->PARAMS.BOWClustering.LEVELS;
+    int nNoMatch = pParent->anMinMatchStrength[LEVELS - 1];
+
+    const int nImages = (int) pParent->vImages.size_th();
+    const constImIt imageIterBegin = pParent->vImages.begin();
+
+    CDynArray<int> anScores(nImages, 0);
+    CDynArray<int> anScoredImages; //Images with a non-zero score
+    anScoredImages.reserve(std::min<int>(nImages, 1024));
+
+    const TWordBag & queryWords = aWords[LEVELS - 1];
+    for (TWordBag::const_iterator pImWord = queryWords.begin(); pImWord != queryWords.end(); pImWord++) {
+        const int nQueryWeight = pImWord->Weight();
+        CBoWWord::CPostingList::CReader postings(pImWord->Word()->Postings());
+        int nImageIdx = 0, nWeight = 0;
+        while (postings.next(nImageIdx, nWeight)) {
+            const int nWordScore = min(nQueryWeight, nWeight);
+            int & nScore = anScores[nImageIdx];
+            if (nScore == 0 && nWordScore > 0)
+                anScoredImages.push_back(nImageIdx);
+            nScore += nWordScore;
+        }
+    }
+
+    //Drop erased images, and insert in DB order so ties are broken the same as the linear scan
+    std::sort(anScoredImages.begin(), anScoredImages.end());
+    int nScoredImages = 0;
+    for (CDynArray<int>::const_iterator pnIdx = anScoredImages.begin(); pnIdx != anScoredImages.end(); pnIdx++)
+        if (imageIterBegin[*pnIdx])
+            anScoredImages[nScoredImages++] = *pnIdx;
+
+    if (nNoMatch < 0 && nScoredImages < nReturnMax) {
+        //Images sharing no words (score 0) make the top-K too, so go through the whole DB like getBoWMatches_Loop_int does
+        for (int nImageIdx = 0; nImageIdx < nImages; nImageIdx++) {
+            const CBoWWordBag * pCompareAgainst = imageIterBegin[nImageIdx];
+            if (!pCompareAgainst) continue; //has been erased
+            if (!pCompareAgainst->aWords[LEVELS - 1].size()) continue; //Don't match against images with empty word bags
+
+            if (anScores[nImageIdx] > nNoMatch)
+                insertMatch(pvMatches, nReturnMax, nNoMatch, pCompareAgainst->id(), anScores[nImageIdx]);
+        }
+    } else {
+        for (int i = 0; i < nScoredImages; i++) {
+            const int nImageIdx = anScoredImages[i];
+            if (anScores[nImageIdx] > nNoMatch)
+                insertMatch(pvMatches, nReturnMax, nNoMatch, imageIterBegin[nImageIdx]->id(), anScores[nImageIdx]);
+        }
+    }
+}
+
+void CBoW::CBoWWordBag::addToInvertedFile(int nImageIdx) const {
+    const TWordBag & words = bottomLevelWords();
+    for (TWordBag::const_iterator pImWord = words.begin(); pImWord != words.end(); pImWord++)
+        pImWord->Word()->addPosting(nImageIdx, pImWord->Weight());
+}
+
+void CBoW::CBoWWord::CPostingList::replaceImages(const int * anImageIdx, int nImages, const std::vector<std::pair<int, int> > & newPostings) {
+    CDynArray<std::pair<int, int> > merged;
+    merged.reserve(nCount + newPostings.size());
+
+    std::vector<std::pair<int, int> >::const_iterator pNewPosting = newPostings.begin();
+    const int * pnImageIdx = anImageIdx, * pnImageIdxEnd = anImageIdx + nImages;
+    CReader postings(*this);
+    int nImageIdx = -1, nWeight = -1;
+    while (postings.next(nImageIdx, nWeight)) {
+        for (; pNewPosting != newPostings.end() && pNewPosting->first < nImageIdx; pNewPosting++)
+            merged.push_back(*pNewPosting);
 
-                CBoWMatch<int> Match(pCompareAgainst->id(), nMatch);
-                pvMatches->insert(Match);
+        while (pnImageIdx != pnImageIdxEnd && *pnImageIdx < nImageIdx)
+            pnImageIdx++;
+        if (pnImageIdx == pnImageIdxEnd || *pnImageIdx != nImageIdx)
+            merged.push_back(std::pair<int, int>(nImageIdx, nWeight));
+    }
+    for (; pNewPosting != newPostings.end(); pNewPosting++)
+        merged.push_back(*pNewPosting);
+
+    clear();
+    for (CDynArray<std::pair<int, int> >::const_iterator pPosting = merged.begin(); pPosting != merged.end(); pPosting++)
+        push_back(pPosting->first, pPosting->second);
+}
+
+//Called after RecreateWB with a new dictionary, so posting lists start empty
+void CBoW::buildInvertedFile() {
+    int nImageIdx = 0;
+    for (constImIt ppIm = vImages.begin(); ppIm != vImages.end(); ppIm++, nImageIdx++) {
+        const CBoWWordBag * pWB = *ppIm;
+        if (pWB)
+            pWB->addToInvertedFile(nImageIdx);
+    }
+}
+
+//Collect the descriptors currently quantised to pWord by re-quantising the images in its posting list
+
+void CBoW::getWordDescriptors(const CBoWWord * pWord, CDescriptorSet * pMembers) const {
+    const int LEVELS = PARAMS.BOWClustering.LEVELS;
+    CBoWWordBag::TWordPaths aWordPaths;
+
+    CBoWWord::CPostingList::CReader postings(pWord->Postings());
+    int nImageIdx = -1, nWeight = -1;
+    while (postings.next(nImageIdx, nWeight)) {
+        const CBoWWordBag * pWB = vImages.begin()[nImageIdx];
+        if (!pWB) continue; //erased
+
+        CDescriptorSet * pDescriptors = pWB->DescriptorSet();
+        aWordPaths.resize(pDescriptors->Count() * LEVELS);
+        lookupWordPaths(pDescriptors, 0, pDescriptors->Count(), aWordPaths.begin());
+        for (int i = 0; i < pDescriptors->Count(); i++)
+            if (aWordPaths[i * LEVELS + LEVELS - 1] == pWord)
+                pMembers->Push(pDescriptors->get(i));
+    }
+}
 
-                if ((int) pvMatches->size() >= nReturnMax)
-                    nNoMatch = (--(pvMatches->end()))->MatchStrength();
+//Called from addImage (write lock held, not clustering) instead of recreating the whole dictionary. Bottom-level
+//words that have grown too big are split in two by clustering their descriptors, and words that are too small
+//are dropped. Only images in the changed words' posting lists are re-quantised and re-weighted.
+
+void CBoW::updateDictionaryIncrementally() {
+    const CBOWParams::CBOWClusteringParams & BOWCLUSTERPARAMS = PARAMS.BOWClustering;
+    const CBOWParams::CDescriptorBinningParams & BINNING_PARAMS = PARAMS.DescriptorBinning;
+    const int nSplitSize = min<int>(2 * BOWCLUSTERPARAMS.DESCRIPTORS_PER_WORD, BINNING_PARAMS.UPPER_BOUND);
+    const int nDropSize = BINNING_PARAMS.LOWER_BOUND;
+
+    CDynArray<CBoWDictionary *> apLeafDictionaries;
+    CDynArray<CBoWWord *> apLeafWords;
+    pDictionary->getLeafWords(apLeafDictionaries, apLeafWords);
+
+    CDynArray<CBoWWord *> apRetiredWords;
+    std::vector<int> anAffectedImages;
+
+    for (int nWord = 0; nWord < apLeafWords.size() && apRetiredWords.size() < BOWCLUSTERPARAMS.INCREMENTAL_MAX_UPDATES; nWord++) {
+        CBoWWord * pWord = apLeafWords[nWord];
+        CBoWDictionary * pLeafDictionary = apLeafDictionaries[nWord];
+        CDynArray<CBoWWord *> apNewWords;
+
+        if (pWord->DescriptorCount() >= nSplitSize) {
+            boost::scoped_ptr<CDescriptorSet> pMembers(vImages.makeNewDS());
+            getWordDescriptors(pWord, pMembers.get());
+            if (pMembers->Count() < nSplitSize)
+                continue;
+
+            {
+                boost::scoped_ptr<CClusterSet> pClusters(pMembers->Cluster(2, 0));
+                for (int nCluster = 0; nCluster < pClusters->size(); nCluster++) {
+                    const CCluster * pCluster = (*pClusters)[nCluster];
+                    if (pCluster->Count() > nDropSize)
+                        apNewWords.push_back(new CBoWWord(pCluster->Centre()->clone(), pCluster->Count()));
+                }
+                pMembers->assignToCluster(0); //Clusters are deleted here, and these descriptors will be re-quantised
             }
+
+            if (apNewWords.size() < 2) {
+                for (CDynArray<CBoWWord *>::iterator ppNewWord = apNewWords.begin(); ppNewWord < apNewWords.end(); ppNewWord++)
+                    delete *ppNewWord;
+                continue;
+            }
+        } else if (pWord->DescriptorCount() > nDropSize || pLeafDictionary->size() < 2)
+            continue; //Otherwise drop it. Its descriptors will move to the nearest remaining word
+
+        pLeafDictionary->replaceWord(pWord, apNewWords);
+        apRetiredWords.push_back(pWord);
+
+        CBoWWord::CPostingList::CReader postings(pWord->Postings());
+        int nImageIdx = -1, nWeight = -1;
+        while (postings.next(nImageIdx, nWeight))
+            anAffectedImages.push_back(nImageIdx);
+    }
+
+    if (apRetiredWords.size() == 0)
+        return;
+
+    std::sort(anAffectedImages.begin(), anAffectedImages.end());
+    anAffectedImages.erase(std::unique(anAffectedImages.begin(), anAffectedImages.end()), anAffectedImages.end());
+
+    cout << "Incremental dictionary update: replaced " << apRetiredWords.size() << " words, re-quantising " << anAffectedImages.size() << " images\n";
+
+    pDictionary->recountWords();
+
+    std::sort(apRetiredWords.begin(), apRetiredWords.end());
+
+    //Words (other than retired ones) whose postings for the affected images are about to change
+    std::set<CBoWWord *> stalePostings;
+
+    const constImIt ppImages = vImages.begin();
+    for (std::vector<int>::const_iterator pnImageIdx = anAffectedImages.begin(); pnImageIdx != anAffectedImages.end(); pnImageIdx++) {
+        CBoWWordBag * pWB = ppImages[*pnImageIdx];
+        if (pWB) {
+            pWB->CountWordOccurances<true>();
+
+            const CBoWWordBag::TWordBag & words = pWB->bottomLevelWords();
+            for (CBoWWordBag::TWordBag::const_iterator pImWord = words.begin(); pImWord != words.end(); pImWord++)
+                if (!std::binary_search(apRetiredWords.begin(), apRetiredWords.end(), pImWord->Word()))
+                    stalePostings.insert(pImWord->Word());
         }
     }
-    delete pSubvecScores;
+
+    delete pFrozenDictionary;
+    pFrozenDictionary = PARAMS.FROZEN_DICTIONARY ? new CBoWFrozenDictionary(pDictionary, BOWCLUSTERPARAMS.LEVELS) : 0;
+
+    for (std::vector<int>::const_iterator pnImageIdx = anAffectedImages.begin(); pnImageIdx != anAffectedImages.end(); pnImageIdx++) {
+        CBoWWordBag * pWB = ppImages[*pnImageIdx];
+        if (pWB) {
+            pWB->DescriptorSet()->assignToCluster(0); //Hints may point at retired words
+            pWB->RecreateWordBag();
+            pWB->CountWordOccurances<false>();
+        }
+    }
+
+    //New postings for the affected images, in image order
+    std::map<CBoWWord *, std::vector<std::pair<int, int> > > newPostings;
+    for (std::vector<int>::const_iterator pnImageIdx = anAffectedImages.begin(); pnImageIdx != anAffectedImages.end(); pnImageIdx++) {
+        CBoWWordBag * pWB = ppImages[*pnImageIdx];
+        if (pWB) {
+            (pWB->*pfn_WeightWordBag)();
+
+            const CBoWWordBag::TWordBag & words = pWB->bottomLevelWords();
+            for (CBoWWordBag::TWordBag::const_iterator pImWord = words.begin(); pImWord != words.end(); pImWord++)
+                newPostings[pImWord->Word()].push_back(std::pair<int, int>(*pnImageIdx, pImWord->Weight()));
+        }
+    }
+
+    //Retired words' postings go with them. Other words only change for the affected images, whose weights have all changed
+    for (CDynArray<CBoWWord *>::iterator ppWord = apRetiredWords.begin(); ppWord < apRetiredWords.end(); ppWord++)
+        delete *ppWord;
+
+    const std::vector<std::pair<int, int> > noPostings;
+    for (std::set<CBoWWord *>::const_iterator ppWord = stalePostings.begin(); ppWord != stalePostings.end(); ppWord++)
+        if (newPostings.find(*ppWord) == newPostings.end())
+            (*ppWord)->replacePostings(&anAffectedImages[0], (int) anAffectedImages.size(), noPostings);
+
+    for (std::map<CBoWWord *, std::vector<std::pair<int, int> > >::const_iterator pNewPostings = newPostings.begin(); pNewPostings != newPostings.end(); pNewPostings++)
+        pNewPostings->first->replacePostings(&anAffectedImages[0], (int) anAffectedImages.size(), pNewPostings->second);
 }
 
 template<bool DECREMENT>
@@ -1182,10 +2066,13 @@ void CBoW::CBoWWordBag::CountWordOccurances() const {
     for (int nLevel = LEVELS - 1; nLevel < LEVELS; nLevel++) {
         TWordBag::iterator ppEnd = aWords[nLevel].end();
         for (TWordBag::iterator ppWord = aWords[nLevel].begin(); ppWord < ppEnd; ppWord++) {
-            if (DECREMENT)
+            if (DECREMENT) {
                 ppWord->Word()->DecrementOccurances();
-            else
+                ppWord->Word()->AddDescriptors(-ppWord->FrequencyInImage());
+            } else {
                 ppWord->Word()->IncrementOccurances();
+                ppWord->Word()->AddDescriptors(ppWord->FrequencyInImage());
+            }
         }
     }
 }
@@ -1212,27 +2099,45 @@ TBoWMatchVector * CBoW::CBoWWordBag::getBoWMatches(int nReturnMax) {
     }
 
     //This loop is the outer loop around the critical section
-    if (pParent->PARAMS.QUERY_THREADS > 1) {
-        const int NUM_IMAGES_PER_THREAD = (int) (pParent->vImages.size_th()) / pParent->PARAMS.QUERY_THREADS;
-        //		ARRAY(boost::thread *, apQueryThreads, (const int)pParent->PARAMS.QUERY_THREADS); //TODO: array of smart ptrs
-        CDynArrayOwner<boost::thread> apQueryThreads(pParent->PARAMS.QUERY_THREADS);
-
-        for (int nThread = 0; nThread < pParent->PARAMS.QUERY_THREADS; nThread++) {
-            constImIt ImStart = pParent->vImages.begin() + (nThread * NUM_IMAGES_PER_THREAD);
-            constImIt ImEnd = ImStart + NUM_IMAGES_PER_THREAD;
-            if (nThread == pParent->PARAMS.QUERY_THREADS - 1) ImEnd = pParent->vImages.end();
-
-            apQueryThreads[nThread] = new boost::thread(boost::bind(&CBoW::CBoWWordBag::getBoWMatches_Loop<eCompMethod>,
-                    this, pvMatches, nReturnMax, PTR(anScoreAgainstBackground), ImStart, ImEnd));
-        }
-        for (int nThread = 0; nThread < pParent->PARAMS.QUERY_THREADS; nThread++) {
-            apQueryThreads[nThread]->join();
-            //delete apQueryThreads[nThread];
-        }
+    if (pParent->useInvertedFile()) {
+        getBoWMatches_InvertedFile(pvMatches, nReturnMax);
     } else {
-        constImIt imageIterBegin = pParent->vImages.begin();
-        constImIt imageIterEnd = pParent->vImages.end();
-        getBoWMatches_Loop<eCompMethod > (pvMatches, nReturnMax, PTR(anScoreAgainstBackground), imageIterBegin, imageIterEnd);
+        //Split the DB into partitions of at least QUERY_MIN_PARTITION images, one job each on the query threadpool.
+        //Each job keeps its own top-K, then they're merged here in DB order.
+        const int nImages = (int) pParent->vImages.size_th();
+        const int nPartitions = max<int>(1, min<int>(pParent->PARAMS.QUERY_THREADS, nImages / pParent->PARAMS.QUERY_MIN_PARTITION));
+
+        boost::mutex::scoped_try_lock threadpoolLock(pParent->mxQueryThreadpool, boost::defer_lock);
+        if (nPartitions > 1)
+            threadpoolLock.try_lock(); //If another query has the threadpool just run in this thread
+
+        if (threadpoolLock.owns_lock()) {
+            const int NUM_IMAGES_PER_PARTITION = nImages / nPartitions;
+            CDynArrayOwner<TBoWMatchVector> apPartitionMatches(nPartitions);
+
+            for (int nPartition = 0; nPartition < nPartitions; nPartition++) {
+                constImIt ImStart = pParent->vImages.begin() + (nPartition * NUM_IMAGES_PER_PARTITION);
+                constImIt ImEnd = ImStart + NUM_IMAGES_PER_PARTITION;
+                if (nPartition == nPartitions - 1) ImEnd = pParent->vImages.end();
+
+                apPartitionMatches[nPartition] = new TBoWMatchVector();
+                TNullaryFnObj fn = boost::bind(&CBoW::CBoWWordBag::getBoWMatches_Loop<eCompMethod>,
+                        this, apPartitionMatches[nPartition], nReturnMax, nPartitions, PTR(anScoreAgainstBackground), ImStart, ImEnd);
+                pParent->pQueryThreadpool->addJob(fn);
+            }
+            pParent->pQueryThreadpool->waitForAll();
+
+            int nNoMatch = pParent->anMinMatchStrength[LEVELS - 1];
+            for (int nPartition = 0; nPartition < nPartitions; nPartition++) {
+                const TBoWMatchVector * pPartitionMatches = apPartitionMatches[nPartition];
+                for (TBoWMatchVector::const_iterator pMatch = pPartitionMatches->begin(); pMatch != pPartitionMatches->end(); pMatch++) {
+                    if (pMatch->MatchStrength() <= nNoMatch)
+                        break; //Sorted, so the rest of this partition can't make it
+                    insertMatch(pvMatches, nReturnMax, nNoMatch, pMatch->id(), pMatch->MatchStrength());
+                }
+            }
+        } else
+            getBoWMatches_Loop<eCompMethod > (pvMatches, nReturnMax, 1, PTR(anScoreAgainstBackground), pParent->vImages.begin(), pParent->vImages.end());
     }
 
     checkWBException();
@@ -1259,17 +2164,10 @@ inline int CBoW::intintLog(int i) {
     if (i < INTINT_LOG_CACHE_LIM) {
         COUNTHITS(nHit++);
         return anIntLogCache[i];
-    } else if (i == nCache_i) {
-        COUNTHITS(nCache++);
-        //cout << 'h';
-        return nLog_i;
     } else {
+        //Used to cache the last i here, but that wasn't TS with concurrent queries (and log is fast enough)
         COUNTHITS(nMiss++);
-        int nLog = doubleToInt(INTINTLOG_SCALE * log((double) i));
-        //cout << 'm';
-        nCache_i = i;
-        nLog_i = nLog; //Should really be atomic/threadsafe
-        return nLog;
+        return doubleToInt(INTINTLOG_SCALE * log((double) i));
     }
 }
 
@@ -1434,17 +2332,6 @@ int CBoW::CBoWWordBag::getBoWMatch(const CBoWWordBag * pwbExisting, const int *
                 p /= anScoreAgainstBackground[nLevel];)
             }
 
-#ifndef __GNUC__
-        static int nPrintScoreCount = 10;
-
-        if (nPrintScoreCount > 0 && nLevel < 2) {
-            nPrintScoreCount--;
-            char pc[50];
-            sprintf_s(pc, 50, "%d: %d\n", nLevel, p);
-            cout << pc;
-        }
-#endif
-
         //if(nLevel > -1) cout << p << "=p level=" << nLevel << '\n' ;
         if (anMinMatchStrength[nLevel] > p) return anMinMatchStrength[LEVELS - 1];
     }
@@ -1773,17 +2660,24 @@ void CBoW::addImage(CBoWWordBag * pWB) {
 
     vImages.Push(pWB);
 
-    if (pDictionary)
+    if (pDictionary) {
         pWB->CountWordOccurances < false > ();
+        if (useInvertedFile())
+            pWB->addToInvertedFile(vImages.size_th() - 1); //Push puts it at the back
+    }
 
     //Todo: when do we recreate dictionary? Every frame at first (doesn't matter how slow at first anyway)
     if (//vImages.Count() >=2 && //otherwise dont get good corresp. between 1 and 2 --doesn't seem to matter
             vImages.totalDescriptorCount() > nNextClusterCount && !bClustering
             && PARAMS.BOWClustering.RECLUSTER_FREQUENCY > 0 //dReclusterFrequency<0 == no auto. clustering
             ) {
-        bClustering = true; //This is safe as we currently have a lock, and it will be unset when the clustring code has a lock.
         nNextClusterCount = doubleToInt(vImages.totalDescriptorCount() * PARAMS.BOWClustering.RECLUSTER_FREQUENCY);
-        recreateDictionary();
+        if (useIncrementalUpdates())
+            updateDictionaryIncrementally();
+        else {
+            bClustering = true; //This is safe as we currently have a lock, and it will be unset when the clustring code has a lock.
+            recreateDictionary();
+        }
     }
     cout << "Added " << pWB->id() << "\n";
 }
@@ -1791,7 +2685,7 @@ void CBoW::addImage(CBoWWordBag * pWB) {
 //Always takes memory
 
 void CBoW::addImage(CDescriptorSet ** ppDescriptors, int nNewImageId) {
-    WRITE_LOCK;
+    UPGRADEABLE_LOCK; //Queries can continue while we make the new word bag
 
     CHECK(!ppDescriptors, "CBoW::addImage: Null parameter");
     CDescriptorSet * pDescriptors = *ppDescriptors;
@@ -1806,14 +2700,16 @@ void CBoW::addImage(CDescriptorSet ** ppDescriptors, int nNewImageId) {
                     pAllDescriptors = pDescriptors->makeNewDS();
             }*/
 
-    addImage(new CBoWWordBag(pDescriptors, this, nNewImageId));
+    CBoWWordBag * pWB = new CBoWWordBag(pDescriptors, this, nNewImageId);
     *ppDescriptors = 0; //I now own the memory;
+
+    UPGRADE_LOCK; //Only block queries while adding to the DB (and maybe reclustering)
+    addImage(pWB);
 }
 
 TBoWMatchVector * CBoW::getMatches(CDescriptorSet * pDescriptors, int nReturnMax) //takes pDescriptors memory from caller. Is it freed?
 {
-    //UPGRADEABLE_LOCK; //Might wait here for clustering to finish
-    WRITE_LOCK; //Use a write lock cos we need one for recreatewordbag.
+    READ_LOCK; //Might wait here for clustering to finish. Recreating wb only changes the new wb
 
     if(IS_DEBUG) CHECK(!pDescriptors || pDescriptors->Count() == 0, "CBoW::getMatches: Bad/empty descriptor set");
     //if(IS_DEBUG) CHECK(!pAllDescriptors, "CBoW::getMatches: Error initialising all descriptors' set");
@@ -1832,19 +2728,10 @@ TBoWMatchVector * CBoW::getMatches_int(CBoWWordBag * pwb, int nReturnMax) {
 };
 
 TBoWMatchVector * CBoW::getMatches(int nId_in, int nReturnMax) {
-    WRITE_LOCK; //Might wait here for clustering to finish
+    READ_LOCK; //Might wait here for clustering to finish
     cout << "Getting matches with id " << nId_in << endl;
-    TBoWMatchVector * pRet = 0;
-    try {
-        CBoWWordBag * pwb = vImages.Find(nId_in);
-        pRet = getMatches_int(pwb, nReturnMax);
-    }    catch (...) {
-        RELEASE_WRITE_LOCK;
-        throw;
-    }
-    RELEASE_WRITE_LOCK;
-
-    return pRet;
+    CBoWWordBag * pwb = vImages.Find(nId_in);
+    return getMatches_int(pwb, nReturnMax);
 };
 
 /*extern double statA,statB,statT1,statT2,statScale;
@@ -1905,7 +2792,7 @@ int CBoW::CBoWWordBag::BruteForceMatch(CBoW::CBoWWordBag * pWB) const {
     return -doubleToInt(1000 * dDist);
 }
 
-CBoW::CBoWWordBag::CBoWWordBag(CDescriptorSet * pDescriptors_in, const CBoW * pParent_in, int nId_in) : pParent(pParent_in), pDescriptors(pDescriptors_in), nId(nId_in) {
+CBoW::CBoWWordBag::CBoWWordBag(CDescriptorSet * pDescriptors_in, const CBoW * pParent_in, int nId_in) : pParent(pParent_in), pDescriptors(pDescriptors_in), nDescriptorCount(pDescriptors_in->Count()), pMappedDescriptors(0), nId(nId_in) {
     if(IS_DEBUG) CHECK(!pDescriptors_in || !pDescriptors_in->Count() || !pParent_in, "CBoW::CBoWWordBag::CBoWWordBag: Bad parameter");
 
     if (pParent->PARAMS.BOWClustering.BRUTEFORCE_MATCHING_LEVEL() > 0)
@@ -2010,6 +2897,8 @@ void CBoW::remove(int nId) {
     WRITE_LOCK;
     const bool bLocked_notClustering = mxClusteringCantDelete.try_lock();
 
+    //Inverted file postings aren't removed: Erase zeros this image's slot in vImages and queries skip it
+
     try {
         vImages.Erase(nId, bLocked_notClustering);
     } catch (...) {
@@ -2170,7 +3059,7 @@ void CBoW::ensureClusteredOnce() //should NOT have a write lock here
 const CBoWCorrespondences * CBoW::getCorrespondences(CDescriptorSet * pDS1, int nId2, const CBOWMatchingParams & MATCHING_PARAMS) {
     ensureClusteredOnce();
 
-    SCOPED_WRITE_LOCK; //Use STATICS while matching
+    READ_LOCK;
 
     if(IS_DEBUG) CHECK(nId2 == DONT_ADD || !pDS1, "CBoW::getCorrespondences: Bad params");
 
@@ -2183,7 +3072,7 @@ const CBoWCorrespondences * CBoW::getCorrespondences(CDescriptorSet * pDS1, int
 const CBoWCorrespondences * CBoW::getCorrespondences(int nId1, CDescriptorSet * pDS2, const CBOWMatchingParams & MATCHING_PARAMS) {
     ensureClusteredOnce();
 
-    SCOPED_WRITE_LOCK; //Use STATICS while matching
+    READ_LOCK;
 
     if(IS_DEBUG) CHECK(nId1 == DONT_ADD || !pDS2, "CBoW::getCorrespondences: Bad params");
 
@@ -2196,7 +3085,7 @@ const CBoWCorrespondences * CBoW::getCorrespondences(int nId1, CDescriptorSet *
 const CBoWCorrespondences * CBoW::getCorrespondences(CDescriptorSet * pDS1, CDescriptorSet * pDS2, const CBOWMatchingParams & MATCHING_PARAMS) {
     ensureClusteredOnce();
 
-    SCOPED_WRITE_LOCK; //Use STATICS while matching
+    READ_LOCK;
     if(IS_DEBUG) CHECK(!pDS1 || !pDS2, "CBoW::getCorrespondences: Bad params");
 
     CBoWWordBag Wb1(pDS1, this, DONT_ADD);
@@ -2208,7 +3097,7 @@ const CBoWCorrespondences * CBoW::getCorrespondences(CDescriptorSet * pDS1, CDes
 const CBoWCorrespondences * CBoW::getCorrespondences(int nId1, int nId2, const CBOWMatchingParams & MATCHING_PARAMS) {
     ensureClusteredOnce();
 
-    SCOPED_WRITE_LOCK; //Use STATICS while matching
+    READ_LOCK;
     if(IS_DEBUG) CHECK(nId1 == DONT_ADD || nId2 == DONT_ADD, "CBoW::getCorrespondences: Bad params");
     CBoWWordBag * pWb1 = vImages.Find(nId1);
     CBoWWordBag * pWb2 = vImages.Find(nId2);
@@ -2378,7 +3267,7 @@ void CBoW::CBoWWordBag::BFCorrFromRangeNN(const CDescriptorSet * pDS1, const CDe
         const CDynArray<CBoWWordDescMatch>::const_iterator WB1WordListRangeEnd,
         const CDynArray<CBoWWordDescMatch>::const_iterator WB2WordList,
         const CDynArray<CBoWWordDescMatch>::const_iterator WB2WordListRangeEnd,
-        double dCondition, const int BF_NN, CBoWCorrespondences * pCorrespondences, const CBOWParams::CBOWCorrespondenceProbParams & CORR_PROB_PARAMS) {
+        double dCondition, const int BF_NN, CBoWCorrespondences * pCorrespondences, CMatchMap & aStrongestMatches) {
     /*
     TMatchMap aStrongestMatchesLeft, aStrongestMatchesRight;
 
@@ -2406,8 +3295,6 @@ void CBoW::CBoWWordBag::BFCorrFromRangeNN(const CDescriptorSet * pDS1, const CDe
     cullMatches(aStrongestMatchesLeft, aStrongestMatchesLeftGood, dCondition);
     cullMatches(aStrongestMatchesRight, aStrongestMatchesRightGood, dCondition);
      */
-    static CMatchMap aStrongestMatches(CORR_PROB_PARAMS); //Not TS, that's ok cos we're locked out
-
     aStrongestMatches.init(WB1WordListRangeEnd - WB1WordList, WB2WordListRangeEnd - WB2WordList);
     int nL = 0;
     for (CDynArray<CBoW::CBoWWordBag::CBoWWordDescMatch>::const_iterator pW1 = WB1WordList; pW1 != WB1WordListRangeEnd; pW1++) {
@@ -2598,7 +3485,7 @@ const CBoWCorrespondences * CBoW::CBoWWordBag::getBruteForceCorrespondences(cons
         for (int i = 0; i < pDS->Count(); i++) {
             const CDescriptor * pThisDesc = pDS->get_const(i);
             const int nRadius = pParent->PARAMS.DescriptorBinning.RADIUS;
-            const CDescriptor * pClosestDesc = pDescriptors->ClosestDescriptor(pThisDesc, dCondition, nRadius);
+            const CDescriptor * pClosestDesc = DescriptorSet()->ClosestDescriptor(pThisDesc, dCondition, nRadius);
             if (pClosestDesc) {
                 //DO NOT NEED TO Check symmetry cos used condition
                 //const CDescriptor * pClosestDescSym = pWB->pDescriptors->ClosestDescriptor(pClosestDesc, dCondition, nRadius);
@@ -2616,6 +3503,8 @@ const CBoWCorrespondences * CBoW::CBoWWordBag::getBruteForceCorrespondences(cons
         CDynArray<CBoWWordDescMatch>::const_iterator WB2WordList = pWB->aDescriptorWordsBF.begin();
         CDynArray<CBoWWordDescMatch>::const_iterator WB2WordListEnd = pWB->aDescriptorWordsBF.end();
 
+        CMatchMap aStrongestMatches(pParent->PARAMS.BOWCorrespondenceProb); //Reused for every range, one per call so TS
+
         if (WB1WordList != WB1WordListEnd && WB2WordList != WB2WordListEnd) {
 
             const CBoWWord * pWordInWB2 = WB2WordList->Word();
@@ -2673,7 +3562,7 @@ const CBoWCorrespondences * CBoW::CBoWWordBag::getBruteForceCorrespondences(cons
                                 WB1WordListRangeEnd,
                                 WB2WordList,
                                 WB2WordListRangeEnd,
-                                dCondition, BF_NN, pCorrespondences, pParent->PARAMS.BOWCorrespondenceProb);
+                                dCondition, BF_NN, pCorrespondences, aStrongestMatches);
                     }
 
                     WB1WordList = WB1WordListRangeEnd;
@@ -2829,8 +3718,7 @@ inline void CBoW::CBoWImageDB::Push(CBoWWordBag * pWB) {
     //cout << "Adding id " << pWB->id() << "," << size()-1 << " to lookup map\n";
     imIdLookupMap[pWB->id()] = size() - 1; //size-1 is the index into the safeVector of what we've just inserted
 
-    const CDescriptorSet * pDS = pWB->DescriptorSet();
-    nAllDescriptorsCount += pDS->Count();
+    nAllDescriptorsCount += pWB->TotalWordCount();
 
     if(IS_DEBUG) CHECK(!exists(pWB->id()), "Push: Word bag push failed");
 };
@@ -2860,8 +3748,7 @@ inline void CBoW::CBoWImageDB::Erase(imageNum nID, const bool bLocked_notCluster
 
     CBoWWordBag * pWB = *ppWBPos;
 
-    const CDescriptorSet * pDS = pWB->DescriptorSet();
-    nAllDescriptorsCount -= pDS->Count(); //this is not used while actually clustering
+    nAllDescriptorsCount -= pWB->TotalWordCount(); //this is not used while actually clustering
 
     imIdLookupMap.erase(nID);
     vImagesToErase.push_back(pWB);
@@ -2875,6 +3762,7 @@ inline void CBoW::CBoWImageDB::Erase(imageNum nID, const bool bLocked_notCluster
         for (int i = 0; i < words.size(); i++) //May be concurrent with clustering but shouldn't be a probelm
         {
             words[i].Word()->DecrementOccurances(/*words[i].FrequencyInImage()*/);
+            words[i].Word()->AddDescriptors(-words[i].FrequencyInImage());
         }
 
         //BUT DO NOT DELETE YET OR MAY DELETE CLUSTER CENTRES
@@ -17,6 +17,8 @@
 
 #include "util/dynArray.h"
 
+namespace boost { namespace interprocess { class mapped_region; } }
+
 /*#if CLUSTER_THREADS>0
 #define MT
 #endif
@@ -48,22 +50,18 @@
 #include "util/smallHashTable.h"
 #include "util/exception.h"
 #include "description/descriptor.h"
+#include "geom/threadpool.h"
 
 #define SCOPED_WRITE_LOCK checkClusteringException(); boost::unique_lock<boost::shared_mutex> write_lock(mxClusteringRW);
 #define WRITE_LOCK SCOPED_WRITE_LOCK
 #define RELEASE_WRITE_LOCK
 //#define WRITE_LOCK checkClusteringException(); pthread_mutex_init(&mxClusteringRW_pt, NULL);
 //#define RELEASE_WRITE_LOCK pthread_mutex_destroy(&mxClusteringRW_pt);
-/*
+
+//Queries and correspondences only read the dictionary and image DB, so can run concurrently
 #define READ_LOCK checkClusteringException(); boost::shared_lock<boost::shared_mutex> reader_lock(mxClusteringRW);
 #define UPGRADEABLE_LOCK checkClusteringException(); boost::upgrade_lock<boost::shared_mutex> upg_lock(mxClusteringRW);
 #define UPGRADE_LOCK checkClusteringException(); boost::unique_lock<boost::shared_mutex> write_lock(boost::move(upg_lock));
- */
-
-// For Brute force:
-#define READ_LOCK WRITE_LOCK
-#define UPGRADEABLE_LOCK WRITE_LOCK
-#define UPGRADE_LOCK
 
 #define LOCK_WHILE_COUNTING_OCCURANCES boost::mutex::scoped_lock scoped_lock(mxOccuranceCounting);
 //************************************************//
@@ -106,12 +104,14 @@ protected:
     class CBoWWord {
         const CDescriptor * pDescriptor;
         int nTotalFrequency,
-        nTotalOccurances; // how many images does it occur in
+        nTotalOccurances, // how many images does it occur in
+        nDescriptorCount; // how many descriptors in the DB map to this word (bottom level, kept with nTotalOccurances)
 
         bool bIOwnMyDescriptor;
 
     public:
         CBoWWord(CCluster * pCluster);
+        CBoWWord(const CDescriptor * pDescriptor, int nTotalFrequency); //Reloaded from file, takes descriptor memory
         /*virtual*/ ~CBoWWord();
 
         inline const CDescriptor * Descriptor() const {
@@ -140,15 +140,168 @@ protected:
             if(IS_DEBUG) CHECK(nTotalOccurances < 0, "DecrementOccurances fell below zero");
         };
 
+        inline int DescriptorCount() const {
+            return nDescriptorCount;
+        };
+
+        inline void AddDescriptors(int n) {
+            nDescriptorCount += n;
+        };
+
+        inline void setCounts(int nTotalOccurances_in, int nDescriptorCount_in) { //Reloaded from file
+            nTotalOccurances = nTotalOccurances_in;
+            nDescriptorCount = nDescriptorCount_in;
+        };
+
         static bool sortWordsByDescPtr(const CBoWWord * pWord1, const CBoWWord * pWord2) {
             return pWord1->Descriptor() < pWord2->Descriptor();
         }
+
+        //Inverted file entries for this word: (image index, weight) pairs in increasing image index order.
+        //Encoded as varint image index deltas followed by 16-bit weights (bigger weights escaped), ~3 bytes each.
+        //Postings loaded from a saved file are read where they are in the mapped file, and only copied when more are added.
+        class CPostingList {
+            CDynArray<unsigned char> abEncoded;
+            const unsigned char * pbMapped, * pbMappedEnd;
+            int nLastImageIdx, nCount;
+
+            void unmap() {
+                abEncoded.reserve((int) (pbMappedEnd - pbMapped) + 16);
+                for (const unsigned char * pb = pbMapped; pb < pbMappedEnd; pb++)
+                    abEncoded.push_back(*pb);
+                pbMapped = pbMappedEnd = 0;
+            }
+
+            inline void pushVarint(unsigned int n) {
+                while (n >= 0x80) {
+                    abEncoded.push_back((unsigned char) (n | 0x80));
+                    n >>= 7;
+                }
+                abEncoded.push_back((unsigned char) n);
+            }
+        public:
+
+            CPostingList() : pbMapped(0), pbMappedEnd(0), nLastImageIdx(0), nCount(0) {
+            }
+
+            //Use nBytes of encoded postings in a mapped file, which must outlive this list (or its next push_back)
+            void map(const unsigned char * pbEncoded, int nBytes, int nCount_in, int nLastImageIdx_in) {
+                clear();
+                pbMapped = pbEncoded;
+                pbMappedEnd = pbEncoded + nBytes;
+                nCount = nCount_in;
+                nLastImageIdx = nLastImageIdx_in;
+            }
+
+            inline void push_back(int nImageIdx, int nWeight) {
+                if(IS_DEBUG) CHECK(nImageIdx < nLastImageIdx || nWeight < 0, "CPostingList: Postings must be added in image order");
+                if (pbMapped)
+                    unmap();
+                pushVarint(nImageIdx - nLastImageIdx);
+                if (nWeight < 0xFFFF) {
+                    abEncoded.push_back((unsigned char) nWeight);
+                    abEncoded.push_back((unsigned char) (nWeight >> 8));
+                } else {
+                    abEncoded.push_back(0xFF);
+                    abEncoded.push_back(0xFF);
+                    pushVarint(nWeight);
+                }
+                nLastImageIdx = nImageIdx;
+                nCount++;
+            }
+
+            inline void clear() {
+                abEncoded.clear();
+                pbMapped = pbMappedEnd = 0;
+                nLastImageIdx = nCount = 0;
+            }
+
+            inline int size() const {
+                return nCount;
+            }
+
+            inline int lastImageIdx() const {
+                return nLastImageIdx;
+            }
+
+            inline int bytes() const { //heap only, not mapped
+                return abEncoded.capacity();
+            }
+
+            inline const unsigned char * encodedBegin() const {
+                return pbMapped ? pbMapped : abEncoded.begin();
+            }
+
+            inline const unsigned char * encodedEnd() const {
+                return pbMapped ? pbMappedEnd : abEncoded.end();
+            }
+
+            //Decodes postings in order
+            class CReader {
+                const unsigned char * pbPos, * pbEnd;
+                int nImageIdx;
+
+                inline unsigned int readVarint() {
+                    unsigned int n = 0;
+                    for (int nShift = 0;; nShift += 7) {
+                        const unsigned char b = *pbPos++;
+                        n |= (unsigned int) (b & 0x7F) << nShift;
+                        if (!(b & 0x80)) return n;
+                    }
+                }
+            public:
+
+                CReader(const CPostingList & postings) : pbPos(postings.encodedBegin()), pbEnd(postings.encodedEnd()), nImageIdx(0) {
+                }
+
+                //false when there are no more postings
+                inline bool next(int & nImageIdx_out, int & nWeight) {
+                    if (pbPos >= pbEnd) return false;
+                    nImageIdx += readVarint();
+                    nWeight = pbPos[0] | (pbPos[1] << 8);
+                    pbPos += 2;
+                    if (nWeight == 0xFFFF)
+                        nWeight = readVarint();
+                    nImageIdx_out = nImageIdx;
+                    return true;
+                }
+            };
+
+            //Drop postings for the nImages images in anImageIdx (increasing), and merge in newPostings ((image idx, weight), increasing)
+            void replaceImages(const int * anImageIdx, int nImages, const std::vector<std::pair<int, int> > & newPostings);
+        };
+
+        inline void addPosting(int nImageIdx, int nWeight) {
+            postings.push_back(nImageIdx, nWeight);
+        };
+
+        inline const CPostingList & Postings() const {
+            return postings;
+        };
+
+        inline void mapPostings(const unsigned char * pbEncoded, int nBytes, int nCount, int nLastImageIdx) {
+            postings.map(pbEncoded, nBytes, nCount, nLastImageIdx);
+        };
+
+        inline void clearPostings() {
+            postings.clear();
+        };
+
+        inline void replacePostings(const int * anImageIdx, int nImages, const std::vector<std::pair<int, int> > & newPostings) {
+            postings.replaceImages(anImageIdx, nImages, newPostings);
+        };
+    private:
+        CPostingList postings; //Bottom-level words only. Built in RecreateWB and addImage, erased images skipped when scoring
     };
     static CBoW::CBoWWord * findBinaryChop(const CDescriptor * pDesc, CBoW::CBoWWord * const* apWords, const int nLength);
 
+    class CBoWFrozenDictionary;
+
 public:
 
     class CBoWDictionary {
+        friend class CBoWFrozenDictionary;
+
         CDynArray<CBoWWord *> Words;
 
         int nLevel, //< 1=bottom level
@@ -203,6 +356,15 @@ public:
                 const int * anLevelWordCounts_in,
                 const CBOWParams::CDescriptorBinningParams & pBinningParams, const CBOWParams::CBOWClusteringParams & BOWCLUSTERPARAMS, CClusterDrawer ** ppDrawCS);
 
+        //Rebuild a saved dictionary from the mapped file (see CBoW::load). Advances pData past this dictionary. Words are
+        //appended to apWordsById in the order they were saved, which is how word bags refer to them
+        CBoWDictionary(const char *& pData, const char * pDataEnd, int nLevel_in, const CDescriptor * pPrototype, CDynArray<CBoWWord *> & apWordsById);
+
+        //Numbers words in the order they're written
+        void save(std::ostream & file, std::map<const CBoWWord *, int> & wordIds) const;
+
+        size_t memoryUsage(size_t & nPostingBytes) const; //Words and centres (not postings, which are added to nPostingBytes)
+
         void LookupWordAllLevels(const CDescriptor * pDescriptor, int nLevel, CBoWWord ** apWords, const CDescriptor ** apClosestDescriptors, const CBOWParams::CDescriptorBinningParams & pBinningParams) const; //Look up word in all levels at once--for adding to dictionary
 
         ~CBoWDictionary();
@@ -214,6 +376,15 @@ public:
         inline const int * WordCountArray() const {
             return anWordLevelCounts;
         };
+
+        inline int size() const {
+            return Words.size();
+        };
+
+        //For incremental updates: bottom-level words, with the dictionary holding each
+        void getLeafWords(CDynArray<CBoWDictionary *> & apLeafDictionaries, CDynArray<CBoWWord *> & apLeafWords);
+        void replaceWord(CBoWWord * pOldWord, const CDynArray<CBoWWord *> & apNewWords); //Bottom level only, caller deletes pOldWord
+        const int * recountWords();
     };
     typedef CDynArray<CLocation> TImPointVec;
 
@@ -223,6 +394,8 @@ protected:
         CBoWDictionary * pSubDictionary; //This 'word' is a big cluster of descriptors. This dictionary clusters this cluster.
     public:
         CBoWNodeWord(CCluster * pCluster, const CBoW::CBoWDictionary::CGetClusterNum & getClusterCount, int nLevel, const int * anLevelWordCounts_in, const CBOWParams::CDescriptorBinningParams & pBinningParams, const CBOWParams::CBOWClusteringParams & BOWCLUSTERPARAMS, CClusterDrawer ** ppDrawCS);
+        CBoWNodeWord(const CDescriptor * pDescriptor, int nTotalFrequency, CBoWDictionary * pSubDictionary) : CBoWWord(pDescriptor, nTotalFrequency), pSubDictionary(pSubDictionary) {
+        }
 
         ~CBoWNodeWord() {
             delete pSubDictionary;
@@ -233,6 +406,40 @@ protected:
         inline const CBoWDictionary * SubDictionary() const {
             return pSubDictionary;
         };
+
+        inline CBoWDictionary * SubDictionary() {
+            return pSubDictionary;
+        };
+    };
+
+    //Read-only copy of the dictionary for fast lookup of descriptors with no cluster assignment. Each level's centres
+    //are copied into one contiguous aligned block, with every node's children adjacent. The tree is still used for building.
+    class CBoWFrozenDictionary {
+        class CChildRange //essentially a struct
+        {
+        public:
+            int nFirstChild, nChildren;
+
+            CChildRange() : nFirstChild(0), nChildren(0) {
+            }
+
+            CChildRange(int nFirstChild, int nChildren) : nFirstChild(nFirstChild), nChildren(nChildren) {
+            }
+        };
+
+        const int LEVELS;
+        int nStride; //bytes between centres
+        char ** apBlockMem, ** apBlocks; //per level, top first. apBlocks are aligned
+        CDynArray<CBoWWord *> * aapWords; //per level, the word each centre came from
+        CDynArray<CChildRange> * aaChildren; //per level (not bottom), where each word's children are in the level below
+    public:
+        CBoWFrozenDictionary(const CBoWDictionary * pDictionary, const int LEVELS);
+        ~CBoWFrozenDictionary();
+
+        //Words at every level for pDescriptors[anDescIdx[i]], written to aWordPaths + anDescIdx[i]*LEVELS
+        void LookupWordsAllLevels(const CDescriptorSet * pDescriptors, const int * anDescIdx, const int nCount, CBoWWord ** aWordPaths, const CDescriptor::TDist RADIUS) const HOT;
+
+        size_t memoryUsage() const;
     };
 
     //Rev. 125: Moved to tree structure for word bag. Leave word-counting in dictionary (anWordLevelCounts) as need per-level word counts for bayes classifier
@@ -314,6 +521,7 @@ protected:
             }
 
             CBoWImageWord(CBoW::CBoWWord * pWord_in, const CLocation & Loc);
+            CBoWImageWord(CBoW::CBoWWord * pWord_in, int nFrequency_in, int nWeight_in, const char *& pData, const char * pDataEnd); //Reloaded from file
             void IncrementFrequency(const CLocation & Loc);
             ~CBoWImageWord();
             void DestroyLoc();
@@ -339,6 +547,16 @@ protected:
                 return nWeight;
             };
 
+            inline int locationCount() const { //how many locations are stored
+                if (nFrequency > LOCATION_STORE_LIM || aLocations.loc().zero()) return 0;
+                return nFrequency;
+            }
+
+            inline int locationBytes() const { //heap memory for the location list
+                if (nFrequency < 2 || nFrequency > LOCATION_STORE_LIM || aLocations.loc().zero()) return 0;
+                return (nFrequency == 2 ? 2 : LOCATION_STORE_LIM) * (int) sizeof (CLocation);
+            }
+
             inline const CLocation Location(int n) const {
                 if (aLocations.loc().zero()) return aLocations.loc(); //equiv return 0
 
@@ -373,7 +591,11 @@ protected:
     private:
         typedef CBoWImageWord * TImWordIt;
         TWordBag * aWords;
-        CDescriptorSet * pDescriptors; //does own the memory
+        mutable CDescriptorSet * pDescriptors; //does own the memory
+        int nDescriptorCount;
+        const char * pMappedDescriptors; //Loaded images' descriptors, in the mapped file until they're needed
+
+        void materialiseDescriptors() const;
 
         class CBoWWordDescMatch {
             const CBoWWord * pImWord;
@@ -416,8 +638,6 @@ protected:
         templateCompMethod
         int CompareWithAll(TWordBag * pWordsInImage, int nWords) const;
 
-        boost::mutex mxQuery;
-
         CException pWBException;
 
         void checkWBException() {
@@ -428,10 +648,16 @@ protected:
         };
 
         templateCompMethod
-        void getBoWMatches_Loop(TBoWMatchVector *pvMatches, int nReturnMax, const int * anScoreAgainstBackground, CDynArray<CBoWWordBag *>::const_iterator imageIterBegin, CDynArray<CBoWWordBag *>::const_iterator imageIterEnd) HOT;
+        void getBoWMatches_Loop(TBoWMatchVector *pvMatches, int nReturnMax, int nPartitions, const int * anScoreAgainstBackground, CDynArray<CBoWWordBag *>::const_iterator imageIterBegin, CDynArray<CBoWWordBag *>::const_iterator imageIterEnd) HOT;
 
         templateCompMethod
-        void getBoWMatches_Loop_int(TBoWMatchVector *pvMatches, int nReturnMax, const int * anScoreAgainstBackground, CDynArray<CBoWWordBag *>::const_iterator imageIterBegin, CDynArray<CBoWWordBag *>::const_iterator imageIterEnd) HOT;
+        void getBoWMatches_Loop_int(TBoWMatchVector *pvMatches, int nReturnMax, int nPartitions, const int * anScoreAgainstBackground, CDynArray<CBoWWordBag *>::const_iterator imageIterBegin, CDynArray<CBoWWordBag *>::const_iterator imageIterEnd) HOT;
+
+        void getBoWMatches_InvertedFile(TBoWMatchVector *pvMatches, int nReturnMax) const HOT;
+
+        static inline void insertMatch(TBoWMatchVector *pvMatches, int nReturnMax, int & nNoMatch, int nId, int nMatch);
+
+        void quantise_Loop(int nStart, int nEnd, CBoWWord ** aWordPaths);
 
         typedef std::multiset<int, std::less<int> > TSortedIntSet;
         inline int VectorCompare(const CBoWWordBag * pWB, int nLevel) const;
@@ -460,8 +686,8 @@ protected:
         //typedef set<CLocation, CLocationSort> TLocationSet;
 
         typedef std::pair<CLocation, CDescriptor::TDist> TLocDistPair;
-        typedef boost::details::pool::null_mutex boost_pool_mutex;
-        //typedef boost::details::pool::pthread_mutex boost_pool_mutex;
+        //typedef boost::details::pool::null_mutex boost_pool_mutex; Not TS, and correspondences are found concurrently now
+        typedef boost::details::pool::default_mutex boost_pool_mutex;
         typedef CSmallHashTable<CLocation, 64, 1, locationHash < 64 > > TSimpleLocSet;
 
         class CLocDistPairSort : std::binary_function<const TLocDistPair &, const TLocDistPair &, bool> {
@@ -586,7 +812,7 @@ protected:
                 const CDynArray<CBoWWordDescMatch>::const_iterator WB1WordListRangeEnd,
                 const CDynArray<CBoWWordDescMatch>::const_iterator WB2WordList,
                 const CDynArray<CBoWWordDescMatch>::const_iterator WB2WordListRangeEnd,
-                double dCondition, const int BF_NN, CBoWCorrespondences * pCorrespondences, const CBOWParams::CBOWCorrespondenceProbParams & CORR_PROB_PARAMS);
+                double dCondition, const int BF_NN, CBoWCorrespondences * pCorrespondences, CMatchMap & aStrongestMatches);
         static void addMatchesToLeftPoint(const TSimpleMatchMap & aStrongestMatchesLeft, const TSimpleMatchMap & aStrongestMatchesRight, const CLocation locLeft, TSimpleLocSet & matchesLeft, TSimpleLocSet & matchesRight);
         static void addMatchesToRightPoint(const TSimpleMatchMap & aStrongestMatchesLeft, const TSimpleMatchMap & aStrongestMatchesRight, const CLocation locLeft, TSimpleLocSet & matchesLeft, TSimpleLocSet & matchesRight);
         static void cullMatches(const TMatchMap & aStrongestMatchesLeft, TSimpleMatchMap & aStrongestMatchesLeftGood, double dCondition);
@@ -595,23 +821,37 @@ protected:
         static void printMap(TSimpleMatchMap & aStrongestMatches);
     public:
         CBoWWordBag(CDescriptorSet * pDescriptors_in, const CBoW * pParent_in, int nId);
+        CBoWWordBag(const char *& pData, const char * pDataEnd, const CBoW * pParent_in, int nId, const CDynArray<CBoWWord *> & apWordsById); //Reloaded from file (see CBoW::load)
         ~CBoWWordBag();
 
+        void save(std::ostream & file, const std::map<const CBoWWord *, int> & wordIds) const;
+
         int BruteForceMatch(CBoW::CBoWWordBag * pWB) const;
 
         inline unsigned int TotalWordCount() const {
-            return (unsigned int) pDescriptors->Count();
+            return (unsigned int) nDescriptorCount;
         }; //total words in this image=>same at every level
 
         void RecreateWordBag();
 
+        typedef CDynArray<CBoWWord *> TWordPaths; //LEVELS words per descriptor, top level first. Bottom word is 0 if no word within RADIUS
+
+        //Look up every descriptor's words, in blocks split across the query threadpool
+        void quantise(TWordPaths & aWordPaths);
+
         template<bool DECREMENT>
         void CountWordOccurances() const;
 
+        void addToInvertedFile(int nImageIdx) const;
+
+        size_t memoryUsage(size_t & nDescriptorBytes) const; //Word bags (not descriptors, which are added to nDescriptorBytes)
+
         templateCompMethod
         void WeightWordBag();
 
         inline CDescriptorSet * DescriptorSet() const {
+            if (pMappedDescriptors)
+                materialiseDescriptors();
             return pDescriptors;
         };
         //inline CDescriptorSet * DescriptorSet() { return pDescriptors; };
@@ -766,6 +1006,11 @@ protected:
         inline void Push(CBoWWordBag * pWB);
         inline void Erase(imageNum nID, const bool);
 
+        inline void PushErased() { //Placeholder for a saved image that had been erased, so later images keep their inverted file index
+            push_back(0);
+            nErased++;
+        }
+
         inline CBoWWordBag * Find(imageNum nID) {
             CBoWWordBag * pWB = *Find_int(nID);
             CHECK(!pWB, "Find: No WB found, does id exist?");
@@ -831,6 +1076,11 @@ protected:
     CBoWImageDB vImages; //Some sort of tree per frame? We want to ask "What frames have word n?" Stick with arrays for now--we have a fairly small word list.
 
     CBoWDictionary * pDictionary; //All words, including mid-points
+    CBoWFrozenDictionary * pFrozenDictionary; //Flattened copy of pDictionary, or 0
+
+    boost::interprocess::mapped_region * pMappedFile; //File we were loaded from, or 0. Postings and descriptors are read from it
+    CDescriptorSet * pMappedPrototype; //One descriptor of the loaded type, to copy vtable ptrs from
+    mutable boost::mutex mxMappedDescriptors; //Images' descriptors may be first needed by concurrent queries
 
     //Do clustering
     void ClusterDescriptorsIntoWords();
@@ -847,8 +1097,24 @@ protected:
     void ReplaceDictionary_int(CBoW::CBoWDictionary ** ppNewDictionary);
     void ReplaceDictionary(CBoW::CBoWDictionary ** ppNewDictionary);
 
+    //Score queries from per-word posting lists rather than comparing against every word bag
+    bool useInvertedFile() const {
+        return PARAMS.INVERTED_FILE && (PARAMS.COMP_METHOD == CBOWParams::eNisterDist || PARAMS.COMP_METHOD == CBOWParams::eVectorDistFast);
+    }
+    void buildInvertedFile();
+
+    //Split/drop bottom-level words and re-quantise only the images containing them, rather than reclustering everything
+    bool useIncrementalUpdates() const {
+        return PARAMS.BOWClustering.INCREMENTAL && pDictionary && useInvertedFile() && PARAMS.WB_WEIGHT_METHOD != CBOWParams::eDF_ITDF;
+    }
+    void updateDictionaryIncrementally();
+    void getWordDescriptors(const CBoWWord * pWord, CDescriptorSet * pMembers) const;
+
     void addImage(CBoWWordBag * pWB);
 
+    void lookupWordPath(const CDescriptor * pDescriptor, CBoWWord ** apWords) const;
+    void lookupWordPaths(const CDescriptorSet * pDescriptors, int nStart, int nEnd, CBoWWord ** aWordPaths) const HOT;
+
     double getBayesPosteriorFromPriorWithLambda(double dPrior, int nImageWords, int nWordFrequencyTotal, int nWordFrequencyImage, int nWordFrequencyNewImage);
     double getBayesPosteriorFromPriorMEstimate(double dPrior, int nImageWords, int nWordFrequencyTotal, int nWordFrequencyImage, int nWordFrequencyNewImage) const;
     inline static double getBayesScoreM(int nTimesWordAppearsInCat, int nTotalWordsInCat);
@@ -866,8 +1132,6 @@ protected:
     static int intintLog(int i);
     static int anIntLogCache[INTINT_LOG_CACHE_LIM];
     static void setupIntIntLogCache();
-    static int nCache_i;
-    static int nLog_i;
 
     //CDescriptorSet * pAllDescriptors;
 
@@ -876,6 +1140,9 @@ protected:
     bool bClustering; // Don't start clustering until the last clustering attempt is done.
     boost::thread * pClusterThread;
 
+    CThreadpool_base * pQueryThreadpool; //QUERY_THREADS workers, kept for our lifetime
+    mutable boost::mutex mxQueryThreadpool; //Concurrent queries can't share the pool; whoever doesn't get it runs single-threaded
+
     //double dReclusterFrequency;
     //unsigned int nDescriptorsPerWord;
     bool bDeleting;
@@ -938,6 +1205,19 @@ public:
 
     void remove(int nId);
 
+    //Write the dictionary, inverted file, word bags and every image's descriptors to a versioned binary file.
+    //Descriptors must be plain data (CDescriptor::plainData)
+    void save(const char * szFilename);
+
+    //Reopen a saved database into an empty CBoW by mapping the file. Nothing is re-clustered or re-quantised: postings
+    //are used from the file, and each image's descriptors are only copied out when first needed (e.g. for correspondences).
+    //The file must not change while we exist. pPrototype is any non-empty set of the same descriptor type.
+    //Throws on a bad or mismatched file, after which this CBoW should only be deleted.
+    void load(const char * szFilename, const CDescriptorSet * pPrototype);
+
+    //Approximate heap memory used by the dictionary, inverted file, word bags and descriptors, in bytes
+    size_t memoryUsage(bool bPrint = true);
+
     bool contains(int nId) const {
         return vImages.exists(nId);
     }
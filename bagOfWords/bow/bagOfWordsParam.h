@@ -22,7 +22,11 @@ PARAMCLASS(BOW)
 	PARAME(COMP_METHOD, NisterDist, "Vector distance between word bags. Brute-force compares descriptors directly (slow, no better)")
 	PARAME(WB_WEIGHT_METHOD, TF_IDF, "There's a few different TF-IDF weighting functions in the literature. Low sensitivity. Either TF_IDF, from Nister-Stewenius-2006; DF_ITDF (variation with total occurances); TF_IDF_Wikipedia (the one on Wikipedia)")
 	PARAM(RWB_THREADS, 1, 64, 2 DEBUGONLY(-1), "Currently blocking, so set num threads high normally.")
-	PARAM(QUERY_THREADS, 1, 64, 1, "Can speed-up queries, but fast anyway.")
+	PARAM(QUERY_THREADS, 1, 64, 1, "Threadpool size for queries and for quantising new images into words. Can speed-up queries, but fast anyway.")
+	PARAM(QUERY_MIN_PARTITION, 1, MAX_INT, 500, "Don't split the image DB between query threads into partitions smaller than this (small DBs are faster in one thread).")
+	PARAMB(INVERTED_FILE, true, "Score NisterDist/VectorDistFast queries by accumulating over per-word posting lists, rather than comparing against every image. Same top-K as NisterDist, much faster for big DBs.")
+	PARAMB(COMPACT_WORD_BAGS, false, "Only keep the bottom level of each image's word bag (the only level used for scoring and correspondences). Saves memory for big DBs.")
+	PARAMB(FROZEN_DICTIONARY, true, "Look up words for new descriptors in a flattened copy of the dictionary (contiguous centres per level). Same words, faster.")
 	CHILDCLASS(BOWClustering, "Parameters for creating hierarchical dictionary (codebook/vocabulary)")
 	CHILDCLASS(DescriptorBinning, "Parameters for assigning descriptors to clusters")
 	CHILDCLASS(BOWCorrespondenceProb, "Params for assigning prior probabilities to correspondences.")
@@ -35,6 +39,10 @@ PARAMCLASS(BOW)
 									 TF_IDF_Wikipedia); //Different TF_IDF calc, from Wikipedia: http://en.wikipedia.org/wiki/Tf-idf
 	CNumParam<int> RWB_THREADS;
 	CNumParam<int> QUERY_THREADS;
+	CNumParam<int> QUERY_MIN_PARTITION;
+	CNumParam<bool> INVERTED_FILE;
+	CNumParam<bool> COMPACT_WORD_BAGS;
+	CNumParam<bool> FROZEN_DICTIONARY;
 
 	PARAMCLASS(BOWClustering)
 		PARAM(LEVELS, 1, MAX_BOW_LEVELS, 3, "Levels in hierarchical dictionary")
@@ -43,6 +51,8 @@ PARAMCLASS(BOW)
 		PARAM(RECLUSTER_FREQUENCY, -1, 10, -1, "If != -1, a new dictionary will be created (e.g. in background) every time number of descriptors in total grows by this factor.")
 		PARAME(BRANCH_METHOD, FixedClusterSizeTarget, "How to choose centre count for sub-clusterings. Sensitivity low")
 		PARAM(BF_LEVEL, 0, MAX_BOW_LEVELS, 3, "Level of dictionary used for descriptor partitioning for BoW feature matching") //0==global BF matching. BF_LEVEL <= LEVELS enforced
+		PARAMB(INCREMENTAL, false, "When RECLUSTER_FREQUENCY triggers and we already have a dictionary, split overfull bottom-level words and drop tiny ones instead of reclustering everything. Only images containing changed words are re-quantised. Needs the inverted file and TF_IDF/TF_IDF_Wikipedia weights (otherwise reclusters)")
+		PARAM(INCREMENTAL_MAX_UPDATES, 1, MAX_INT, 100, "Most words split or dropped per incremental update (bounds the time addImage holds the write lock)")
 		{}
 
 		CNumParam<int> LEVELS;
@@ -53,6 +63,9 @@ PARAMCLASS(BOW)
 	//private: todo: restore--currently hacked to test matching
 		CNumParam<int> BF_LEVEL; //Private param only accessible for derived parameters
 	public:
+		CNumParam<bool> INCREMENTAL;
+		CNumParam<int> INCREMENTAL_MAX_UPDATES;
+
 		int BRUTEFORCE_MATCHING_LEVEL() const
 		{
 			static bool bWarned = false;
@@ -177,17 +177,27 @@ public:
             for(int i=0;i<nNumThreadsToDispatch;i++)
                 semaphore_waitForAll.wait();
         }
-        if (bExitByException)
+        if(!bExitByException && !exception)
+            return;
+        
+        //Every worker has finished now. Reset the error state and drop any jobs that weren't started, so the pool is still usable after we throw
+        const bool bExit = bExitByException;
+        const CException workerException = exception;
+        bExitByException = false;
+        exception = CException();
         {
-            std::cout << "Exit triggered from a worker thread" << std::endl;
-            throw CException();
+            boost::mutex::scoped_lock scopedLock(mxLockVector);
+            aJobs.clear();
         }
         
-        if(strlen(exception.what()) > 0)
+        if (bExit)
         {
-            std::cerr << "ERROR thrown in worker thread: " << exception.what() << endl;
-            throw exception;
+            std::cout << "Exit triggered from a worker thread" << std::endl;
+            throw CException();
         }
+        
+        std::cerr << "ERROR thrown in worker thread: " << workerException.what() << endl;
+        throw workerException;
     }
     
     virtual int getNumThreads() const  { return ((int)aThreads.size() < 1) ? 1 : (int)aThreads.size(); } 
@@ -633,3 +643,41 @@ CThreadpool_base * CThreadpool_base::makeThreadpool(const int nNumThreads)
         //return new CThreadpool_RW(-nNumThreads);
         return new CThreadpool_condition(-nNumThreads);
 }   
+
+void CSharedThreadpool::setNumThreads(const int nNumThreads_in)
+{
+    CHECK(nNumThreads_in < 1, "setNumThreads: Need at least 1 thread");
+    boost::mutex::scoped_lock scopedLock(mxThreadpool);
+    if(nNumThreads_in != nNumThreads)
+    {
+        delete pThreadpool;
+        pThreadpool = 0;
+        nNumThreads = nNumThreads_in;
+    }
+}
+
+CSharedThreadpool::CLock::CLock(CSharedThreadpool & sharedThreadpool, const bool bTryLock) : sharedThreadpool(sharedThreadpool), lock(sharedThreadpool.mxThreadpool, boost::defer_lock)
+{
+    if(bTryLock)
+        lock.try_lock();
+}
+
+CSharedThreadpool::CLock::~CLock()
+{
+    if(lock.owns_lock() && std::uncaught_exception())
+    {
+        //A job threw (maybe leaving its pool half-finished); start again with new threads next time
+        delete sharedThreadpool.pThreadpool;
+        sharedThreadpool.pThreadpool = 0;
+    }
+}
+
+CThreadpool_base * CSharedThreadpool::CLock::threadpool()
+{
+    if(!lock.owns_lock() || sharedThreadpool.nNumThreads <= 1)
+        return 0;
+    
+    if(!sharedThreadpool.pThreadpool)
+        sharedThreadpool.pThreadpool = CThreadpool_base::makeThreadpool(sharedThreadpool.nNumThreads);
+    return sharedThreadpool.pThreadpool;
+}
@@ -7,6 +7,7 @@
 #else
 #  include <tr1/functional>
 #endif
+#include <boost/thread/mutex.hpp>
 
 typedef void TNullaryFn(void);
 typedef std::tr1::function<TNullaryFn> TNullaryFnObj;
@@ -29,4 +30,35 @@ public:
     static void nothingFn() {}
 };
 
+//A threadpool kept for the life of the program and shared by several callers. Whoever gets the lock has the pool; everyone else 
+//should run single-threaded. If a job throws while the pool is held it is thrown away, so the next user gets a fresh one.
+class CSharedThreadpool
+{
+    boost::mutex mxThreadpool;
+    CThreadpool_base * pThreadpool; //Protected by mxThreadpool
+    int nNumThreads;
+
+    CSharedThreadpool(const CSharedThreadpool &);
+    void operator=(const CSharedThreadpool &);
+public:
+    CSharedThreadpool(const int nNumThreads) : pThreadpool(0), nNumThreads(nNumThreads) {}
+    ~CSharedThreadpool() { delete pThreadpool; }
+
+    //Waits for the current user to finish
+    void setNumThreads(const int nNumThreads);
+
+    class CLock
+    {
+        CSharedThreadpool & sharedThreadpool;
+        boost::mutex::scoped_try_lock lock;
+    public:
+        //Doesn't block. Pass bTryLock=false when the job is too small to be worth sharing out
+        CLock(CSharedThreadpool & sharedThreadpool, const bool bTryLock = true);
+        ~CLock();
+
+        //0 if someone else has the pool or we're single-threaded
+        CThreadpool_base * threadpool();
+    };
+};
+
 #endif // CTHREADPOOL_H
@@ -53,7 +53,7 @@ public:
     CHistAndVectorDescriptor(const double * aDescriptor) : descriptorType(aDescriptor, 1), CTHist(aDescriptor + descriptorType::DescriptorLength()) {};
     CHistAndVectorDescriptor(const char * aDescriptor) : descriptorType(aDescriptor), CTHist(aDescriptor + descriptorType::DescriptorLength()) {};
 
-	virtual int size() const { return sizeof(this); }
+	virtual int size() const { return sizeof(*this); }
 };
 
 H_TEMPLATE
@@ -76,8 +76,9 @@ public:
     typedef char elType;
     inline char * DescriptorVector() const { return (char *)(void *)this; };
 
-	virtual int size() const { return sizeof(this); }
+	virtual int size() const { return sizeof(*this); }
 	virtual int length() const { return HIST_BINS; }
+	virtual bool plainData() const { return true; }
 };
 
 H_TEMPLATE
@@ -88,7 +89,7 @@ public:
     CHistAndLocationDescriptor(const double * aDescriptor, double dScale, const ImageRGB * pIm, CvPoint point) : CTHistDescriptor(aDescriptor, dScale, pIm, point), Location(point.x, point.y) {};
     virtual CLocation location() const { return Location; };
 
-	virtual int size() const { return sizeof(this); }
+	virtual int size() const { return sizeof(*this); }
 };
 
 TEMPLATE_HV
@@ -104,6 +105,6 @@ public:
 
     virtual CLocation location() const { return Location; };
 
-	virtual int size() const { return sizeof(this); }
+	virtual int size() const { return sizeof(*this); }
 };
 
@@ -0,0 +1,147 @@
+/* Code by Tom Botterill. Documentation and license at http://www.hilandtom.com/tombotterill/code */
+
+#pragma once
+
+#ifndef BINARY_DESCRIPTOR_H
+#define BINARY_DESCRIPTOR_H
+
+#include "descriptor.h"
+#include "patchParams.h"
+#include "image/imageAccess.h"
+#include "util/fastnorms.h"
+
+//BRIEF-style binary descriptor: BITS intensity comparisons between pairs of (box-smoothed) pixels around a corner.
+//Distance is the Hamming distance (popcount of XOR), so matching and BoW quantisation are much cheaper than with patches.
+//Pairs are sampled from an isotropic Gaussian about the corner, sd=2/5 of the patch radius (the best pattern in Calonder et al's paper).
+//With ORIENT the pattern is rotated to the intensity centroid angle (steered BRIEF, as in ORB).
+
+class CBRIEFPattern
+{
+public:
+    static const int BITS = 256;
+
+    //Pairs of points in the unit disc
+    float ax1[BITS], ay1[BITS], ax2[BITS], ay2[BITS];
+
+    static const CBRIEFPattern & pattern()
+    {
+        static const CBRIEFPattern s_pattern; //Thread-safe initialisation
+        return s_pattern;
+    }
+
+private:
+    //Own generator so the pattern is the same in every run/program, and doesn't disturb CRandom
+    unsigned int nSeed;
+    double uniform()
+    {
+        nSeed = nSeed * 1103515245u + 12345u;
+        return ((nSeed >> 8) + 0.5) / (double)(1 << 24);
+    }
+    void gaussianPoint(float & x, float & y)
+    {
+        const double SD = 0.4;
+        for(;;)
+        {
+            const double r = SD*sqrt(-2.0*log(uniform())), theta = 2*M_PI*uniform();
+            x = (float)(r*cos(theta));
+            y = (float)(r*sin(theta));
+            if(x*x + y*y <= 1)
+                return;
+        }
+    }
+
+    CBRIEFPattern() : nSeed(0xB41EF)
+    {
+        for(int i=0; i<BITS; i++)
+        {
+            gaussianPoint(ax1[i], ay1[i]);
+            gaussianPoint(ax2[i], ay2[i]);
+        }
+    }
+};
+
+template<typename imDataType>
+class CBRIEFDescriptor : public CDescriptor
+{
+public:
+    static const int WORDS = CBRIEFPattern::BITS/64;
+private:
+    unsigned long long anBits[WORDS];
+    CLocation Location;
+    float fOrientation; //Degrees
+
+    //Sum of the 3x3 block centred on x,y; smooths out noise before comparing
+    static inline int boxSum(const IplImage * pIm, const int x, const int y)
+    {
+        int nSum = 0;
+        for(int yy=y-1; yy<=y+1; yy++)
+            for(int xx=x-1; xx<=x+1; xx++)
+                nSum += (int)CIplPx<imDataType>::getGrey(pIm, xx, yy);
+        return nSum;
+    }
+
+    //Angle from the centre to the intensity centroid of a disc
+    static double centroidAngle(const IplImage * pIm, const int x, const int y, const int nRad)
+    {
+        int m10 = 0, m01 = 0;
+        for(int dy=-nRad; dy<=nRad; dy++)
+            for(int dx=-nRad; dx<=nRad; dx++)
+                if(dx*dx + dy*dy <= nRad*nRad)
+                {
+                    const int I = (int)CIplPx<imDataType>::getGrey(pIm, x+dx, y+dy);
+                    m10 += dx*I;
+                    m01 += dy*I;
+                }
+        return atan2((double)m01, (double)m10);
+    }
+
+public:
+    //Samples lie within PATCH_SCALE*PATCH_RAD (including the box filter), so CPatchDescriptorParams::margin() is big enough
+    CBRIEFDescriptor(double dScale, const IplImage * pIm, CLocation point, const int PATCH_RAD, const CPatchParams & PATCH_PARAMS) : Location(point), fOrientation(0)
+    {
+        const CLocation scaledPoint(dScale*point.dx(), dScale*point.dy());
+        const int x = scaledPoint.x(), y = scaledPoint.y();
+        const int nRad = PATCH_PARAMS.PATCH_SCALE * PATCH_RAD - 1;
+
+        double s = 0, c = 1;
+        if(PATCH_PARAMS.ORIENT)
+        {
+            const double dAngle = centroidAngle(pIm, x, y, nRad);
+            s = sin(dAngle); c = cos(dAngle);
+            fOrientation = (float)(dAngle*180.0/M_PI);
+        }
+
+        const CBRIEFPattern & P = CBRIEFPattern::pattern();
+        for(int nWord=0; nWord<WORDS; nWord++)
+        {
+            unsigned long long nBits = 0;
+            for(int nBit=0; nBit<64; nBit++)
+            {
+                const int i = nWord*64 + nBit;
+                const int x1 = doubleToInt(nRad*(c*P.ax1[i] - s*P.ay1[i])), y1 = doubleToInt(nRad*(s*P.ax1[i] + c*P.ay1[i]));
+                const int x2 = doubleToInt(nRad*(c*P.ax2[i] - s*P.ay2[i])), y2 = doubleToInt(nRad*(s*P.ax2[i] + c*P.ay2[i]));
+                if(boxSum(pIm, x+x1, y+y1) < boxSum(pIm, x+x2, y+y2))
+                    nBits |= 1ULL << nBit;
+            }
+            anBits[nWord] = nBits;
+        }
+    }
+
+    CDescriptor::TDist distance(const CDescriptor * pd) const
+    {
+        const CBRIEFDescriptor * pBRIEF = CAST<const CBRIEFDescriptor *>(pd);
+        if(IS_DEBUG) CHECK(!pBRIEF, "CBRIEFDescriptor:distance: Descriptor not a CBRIEFDescriptor");
+        return g_pNormKernels->Hamming_u64(anBits, pBRIEF->anBits, WORDS);
+    }
+    virtual int closestInBlock(const char * pBlock, int nCount, int nStride, CDescriptor::TDist & nClosestDist) const { return closestInBlock_T(this, pBlock, nCount, nStride, nClosestDist); }
+    virtual void distancesToBlock(const char * pBlock, int nCount, int nStride, CDescriptor::TDist * aDists) const { distancesToBlock_T(this, pBlock, nCount, nStride, aDists); }
+
+    virtual CLocation location() const { return Location; }
+    virtual double orientation() const { return fOrientation; }
+
+    virtual int size() const { return sizeof(*this); }
+    virtual bool plainData() const { return true; }
+    virtual int length() const { return WORDS*sizeof(unsigned long long); }
+};
+
+#endif
@@ -23,10 +23,13 @@ public:
 	~CVectorAndHistDescriptor();
 
     double distance(const CDescriptor * pd) const; //still virtual
+    virtual int closestInBlock(const char * pBlock, int nCount, int nStride, TDist & nClosestDist) const { return CDescriptor::closestInBlock(pBlock, nCount, nStride, nClosestDist); }
+    virtual void distancesToBlock(const char * pBlock, int nCount, int nStride, TDist * aDists) const { CDescriptor::distancesToBlock(pBlock, nCount, nStride, aDists); }
+    virtual int vectorLength() const { return 0; } //Distance isn't just the vector's
 
 	inline const CvHistogram * Hist() const { return pHist; };
 
-	virtual int size() const { return sizeof(this); }
+	virtual int size() const { return sizeof(*this); }
 };
 
 templateVS
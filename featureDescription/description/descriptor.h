@@ -36,6 +36,7 @@ enum eKMImplementation
 #endif
 
 #include "util/location.h"
+#include "descriptorArena.h"
 
 //Abstract class for any descriptor that can be clustered
 enum eInvDescriptorType
@@ -95,10 +96,40 @@ public:
 	virtual int size() const = 0;
 	virtual int length() const = 0;
 	virtual char * ptr() const { return ((char *)(void *)this)+sizeof(void*) /* virtual function ptr */; }; //breaks const
+	virtual bool plainData() const { return false; } //True if ptr()..size() holds no pointers, so can be copied to a file and back
+
+	//Coordinates, for descriptors in a vector space with an axis-aligned norm (used to build kd-trees). 0 if there aren't any
+	virtual int vectorLength() const { return 0; }
+	virtual void getVector(float * afVector) const { THROW("This descriptor isn't a vector"); }
+	virtual void setVector(const float * afVector) { THROW("This descriptor isn't a vector"); } //e.g. to move a cluster centre to a mean
+
+	//Closest of nCount descriptors of this type stored contiguously, nStride bytes apart (e.g. one node's children in a frozen BoW dictionary).
+	//Returns its index, or -1 if none is closer than nClosestDist (which is updated). One virtual call per block rather than one per descriptor.
+	virtual int closestInBlock(const char * pBlock, int nCount, int nStride, TDist & nClosestDist) const
+	{
+		int nClosest = -1;
+		for(int i=0; i<nCount; i++, pBlock += nStride)
+		{
+			const TDist dist = distance(reinterpret_cast<const CDescriptor *>(pBlock));
+			if(dist < nClosestDist)
+			{
+				nClosestDist = dist;
+				nClosest = i;
+			}
+		}
+		return nClosest;
+	}
+
+	//Distances to nCount descriptors of this type stored contiguously, nStride bytes apart (e.g. a CPackedDescriptorSet)
+	virtual void distancesToBlock(const char * pBlock, int nCount, int nStride, TDist * aDists) const
+	{
+		for(int i=0; i<nCount; i++, pBlock += nStride)
+			aDists[i] = distance(reinterpret_cast<const CDescriptor *>(pBlock));
+	}
 
 	CDescriptor * clone() const
 	{
-		CDescriptor * pClone = (CDescriptor *)malloc(size());
+		CDescriptor * pClone = (CDescriptor *)::operator new(size()); //Clones are deleted
 		memcpy((void *)pClone, this, size());
 
 		if(IS_DEBUG) CHECK(distance(pClone) != 0, "Clone failed");
@@ -106,13 +137,39 @@ public:
 
 		return pClone;
 	}
+
+protected:
+	//For overriding closestInBlock: qualified distance call so the compiler can inline TDesc's distance function
+	template<class TDesc>
+	static int closestInBlock_T(const TDesc * pDesc, const char * pBlock, int nCount, int nStride, TDist & nClosestDist)
+	{
+		int nClosest = -1;
+		for(int i=0; i<nCount; i++, pBlock += nStride)
+		{
+			const TDist dist = pDesc->TDesc::distance(reinterpret_cast<const CDescriptor *>(pBlock));
+			if(dist < nClosestDist)
+			{
+				nClosestDist = dist;
+				nClosest = i;
+			}
+		}
+		return nClosest;
+	}
+
+	template<class TDesc>
+	static void distancesToBlock_T(const TDesc * pDesc, const char * pBlock, int nCount, int nStride, TDist * aDists)
+	{
+		for(int i=0; i<nCount; i++, pBlock += nStride)
+			aDists[i] = pDesc->TDesc::distance(reinterpret_cast<const CDescriptor *>(pBlock));
+	}
 };
 
 //typedef std::vector<CDescriptor *> TDescriptorVector;
 typedef CDynArray<CDescriptor *> TDescriptorVector;
 typedef CDynArray<const CDescriptor *> TConstDescriptorVector;
 
-class TMPSet;
+class CPackedDescriptorSet;
+class CDescriptorIndex;
 
 class CMatchableDescriptors
 {
@@ -133,21 +190,29 @@ public:
 		 : MATCH_CONDITION(MATCH_CONDITION), PP(PP), NN(NN), MAX_SEPERATION(MAX_SEPERATION), NEARBYNESS(NEARBYNESS), OI_NEARBY_ANGLE(OI_NEARBY_ANGLE)
 		{}
 	};
+	typedef std::pair<CDescriptor::TDist, int> TMatchPair; //Distance, index in the other set
 protected:
     const CBoWCorrespondences * getBruteForceCorrespondenceSet_int(const CMatchableDescriptors * pDS, const CMatchSettings & MS, CBoWCorrespondences * pCorr) const HOT;
 
+	//Fill in the NN+1 closest matches in pDS for descriptors nStart..nEnd-1 (aTopNN has NN+1 entries per descriptor, anTopNN their counts)
 	template<bool LIMIT_DISTANCES, bool ROTATION_INVARIANCE>
-	void getBFC_matchDescriptors_RI(const int nStart, const int nEnd, const CMatchableDescriptors * pDS, const CMatchSettings & MS, TMPSet * d) const;
+	void getBFC_matchDescriptors_RI(const int nStart, const int nEnd, const CMatchableDescriptors * pDS, const CMatchSettings & MS, TMatchPair * aTopNN, int * anTopNN) const;
 	template<bool LIMIT_DISTANCES>
-	void getBFC_matchDescriptors(const int nStart, const int nEnd, const CMatchableDescriptors * pDS, const CMatchSettings & MS, TMPSet * d) const;
-	void getBFC_matchDescriptorsMT(const int nStart, const int nEnd, const CMatchableDescriptors * pDS, const CMatchSettings & MS, TMPSet * d) const;
+	void getBFC_matchDescriptors(const int nStart, const int nEnd, const CMatchableDescriptors * pDS, const CMatchSettings & MS, TMatchPair * aTopNN, int * anTopNN) const;
+	void getBFC_matchDescriptorsMT(const int nStart, const int nEnd, const CMatchableDescriptors * pDS, const CMatchSettings & MS, TMatchPair * aTopNN, int * anTopNN) const;
 public:
 	const CBoWCorrespondences * getBruteForceCorrespondenceSet(const CMatchableDescriptors * pDS, const CMatchSettings & MS, CBoWCorrespondences * pCorr) const;
+
+	//Size of the threadpool shared by all brute-force matching (1 matches in the calling thread)
+	static void setMatchingThreads(const int nThreads);
 	virtual int Count() const = 0;
 	inline const CDescriptor * get_const(int i) const { return (*this)[i]; }
 	virtual const CDescriptor * operator[](int i) const { return get_const(i); };
 
 	virtual void Clear() = 0;
+
+	//Non-zero if descriptors are stored contiguously, so batch distances can be used
+	virtual const CPackedDescriptorSet * packed() const { return 0; }
 };
 
 class CSimpleMatchableDescriptors: public CMatchableDescriptors
@@ -167,11 +232,19 @@ class CDescriptorSet : public CMatchableDescriptors
 private:
 	bool Contains(const CDescriptor * pDescriptor) const;
 
+	CDescriptorIndex * pIndex; //Optional approximate nearest-neighbour index
+	int nIndexChecks;
+	CDescriptorArena * pArena;
+	const CDescriptorIndex * index() const { return pIndex; } //0 if there isn't one
+
 protected:
 	//Adds a random subset of this set to pRandSubset, include centres if given
 	void RandomSubset(int n, CDescriptorSet * pRandSubset, CClusterSet * pBestClusters = 0, bool bForceSeperation = false);
 
 	void clearClusterAssignments();
+
+	//Derived sets call this whenever descriptors are added or removed, as the index refers to them by position
+	inline void invalidateIndex() { if(pIndex) clearIndex(); }
 public:
 	//A function that takes a vector of descriptors and clusters them into k clusters.
 	virtual CClusterSet * Cluster(int nClusters, const CCluster * pParentCluster) = 0;
@@ -183,8 +256,25 @@ public:
 	virtual CDescriptor * operator[](int i) = 0;
 	inline CDescriptor * get(int i) { return (*this)[i]; }
 
-	virtual ~CDescriptorSet()
+	CDescriptorSet() : pIndex(0), nIndexChecks(0), pArena(0) {}
+	CDescriptorSet(const CDescriptorSet &) : CMatchableDescriptors(), pIndex(0), nIndexChecks(0), pArena(0) {} //Index and arena aren't copied
+	CDescriptorSet & operator=(const CDescriptorSet &) { clearIndex(); return *this; }
+	virtual ~CDescriptorSet();
+
+	//Threads used by Cluster() (shared by all descriptor sets)
+	static void setClusteringThreads(const int nThreads);
+
+	//Use an ANN index (CDescriptorIndex) for the closest-descriptor queries below, evaluating at most nChecks distances per query. Dropped when descriptors are added or removed.
+	void buildIndex(const int nChecks, const int nTrees = 4);
+	void clearIndex();
+
+	//Memory for this set's descriptors (e.g. one frame's), created when first needed. If used, every descriptor Push'ed here must come from
+	//it, and they're all freed together with the set (by deleteDS or delete) rather than one at a time. Sets sharing descriptors don't own them.
+	CDescriptorArena * arena()
 	{
+		if(!pArena)
+			pArena = new CDescriptorArena;
+		return pArena;
 	}
 
 	const CDescriptor * ClosestDescriptor(const CDescriptor * pDesc) const;
@@ -207,8 +297,16 @@ public:
 		const CDescriptorSet * pDescriptors = *ppDescriptors;
 		if(pDescriptors)
 		{
-			for(int i=0; i<pDescriptors->Count(); i++)
-				delete pDescriptors->get_const(i); //the descriptor
+			if(!pDescriptors->pArena) //otherwise the arena frees them all at once
+			{
+				for(int i=0; i<pDescriptors->Count(); i++)
+					delete pDescriptors->get_const(i); //the descriptor
+			}
+			else if(IS_DEBUG)
+			{
+				for(int i=0; i<pDescriptors->Count(); i++)
+					CHECK(!pDescriptors->pArena->contains(pDescriptors->get_const(i)), "deleteDS: Descriptor in a set with an arena wasn't allocated from it");
+			}
 
 			delete pDescriptors; *ppDescriptors = 0;
 		}
@@ -221,6 +319,48 @@ public:
 	}
 };
 
+//Copies of descriptors of one concrete type, packed nStride bytes apart in one aligned buffer, with locations and
+//orientations in parallel arrays. Batch distances make one virtual call per row rather than one per pair.
+class CPackedDescriptorSet : public CMatchableDescriptors
+{
+	char * pMem, * pBlock;
+	int nCount, nStride;
+	CDynArray<CLocation> aLocations;
+	CDynArray<double> adOrientations;
+
+	void pack(const CDescriptor * const * apDescriptors, int nCount);
+
+	CPackedDescriptorSet(const CPackedDescriptorSet &);
+	void operator=(const CPackedDescriptorSet &);
+public:
+	explicit CPackedDescriptorSet(const CMatchableDescriptors * pDescriptors);
+	CPackedDescriptorSet(const CDescriptor * const * apDescriptors, int nCount);
+	~CPackedDescriptorSet() { Clear(); }
+
+	//Whether every descriptor in pDescriptors is the same type, so they can be packed
+	static bool packable(const CMatchableDescriptors * pDescriptors);
+
+	virtual int Count() const { return nCount; }
+	virtual const CDescriptor * operator[](int i) const { return reinterpret_cast<const CDescriptor *>(pBlock + i*nStride); }
+	virtual void Clear();
+	virtual const CPackedDescriptorSet * packed() const { return this; }
+
+	inline const char * block() const { return pBlock; }
+	inline int stride() const { return nStride; }
+	inline CLocation location(int i) const { return aLocations[i]; }
+	inline double orientation(int i) const { return adOrientations[i]; }
+
+	//One-to-many: aDists[j] = distance from pDesc to descriptor j
+	inline void distances(const CDescriptor * pDesc, CDescriptor::TDist * aDists) const
+	{
+		if(nCount > 0)
+			pDesc->distancesToBlock(pBlock, nCount, nStride, aDists);
+	}
+
+	//Many-to-many: aDists[i*pOther->Count() + j] = distance from descriptor i here to pOther's descriptor j
+	void distances(const CPackedDescriptorSet * pOther, CDescriptor::TDist * aDists) const;
+};
+
 #include "descriptorClustering.h"
 
 pragma_warning (pop)
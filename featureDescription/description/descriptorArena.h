@@ -0,0 +1,84 @@
+/* Code by Tom Botterill. Documentation and license at http://www.hilandtom.com/tombotterill/code */
+
+#pragma once
+
+#ifndef DESCRIPTORARENA_H
+#define DESCRIPTORARENA_H
+
+#include "util/dynArray.h"
+#include <boost/noncopyable.hpp>
+#include <stdlib.h>
+#include <new>
+
+//Bump allocator for descriptors with the same lifetime (e.g. all of one frame's). Nothing is freed until the arena is deleted, then
+//everything is freed at once. Descriptors from an arena must never be deleted individually (their destructors aren't called, which is
+//fine as descriptors don't own any memory). Not thread-safe: use one arena per thread/descriptor set.
+class CDescriptorArena : boost::noncopyable
+{
+	static const size_t CHUNK_SIZE = 64*1024;
+	static const size_t ALIGNMENT = 16; //Enough for SSE loads of descriptor data
+
+	CDynArray<char *> apChunks, apChunkEnds;
+	char * pNext, * pEnd;
+
+	void newChunk(const size_t nMinSize)
+	{
+		const size_t nSize = std::max<size_t>((size_t)CHUNK_SIZE, nMinSize + ALIGNMENT); //Copy so CHUNK_SIZE needn't be defined
+		char * pChunk = (char *)malloc(nSize);
+		CHECK(!pChunk, "CDescriptorArena: Out of memory");
+		pNext = pChunk;
+		pEnd = pChunk + nSize;
+		apChunks.push_back(pChunk);
+		apChunkEnds.push_back(pEnd);
+	}
+
+	static char * align(char * p)
+	{
+		return (char *)(((size_t)p + ALIGNMENT - 1) & ~(ALIGNMENT - 1));
+	}
+
+public:
+	CDescriptorArena() : pNext(0), pEnd(0) {}
+
+	~CDescriptorArena()
+	{
+		for(int i=0; i<(int)apChunks.size(); i++)
+			free(apChunks[i]);
+	}
+
+	void * alloc(const size_t nSize)
+	{
+		char * p = align(pNext);
+		if(!pNext || p + nSize > pEnd)
+		{
+			newChunk(nSize);
+			p = align(pNext);
+		}
+		pNext = p + nSize;
+		return p;
+	}
+
+	//For checking ownership (slow)
+	bool contains(const void * p) const
+	{
+		for(int i=0; i<(int)apChunks.size(); i++)
+			if((const char *)p >= apChunks[i] && (const char *)p < apChunkEnds[i])
+				return true;
+		return false;
+	}
+
+	//Allocate from pArena, or from the heap (for delete) if there isn't one
+	static void * allocate(CDescriptorArena * pArena, const size_t nSize)
+	{
+		return pArena ? pArena->alloc(nSize) : ::operator new(nSize);
+	}
+
+	//new TDesc(args...), in pArena if given
+	template<class TDesc, typename... TArgs>
+	static TDesc * make(CDescriptorArena * pArena, const TArgs &... args)
+	{
+		return new (allocate(pArena, sizeof(TDesc))) TDesc(args...);
+	}
+};
+
+#endif
@@ -1,8 +1,12 @@
 /* Code by Tom Botterill. Documentation and license at http://www.hilandtom.com/tombotterill/code */
 
 #include "descriptor.h"
+#include "geom/threadpool.h"
 #include <set>
 #include <functional>
+#include <boost/bind.hpp>
+
+#define ASSIGN_BLOCK 256 //Descriptors per job when assigning in parallel
 
 using namespace std;
 
@@ -106,6 +110,90 @@ void CClusterSet::remindDescriptorsOfAssignments()
     }
 }
 
+void CClusterSet::findClosestClusters_int(CDescriptorSet * pDescriptors, int nAssignSpeedup, int nStart, int nEnd, CCluster ** apClosestClusters, CDescriptor::TDist * aClosestDists) const
+{
+    ARRAY(bool, aTooFarAway, size());
+
+    for(int i=nStart; i < nEnd; i++)
+    {
+        const CDescriptor * pDescriptor = (*pDescriptors)[i*nAssignSpeedup];
+
+        CCluster * pClosestCluster = *begin(); //Will be used when there's only 1 option
+        CDescriptor::TDist dClosestDist=MAX_ALLOWED_DIST;
+
+        if(pDescriptor->assignment())
+        {
+        	dClosestDist = pDescriptor->assignmentDist();
+        	pClosestCluster = const_cast<CCluster *>( pDescriptor->assignment() ); //Think this is ok...
+        }
+        else if(size() > 1)
+        {
+			setConstant(PTR(aTooFarAway), false, size());
+
+			for(CClusterSet::const_iterator ppCluster=begin(); ppCluster != end(); ppCluster++)
+			{
+		        CCluster * pCluster = *ppCluster;
+				int nThisCentreIdx = pCluster->idx();
+
+				if(aTooFarAway[nThisCentreIdx])
+				{
+					DEBUGONLY(CDescriptor::TDist dDist=pDescriptor->distance(pCluster->Centre());
+					if(dDist < dClosestDist)
+						cout << "ERROR: Closer centre missed\n");
+					continue;
+				}
+
+				CDescriptor::TDist dDist=pDescriptor->distance(pCluster->Centre());
+				if (dDist<dClosestDist)
+				{
+					dClosestDist=dDist;
+					pClosestCluster=pCluster;
+				}
+
+				if(aaDistances)
+				{
+					CDescriptor::TDist distFromCentreUB = 2*(dDist+dClosestDist); //UB1 For Euclidean norm
+
+					aTooFarAway[nThisCentreIdx] = true;
+
+					bool * pTooFarAway = PTR(aTooFarAway);
+					for(int nOtherClusterIdx=0; nOtherClusterIdx < size(); nOtherClusterIdx++, pTooFarAway++)
+					{
+						if(*pTooFarAway)
+							continue;
+
+						CDescriptor::TDist dDistToOtherCentre = aaDistances[nThisCentreIdx * size() + nOtherClusterIdx];
+						if(distFromCentreUB <= dDistToOtherCentre)
+						{
+							//then definitely not closer to other centre, by Triangle ineq.
+							*pTooFarAway = true;
+						}
+					}
+				}
+			}
+        }
+
+        apClosestClusters[i] = pClosestCluster;
+        aClosestDists[i] = dClosestDist;
+    }
+}
+
+//Jobs are fixed-size blocks, and each only writes its own results
+void CClusterSet::findClosestClusters(CDescriptorSet * pDescriptors, int nAssignSpeedup, int nToAssign, CCluster ** apClosestClusters, CDescriptor::TDist * aClosestDists, CThreadpool_base * pThreadpool) const
+{
+    if(pThreadpool && nToAssign > ASSIGN_BLOCK && size() > 1)
+    {
+        for(int nStart=0; nStart < nToAssign; nStart += ASSIGN_BLOCK)
+        {
+            TNullaryFnObj fn = boost::bind(&CClusterSet::findClosestClusters_int, this, pDescriptors, nAssignSpeedup, nStart, min<int>(nStart + ASSIGN_BLOCK, nToAssign), apClosestClusters, aClosestDists);
+            pThreadpool->addJob(fn);
+        }
+        pThreadpool->waitForAll();
+    }
+    else
+        findClosestClusters_int(pDescriptors, nAssignSpeedup, 0, nToAssign, apClosestClusters, aClosestDists);
+}
+
 #define LogClusterQuality
 #ifdef LogClusterQuality
 
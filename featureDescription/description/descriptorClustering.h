@@ -7,6 +7,8 @@
 #include <iostream>
 #include <boost/noncopyable.hpp>
 
+class CThreadpool_base;
+
 //One cluster
 class CCluster : boost::noncopyable
 {
@@ -108,6 +110,10 @@ class CClusterSet: public TClusterVector
 	const CDescriptor::TDist * aaDistances;
 
 	double dTotalDistance;
+
+	//Closest centre to every nAssignSpeedup'th descriptor (or its existing assignment)
+	void findClosestClusters_int(CDescriptorSet * pDescriptors, int nAssignSpeedup, int nStart, int nEnd, CCluster ** apClosestClusters, CDescriptor::TDist * aClosestDists) const HOT;
+	void findClosestClusters(CDescriptorSet * pDescriptors, int nAssignSpeedup, int nToAssign, CCluster ** apClosestClusters, CDescriptor::TDist * aClosestDists, CThreadpool_base * pThreadpool) const;
 public:
 	CClusterSet(unsigned int nSize, CDescriptor::TDist ** paaDistances)
 	: aaDistances(paaDistances ? *paaDistances : 0), dTotalDistance ( NOT_ASSIGNED())
@@ -126,7 +132,7 @@ public:
 	}
 
 	template<bool bQuiet>
-	double AssignToClusters(CDescriptorSet * pDescriptors, int nAssignSpeedup) HOT; //Assign all in this set to clusters. NB sometimes the ret val isn't used, and doesn't need to be calculated
+	double AssignToClusters(CDescriptorSet * pDescriptors, int nAssignSpeedup, CThreadpool_base * pThreadpool = 0) HOT; //Assign all in this set to clusters. NB sometimes the ret val isn't used, and doesn't need to be calculated
 	void CheckDisimilarity() const;
 	void CheckAssignment() const;
 
@@ -147,151 +153,41 @@ public:
 };
 
 // If nAssignSpeedup > 1 we don't actually assign descriptors to clusters, only estimate disp.
+// Closest centres are found in parallel if a threadpool is given; assignment is then done in order, so the result doesn't depend on the number of threads.
 template <bool bQuiet>
-double CClusterSet::AssignToClusters(CDescriptorSet * pDescriptors, int nAssignSpeedup)
+double CClusterSet::AssignToClusters(CDescriptorSet * pDescriptors, int nAssignSpeedup, CThreadpool_base * pThreadpool)
 {
     CHECK(dTotalDistance != CClusterSet::NOT_ASSIGNED(), "CClusterSet::AssignToClusters: Already assigned");
     double dTotalDist = 0;
     int nBorderlinePoints = 0;
-    int nDescriptors = pDescriptors->Count();
+    const int nToAssign = (pDescriptors->Count() + nAssignSpeedup - 1) / nAssignSpeedup;
 
-    ARRAY(bool, aTooFarAway, size());
-	static int s_nComparisons=0, s_nFarAway=0, s_nAvoidedByBeingClose=0;
+    CDynArray<CCluster *> apClosestClusters(nToAssign); //Not on the stack, there may be millions
+    CDynArray<CDescriptor::TDist> aClosestDists(nToAssign);
+    findClosestClusters(pDescriptors, nAssignSpeedup, nToAssign, apClosestClusters.begin(), aClosestDists.begin(), pThreadpool);
 
-    for(int nDescriptor=0; nDescriptor < nDescriptors; nDescriptor += nAssignSpeedup)
+    for(int i=0; i < nToAssign; i++)
     {
-        CDescriptor * pDescriptor = (*pDescriptors)[nDescriptor];
-
-        CClusterSet::iterator ppClosestCluster=begin(); //Will be used when there's only 1 option
-        CCluster * pClosestCluster = *ppClosestCluster;
+        CDescriptor * pDescriptor = (*pDescriptors)[i*nAssignSpeedup];
+        CCluster * pClosestCluster = apClosestClusters[i];
 
         if(pDescriptor->assignment())
         {
         	dTotalDist += pDescriptor->assignmentDist();
-        	pClosestCluster = const_cast<CCluster *>( pDescriptor->assignment() ); //Think this is ok...
         }
         else
         {
-			CDescriptor::TDist dClosestDist=MAX_ALLOWED_DIST;
 			if(size() > 1)
-			{
-				CDescriptor::TDist dNextClosestDist=MAX_ALLOWED_DIST;
-
-				setConstant(PTR(aTooFarAway), false, size());
-
-				//int nNextIdx = 0;
-
-				int nActualComparisons=0, nFarAway=0;
-				for(CClusterSet::iterator ppCluster=begin(); ppCluster != end(); ppCluster++)
-				//while(nNextIdx >= 0)
-				{
-			        CCluster * pCluster = *ppCluster;
-					//CCluster * pCluster = pBegin + nNextIdx;
-
-					int nThisCentreIdx = pCluster->idx();
-
-					//cout << "Trying c " << nNextIdx << " idx " << pCluster->idx() << endl;
-
-					if(aTooFarAway[nThisCentreIdx])
-					{
-						DEBUGONLY(CDescriptor::TDist dDist=pDescriptor->distance(pCluster->Centre());
-						if(dDist < dClosestDist)
-							cout << "ERROR: Closer centre missed\n");
-						nFarAway++;
-						continue;
-					}
-
-					//std::cout << pCluster->KMCountEst() << ' ';
-					CDescriptor::TDist dDist=pDescriptor->distance(pCluster->Centre());
-					nActualComparisons++;
-					if (dDist<dClosestDist)
-					{
-						if(!bQuiet)
-							dNextClosestDist = dClosestDist;
-
-						dClosestDist=dDist;
-						pClosestCluster=pCluster;
-
-						/*if(dDist < pCluster->halfMinDist())
-						{
-							break;
-						}*/
-					}
-
-					if(aaDistances)
-					{
-						//CDescriptor::TDist distFromCentreUB = 2*dDist; //For any metric
-						//CDescriptor::TDist distFromCentreUB = 4*dDist; //For Euclidean norm
-						//CDescriptor::TDist distFromCentreUB = dDist+dClosestDist; //For any metric
-						CDescriptor::TDist distFromCentreUB = 2*(dDist+dClosestDist); //UB1 For Euclidean norm
-						//CDescriptor::TDist distFromCentreUBexact = sqr(sqrt(dDist)+sqrt(dClosestDist)); //UB exact
-						//CDescriptor::TDist distFromCentreLBexact = sqr(sqrt(dDist)-sqrt(dClosestDist)); //LB exact
-						//cout << distFromCentreUB << " approx, " << distFromCentreUBexact << " exact\n";
-						//cout << distFromCentreUB << " approx, " << distFromCentreLBexact << " LB exact\n";
-
-						aTooFarAway[nThisCentreIdx] = true;
-
-						/*CDescriptor::TDist dClosestToThis = MAX_ALLOWED_DIST;
-						nNextIdx = -1;
-
-						 * Choosing furthest descriptor saves about 10%
-						 * 			nearest 					    16%
-						 * 			nearest to distance			    16%
-						*/
-
-						bool * pTooFarAway = PTR(aTooFarAway);
-						for(int nOtherClusterIdx=0; nOtherClusterIdx < size(); nOtherClusterIdx++, pTooFarAway++)
-						{
-							if(*pTooFarAway)
-								continue;
-
-							CDescriptor::TDist dDistToOtherCentre = aaDistances[nThisCentreIdx * size() + nOtherClusterIdx];
-							if(distFromCentreUB <= dDistToOtherCentre)
-							{
-								//then definitely not closer to other centre, by Triangle ineq.
-								*pTooFarAway = true;
-							}
-							/*else if(!aTooFarAway[nOtherClusterIdx] && distFromCentreUBexact <= dDistToOtherCentre)
-								cout << "1 in gap\n"; Extremely few in gap
-							else if(distFromCentreLBexact >= dDistToOtherCentre) Extremely few can be eliminated this way--1 in 250 descriptors eliminate 1 centre
-								cout << "1 within LB\n";*/
-
-
-							/*else if(fabs(dDistToOtherCentre - dDist) < dClosestToThis)
-							{
-								nNextIdx = nOtherClusterIdx;
-								dClosestToThis = fabs(dDistToOtherCentre - dDist);
-							}*/
-						}
-					}
-				}
-				//std::cout << "Assigned to " << size() << " centres with " << i << " comparisons, " << nFarAway << " avoided by being too far away\n";
-				s_nComparisons += size();
-				s_nFarAway += nFarAway;
-				s_nAvoidedByBeingClose += size()-nActualComparisons;
-				dTotalDist += dClosestDist;
-			}
-			//else
-				//cout << "1 cluster\n";
-
-			//if(nAssignSpeedup==1)
-	        pDescriptor->assignToCluster(pClosestCluster, dClosestDist);
+				dTotalDist += aClosestDists[i];
+
+	        pDescriptor->assignToCluster(pClosestCluster, aClosestDists[i]);
         }
 
         if(nAssignSpeedup==1)
         {
             pClosestCluster->Push(pDescriptor);
         }
-
-
-        /*if(!bQuiet)
-        {
-            if(dNextClosestDist-dClosestDist < 5) //count points on the border of 2 clusters
-                nBorderlinePoints++;
-        }*/
     }
-	//std::cout << "RUNNING TOTAL: Assigned to " << s_nComparisons << " centres, saving " << s_nAvoidedByBeingClose << " comparisons by knowing radius; " << s_nFarAway << " avoided by being too far away\n";
-//Example RUNNING TOTAL: Assigned to 41799618 centres, saving 11301745 comparisons by knowing radius; 8120828 avoided by being too far away
 
     if(nAssignSpeedup==1)
         dTotalDistance = dTotalDist; //otherwise not assigned
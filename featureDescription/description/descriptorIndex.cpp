@@ -0,0 +1,358 @@
+/* Code by Tom Botterill. Documentation and license at http://www.hilandtom.com/tombotterill/code */
+
+#include "descriptorIndex.h"
+#include "vectorDescriptor.h"
+#include "time/SpeedTest.h"
+#include <queue>
+#include <algorithm>
+#include <iostream>
+#include <boost/scoped_ptr.hpp>
+
+using namespace std;
+
+#define KD_LEAF_SIZE 8
+#define KD_SPLIT_SAMPLES 100 //Points used to estimate each dimension's mean and variance
+#define KD_SPLIT_CANDIDATES 5 //Split on a random one of the highest-variance dimensions, so the trees are different
+#define VP_LEAF_SIZE 8
+
+//Own generator so indices are the same every run, and building one doesn't disturb CRandom
+static inline int nextRand(unsigned int & nSeed, const int n) {
+    nSeed = nSeed * 1103515245u + 12345u;
+    return (int) (((unsigned long long) (nSeed >> 8) * n) >> 24); //High bits: the low bits of an LCG have short periods
+}
+
+void CDescriptorIndex::CKnnResult::offer(const CDescriptor::TDist dist, const int nIdx) {
+    const TMatchPair match(dist, nIdx);
+    if (nFound == k && !(match < aMatches[k - 1]))
+        return;
+    for (int i = 0; i < nFound; i++)
+        if (aMatches[i].second == nIdx)
+            return; //Already found (in another kd-tree)
+
+    int i = (nFound == k) ? k - 1 : nFound++;
+    for (; i > 0 && match < aMatches[i - 1]; i--)
+        aMatches[i] = aMatches[i - 1];
+    aMatches[i] = match;
+}
+
+int CDescriptorIndex::knn(const CDescriptor * pDesc, const int k, TMatchPair * aMatches, const int nChecks) const {
+    CKnnResult result(aMatches, k);
+    if (nChecks <= 0 || nChecks >= nCount) {
+        for (int i = 0; i < nCount; i++)
+            result.offer(pDesc->distance(pDescriptors->get_const(i)), i);
+    } else
+        search(pDesc, result, nChecks);
+
+    return result.found();
+}
+
+//Best-bin-first: unexplored branches, closest (by some lower bound on distance) first
+struct CBranch {
+    float fKey;
+    int nTree, nNode;
+
+    CBranch(float fKey, int nTree, int nNode) : fKey(fKey), nTree(nTree), nNode(nNode) {}
+    bool operator<(const CBranch & other) const { return fKey > other.fKey; } //priority_queue pops the smallest key
+};
+
+//Randomised kd-forest (Silpa-Anan and Hartley; as in FLANN). All trees are searched together from one priority queue.
+class CKDForestIndex : public CDescriptorIndex {
+    struct CNode {
+        int nDim; //-1 for a leaf
+        float fSplit;
+        int anChildren[2]; //Below and above fSplit. Leaves: start and end in aIndices
+    };
+    struct CTree {
+        CDynArray<CNode> aNodes;
+        CDynArray<int> aIndices;
+    };
+
+    const int nDims;
+    CDynArray<float> afCoords;
+    CDynArrayOwner<CTree> apTrees;
+
+    inline const float * coords(const int nIdx) const { return afCoords.begin() + nIdx * nDims; }
+
+    int buildNode(CTree * pTree, const int nStart, const int nEnd, unsigned int & nSeed) {
+        const int nNode = pTree->aNodes.size();
+        CNode node;
+        node.nDim = -1;
+        node.fSplit = 0;
+        node.anChildren[0] = nStart;
+        node.anChildren[1] = nEnd;
+        pTree->aNodes.push_back(node);
+
+        const int nPoints = nEnd - nStart;
+        if (nPoints <= KD_LEAF_SIZE)
+            return nNode;
+
+        const int nSamples = min<int>(nPoints, KD_SPLIT_SAMPLES);
+        ARRAYZ(double, adSum, nDims);
+        ARRAYZ(double, adSumSq, nDims);
+        for (int nSample = 0; nSample < nSamples; nSample++) {
+            const float * af = coords(pTree->aIndices[nStart + (nSample * nPoints) / nSamples]);
+            for (int d = 0; d < nDims; d++) {
+                adSum[d] += af[d];
+                adSumSq[d] += sqr((double) af[d]);
+            }
+        }
+
+        ARRAY(int, anDims, nDims);
+        for (int d = 0; d < nDims; d++) {
+            anDims[d] = d;
+            adSumSq[d] = adSumSq[d] / nSamples - sqr(adSum[d] / nSamples); //Variance
+        }
+        const int nCandidates = min<int>(nDims, KD_SPLIT_CANDIDATES);
+        const double * adVar = PTR(adSumSq);
+        partial_sort(PTR(anDims), PTR(anDims) + nCandidates, PTR(anDims) + nDims, [adVar](int d1, int d2) { return adVar[d1] > adVar[d2]; });
+
+        int nDim = anDims[nextRand(nSeed, nCandidates)];
+        if (adVar[nDim] <= 0)
+            nDim = anDims[0];
+        if (adVar[nDim] <= 0)
+            return nNode; //Sample all identical
+
+        float fSplit = (float) (adSum[nDim] / nSamples);
+        int * pStart = pTree->aIndices.begin() + nStart, * pEnd = pTree->aIndices.begin() + nEnd;
+        int * pMid = partition(pStart, pEnd, [this, nDim, fSplit](int nIdx) { return coords(nIdx)[nDim] < fSplit; });
+
+        if (pMid == pStart || pMid == pEnd) {
+            //Mean of the sample is a bad split for everything, try the median
+            pMid = pStart + nPoints / 2;
+            nth_element(pStart, pMid, pEnd, [this, nDim](int nIdx1, int nIdx2) { return coords(nIdx1)[nDim] < coords(nIdx2)[nDim]; });
+            fSplit = coords(*pMid)[nDim];
+        }
+        const int nMid = nStart + (int) (pMid - pStart);
+
+        const int nBelow = buildNode(pTree, nStart, nMid, nSeed);
+        const int nAbove = buildNode(pTree, nMid, nEnd, nSeed);
+
+        CNode & thisNode = pTree->aNodes[nNode]; //Not before, aNodes may have moved
+        thisNode.nDim = nDim;
+        thisNode.fSplit = fSplit;
+        thisNode.anChildren[0] = nBelow;
+        thisNode.anChildren[1] = nAbove;
+        return nNode;
+    }
+
+protected:
+    virtual void search(const CDescriptor * pDesc, CKnnResult & result, const int nChecks) const {
+        ARRAY(float, afQuery, nDims);
+        pDesc->getVector(PTR(afQuery));
+
+        priority_queue<CBranch> branches;
+        for (int nTree = 0; nTree < (int) apTrees.size(); nTree++)
+            branches.push(CBranch(0, nTree, 0));
+
+        int nChecked = 0;
+        while (!branches.empty() && (nChecked < nChecks || !result.full())) {
+            const CBranch branch = branches.top();
+            branches.pop();
+
+            const CTree * pTree = apTrees[branch.nTree];
+            int nNode = branch.nNode;
+            for (;;) {
+                const CNode & node = pTree->aNodes[nNode];
+                if (node.nDim < 0)
+                    break;
+                const float fDiff = afQuery[node.nDim] - node.fSplit;
+                const int nNear = (fDiff < 0) ? 0 : 1;
+                branches.push(CBranch(branch.fKey + fDiff * fDiff, branch.nTree, node.anChildren[1 - nNear]));
+                nNode = node.anChildren[nNear];
+            }
+
+            const CNode & leaf = pTree->aNodes[nNode];
+            for (int i = leaf.anChildren[0]; i < leaf.anChildren[1]; i++, nChecked++) {
+                const int nIdx = pTree->aIndices[i];
+                result.offer(pDesc->distance(pDescriptors->get_const(nIdx)), nIdx);
+            }
+        }
+    }
+
+public:
+    CKDForestIndex(const CMatchableDescriptors * pDescriptors, const int nDims, const int nTrees) : CDescriptorIndex(pDescriptors), nDims(nDims) {
+        afCoords.resize(nCount * nDims);
+        for (int i = 0; i < nCount; i++)
+            pDescriptors->get_const(i)->getVector(afCoords.begin() + i * nDims);
+
+        unsigned int nSeed = 1;
+        for (int nTree = 0; nTree < nTrees; nTree++) {
+            CTree * pTree = new CTree;
+            pTree->aIndices.resize(nCount);
+            for (int i = 0; i < nCount; i++)
+                pTree->aIndices[i] = i;
+            buildNode(pTree, 0, nCount, nSeed);
+            apTrees.push_back(pTree);
+        }
+    }
+};
+
+//Vantage-point tree (Yianilos): works for any distance. Each node splits its descriptors at the median distance from a random one.
+//Branches are prioritised by |d - mu| but never pruned, as this is only a lower bound for true metrics (not e.g. squared Euclidean distances)
+class CVPTreeIndex : public CDescriptorIndex {
+    struct CNode {
+        int nVantagePoint; //-1 for a leaf
+        CDescriptor::TDist mu;
+        int anChildren[2]; //Closer and further than mu. Leaves: start and end in aIndices
+    };
+
+    CDynArray<CNode> aNodes;
+    CDynArray<int> aIndices;
+
+    int buildNode(const int nStart, const int nEnd, unsigned int & nSeed, TMatchPair * aScratch) {
+        const int nNode = aNodes.size();
+        CNode node;
+        node.nVantagePoint = -1;
+        node.mu = 0;
+        node.anChildren[0] = nStart;
+        node.anChildren[1] = nEnd;
+        aNodes.push_back(node);
+
+        if (nEnd - nStart <= VP_LEAF_SIZE)
+            return nNode;
+
+        swap(aIndices[nStart], aIndices[nStart + nextRand(nSeed, nEnd - nStart)]);
+        const int nVantagePoint = aIndices[nStart];
+        const CDescriptor * pVantagePoint = pDescriptors->get_const(nVantagePoint);
+
+        for (int i = nStart + 1; i < nEnd; i++)
+            aScratch[i] = TMatchPair(pVantagePoint->distance(pDescriptors->get_const(aIndices[i])), aIndices[i]);
+
+        const int nMid = (nStart + 1 + nEnd) / 2;
+        nth_element(aScratch + nStart + 1, aScratch + nMid, aScratch + nEnd);
+        for (int i = nStart + 1; i < nEnd; i++)
+            aIndices[i] = aScratch[i].second;
+
+        const CDescriptor::TDist mu = aScratch[nMid].first;
+        const int nInside = buildNode(nStart + 1, nMid, nSeed, aScratch);
+        const int nOutside = buildNode(nMid, nEnd, nSeed, aScratch);
+
+        CNode & thisNode = aNodes[nNode];
+        thisNode.nVantagePoint = nVantagePoint;
+        thisNode.mu = mu;
+        thisNode.anChildren[0] = nInside;
+        thisNode.anChildren[1] = nOutside;
+        return nNode;
+    }
+
+protected:
+    virtual void search(const CDescriptor * pDesc, CKnnResult & result, const int nChecks) const {
+        priority_queue<CBranch> branches;
+        branches.push(CBranch(0, 0, 0));
+
+        int nChecked = 0;
+        while (!branches.empty() && (nChecked < nChecks || !result.full())) {
+            const CBranch branch = branches.top();
+            branches.pop();
+
+            const CNode & node = aNodes[branch.nNode];
+            if (node.nVantagePoint < 0) {
+                for (int i = node.anChildren[0]; i < node.anChildren[1]; i++, nChecked++)
+                    result.offer(pDesc->distance(pDescriptors->get_const(aIndices[i])), aIndices[i]);
+            } else {
+                const CDescriptor::TDist dist = pDesc->distance(pDescriptors->get_const(node.nVantagePoint));
+                result.offer(dist, node.nVantagePoint);
+                nChecked++;
+
+                const int nNear = (dist < node.mu) ? 0 : 1;
+                const float fFarKey = max<float>(branch.fKey, (float) abs(dist - node.mu));
+                branches.push(CBranch(branch.fKey, 0, node.anChildren[nNear]));
+                branches.push(CBranch(fFarKey, 0, node.anChildren[1 - nNear]));
+            }
+        }
+    }
+
+public:
+    explicit CVPTreeIndex(const CMatchableDescriptors * pDescriptors) : CDescriptorIndex(pDescriptors) {
+        aIndices.resize(nCount);
+        for (int i = 0; i < nCount; i++)
+            aIndices[i] = i;
+
+        ARRAY(TMatchPair, aScratch, max<int>(nCount, 1));
+        unsigned int nSeed = 1;
+        buildNode(0, nCount, nSeed, PTR(aScratch));
+    }
+};
+
+CDescriptorIndex * CDescriptorIndex::makeIndex(const CMatchableDescriptors * pDescriptors, eIndexType eType, int nTrees) {
+    const int nDims = (pDescriptors->Count() > 0) ? pDescriptors->get_const(0)->vectorLength() : 0;
+
+    if (eType == eAutoIndex)
+        eType = (nDims > 0) ? eKDForest : eVPTree;
+
+    if (eType == eKDForest) {
+        CHECK(nDims == 0, "makeIndex: kd-trees need vector-space descriptors");
+        CHECK(nTrees < 1, "makeIndex: Need at least one tree");
+        return new CKDForestIndex(pDescriptors, nDims, nTrees);
+    }
+    return new CVPTreeIndex(pDescriptors);
+}
+
+void CDescriptorIndex::testRecall(const CMatchableDescriptors * pDescriptors, const CMatchableDescriptors * pQueries, eIndexType eType, int k) {
+    const int nQueries = pQueries->Count();
+    CHECK(nQueries == 0 || k < 1, "testRecall: Nothing to test");
+
+    CStopWatch s;
+    s.startTimer();
+    boost::scoped_ptr<CDescriptorIndex> pIndex(makeIndex(pDescriptors, eType));
+    s.stopTimer();
+    cout << "Indexed " << pDescriptors->Count() << " descriptors in " << s.getElapsedTime() << "s" << endl;
+
+    ARRAY(TMatchPair, aExact, nQueries * k);
+    ARRAY(int, anExact, nQueries);
+    s.startTimer();
+    for (int q = 0; q < nQueries; q++)
+        anExact[q] = pIndex->knn(pQueries->get_const(q), k, PTR(aExact) + q * k, 0);
+    s.stopTimer();
+    const double dExactTime = s.getElapsedTime();
+    cout << "Exact scan: " << 1000 * dExactTime / nQueries << "ms per query" << endl;
+
+    ARRAY(TMatchPair, aApprox, nQueries * k);
+    ARRAY(int, anApprox, nQueries);
+    for (int nChecks = 16; nChecks < pDescriptors->Count(); nChecks *= 2) {
+        s.startTimer();
+        for (int q = 0; q < nQueries; q++)
+            anApprox[q] = pIndex->knn(pQueries->get_const(q), k, PTR(aApprox) + q * k, nChecks);
+        s.stopTimer();
+        const double dTime = s.getElapsedTime();
+
+        //A neighbour is found if we have one at the same distance (descriptors that are equally close are equally good)
+        int nFound = 0, nTotal = 0;
+        for (int q = 0; q < nQueries; q++)
+            for (int i = 0; i < anExact[q]; i++, nTotal++)
+                if (i < anApprox[q] && aApprox[q * k + i].first == aExact[q * k + i].first)
+                    nFound++;
+
+        cout << "Checks=" << nChecks << ": recall=" << (double) nFound / nTotal << ", " << 1000 * dTime / nQueries << "ms per query, " << (dTime > 0 ? dExactTime / dTime : 0) << "x exact scan speed" << endl;
+    }
+}
+
+void testDescriptorIndex() {
+    typedef CVectorSpaceDescriptor<unsigned char, 64, eEuclidSquared> TDesc;
+    const int CLUSTERS = 200, DESCRIPTORS = 20000, QUERIES = 1000, LENGTH = 64;
+
+    unsigned int nSeed = 12345;
+    ARRAY(unsigned char, acCentres, CLUSTERS * LENGTH);
+    for (int i = 0; i < CLUSTERS * LENGTH; i++)
+        acCentres[i] = (unsigned char) nextRand(nSeed, 256);
+
+    CSimpleMatchableDescriptors DB, queries;
+    CDynArrayOwner<TDesc> apDescriptors;
+    unsigned char acDesc[LENGTH];
+    for (int i = 0; i < DESCRIPTORS + QUERIES; i++) {
+        const unsigned char * acCentre = PTR(acCentres) + nextRand(nSeed, CLUSTERS) * LENGTH;
+        for (int d = 0; d < LENGTH; d++)
+            acDesc[d] = (unsigned char) min<int>(255, max<int>(0, (int) acCentre[d] + nextRand(nSeed, 61) - 30));
+        TDesc * pDesc = new TDesc(acDesc);
+        apDescriptors.push_back(pDesc);
+        if (i < DESCRIPTORS)
+            DB.Push_const(pDesc);
+        else
+            queries.Push_const(pDesc);
+    }
+
+    cout << "kd-forest:" << endl;
+    CDescriptorIndex::testRecall(&DB, &queries, CDescriptorIndex::eKDForest);
+    cout << "vp-tree:" << endl;
+    CDescriptorIndex::testRecall(&DB, &queries, CDescriptorIndex::eVPTree);
+}
@@ -0,0 +1,62 @@
+/* Code by Tom Botterill. Documentation and license at http://www.hilandtom.com/tombotterill/code */
+
+#pragma once
+
+#ifndef DESCRIPTORINDEX_H
+#define DESCRIPTORINDEX_H
+
+#include "descriptor.h"
+
+//Approximate nearest-neighbour search in a set of descriptors. The descriptors aren't copied, and mustn't change while indexed
+//(a CDescriptorSet drops its index when descriptors are added or removed).
+//nChecks trades recall for speed: it's the max number of distances evaluated per query (<= 0 for an exact linear scan).
+class CDescriptorIndex
+{
+public:
+	typedef CMatchableDescriptors::TMatchPair TMatchPair;
+	enum eIndexType { eAutoIndex, eKDForest, eVPTree };
+
+	//The k best (distance, index) pairs found so far, sorted
+	class CKnnResult
+	{
+		TMatchPair * aMatches;
+		const int k;
+		int nFound;
+	public:
+		CKnnResult(TMatchPair * aMatches, int k) : aMatches(aMatches), k(k), nFound(0) {}
+		void offer(const CDescriptor::TDist dist, const int nIdx);
+		int found() const { return nFound; }
+		bool full() const { return nFound == k; }
+	};
+
+protected:
+	const CMatchableDescriptors * pDescriptors;
+	const int nCount;
+
+	explicit CDescriptorIndex(const CMatchableDescriptors * pDescriptors) : pDescriptors(pDescriptors), nCount(pDescriptors->Count()) {}
+
+	virtual void search(const CDescriptor * pDesc, CKnnResult & result, const int nChecks) const = 0;
+
+private:
+	CDescriptorIndex(const CDescriptorIndex &);
+	void operator=(const CDescriptorIndex &);
+
+public:
+	virtual ~CDescriptorIndex() {}
+
+	int Count() const { return nCount; } //When built
+
+	//Closest k descriptors to pDesc, sorted by distance then index. Returns how many were found (fewer than k if the set is smaller)
+	int knn(const CDescriptor * pDesc, const int k, TMatchPair * aMatches, const int nChecks) const;
+
+	//eAutoIndex gives a randomised kd-forest for vector-space descriptors (see CDescriptor::vectorLength) and a vantage-point tree for anything else
+	static CDescriptorIndex * makeIndex(const CMatchableDescriptors * pDescriptors, eIndexType eType = eAutoIndex, int nTrees = 4);
+
+	//Print recall (fraction of the true k nearest neighbours found) and speed against the exact scan, for a range of nChecks
+	static void testRecall(const CMatchableDescriptors * pDescriptors, const CMatchableDescriptors * pQueries, eIndexType eType = eAutoIndex, int k = 2);
+};
+
+//testRecall on clustered random SIFT-like descriptors, with both index types
+void testDescriptorIndex();
+
+#endif
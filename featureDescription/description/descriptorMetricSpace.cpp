@@ -2,22 +2,355 @@
 
 #include "descriptorClustering.h"
 #include "vectorDescriptor.h"
+#include "util/random.h"
+#include "geom/threadpool.h"
 #include <set>
 #include <functional>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
 
 using namespace std;
 
+#define KMEDOIDS_BLOCK 16 //Rows of the distance matrix/candidate centres per job
+#define MINIBATCH_BLOCK 256 //Descriptors assigned per job by mini-batch k-means
+
+//Shared by everything being clustered; if it's busy (e.g. when subtrees are clustered in parallel) we cluster in this thread
+static CSharedThreadpool s_clusteringThreadpool(1);
+
+void CDescriptorSet::setClusteringThreads(const int nThreads)
+{
+    s_clusteringThreadpool.setNumThreads(nThreads);
+}
+
+//Run fn(nStart, nEnd) over [0, nCount) in fixed-size blocks, so results don't depend on the number of threads
+static void forEachBlock(CThreadpool_base * pThreadpool, const int nCount, const boost::function<void (int, int)> & fn, const int nBlock = KMEDOIDS_BLOCK)
+{
+    if(pThreadpool && nCount > nBlock)
+    {
+        for(int nStart=0; nStart<nCount; nStart += nBlock)
+        {
+            TNullaryFnObj job = boost::bind(fn, nStart, min<int>(nStart + nBlock, nCount));
+            pThreadpool->addJob(job);
+        }
+        pThreadpool->waitForAll();
+    }
+    else
+        fn(0, nCount);
+}
+
+//The O(n^2) steps of k-medoids, for a range of rows. Each only writes to its own rows (and the symmetric entries of the distance matrix)
+class CMetricSpaceDescriptorSet::CKMedoids
+{
+    CDescriptor * const * apDescriptors;
+    const CPackedDescriptorSet * pPacked;
+    TKMDistType * const * d;
+    const int nDescriptors;
+    const int * aAssignments;
+    TKMDistType * cost;
+
+    int nSwapCentre; //Centre being swapped out, and all the others
+    const int * aOtherCentres;
+    int nOtherCentres;
+
+public:
+    CKMedoids(CDescriptor * const * apDescriptors, const CPackedDescriptorSet * pPacked, TKMDistType * const * d, int nDescriptors, const int * aAssignments, TKMDistType * cost)
+        : apDescriptors(apDescriptors), pPacked(pPacked), d(d), nDescriptors(nDescriptors), aAssignments(aAssignments), cost(cost), nSwapCentre(-1), aOtherCentres(0), nOtherCentres(0) {}
+
+    void setSwap(int i, const int * aCentres, int nCentres)
+    {
+        nSwapCentre = i;
+        aOtherCentres = aCentres;
+        nOtherCentres = nCentres;
+    }
+
+    //Upper triangle of rows nStart..nEnd-1, mirrored
+    void distanceRows(int nStart, int nEnd) const
+    {
+        ARRAY(CDescriptor::TDist, aRowDists, nDescriptors);
+        for (int nDesc1=nStart;nDesc1<nEnd;nDesc1++)
+        {
+            const int nRemaining = nDescriptors-nDesc1-1;
+            if(nRemaining > 0)
+                apDescriptors[nDesc1]->distancesToBlock(pPacked->block() + (nDesc1+1)*pPacked->stride(), nRemaining, pPacked->stride(), PTR(aRowDists));
+
+            for (int nDesc2=nDesc1+1;nDesc2<nDescriptors;nDesc2++)
+            {
+                TKMDistType dist = (TKMDistType)aRowDists[nDesc2-nDesc1-1];
+                if(dist<0)
+                    dist = (TKMDistType)(apDescriptors[nDesc1]->distance(apDescriptors[nDesc2]) );
+                if(IS_DEBUG) CHECK(dist < 0, "CMetricSpaceDescriptorSet::kMedoidCluster: negative distance");
+                dist=max<TKMDistType>(dist, 1); //ensure distances are positive
+                d[nDesc2][nDesc1] = d[nDesc1][nDesc2] = dist;
+            }
+            d[nDesc1][nDesc1] = 0;
+        }
+    }
+
+    void rowSums(int nStart, int nEnd) const
+    {
+        for (int nDesc1=nStart;nDesc1<nEnd;nDesc1++)
+        {
+            TKMDistType dTotalDist=0;
+            for (int nDesc2=0;nDesc2<nDescriptors;nDesc2++)
+                dTotalDist += d[nDesc1][nDesc2];
+            cost[nDesc1] = dTotalDist;
+        }
+    }
+
+    //Decrease in sum dist from making each non-centre a centre (d is symmetric so we can read rows)
+    void buildCosts(int nStart, int nEnd) const
+    {
+        for(int nNewPotentialCentre=nStart; nNewPotentialCentre<nEnd; nNewPotentialCentre++)
+        {
+            TKMDistType dCostSum = 0;
+            if(aAssignments[nNewPotentialCentre] != nNewPotentialCentre) //not a centre
+            {
+                const TKMDistType * aDistsToNewPotentialCentre = d[nNewPotentialCentre];
+                for(int nDescriptor=0; nDescriptor<nDescriptors; nDescriptor++)
+                {
+                    TKMDistType dCost = aDistsToNewPotentialCentre[nDescriptor] - d[nDescriptor][aAssignments[nDescriptor]];
+                    if(dCost < 0)
+                        dCostSum += dCost;
+                }
+            }
+            cost[nNewPotentialCentre] = dCostSum;
+        }
+    }
+
+    //Cost of swapping centre nSwapCentre with each non-centre h
+    void swapCosts(int nStart, int nEnd) const
+    {
+        const int i = nSwapCentre;
+        for(int h=nStart; h<nEnd; h++)
+        {
+            TKMDistType dCost=0;
+
+            if(aAssignments[h] != h)
+            {
+                for(int j=0; j<nDescriptors; j++) //for each non-centre that's not h
+                {
+                    if(aAssignments[j] != j && j != h)
+                    {
+                        TKMDistType dToNewCentre=d[h][j];
+                        if(aAssignments[j] == i)//if j was in cluster i
+                        {
+                            TKMDistType dToCurrentCentre=d[j][i];
+                            TKMDistType dCostImprovment=dToNewCentre-dToCurrentCentre;
+                            if(dCostImprovment < 0) //if j is closer to h than it was to i
+                            {
+                                dCost += dCostImprovment;
+                            }
+                            else
+                            {
+                                //assign j to another cluster (may be h)
+                                for(int nOther=0; nOther<nOtherCentres; nOther++)
+                                {
+                                    TKMDistType dToThisCentre=d[j][aOtherCentres[nOther]];
+                                    if(dToThisCentre < dToNewCentre)
+                                    {
+                                        dToNewCentre = dToThisCentre;
+                                    }
+                                }
+                                dCost += dToNewCentre-dToCurrentCentre; //might be positive (bad)
+                            }
+                        }
+                        else
+                        {
+                            TKMDistType dCostImprovment=dToNewCentre-d[j][aAssignments[j]];
+                            if ( dCostImprovment < 0 )//if j closer to h than its current centre
+                            {
+                                dCost += dCostImprovment;
+                            } //otherwise no effect on cost
+                        }
+                    }//isn't centre
+                }//for every other descriptor
+            }//isn't centre
+            cost[h] = dCost; //will be 0 if h is a centre
+        }
+    }
+};
+
+//Mini-batch k-means (Sculley, Web-scale k-means clustering, 2010) on float copies of vector descriptors (see CDescriptor::getVector).
+//Centres are stored contiguously so each distance is one SIMD kernel call. Batches are sampled and centres updated in this thread;
+//only assignment runs in parallel (each job writes its own rows) so the result doesn't depend on the number of threads.
+class CMetricSpaceDescriptorSet::CMiniBatchKMeans
+{
+    CDescriptor * const * apDescriptors;
+    const int nDims, nClusters;
+
+    boost::scoped_array<float> afCentres, afOldCentres;
+    boost::scoped_array<int> anCentreCounts;
+
+    //Current batch (or the seeding sample)
+    boost::scoped_array<int> anBatch, anBatchAssignments;
+    boost::scoped_array<float> afBatch, afBatchDists;
+
+    //Final assignment of all descriptors, to typed copies of the centres
+    const CPackedDescriptorSet * pPackedCentres;
+    int * anAssignments;
+    CDescriptor::TDist * aAssignmentDists;
+
+    inline float * centre(int nCentre) const { return afCentres.get() + nCentre*nDims; }
+    inline float * batchVector(int nBatchIdx) const { return afBatch.get() + nBatchIdx*nDims; }
+
+public:
+    CMiniBatchKMeans(CDescriptor * const * apDescriptors, int nDims, int nClusters, int nMaxBatch)
+        : apDescriptors(apDescriptors), nDims(nDims), nClusters(nClusters),
+          afCentres(new float[nClusters*nDims]), afOldCentres(new float[nClusters*nDims]), anCentreCounts(new int[nClusters]),
+          anBatch(new int[nMaxBatch]), anBatchAssignments(new int[nMaxBatch]), afBatch(new float[nMaxBatch*nDims]), afBatchDists(new float[nMaxBatch]),
+          pPackedCentres(0), anAssignments(0), aAssignmentDists(0)
+    {
+        setZero(anCentreCounts.get(), nClusters);
+    }
+
+    int * batch() { return anBatch.get(); }
+
+    //Copy the vectors of batch elements nStart..nEnd-1
+    void getVectors(int nStart, int nEnd) const
+    {
+        for(int i=nStart; i<nEnd; i++)
+            apDescriptors[anBatch[i]]->getVector(batchVector(i));
+    }
+
+    //Closest of the first nCentres centres to each batch element (also fetches their vectors)
+    void assignBatch(int nStart, int nEnd, int nCentres) const
+    {
+        getVectors(nStart, nEnd);
+        for(int i=nStart; i<nEnd; i++)
+        {
+            const float * afVec = batchVector(i);
+            float fClosestDist = HUGE;
+            int nClosest = 0;
+            for(int nCentre=0; nCentre<nCentres; nCentre++)
+            {
+                const float fDist = g_pNormKernels->SSD_f32(afVec, centre(nCentre), nDims);
+                if(fDist < fClosestDist)
+                {
+                    fClosestDist = fDist;
+                    nClosest = nCentre;
+                }
+            }
+            anBatchAssignments[i] = nClosest;
+            afBatchDists[i] = fClosestDist;
+        }
+    }
+
+    //k-means++ (Arthur and Vassilvitskii) on the nSample descriptors in batch(): each new centre is chosen with probability proportional
+    //to its squared distance to the closest centre so far. Returns the descriptor each centre was seeded from.
+    void seed(int nSample, int * anSeeds, CThreadpool_base * pThreadpool)
+    {
+        const int nFirst = CRandom::Uniform(nSample);
+        anSeeds[0] = anBatch[nFirst];
+        getVectors(0, nSample);
+        memcpy(centre(0), batchVector(nFirst), nDims*sizeof(float));
+        for(int i=0; i<nSample; i++)
+            afBatchDists[i] = g_pNormKernels->SSD_f32(batchVector(i), centre(0), nDims);
+
+        for(int nCentre=1; nCentre<nClusters; nCentre++)
+        {
+            double dTotalDist = 0;
+            for(int i=0; i<nSample; i++)
+                dTotalDist += afBatchDists[i];
+
+            int nNew = nSample-1;
+            if(dTotalDist > 0)
+            {
+                double dSample = CRandom::Uniform(dTotalDist);
+                for(int i=0; i<nSample; i++)
+                {
+                    dSample -= afBatchDists[i];
+                    if(dSample < 0 && afBatchDists[i] > 0)
+                    {
+                        nNew = i;
+                        break;
+                    }
+                }
+            }
+            else
+                nNew = CRandom::Uniform(nSample); //Fewer distinct descriptors than clusters
+
+            anSeeds[nCentre] = anBatch[nNew];
+            memcpy(centre(nCentre), batchVector(nNew), nDims*sizeof(float));
+
+            forEachBlock(pThreadpool, nSample, boost::bind(&CMiniBatchKMeans::updateSeedDists, this, _1, _2, nCentre), MINIBATCH_BLOCK);
+        }
+    }
+
+    void updateSeedDists(int nStart, int nEnd, int nNewCentre) const
+    {
+        for(int i=nStart; i<nEnd; i++)
+            afBatchDists[i] = min<float>(afBatchDists[i], g_pNormKernels->SSD_f32(batchVector(i), centre(nNewCentre), nDims));
+    }
+
+    //Assign a batch then move each centre towards its new members, with a per-centre learning rate of 1/(members so far).
+    //Returns the mean squared movement of the centres, relative to the mean squared distance from the batch to its centres.
+    double iterate(int nBatch, CThreadpool_base * pThreadpool)
+    {
+        forEachBlock(pThreadpool, nBatch, boost::bind(&CMiniBatchKMeans::assignBatch, this, _1, _2, nClusters), MINIBATCH_BLOCK);
+
+        memcpy(afOldCentres.get(), afCentres.get(), nClusters*nDims*sizeof(float));
+
+        double dBatchDist = 0;
+        for(int i=0; i<nBatch; i++)
+        {
+            const int nCentre = anBatchAssignments[i];
+            const float fEta = 1.0f / ++anCentreCounts[nCentre];
+            const float * afVec = batchVector(i);
+            float * afCentre = centre(nCentre);
+            for(int d=0; d<nDims; d++)
+                afCentre[d] += fEta*(afVec[d] - afCentre[d]);
+
+            dBatchDist += afBatchDists[i];
+        }
+
+        double dMovement = 0;
+        for(int nCentre=0; nCentre<nClusters; nCentre++)
+            dMovement += g_pNormKernels->SSD_f32(centre(nCentre), afOldCentres.get() + nCentre*nDims, nDims);
+
+        dMovement /= nClusters;
+        dBatchDist /= nBatch;
+        return dBatchDist > 0 ? dMovement/dBatchDist : 0;
+    }
+
+    void getCentre(int nCentre, CDescriptor * pCentre) const
+    {
+        pCentre->setVector(centre(nCentre));
+    }
+
+    void setFinalAssignment(const CPackedDescriptorSet * pPackedCentres_in, int * anAssignments_in, CDescriptor::TDist * aAssignmentDists_in)
+    {
+        pPackedCentres = pPackedCentres_in;
+        anAssignments = anAssignments_in;
+        aAssignmentDists = aAssignmentDists_in;
+    }
+
+    //Closest centre to every descriptor, with the descriptors' own distance function
+    void assignAll(int nStart, int nEnd) const
+    {
+        for(int i=nStart; i<nEnd; i++)
+        {
+            CDescriptor::TDist closestDist = MAX_ALLOWED_DIST;
+            const int nClosest = apDescriptors[i]->closestInBlock(pPackedCentres->block(), nClusters, pPackedCentres->stride(), closestDist);
+            anAssignments[i] = max<int>(nClosest, 0);
+            aAssignmentDists[i] = closestDist;
+        }
+    }
+};
+
 ///////////  Metric space clustering /////////////////////////
 void CMetricSpaceDescriptorSet::Push(CDescriptor * pDescriptor)
 {
 	//if(IS_DEBUG) CHECK(vDescriptors.contains(pDescriptor), "Pushing same descriptor to DS twice"); // remove slow check
 	vDescriptors.push_back(pDescriptor);
+	invalidateIndex();
 }
 
 void CMetricSpaceDescriptorSet::Push(CDescriptorSet * pDescriptorSet)
 {
     const CMetricSpaceDescriptorSet * pMSDescriptorSet = CAST<const CMetricSpaceDescriptorSet * >(pDescriptorSet);
 	vDescriptors.copy_back(pMSDescriptorSet->vDescriptors.begin(), pMSDescriptorSet->vDescriptors.end());
+	invalidateIndex();
 }
 
 int pointerSortPredicate(void * p1, void * p2) { return p1>p2; }
@@ -27,11 +360,24 @@ CClusterSet * CMetricSpaceDescriptorSet::Cluster(int nClusters, const CCluster *
 {
 	const CDescriptorSetClusteringParams::CCLARA_KMedoidsParams & CKM_PARAMS = DSC_PARAMS.CLARA_KMedoids;
 
+	CSharedThreadpool::CLock threadpoolLock(s_clusteringThreadpool);
+	CThreadpool_base * pThreadpool = threadpoolLock.threadpool();
+
+	//Mini-batch k-means clusters the whole set (no CLARA subsets). Anything that isn't a vector is clustered with k-medoids
+	if(DSC_PARAMS.ClusteringAlg == CDescriptorSetClusteringParams::eMiniBatchKMeans && Count() > 0 && vDescriptors[0]->vectorLength() > 0)
+	{
+		clearClusterAssignments();
+		CClusterSet * pClusters = miniBatchKMeansCluster(min<int>(nClusters, Count()), pParentCluster, pThreadpool);
+		AssignMSDescriptorSets(pClusters);
+		pClusters->AssignToClusters<true>(this, 1, pThreadpool);
+		return pClusters;
+	}
+
 	nClusters = min<int>(nClusters, CKM_PARAMS.MAX_DESCRIPTORS_KM); //Check not clustering into too many clusters
 
 	//If problem is small use k-medoids
 	if((int)Count()<=CKM_PARAMS.MAX_DESCRIPTORS_KM)
-		return cluster_int(nClusters, pParentCluster, 1);
+		return cluster_int(nClusters, pParentCluster, 1, pThreadpool);
 
     //**cout << "Clustering: CLARA, " << Count() << " descriptors, " << nClusters << " clusters...";
 
@@ -64,7 +410,7 @@ CClusterSet * CMetricSpaceDescriptorSet::Cluster(int nClusters, const CCluster *
 		clearClusterAssignments();
 
 
-		pClusters = pRandSubset->cluster_int(nClusters, pParentCluster, nAssignSpeedup);
+		pClusters = pRandSubset->cluster_int(nClusters, pParentCluster, nAssignSpeedup, pThreadpool);
 
         //pClusters->ResetClusters();
         //double dTotalDist = pClusters->AssignToClusters<true>(this, nAssignSpeedup);
@@ -102,7 +448,7 @@ CClusterSet * CMetricSpaceDescriptorSet::Cluster(int nClusters, const CCluster *
     if(nAssignSpeedup != 1)
     {
     	AssignMSDescriptorSets(pBestClusters);
-        pBestClusters->AssignToClusters<true>(this, 1);
+        pBestClusters->AssignToClusters<true>(this, 1, pThreadpool);
     }
     //else if(!bAssignedToBestClusters)
    		//pBestClusters->AssignToClusters<true>(this, 1);
@@ -110,12 +456,12 @@ CClusterSet * CMetricSpaceDescriptorSet::Cluster(int nClusters, const CCluster *
     return pBestClusters;
 }
 
-CClusterSet * CMetricSpaceDescriptorSet::cluster_int(unsigned int nClusters, const CCluster * pParentCluster, int nAssignSpeedup)
+CClusterSet * CMetricSpaceDescriptorSet::cluster_int(unsigned int nClusters, const CCluster * pParentCluster, int nAssignSpeedup, CThreadpool_base * pThreadpool)
 {
 	CClusterSet * pClusters=0;
 
-	if(DSC_PARAMS.ClusteringAlg == CDescriptorSetClusteringParams::eCLARA_KMedoids)
-		pClusters=kMedoidCluster(nClusters, pParentCluster);
+	if(DSC_PARAMS.ClusteringAlg == CDescriptorSetClusteringParams::eCLARA_KMedoids || DSC_PARAMS.ClusteringAlg == CDescriptorSetClusteringParams::eMiniBatchKMeans)
+		pClusters=kMedoidCluster(nClusters, pParentCluster, pThreadpool);
 	else if(DSC_PARAMS.ClusteringAlg == CDescriptorSetClusteringParams::eCLARA_KMeans || DSC_PARAMS.ClusteringAlg == CDescriptorSetClusteringParams::eKMeans)
 		pClusters=kMeansCluster(nClusters, pParentCluster);
 	//else if(DSC_PARAMS.ClusteringAlg == CDescriptorSetClusteringParams::eCLARA_RandomCentres || DSC_PARAMS.ClusteringAlg == CDescriptorSetClusteringParams::eRandomCentres)
@@ -126,7 +472,7 @@ CClusterSet * CMetricSpaceDescriptorSet::cluster_int(unsigned int nClusters, con
         AssignMSDescriptorSets(pClusters);
     }
 
-    pClusters->AssignToClusters<true>(this, nAssignSpeedup);
+    pClusters->AssignToClusters<true>(this, nAssignSpeedup, pThreadpool);
     return pClusters;
 }
 
@@ -168,6 +514,88 @@ CClusterSet * CMetricSpaceDescriptorSet::kMeansCluster(int nClusters, const CClu
 	return pClusters;
 }
 
+//Mini-batch k-means, seeded with k-means++. Centres are copies of descriptors moved to the cluster means (CDescriptor::setVector).
+//Assigns every descriptor (like kMedoidCluster) so dispersion and distances between centres are known.
+CClusterSet * CMetricSpaceDescriptorSet::miniBatchKMeansCluster(int nClusters, const CCluster * pParentCluster, CThreadpool_base * pThreadpool) const
+{
+	const CDescriptorSetClusteringParams::CMiniBatchParams & MB_PARAMS = DSC_PARAMS.MiniBatch;
+
+	const int nDescriptors = Count();
+	CHECK(nClusters > nDescriptors || nClusters <= 0, "CMetricSpaceDescriptorSet::miniBatchKMeansCluster: Too many clusters");
+	const int nDims = vDescriptors[0]->vectorLength();
+	const int nSeedingSample = min<int>(nDescriptors, max<int>(MB_PARAMS.SEEDING_SAMPLE, nClusters));
+	const int nBatchSize = min<int>(nDescriptors, MB_PARAMS.BATCH_SIZE);
+
+	CMiniBatchKMeans mbkm(vDescriptors.begin(), nDims, nClusters, max<int>(nSeedingSample, nBatchSize));
+
+	//Seed from a random sample (all of them if there aren't many)
+	int * anBatch = mbkm.batch();
+	for(int i=0; i<nSeedingSample; i++)
+		anBatch[i] = (nSeedingSample == nDescriptors) ? i : CRandom::Uniform(nDescriptors);
+
+	CDynArray<int> anSeeds(nClusters);
+	mbkm.seed(nSeedingSample, anSeeds.begin(), pThreadpool);
+
+	for(int nIter=0; nIter < MB_PARAMS.MAX_ITERS; nIter++)
+	{
+		for(int i=0; i<nBatchSize; i++)
+			anBatch[i] = CRandom::Uniform(nDescriptors);
+
+		if(mbkm.iterate(nBatchSize, pThreadpool) < MB_PARAMS.MIN_CENTRE_MOVEMENT)
+			break;
+	}
+
+	//Centres have the same type as the descriptors
+	CDynArray<CDescriptor *> apCentres(nClusters);
+	for(int nCentre=0; nCentre<nClusters; nCentre++)
+	{
+		apCentres[nCentre] = vDescriptors[anSeeds[nCentre]]->clone();
+		mbkm.getCentre(nCentre, apCentres[nCentre]);
+	}
+
+	//Assign everything (in parallel) with the descriptors' own distance
+	const CPackedDescriptorSet packedCentres(apCentres.begin(), nClusters);
+	CDynArray<int> anAssignments(nDescriptors);
+	CDynArray<CDescriptor::TDist> aAssignmentDists(nDescriptors);
+	mbkm.setFinalAssignment(&packedCentres, anAssignments.begin(), aAssignmentDists.begin());
+	forEachBlock(pThreadpool, nDescriptors, boost::bind(&CMiniBatchKMeans::assignAll, &mbkm, _1, _2), MINIBATCH_BLOCK);
+
+	//Dispersion, and distances between centres
+	CDescriptor::TDist * aaDistances = new CDescriptor::TDist[nClusters*nClusters];
+	packedCentres.distances(&packedCentres, aaDistances);
+
+	CDynArray<int> anClusterCount(nClusters, 0);
+	CDynArray<double> adDispersion(nClusters, 0.0);
+	for(int nDesc=0; nDesc<nDescriptors; nDesc++)
+	{
+		anClusterCount[anAssignments[nDesc]]++;
+		adDispersion[anAssignments[nDesc]] += aAssignmentDists[nDesc];
+	}
+
+	CDynArray<CDescriptor::TDist> aMinDist(nClusters, MAX_ALLOWED_DIST);
+	for(int nCentre=0; nCentre<nClusters; nCentre++)
+	{
+		for(int nOther=0; nOther<nClusters; nOther++)
+			if(nOther != nCentre && aaDistances[nCentre*nClusters + nOther] < aMinDist[nCentre])
+				aMinDist[nCentre] = aaDistances[nCentre*nClusters + nOther];
+		aMinDist[nCentre] = max<CDescriptor::TDist>(aMinDist[nCentre], 1);
+	}
+
+	CClusterSet * pClusters=new CClusterSet(nClusters, &aaDistances);
+	for(int nCentre=0; nCentre<nClusters; nCentre++)
+	{
+		const CDescriptor::TDist dispersion = anClusterCount[nCentre] ? (CDescriptor::TDist)(adDispersion[nCentre]/anClusterCount[nCentre]) : aMinDist[nCentre]; //Empty: as for a singleton
+		pClusters->push_back(new CCluster(apCentres[nCentre], true, 0, aMinDist[nCentre]/2, dispersion, anClusterCount[nCentre], nCentre, pParentCluster));
+	}
+
+	for(int nDesc=0; nDesc<nDescriptors; nDesc++)
+		vDescriptors[nDesc]->assignToCluster((*pClusters)[anAssignments[nDesc]], aAssignmentDists[nDesc]);
+
+	std::sort(pClusters->begin(), pClusters->end(), CCluster::CBigClustersFirstPred() );
+
+	return pClusters;
+}
+
 CClusterSet * CMetricSpaceDescriptorSet::RandomCluster(int nClusters, const CCluster * pParentCluster, bool bDuplicate)
 {
 	const CDescriptorSetClusteringParams::CKMeansParams & CKM_PARAMS = DSC_PARAMS.KMeans;
@@ -193,7 +621,7 @@ CClusterSet * CMetricSpaceDescriptorSet::RandomCluster(int nClusters, const CClu
 
 //PAM k-medoids algorithm, Kaufman and Rousseeuw p102
 //Also makes use of the distances computed to assign clusters
-CClusterSet * CMetricSpaceDescriptorSet::kMedoidCluster(int nClusters, const CCluster * pParentCluster) const
+CClusterSet * CMetricSpaceDescriptorSet::kMedoidCluster(int nClusters, const CCluster * pParentCluster, CThreadpool_base * pThreadpool) const
 {
 	const CDescriptorSetClusteringParams::CCLARA_KMedoidsParams & CKM_PARAMS = DSC_PARAMS.CLARA_KMedoids;
 	const int MAX_DESCRIPTORS_KM = CKM_PARAMS.MAX_DESCRIPTORS_KM;
@@ -206,105 +634,95 @@ CClusterSet * CMetricSpaceDescriptorSet::kMedoidCluster(int nClusters, const CCl
 
     ARRAY(TKMDistType, cost, MAX_DESCRIPTORS_KM); //Cost of adding centre i (i.e. negative is good)
 
-    //Pre-calculate all distances
-#ifdef __GNUC__
-    TKMDistType d[MAX_DESCRIPTORS_KM][MAX_DESCRIPTORS_KM];
-#else
-    CHECK(MAX_DESCRIPTORS_KM>450, "K-Medoids: Static alloc size too small");
-    TKMDistType d[450][450]; //Must be constant in Win
-#endif
+    //Pre-calculate all distances (d[i] are rows of one block)
+    CDynArray<TKMDistType> aDistMatrix(nDescriptors*nDescriptors);
+    ARRAY(TKMDistType *, d, nDescriptors);
+    for(int i=0; i<nDescriptors; i++)
+        d[i] = aDistMatrix.begin() + i*nDescriptors;
 
     ARRAY(int, aAssignments, MAX_DESCRIPTORS_KM); // i is assigned to centre aAssignments[i]
     ARRAY(int, aNewCentres, MAX_DESCRIPTORS_KM);
-/*
-    boost::multi_array<TKMDistType, 1> cost(boost::extents[MAX_DESCRIPTORS_KM]);
-    boost::multi_array<TKMDistType, 2> d(boost::extents[MAX_DESCRIPTORS_KM][MAX_DESCRIPTORS_KM]);
-    boost::multi_array<unsigned int, 1> aAssignments(boost::extents[MAX_DESCRIPTORS_KM]);
-*/
-    /*TKMDistType**d=0;//(TKMDistType**)(void*)d_stack;
-    if(nDescriptors>200)
-    {
-        d=new TKMDistType*[nDescriptors];
-        for (unsigned int i=0;i<nDescriptors;i++)
-        {
-            d[i]=new TKMDistType[nDescriptors];
-        }
-    }*/
 
-    for (int nDesc1=0;nDesc1<nDescriptors;nDesc1++)
+    //Packed copy so each row of the distance matrix is one batch distance call
+    const CPackedDescriptorSet packedDescriptors(vDescriptors.begin(), nDescriptors);
+
+    CKMedoids km(vDescriptors.begin(), &packedDescriptors, PTR(d), nDescriptors, PTR(aAssignments), PTR(cost));
+    if(nDescriptors < 2*KMEDOIDS_BLOCK)
+        pThreadpool = 0; //Not worth it
+
+    forEachBlock(pThreadpool, nDescriptors, boost::bind(&CKMedoids::distanceRows, &km, _1, _2));
+
+    if(CKM_PARAMS.KMEANSPP_SEEDING)
     {
-        for (int nDesc2=nDesc1+1;nDesc2<nDescriptors;nDesc2++)
-        {
-            TKMDistType dist = (TKMDistType)(vDescriptors[nDesc1]->distance(vDescriptors[nDesc2]) );
-            if(dist<0)
-            	dist = (TKMDistType)(vDescriptors[nDesc1]->distance(vDescriptors[nDesc2]) );
-            if(IS_DEBUG) CHECK(dist < 0, "CMetricSpaceDescriptorSet::kMedoidCluster: negative distance");
-            dist=max<TKMDistType>(dist, 1); //ensure distances are positive
-            d[nDesc2][nDesc1] = d[nDesc1][nDesc2] = dist;
-        }
-        d[nDesc1][nDesc1] = 0;
-
-    //}
-    //for (unsigned int nDesc1=0;nDesc1<nDescriptors;nDesc1++)
-    //{
-        //Pre-calculate sums of distances as well
-        TKMDistType dTotalDist=0;
-        for (int nDesc2=0;nDesc2<nDescriptors;nDesc2++)
+        //k-means++ seeding (Arthur and Vassilvitskii): each new centre is chosen with probability proportional to its distance from the closest
+        //centre so far (most norms here are squared already). O(nk) rather than O(n^2k) for BUILD, and SWAP then refines these centres.
+        const int nFirstCentre = CRandom::Uniform(nDescriptors);
+        for(int i=0;i<nDescriptors; i++)
+            aAssignments[i] = nFirstCentre;
+
+        for(int nToAdd=1; nToAdd<nClusters; nToAdd++)
         {
-            dTotalDist += d[nDesc1][nDesc2];
+            double dTotalDist = 0;
+            for(int nDescriptor=0; nDescriptor<nDescriptors; nDescriptor++)
+                dTotalDist += d[nDescriptor][aAssignments[nDescriptor]];
+
+            double dSample = CRandom::Uniform(dTotalDist);
+            int nNewCentre = -1;
+            for(int nDescriptor=0; nDescriptor<nDescriptors; nDescriptor++)
+            {
+                if(aAssignments[nDescriptor] != nDescriptor)
+                {
+                    nNewCentre = nDescriptor;
+                    dSample -= d[nDescriptor][aAssignments[nDescriptor]];
+                    if(dSample < 0)
+                        break;
+                }
+            }
+            CHECK(nNewCentre < 0, "CMetricSpaceDescriptorSet::kMedoidCluster: No descriptors left to add as centres");
+
+            for(int nDescriptor=0; nDescriptor<nDescriptors; nDescriptor++)
+            {
+                if(d[nDescriptor][nNewCentre] < d[nDescriptor][aAssignments[nDescriptor]])
+                    aAssignments[nDescriptor] = nNewCentre;
+            }
         }
-        cost[nDesc1] = dTotalDist;
     }
+    else
+    {
+        //Choose k centres BUILD
 
+        //Pre-calculate sums of distances
+        forEachBlock(pThreadpool, nDescriptors, boost::bind(&CKMedoids::rowSums, &km, _1, _2));
 
-    //Choose k centres BUILD
-
-    //First add the most central cluster center (given previous centres)
-    int idxMin = arrayMinIdx(cost, nDescriptors);
+        //First add the most central cluster center (given previous centres)
+        int idxMin = arrayMinIdx(cost, nDescriptors);
 
-    //TODO memset(aAssignments, idxMin, sizeof(unsigned int)*nDescriptors); //Assign all to i
-    for(int i=0;i<nDescriptors; i++)
-        aAssignments[i] = idxMin;
+        //TODO memset(aAssignments, idxMin, sizeof(unsigned int)*nDescriptors); //Assign all to i
+        for(int i=0;i<nDescriptors; i++)
+            aAssignments[i] = idxMin;
 
-    //Now the distance to descriptor i's cluster centre is d[i, aAssignments[i]]
+        //Now the distance to descriptor i's cluster centre is d[i, aAssignments[i]]
 
-    for(int nToAdd=1; nToAdd<nClusters; nToAdd++)
-    {
-        for(int nNewPotentialCentre=0; nNewPotentialCentre<nDescriptors; nNewPotentialCentre++) // for each descriptor that's not a centre
+        for(int nToAdd=1; nToAdd<nClusters; nToAdd++)
         {
-            cost[nNewPotentialCentre] = 0;
-            if(aAssignments[nNewPotentialCentre] != nNewPotentialCentre) //not a centre
+            forEachBlock(pThreadpool, nDescriptors, boost::bind(&CKMedoids::buildCosts, &km, _1, _2));
+
+            int idxMinCost = arrayMinIdx(cost, nDescriptors); //Find the new centre that minimises the cost
+            CHECK(aAssignments[idxMinCost] == idxMinCost, "CMetricSpaceDescriptorSet::kMedoidCluster: idxMinCost is already a cluster centre");//(this should never be an existing centre);
+
+            //And add it as a centre. Reassign all other descriptors
+            for(int nDescriptor=0; nDescriptor<nDescriptors; nDescriptor++) // for each descriptor that's not a centre
             {
-                //Work out the decreased sum dist of making this descriptor a centre
-                for(int nDescriptor=0; nDescriptor<nDescriptors; nDescriptor++) // for each descriptor that's not a centre
+                TKMDistType dToCurrentCentre=d[nDescriptor][ aAssignments[nDescriptor]];
+                TKMDistType dToNewCentre=d[nDescriptor][ idxMinCost];
+                if(dToNewCentre < dToCurrentCentre)
                 {
-                    TKMDistType dToCurrentCentre=d[nDescriptor][ aAssignments[nDescriptor]];
-                    TKMDistType dToNewPotentialCentre=d[nDescriptor][ nNewPotentialCentre];
-                    TKMDistType dCost = dToNewPotentialCentre-dToCurrentCentre;
-                    if(dCost < 0)
-                        cost[nNewPotentialCentre] += dCost;
-
-                    //Don't calc list of new assignments here--will do that later
+                    aAssignments[nDescriptor] = idxMinCost;
                 }
             }
-        }
-        int idxMinCost = arrayMinIdx(cost, nDescriptors); //Find the new centre that minimises the cost
-        if(aAssignments[idxMinCost] == idxMinCost)
-        	idxMinCost = arrayMinIdx(cost, nDescriptors); //Find the new centre that minimises the cost
-        CHECK(aAssignments[idxMinCost] == idxMinCost, "CMetricSpaceDescriptorSet::kMedoidCluster: idxMinCost is already a cluster centre");//(this should never be an existing centre);
 
-        //And add it as a centre. Reassign all other descriptors
-        for(int nDescriptor=0; nDescriptor<nDescriptors; nDescriptor++) // for each descriptor that's not a centre
-        {
-            TKMDistType dToCurrentCentre=d[nDescriptor][ aAssignments[nDescriptor]];
-            TKMDistType dToNewCentre=d[nDescriptor][ idxMinCost];
-            if(dToNewCentre < dToCurrentCentre)
-            {
-                aAssignments[nDescriptor] = idxMinCost;
-            }
+            CHECK(aAssignments[idxMinCost] != idxMinCost, "CMetricSpaceDescriptorSet::kMedoidCluster: idxMinCost hasn't been added as a cluster");
         }
-
-        CHECK(aAssignments[idxMinCost] != idxMinCost, "CMetricSpaceDescriptorSet::kMedoidCluster: idxMinCost hasn't been added as a cluster");
     }
 
     // check we have nClusters cluster centres
@@ -336,60 +754,9 @@ CClusterSet * CMetricSpaceDescriptorSet::kMedoidCluster(int nClusters, const CCl
                     }
                 }
 
-            	for(int h=0; h<nDescriptors; h++) //for each non-centre h
-                {
-                    TKMDistType dCost=0; //Calculate the cost (benefit) of doing this swap
-
-                    if(aAssignments[h] != h)
-                    {
-                        for(int j=0; j<nDescriptors; j++) //for each non-centre that's not h
-                        {
-                            if(aAssignments[j] != j && j != h)
-                            {
-                                TKMDistType dToNewCentre=d[j][h];
-                                if(aAssignments[j] == i)//if j was in cluster i
-                                {
-                                    TKMDistType dToCurrentCentre=d[j][i];
-                                    TKMDistType dCostImprovment=dToNewCentre-dToCurrentCentre;
-                                    if(dCostImprovment < 0) //if j is closer to h than it was to i
-                                    {
-                                        dCost += dCostImprovment;
-                                    }
-                                    else
-                                    {
-                                        //assign j to another cluster (may be h)
-/*                                        for(unsigned int nNewCluster=0; nNewCluster<nDescriptors; nNewCluster++)
-                                        {
-                                            if(aAssignments[nNewCluster] == nNewCluster && nNewCluster != i) //For each centre that's not i*/
-                                    	for(int * pNewCentre = PTR(aNewCentres); pNewCentre < pNewCentresEnd; pNewCentre++)
-                                    	{
-											TKMDistType dToThisCentre=d[j][*pNewCentre];
-											if(dToThisCentre < dToNewCentre)
-											{
-												dToNewCentre = dToThisCentre;
-											}
-										}
-                                        TKMDistType dCostImprovment=dToNewCentre-dToCurrentCentre; //might be positive (bad)
-                                        //Don't do anything with assignment
-                                        dCost += dCostImprovment;
-                                    }
-                                }
-                                else
-                                {
-                                    TKMDistType dToCurrentCentre=d[j][aAssignments[j]];
-                                    TKMDistType dCostImprovment=dToNewCentre-dToCurrentCentre;
-
-                                    if ( dCostImprovment < 0 )//if j closer to h than its current centre
-                                    {
-                                        dCost += dCostImprovment;
-
-                                    } //otherwise no effect on cost
-                                }
-                            }//isn't centre
-                        }//for every other descriptor
-                    }//isn't centre
-                    cost[h] = dCost; //will be 0 if h is a centre
-                }//For each possible candidate to swap to
+                //Calculate the cost (benefit) of swapping i with each non-centre h
+                km.setSwap(i, PTR(aNewCentres), (int)(pNewCentresEnd - PTR(aNewCentres)));
+                forEachBlock(pThreadpool, nDescriptors, boost::bind(&CKMedoids::swapCosts, &km, _1, _2));
 
                 int idxMinCost = arrayMinIdx(cost, nDescriptors); //Find the new centre that minimises the cost
                 if(cost[idxMinCost]<0)
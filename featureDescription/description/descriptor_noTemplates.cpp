@@ -2,12 +2,15 @@
 
 #include "descriptor.h"
 #include "vectorDescriptor.h"
+#include "descriptorIndex.h"
 #include <set>
 #include <functional>
 #include "util/random.h"
 #include "util/set2.h"
 #include "util/Simple2dPoint.h"
+#include "geom/threadpool.h"
 #include <boost/thread.hpp>
+#include <boost/bind.hpp>
 
 using namespace std;
 void CDescriptor::assignToCluster(const CCluster * pCentre, TDist closestClusterDist_in) {
@@ -18,59 +21,74 @@ void CDescriptor::assignToCluster(const CCluster * pCentre, TDist closestCluster
     closestClusterDist = closestClusterDist_in;
 }
 
-typedef std::pair<CDescriptor::TDist, int> TMatchPair;
-class CMatchSort : binary_function<const TMatchPair &, const TMatchPair &, bool> {
-public:
-    result_type operator() (first_argument_type a,
-            second_argument_type b) {
-        return (result_type) (a.first < b.first || (a.first == b.first && a.second < b.second)); //Want to allow multiple equal dists
+#define BFC_ROW_BLOCK 32 //Descriptors from this set matched together against each tile, and the rows in one threadpool job
+#define BFC_COL_TILE 256 //Descriptors from the other set compared with a block of rows at a time, so they stay in cache
+
+//Keep the nMax lowest (distance, index) pairs, sorted. Ties in distance go to the lower index, so the same pairs are kept in whatever order they're offered
+static inline void insertTopNN(CMatchableDescriptors::TMatchPair * aTop, int & nTop, const int nMax, const CMatchableDescriptors::TMatchPair & match) {
+    if (nTop == nMax) {
+        if (!(match < aTop[nMax - 1]))
+            return;
+        nTop--;
     }
-};
-class TMPSet : public set2<TMatchPair, CMatchSort/*, CIndividualPool_NoFree_Allocator< TMatchPair, NN_MAX + 1 >*/ > {
-    //Make forward declaration easier
-};
+    int k = nTop;
+    for (; k > 0 && match < aTop[k - 1]; k--)
+        aTop[k] = aTop[k - 1];
+    aTop[k] = match;
+    nTop++;
+}
+
 template<bool LIMIT_DISTANCES, bool ROTATION_INVARIANCE>
-void CMatchableDescriptors::getBFC_matchDescriptors_RI(const int nStart, const int nEnd, const CMatchableDescriptors * pDS, const CMatchableDescriptors::CMatchSettings & MS, TMPSet * d) const {
-    //const double dCondition = MS.MATCH_CONDITION;
-    //const double dPP = MS.PP;
-    const int NN = MS.NN;
+void CMatchableDescriptors::getBFC_matchDescriptors_RI(const int nStart, const int nEnd, const CMatchableDescriptors * pDS, const CMatchableDescriptors::CMatchSettings & MS, TMatchPair * aTopNN, int * anTopNN) const {
+    const int NN_KEEP = MS.NN + 1;
     const int MAX_SEPERATION = MS.MAX_SEPERATION;
     const int MAX_SEPERATION_SQ = sqr(MAX_SEPERATION * SUBPIX_RES);
-    //const int nCount1 = Count();
     const int nCount2 = pDS->Count();
-    for (int i = nStart; i < nEnd; i++) {
-        const CDescriptor * pDesc1 = get_const(i);
-        CLocation loc1 = pDesc1->location();
-        int nX1 = loc1.xAsIntFast();
-        int nY1 = loc1.yAsIntFast();
-
-        for (int j = 0; j < nCount2; j++) {
-            const CDescriptor * pDesc2 = pDS->get_const(j);
-            bool bCloseEnough = true;
-
-            if (LIMIT_DISTANCES) {
-                CLocation loc2 = pDesc2->location();
-                int nX2 = loc2.xAsIntFast();
-                int nY2 = loc2.yAsIntFast();
-                bCloseEnough = sqr(nX1 - nX2) + sqr(nY1 - nY2) < MAX_SEPERATION_SQ;
-            }
 
-            if (bCloseEnough) {
-                CDescriptor::TDist dist = ROTATION_INVARIANCE ? pDesc1->distance(pDesc2) : pDesc1->orientedDistance(pDesc2, MS.OI_NEARBY_ANGLE);
-                /*if(!ROTATION_INVARIANCE)
-                {
-                    cout << pDesc1->orientation() << ' ' << pDesc2->orientation() << endl;
-                }*/
+    //If pDS is packed compute each row of a tile in one call (unless most will be skipped as too far apart)
+    const CPackedDescriptorSet * pPacked = pDS->packed();
+    const bool bBatch = pPacked && !LIMIT_DISTANCES;
+    CDescriptor::TDist aTileDists[BFC_COL_TILE];
 
-                if ((int) d[i].size() < NN + 1) {
-                    d[i].insert(TMatchPair(dist, j));
-                } else {
-                    TMPSet::iterator pBack = d[i].end();
-                    pBack--;
-                    CDescriptor::TDist lowestDist = pBack->first;
-                    if (dist < lowestDist) {
-                        d[i].erase(pBack);
-                        d[i].insert(TMatchPair(dist, j));
+    for (int nRowStart = nStart; nRowStart < nEnd; nRowStart += BFC_ROW_BLOCK) {
+        const int nRowEnd = std::min<int>(nRowStart + BFC_ROW_BLOCK, nEnd);
+
+        for (int nColStart = 0; nColStart < nCount2; nColStart += BFC_COL_TILE) {
+            const int nColEnd = std::min<int>(nColStart + BFC_COL_TILE, nCount2);
+
+            for (int i = nRowStart; i < nRowEnd; i++) {
+                const CDescriptor * pDesc1 = get_const(i);
+                CLocation loc1 = pDesc1->location();
+                int nX1 = loc1.xAsIntFast();
+                int nY1 = loc1.yAsIntFast();
+                const double dOrientation1 = (bBatch && !ROTATION_INVARIANCE) ? pDesc1->orientation() : 0;
+                TMatchPair * aTop = aTopNN + i * NN_KEEP;
+
+                if (bBatch)
+                    pDesc1->distancesToBlock(pPacked->block() + nColStart * pPacked->stride(), nColEnd - nColStart, pPacked->stride(), aTileDists);
+
+                for (int j = nColStart; j < nColEnd; j++) {
+                    bool bCloseEnough = true;
+
+                    if (LIMIT_DISTANCES) {
+                        CLocation loc2 = pPacked ? pPacked->location(j) : pDS->get_const(j)->location();
+                        int nX2 = loc2.xAsIntFast();
+                        int nY2 = loc2.yAsIntFast();
+                        bCloseEnough = sqr(nX1 - nX2) + sqr(nY1 - nY2) < MAX_SEPERATION_SQ;
+                    }
+
+                    if (bCloseEnough) {
+                        CDescriptor::TDist dist;
+                        if (bBatch) {
+                            dist = aTileDists[j - nColStart];
+                            if (!ROTATION_INVARIANCE && diffMod(dOrientation1, pPacked->orientation(j), 360) > MS.OI_NEARBY_ANGLE) //as CDescriptor::orientedDistance
+                                dist = MAX_ALLOWED_DIST - 1;
+                        } else {
+                            const CDescriptor * pDesc2 = pDS->get_const(j);
+                            dist = ROTATION_INVARIANCE ? pDesc1->distance(pDesc2) : pDesc1->orientedDistance(pDesc2, MS.OI_NEARBY_ANGLE);
+                        }
+
+                        insertTopNN(aTop, anTopNN[i], NN_KEEP, TMatchPair(dist, j));
                     }
                 }
             }
@@ -78,18 +96,26 @@ void CMatchableDescriptors::getBFC_matchDescriptors_RI(const int nStart, const i
     }
 }
 template<bool LIMIT_DISTANCES>
-void CMatchableDescriptors::getBFC_matchDescriptors(const int nStart, const int nEnd, const CMatchableDescriptors * pDS, const CMatchableDescriptors::CMatchSettings & MS, TMPSet * d) const {
+void CMatchableDescriptors::getBFC_matchDescriptors(const int nStart, const int nEnd, const CMatchableDescriptors * pDS, const CMatchableDescriptors::CMatchSettings & MS, TMatchPair * aTopNN, int * anTopNN) const {
     if (MS.NEARBYNESS >= 0)
-        getBFC_matchDescriptors_RI<LIMIT_DISTANCES, false > (nStart, nEnd, pDS, MS, d);
+        getBFC_matchDescriptors_RI<LIMIT_DISTANCES, false > (nStart, nEnd, pDS, MS, aTopNN, anTopNN);
     else
-        getBFC_matchDescriptors_RI<LIMIT_DISTANCES, true > (nStart, nEnd, pDS, MS, d);
+        getBFC_matchDescriptors_RI<LIMIT_DISTANCES, true > (nStart, nEnd, pDS, MS, aTopNN, anTopNN);
 }
-void CMatchableDescriptors::getBFC_matchDescriptorsMT(const int nStart, const int nEnd, const CMatchableDescriptors * pDS, const CMatchableDescriptors::CMatchSettings & MS, TMPSet * d) const {
+void CMatchableDescriptors::getBFC_matchDescriptorsMT(const int nStart, const int nEnd, const CMatchableDescriptors * pDS, const CMatchableDescriptors::CMatchSettings & MS, TMatchPair * aTopNN, int * anTopNN) const {
     if (MS.MAX_SEPERATION > 0)
-        getBFC_matchDescriptors < true > (nStart, nEnd, pDS, MS, d);
+        getBFC_matchDescriptors < true > (nStart, nEnd, pDS, MS, aTopNN, anTopNN);
     else
-        getBFC_matchDescriptors < false > (nStart, nEnd, pDS, MS, d);
+        getBFC_matchDescriptors < false > (nStart, nEnd, pDS, MS, aTopNN, anTopNN);
+}
+
+//One threadpool shared by every brute-force match; concurrent matches run single-threaded
+static CSharedThreadpool s_matchingThreadpool(2);
+
+void CMatchableDescriptors::setMatchingThreads(const int nThreads) {
+    s_matchingThreadpool.setNumThreads(nThreads);
 }
+
 const CBoWCorrespondences * CMatchableDescriptors::getBruteForceCorrespondenceSet_int(const CMatchableDescriptors * pDS, const CMatchableDescriptors::CMatchSettings & MS, CBoWCorrespondences * pCorrIn) const {
     const int nCount1 = Count();
     const int nCount2 = pDS->Count();
@@ -97,16 +123,25 @@ const CBoWCorrespondences * CMatchableDescriptors::getBruteForceCorrespondenceSe
     const double dCondition = MS.MATCH_CONDITION;
     const double dPP = MS.PP;
     const int NN = MS.NN;
+    const int NN_KEEP = NN + 1;
 
-    ARRAY(TMPSet, d, nCount1);
+    //The NN+1 closest descriptors in pDS to each of ours, sorted
+    ARRAY(TMatchPair, aTopNN, nCount1 * NN_KEEP);
+    ARRAYZ(int, anTopNN, nCount1);
+
+    //Blocks of rows are independent jobs, so results don't depend on the number of threads
+    {
+        CSharedThreadpool::CLock threadpoolLock(s_matchingThreadpool, nCount1 > BFC_ROW_BLOCK && nCount2 >= 30);
+        CThreadpool_base * pThreadpool = threadpoolLock.threadpool();
 
-    if (nCount1 < 30 || nCount2 < 30) //Single thread. TODO argument?
-        getBFC_matchDescriptorsMT(0, nCount1, pDS, MS, PTR(d));
-    else {
-        int nMid = nCount1 / 2;
-        boost::thread firstHalf(boost::bind(&CMatchableDescriptors::getBFC_matchDescriptorsMT, this, 0, nMid, pDS, boost::ref(MS), PTR(d)));
-        getBFC_matchDescriptorsMT(nMid, nCount1, pDS, MS, PTR(d));
-        firstHalf.join();
+        if (pThreadpool) {
+            for (int nStart = 0; nStart < nCount1; nStart += BFC_ROW_BLOCK) {
+                TNullaryFnObj fn = boost::bind(&CMatchableDescriptors::getBFC_matchDescriptorsMT, this, nStart, std::min<int>(nStart + BFC_ROW_BLOCK, nCount1), pDS, boost::cref(MS), PTR(aTopNN), PTR(anTopNN));
+                pThreadpool->addJob(fn);
+            }
+            pThreadpool->waitForAll();
+        } else
+            getBFC_matchDescriptorsMT(0, nCount1, pDS, MS, PTR(aTopNN), PTR(anTopNN));
     }
 
     CBoWCorrespondences * pCorr = pCorrIn;
@@ -117,17 +152,18 @@ const CBoWCorrespondences * CMatchableDescriptors::getBruteForceCorrespondenceSe
     ARRAYZ(int, anNumTimesRightMatched, nCount2);
 
     for (int i = 0; i < nCount1; i++) {
+        const TMatchPair * aTop = PTR(aTopNN) + i * NN_KEEP;
+        const int nTop = anTopNN[i];
         int nNumNN = 0;
 
-        if (d[i].size() > 0) {
-            double oldDist = d[i].top().first;
-            for (TMPSet::const_iterator pMP = d[i].begin(); pMP != d[i].end(); pMP++, nNumNN++) {
-                double dNewDist = pMP->first;
+        if (nTop > 0) {
+            double oldDist = aTop[0].first;
+            for (; nNumNN < nTop; nNumNN++) {
+                double dNewDist = aTop[nNumNN].first;
                 if (oldDist < dNewDist * dCondition) {
                     //We're at the end of the n-n
                     break;
                 } else {
-                    //anNumTimesRightMatched[pMP->second]++;
                     oldDist = dNewDist;
                 }
             }
@@ -136,17 +172,18 @@ const CBoWCorrespondences * CMatchableDescriptors::getBruteForceCorrespondenceSe
         anNumTimesLeftMatched[i] = nNumNN;
 
         if (nNumNN <= NN) {
-            for (TMPSet::const_iterator pMP = d[i].begin(); nNumNN > 0; pMP++, nNumNN--) {
-                anNumTimesRightMatched[pMP->second]++;
+            for (int k = 0; k < nNumNN; k++) {
+                anNumTimesRightMatched[aTop[k].second]++;
             }
         }
     }
 
     for (int i = 0; i < nCount1; i++) {
+        const TMatchPair * aTop = PTR(aTopNN) + i * NN_KEEP;
         int nNumMatchedLeft = anNumTimesLeftMatched[i];
         if (nNumMatchedLeft <= NN) {
-            for (TMPSet::const_iterator pMP = d[i].begin(); nNumMatchedLeft > 0; pMP++, nNumMatchedLeft--) {
-                int j = pMP->second;
+            for (int k = 0; k < nNumMatchedLeft; k++) {
+                int j = aTop[k].second;
                 if (anNumTimesRightMatched[j] <= NN) {
                     double dProb = dPP / std::max<int>(anNumTimesLeftMatched[i], anNumTimesRightMatched[j]); //Total prob for first DS is ok, not sure about 2nd. Doesn't matter if not disjoint anyway.
                     pCorr->push_back(CCorrespondence(get_const(i)->location(), pDS->get_const(j)->location(), dProb));
@@ -159,6 +196,12 @@ const CBoWCorrespondences * CMatchableDescriptors::getBruteForceCorrespondenceSe
 }
 const CBoWCorrespondences * CMatchableDescriptors::getBruteForceCorrespondenceSet(const CMatchableDescriptors * pDS, const CMatchSettings & MS, CBoWCorrespondences * pCorr) const {
     //cout << "DS Sizes: " << Count() << ',' << pDS->Count() << endl;
+
+    //Pack pDS once so each of our descriptors is matched against a tile with one batch distance call. Not worth copying for a few rows
+    if (!pDS->packed() && Count() >= BFC_ROW_BLOCK && CPackedDescriptorSet::packable(pDS)) {
+        const CPackedDescriptorSet packedDS(pDS);
+        return getBruteForceCorrespondenceSet_int(&packedDS, MS, pCorr);
+    }
     return getBruteForceCorrespondenceSet_int(pDS, MS, pCorr);
 }
 void CSimpleMatchableDescriptors::Push_const(const CDescriptor * pDescriptor) {
@@ -170,6 +213,72 @@ void CSimpleMatchableDescriptors::Push_const(const CMatchableDescriptors * pDesc
         Push_const(pDescriptorSet->get_const(i));
 }
 
+#define PACKED_BLOCK_ALIGN 64 //cache line
+#define PACKED_STRIDE_ALIGN 16
+
+CPackedDescriptorSet::CPackedDescriptorSet(const CMatchableDescriptors * pDescriptors) : pMem(0), pBlock(0), nCount(0), nStride(0) {
+    const int nDescriptors = pDescriptors->Count();
+    if (nDescriptors > 0) {
+        ARRAY(const CDescriptor *, apDescriptors, nDescriptors);
+        for (int i = 0; i < nDescriptors; i++)
+            apDescriptors[i] = pDescriptors->get_const(i);
+        pack(PTR(apDescriptors), nDescriptors);
+    }
+}
+
+CPackedDescriptorSet::CPackedDescriptorSet(const CDescriptor * const * apDescriptors, int nDescriptors) : pMem(0), pBlock(0), nCount(0), nStride(0) {
+    if (nDescriptors > 0)
+        pack(apDescriptors, nDescriptors);
+}
+
+//Descriptors are flat objects (see CDescriptor::clone) so are copied with memcpy; the copies own nothing
+void CPackedDescriptorSet::pack(const CDescriptor * const * apDescriptors, int nDescriptors) {
+    const int nSize = apDescriptors[0]->size();
+    nStride = PACKED_STRIDE_ALIGN * ((nSize + PACKED_STRIDE_ALIGN - 1) / PACKED_STRIDE_ALIGN);
+
+    pMem = new char[nDescriptors * nStride + PACKED_BLOCK_ALIGN];
+    pBlock = (char *) (((size_t) pMem + PACKED_BLOCK_ALIGN - 1) & ~(size_t) (PACKED_BLOCK_ALIGN - 1));
+
+    aLocations.reserve(nDescriptors);
+    adOrientations.reserve(nDescriptors);
+    for (int i = 0; i < nDescriptors; i++) {
+        const CDescriptor * pDesc = apDescriptors[i];
+        CHECK(pDesc->size() != nSize || *(void * const *) (const void *) pDesc != *(void * const *) (const void *) apDescriptors[0], "CPackedDescriptorSet: Descriptors must all be the same type");
+        memcpy(pBlock + i * nStride, (const void *) pDesc, nSize);
+        aLocations.push_back(pDesc->location());
+        adOrientations.push_back(pDesc->orientation());
+    }
+    nCount = nDescriptors;
+}
+
+bool CPackedDescriptorSet::packable(const CMatchableDescriptors * pDescriptors) {
+    const int nDescriptors = pDescriptors->Count();
+    if (nDescriptors == 0)
+        return false;
+
+    const CDescriptor * pFirst = pDescriptors->get_const(0);
+    for (int i = 1; i < nDescriptors; i++) {
+        const CDescriptor * pDesc = pDescriptors->get_const(i);
+        if (pDesc->size() != pFirst->size() || *(void * const *) (const void *) pDesc != *(void * const *) (const void *) pFirst)
+            return false;
+    }
+    return true;
+}
+
+void CPackedDescriptorSet::Clear() {
+    delete [] pMem;
+    pMem = pBlock = 0;
+    nCount = 0;
+    aLocations.clear();
+    adOrientations.clear();
+}
+
+void CPackedDescriptorSet::distances(const CPackedDescriptorSet * pOther, CDescriptor::TDist * aDists) const {
+    const int nOtherCount = pOther->Count();
+    for (int i = 0; i < nCount; i++)
+        pOther->distances(get_const(i), aDists + i * nOtherCount);
+}
+
 //Only using a set to avoid duplicates so should be fast
 class descriptorFastCompare : binary_function<const CDescriptor *, const CDescriptor *, bool> {
 public:
@@ -230,7 +339,24 @@ bool CDescriptorSet::Contains(const CDescriptor * pDescriptor) const {
     }
     return false;
 }
+CDescriptorSet::~CDescriptorSet() {
+    delete pIndex;
+    delete pArena; //Frees any descriptors allocated from it
+}
+void CDescriptorSet::buildIndex(const int nChecks, const int nTrees) {
+    clearIndex();
+    pIndex = CDescriptorIndex::makeIndex(this, CDescriptorIndex::eAutoIndex, nTrees);
+    nIndexChecks = nChecks;
+}
+void CDescriptorSet::clearIndex() {
+    delete pIndex;
+    pIndex = 0;
+}
 const CDescriptor * CDescriptorSet::ClosestDescriptor(const CDescriptor * pDescCompareTo) const {
+    if (index()) {
+        TMatchPair match;
+        return index()->knn(pDescCompareTo, 1, &match, nIndexChecks) ? get_const(match.second) : 0;
+    }
     CDescriptor::TDist dClosestDist = MAX_ALLOWED_DIST;
     const CDescriptor * pClosestDesc = 0;
     for (int nDesc = 0; nDesc < Count(); nDesc++) {
@@ -245,6 +371,13 @@ const CDescriptor * CDescriptorSet::ClosestDescriptor(const CDescriptor * pDescC
     return pClosestDesc;
 }
 void CDescriptorSet::Closest2Descriptors(const CDescriptor * pDescCompareTo, CDescriptor const** ppClosest, CDescriptor const** pp2ndClosest) const {
+    if (index()) {
+        TMatchPair aMatches[2];
+        const int nFound = index()->knn(pDescCompareTo, 2, aMatches, nIndexChecks);
+        if (nFound > 0) *ppClosest = get_const(aMatches[0].second);
+        if (nFound > 1) *pp2ndClosest = get_const(aMatches[1].second);
+        return;
+    }
     CDescriptor::TDist dClosestDist = MAX_ALLOWED_DIST, d2ndClosestDist = MAX_ALLOWED_DIST;
     //const CDescriptor * pClosestDesc = 0;
     for (int nDesc = 0; nDesc < Count(); nDesc++) {
@@ -265,14 +398,24 @@ void CDescriptorSet::Closest2Descriptors(const CDescriptor * pDescCompareTo, CDe
 const CDescriptor * CDescriptorSet::ClosestDescriptor(const CDescriptor * pDescCompareTo, double dCondition, int nRadius) const {
     CDescriptor::TDist dClosestDist = MAX_ALLOWED_DIST, dNextClosestDist = 0;
     const CDescriptor * pClosestDesc = 0;
-    for (int nDesc = 0; nDesc < Count(); nDesc++) {
-        const CDescriptor * pDesc = get_const(nDesc);
-        CDescriptor::TDist dDist = pDesc->distance(pDescCompareTo);
-
-        if (dDist < dClosestDist) {
-            dNextClosestDist = dClosestDist;
-            dClosestDist = dDist;
-            pClosestDesc = pDesc;
+    if (index()) {
+        TMatchPair aMatches[2];
+        const int nFound = index()->knn(pDescCompareTo, 2, aMatches, nIndexChecks);
+        if (nFound > 0) {
+            dClosestDist = aMatches[0].first;
+            pClosestDesc = get_const(aMatches[0].second);
+            dNextClosestDist = (nFound > 1) ? aMatches[1].first : MAX_ALLOWED_DIST;
+        }
+    } else {
+        for (int nDesc = 0; nDesc < Count(); nDesc++) {
+            const CDescriptor * pDesc = get_const(nDesc);
+            CDescriptor::TDist dDist = pDesc->distance(pDescCompareTo);
+
+            if (dDist < dClosestDist) {
+                dNextClosestDist = dClosestDist;
+                dClosestDist = dDist;
+                pClosestDesc = pDesc;
+            }
         }
     }
     if (nRadius < dClosestDist) return 0;
@@ -304,6 +447,10 @@ void CDescriptorSet::clearClusterAssignments() {
 }
 CDescriptor::TDist CDescriptorSet::Closest(const CDescriptor * pDesc) const {
     CDescriptor::TDist dClosestDist = MAX_ALLOWED_DIST;
+    if (index()) {
+        TMatchPair match;
+        return index()->knn(pDesc, 1, &match, nIndexChecks) ? match.first : dClosestDist;
+    }
     for (int nDesc = 0; nDesc < Count(); nDesc++) {
         CDescriptor::TDist dDist = pDesc->distance(get_const(nDesc));
 
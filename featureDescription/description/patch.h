@@ -612,26 +612,26 @@ public:
 		switch (PATCH_COMP_METHOD)
 		{
 		case CPatchDescriptorParams::ePatchEuclid:
-			return euclidDist(acPatch1, acPatch2, SIZE);
+			return fastEuclidDist(acPatch1, acPatch2, SIZE);
 		case CPatchDescriptorParams::ePatchMaxDist:
 			return MaxDist(acPatch1, acPatch2, SIZE);
 		case CPatchDescriptorParams::ePatchL1:
-			return L1Dist(acPatch1, acPatch2, SIZE);
+			return fastL1Dist(acPatch1, acPatch2, SIZE);
 		case CPatchDescriptorParams::ePatchL1Fast:
 		{
 			const int relSubVecSize = 4; //Look at 1st 1/4 first
 			const int subVecLen = SIZE/relSubVecSize;
-			int dist = L1Dist(acPatch1, acPatch2, subVecLen);
+			int dist = fastL1Dist(acPatch1, acPatch2, subVecLen);
 			if(dist>70*subVecLen) return relSubVecSize*dist;
-			return dist + L1Dist(acPatch1+subVecLen, acPatch2+subVecLen, SIZE-subVecLen);
+			return dist + fastL1Dist(acPatch1+subVecLen, acPatch2+subVecLen, SIZE-subVecLen);
 		}
 		case CPatchDescriptorParams::ePatchEuclidFast:
 		{
 			const int relSubVecSize = 4; //Look at 1st 1/4 first
 			const int subVecLen = SIZE/relSubVecSize;
-			int dist = euclidDist(acPatch1, acPatch2, subVecLen);
+			int dist = fastEuclidDist(acPatch1, acPatch2, subVecLen);
 			if(dist>sqr(70)*subVecLen) return relSubVecSize*dist;
-			return dist + euclidDist(acPatch1+subVecLen, acPatch2+subVecLen, SIZE-subVecLen);
+			return dist + fastEuclidDist(acPatch1+subVecLen, acPatch2+subVecLen, SIZE-subVecLen);
 		}
 		case CPatchDescriptorParams::ePatchL1Parallel:
 		{
@@ -669,7 +669,6 @@ public:
 P_TEMPLATE
 class CPatchWithNorm<dataType, PATCH_RADIUS, CPatchDescriptorParams::ePatchEuclidParallel, ImType, imDataType> : public CTPatch
 {
-	int nTwoTimesSumSquare;
 protected:
 
 public:
@@ -682,7 +681,6 @@ public:
 		{
 			*pcPatch /= 2;
 		}
-		nTwoTimesSumSquare = 2 * sumSquares(CTPatch::acPatch, SIZE);
 	}
 
 	int distance(const CPatchWithNorm<dataType, PATCH_RADIUS, CPatchDescriptorParams::ePatchEuclidParallel, ImType, imDataType> * pPatch) const
@@ -690,7 +688,7 @@ public:
 		const int SIZE = CTPatch::SIZE;
 		const unsigned char * acPatch1 = CTPatch::acPatch;
 		const unsigned char * acPatch2 = pPatch->acPatch;
-		return L2distParallel(acPatch1, acPatch2, SIZE, nTwoTimesSumSquare, pPatch->nTwoTimesSumSquare);
+		return L2distParallel(acPatch1, acPatch2, SIZE);
 	}
 
 	uchar val(int x, int y, int nChannel = 0) const { return 2*CTPatch::val(x,y,nChannel); }
@@ -29,6 +29,8 @@ public:
         CDescriptor::TDist dPatchDist = (CDescriptor::TDist)(CTPatchWithNorm::distance(pPatch));
         return dPatchDist;
     };
+    virtual int closestInBlock(const char * pBlock, int nCount, int nStride, CDescriptor::TDist & nClosestDist) const { return closestInBlock_T(this, pBlock, nCount, nStride, nClosestDist); }
+    virtual void distancesToBlock(const char * pBlock, int nCount, int nStride, CDescriptor::TDist * aDists) const { distancesToBlock_T(this, pBlock, nCount, nStride, aDists); }
 
     static inline int DescriptorLength() { return CTPatch::SIZE; };
     static inline int SURFDescriptorLength() { return 0; };
@@ -38,7 +40,8 @@ public:
     virtual uchar val(int x, int y, int nChannel) const { return CTPatchWithNorm::val(x, y, nChannel); };
 	virtual int diameter() const { return CTPatchWithNorm::DIAMETER; };
 
-	virtual int size() const { return sizeof(this); }
+	virtual int size() const { return sizeof(*this); }
+	virtual bool plainData() const { return true; }
 };
 
 PN_TEMPLATE
@@ -49,7 +52,7 @@ public:
     CPatchAndLocationDescriptor(double dScale, const IplImage * pIm, CLocation point, const CPatchParams & PATCH_PARAMS) : CTPatchDescriptor(dScale, pIm, point, PATCH_PARAMS), Location(point) {};
     virtual CLocation location() const { return Location; };
 
-	virtual int size() const { return sizeof(this); }
+	virtual int size() const { return sizeof(*this); }
 	virtual int length() const { return CTPatchDescriptor::SIZE; }
 };
 #endif
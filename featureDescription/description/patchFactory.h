@@ -12,6 +12,7 @@
 
 #include "util/exception.h"
 #include "patchDescriptor.h"
+#include "binaryDescriptor.h"
 
 #define TDescriptorFactory CDescriptorFactory<unsigned char, unsigned char>
 template<typename dataType, typename imDataType>
@@ -20,53 +21,55 @@ class CDescriptorFactory
 	friend void LoadSettingsFromCfg(const char * szFN);
 public:
 	template<CPatchParams::eColourTypeSize ImType>
-	static CDescriptor * makeDescriptor_int(const IplImage * pImage, const CLocation loc, double dScale, const CPatchDescriptorParams & PATCH_PARAMS)
+	static CDescriptor * makeDescriptor_int(const IplImage * pImage, const CLocation loc, double dScale, const CPatchDescriptorParams & PATCH_PARAMS, CDescriptorArena * pArena)
 	{
 		switch(PATCH_PARAMS.PATCH_COMP_METHOD)
 		{
 		case CPatchDescriptorParams::ePatchEuclidFast:
-			return makeDescriptor_int2<ImType, CPatchDescriptorParams::ePatchEuclidFast>(pImage, loc, dScale, PATCH_PARAMS);
+			return makeDescriptor_int2<ImType, CPatchDescriptorParams::ePatchEuclidFast>(pImage, loc, dScale, PATCH_PARAMS, pArena);
 		case CPatchDescriptorParams::ePatchL1Fast:
-			return makeDescriptor_int2<ImType, CPatchDescriptorParams::ePatchL1Fast>(pImage, loc, dScale, PATCH_PARAMS);
+			return makeDescriptor_int2<ImType, CPatchDescriptorParams::ePatchL1Fast>(pImage, loc, dScale, PATCH_PARAMS, pArena);
 		case CPatchDescriptorParams::ePatchMaxDist:
-			return makeDescriptor_int2<ImType, CPatchDescriptorParams::ePatchMaxDist>(pImage, loc, dScale, PATCH_PARAMS);
+			return makeDescriptor_int2<ImType, CPatchDescriptorParams::ePatchMaxDist>(pImage, loc, dScale, PATCH_PARAMS, pArena);
 		case CPatchDescriptorParams::ePatchCorrel:
-			return makeDescriptor_int2<ImType, CPatchDescriptorParams::ePatchCorrel>(pImage, loc, dScale, PATCH_PARAMS);
+			return makeDescriptor_int2<ImType, CPatchDescriptorParams::ePatchCorrel>(pImage, loc, dScale, PATCH_PARAMS, pArena);
 		case CPatchDescriptorParams::ePatchL1:
-			return makeDescriptor_int2<ImType, CPatchDescriptorParams::ePatchL1>(pImage, loc, dScale, PATCH_PARAMS);
+			return makeDescriptor_int2<ImType, CPatchDescriptorParams::ePatchL1>(pImage, loc, dScale, PATCH_PARAMS, pArena);
 		case CPatchDescriptorParams::ePatchEuclid:
-			return makeDescriptor_int2<ImType, CPatchDescriptorParams::ePatchEuclid>(pImage, loc, dScale, PATCH_PARAMS);
+			return makeDescriptor_int2<ImType, CPatchDescriptorParams::ePatchEuclid>(pImage, loc, dScale, PATCH_PARAMS, pArena);
 		case CPatchDescriptorParams::ePatchEuclidParallel:
-			return makeDescriptor_int2<ImType, CPatchDescriptorParams::ePatchEuclidParallel>(pImage, loc, dScale, PATCH_PARAMS);
+			return makeDescriptor_int2<ImType, CPatchDescriptorParams::ePatchEuclidParallel>(pImage, loc, dScale, PATCH_PARAMS, pArena);
 		case CPatchDescriptorParams::ePatchL1Parallel:
-			return makeDescriptor_int2<ImType, CPatchDescriptorParams::ePatchL1Parallel>(pImage, loc, dScale, PATCH_PARAMS);
+			return makeDescriptor_int2<ImType, CPatchDescriptorParams::ePatchL1Parallel>(pImage, loc, dScale, PATCH_PARAMS, pArena);
+		case CPatchDescriptorParams::ePatchBRIEF:
+			break; //Not a patch, see makeDescriptor
 		}
 		THROW( "makeDescriptor_int: Norm not handled")
 	}
 
 	template<CPatchParams::eColourTypeSize ImType, CPatchDescriptorParams::ePATCH_COMP_METHOD PATCH_COMP_METHOD>
-	static CDescriptor * makeDescriptor_int2(const IplImage * pImage, const CLocation loc, double dScale, const CPatchDescriptorParams & PATCH_PARAMS)
+	static CDescriptor * makeDescriptor_int2(const IplImage * pImage, const CLocation loc, double dScale, const CPatchDescriptorParams & PATCH_PARAMS, CDescriptorArena * pArena)
 	{
 		CDescriptor * pDescriptor = 0;
 		switch(PATCH_PARAMS.PATCH_RAD)
 		{
 		case 1:
-			pDescriptor = new CPatchAndLocationDescriptor<dataType, 1, PATCH_COMP_METHOD, ImType, imDataType>(dScale, pImage, loc, PATCH_PARAMS.Patch);
+			pDescriptor = CDescriptorArena::make<CPatchAndLocationDescriptor<dataType, 1, PATCH_COMP_METHOD, ImType, imDataType> >(pArena, dScale, pImage, loc, PATCH_PARAMS.Patch);
 			break;
 		case 2:
-			pDescriptor = new CPatchAndLocationDescriptor<dataType, 2, PATCH_COMP_METHOD, ImType, imDataType>(dScale, pImage, loc, PATCH_PARAMS.Patch);
+			pDescriptor = CDescriptorArena::make<CPatchAndLocationDescriptor<dataType, 2, PATCH_COMP_METHOD, ImType, imDataType> >(pArena, dScale, pImage, loc, PATCH_PARAMS.Patch);
 			break;
 		case 3:
-			pDescriptor = new CPatchAndLocationDescriptor<dataType, 3, PATCH_COMP_METHOD, ImType, imDataType>(dScale, pImage, loc, PATCH_PARAMS.Patch);
+			pDescriptor = CDescriptorArena::make<CPatchAndLocationDescriptor<dataType, 3, PATCH_COMP_METHOD, ImType, imDataType> >(pArena, dScale, pImage, loc, PATCH_PARAMS.Patch);
 			break;
 		case 4:
-			pDescriptor = new CPatchAndLocationDescriptor<dataType, 4, PATCH_COMP_METHOD, ImType, imDataType>(dScale, pImage, loc, PATCH_PARAMS.Patch);
+			pDescriptor = CDescriptorArena::make<CPatchAndLocationDescriptor<dataType, 4, PATCH_COMP_METHOD, ImType, imDataType> >(pArena, dScale, pImage, loc, PATCH_PARAMS.Patch);
 			break;
 		case 5:
-			pDescriptor = new CPatchAndLocationDescriptor<dataType, 5, PATCH_COMP_METHOD, ImType, imDataType>(dScale, pImage, loc, PATCH_PARAMS.Patch);
+			pDescriptor = CDescriptorArena::make<CPatchAndLocationDescriptor<dataType, 5, PATCH_COMP_METHOD, ImType, imDataType> >(pArena, dScale, pImage, loc, PATCH_PARAMS.Patch);
 			break;
 		case 6:
-			pDescriptor = new CPatchAndLocationDescriptor<dataType, 6, PATCH_COMP_METHOD, ImType, imDataType>(dScale, pImage, loc, PATCH_PARAMS.Patch);
+			pDescriptor = CDescriptorArena::make<CPatchAndLocationDescriptor<dataType, 6, PATCH_COMP_METHOD, ImType, imDataType> >(pArena, dScale, pImage, loc, PATCH_PARAMS.Patch);
 			break;
 		default:
 			THROW( "Bad PATCH_RAD")
@@ -74,15 +77,22 @@ public:
 		return pDescriptor;
 	}
 
-	static CDescriptor * makeDescriptor(const IplImage * pImage, const CLocation loc, double dScale, const CPatchDescriptorParams & PATCH_PARAMS)
+	//Allocated from pArena if given (see CDescriptorSet::arena)
+	static CDescriptor * makeDescriptor(const IplImage * pImage, const CLocation loc, double dScale, const CPatchDescriptorParams & PATCH_PARAMS, CDescriptorArena * pArena = 0)
 	{
+		if(PATCH_PARAMS.PATCH_COMP_METHOD == CPatchDescriptorParams::ePatchBRIEF)
+		{
+			CHECK(pImage->nChannels != 1, "BRIEF descriptors need a greyscale image: set MONO_DESCRIPTOR");
+			return CDescriptorArena::make<CBRIEFDescriptor<imDataType> >(pArena, dScale, pImage, loc, (int)PATCH_PARAMS.PATCH_RAD, PATCH_PARAMS.Patch);
+		}
+
 		if(pImage->nChannels == 3)
 		{
-			return makeDescriptor_int<CPatchParams::RG>(pImage, loc, dScale, PATCH_PARAMS);
+			return makeDescriptor_int<CPatchParams::RG>(pImage, loc, dScale, PATCH_PARAMS, pArena);
 		}
 		else
 		{
-			return makeDescriptor_int<CPatchParams::GREY>(pImage, loc, dScale, PATCH_PARAMS);
+			return makeDescriptor_int<CPatchParams::GREY>(pImage, loc, dScale, PATCH_PARAMS, pArena);
 		}
 	}
 };
@@ -19,12 +19,13 @@ PARAMCLASS(PatchDescriptor)
 	PARAM(PATCH_RAD, 1, 6, 5, "Patch will be square with sides 2*PATCH_RAD+1")
 	PARAME(PATCH_COMP_METHOD, PatchEuclidFast, "Choose norm for comparing patches. Euclidean seems best. The squared val is used.")
 	PARAM(PX_RADIUS, 1, 255, 50, "If 2 descriptors have average differnce of more than this many grey levels they are different.")
+	PARAM(HAMMING_RADIUS, 1, 256, 64, "PatchBRIEF only: if 2 descriptors differ in more than this many of their 256 intensity comparisons they are different.")
 	CHILDCLASS(Patch, "Simplest descriptor: Just an image patch centred around corner")
 	{}
 
 	CNumParam<int> PATCH_RAD;
-	MAKEENUMPARAM8(PATCH_COMP_METHOD, PatchEuclidFast, PatchL1Fast, PatchMaxDist, PatchCorrel, PatchL1, PatchEuclid, PatchEuclidParallel, PatchL1Parallel); /*Todo: consider CPatchDescriptorParams::ePatchCos, CPatchDescriptorParams::ePatchChiSquared, CPatchDescriptorParams::ePatchJeffereys??*/
-	CNumParam<int> PX_RADIUS;
+	MAKEENUMPARAM9(PATCH_COMP_METHOD, PatchEuclidFast, PatchL1Fast, PatchMaxDist, PatchCorrel, PatchL1, PatchEuclid, PatchEuclidParallel, PatchL1Parallel, PatchBRIEF); /*Todo: consider CPatchDescriptorParams::ePatchCos, CPatchDescriptorParams::ePatchChiSquared, CPatchDescriptorParams::ePatchJeffereys??*/
+	CNumParam<int> PX_RADIUS, HAMMING_RADIUS;
 	MAKECHILDCLASS(Patch);
 
 	int margin() const
@@ -60,6 +61,9 @@ PARAMCLASS(PatchDescriptor)
 		case CPatchDescriptorParams::ePatchMaxDist:
 			return PX_RADIUS;
 
+		case CPatchDescriptorParams::ePatchBRIEF:
+			return HAMMING_RADIUS;
+
 		default:
 			THROW("Unhandled patch type")
 		}
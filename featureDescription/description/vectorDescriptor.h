@@ -10,6 +10,7 @@ pragma_warning (disable: 4996)
 pragma_warning (pop)*/
 #include <iostream>
 #include "params/param.h"
+#include "util/fastnorms.h"
 #include <boost/smart_ptr.hpp>
 
 PARAMCLASS(DescriptorSetClustering)
@@ -17,6 +18,7 @@ PARAMCLASS(DescriptorSetClustering)
 	CHILDCLASS(CLARA_KMedoids, "Parameters for CLARA_KMedoids clustering of descriptors")
 	CHILDCLASS(KMeans, "Parameters for kmeans clustering of descriptors")
 	CHILDCLASS(Random, "Parameters for kmeans clustering of descriptors")
+	CHILDCLASS(MiniBatch, "Parameters for mini-batch k-means clustering of vector descriptors")
 	{}
 
 	PARAMCLASS(CLARA_KMedoids) //Todo tidy up, add k-means/seperate CLARA
@@ -25,9 +27,11 @@ PARAMCLASS(DescriptorSetClustering)
 		PARAM(KMEDOIDS_ITERS, 1, 100, 2, "Iterations in k-medoids alg")
 		PARAM(CLARA_ITERS, 1, 100, 1, "Cluster centres are chosen, added to a new subset, refined this many times.")
 		PARAM(SPARSE_ASSIGN_COUNT, 1, 100, 1, "Experimental. Speed up intermediate assignments during CLARA clustering.")
+		PARAMB(KMEANSPP_SEEDING, false, "Choose initial k-medoids centres by k-means++ sampling rather than BUILD (greedy, O(n^2k)). SWAP iterations then refine them.")
 		{}
 
 		CNumParam<int> MAX_DESCRIPTORS_KM, /*MAX_DESCRIPTORS_KM_TOP,*/ KMEDOIDS_ITERS, CLARA_ITERS, SPARSE_ASSIGN_COUNT;
+		CNumParam<bool> KMEANSPP_SEEDING;
 	};
 
 	PARAMCLASS(KMeans) //Todo tidy up, add k-means/seperate CLARA
@@ -45,11 +49,23 @@ PARAMCLASS(DescriptorSetClustering)
 		CNumParam<int> SUBSET_SIZE_CLARA_RANDOM;
 	};
 
-	MAKEENUMPARAM5(ClusteringAlg, CLARA_KMedoids, CLARA_KMeans, KMeans, RandomCentres, CLARA_RandomCentres);
+	PARAMCLASS(MiniBatch)
+		PARAM(BATCH_SIZE, 10, 100000, 1000, "Descriptors sampled per iteration")
+		PARAM(MAX_ITERS, 1, 10000, 100, "Max mini-batch iterations")
+		PARAM(SEEDING_SAMPLE, 100, 1000000, 10000, "k-means++ seeding is on a random sample of this many descriptors")
+		PARAM(MIN_CENTRE_MOVEMENT, 0, 1, 0.0001, "Stop when the mean squared movement of the centres in one iteration is below this fraction of the mean squared distance to the closest centre")
+		{}
+
+		CNumParam<int> BATCH_SIZE, MAX_ITERS, SEEDING_SAMPLE;
+		CNumParam<double> MIN_CENTRE_MOVEMENT;
+	};
+
+	MAKEENUMPARAM6(ClusteringAlg, CLARA_KMedoids, CLARA_KMeans, KMeans, RandomCentres, CLARA_RandomCentres, MiniBatchKMeans);
 
 	MAKECHILDCLASS(CLARA_KMedoids);
 	MAKECHILDCLASS(KMeans);
 	MAKECHILDCLASS(Random);
+	MAKECHILDCLASS(MiniBatch);
 
 	int SUBSET_SIZE(int k) const
 	{
@@ -91,6 +107,8 @@ class CVectorSpaceDescriptor : public CDescriptor
 
 public:
     CDescriptor::TDist distance(const CDescriptor * pd) const;
+    virtual int closestInBlock(const char * pBlock, int nCount, int nStride, TDist & nClosestDist) const { return closestInBlock_T(this, pBlock, nCount, nStride, nClosestDist); }
+    virtual void distancesToBlock(const char * pBlock, int nCount, int nStride, TDist * aDists) const { distancesToBlock_T(this, pBlock, nCount, nStride, aDists); }
 
 	CVectorSpaceDescriptor(const elementType * aDescriptor);
 
@@ -105,8 +123,13 @@ public:
     typedef elementType elType; //Exposes type to other classes
     static eInvDescriptorType vectorType() { return (((elementType)255) > 0) ? eSIFT : eSURF; }; //SIFT iff unsigned char
 
-	virtual int size() const { return sizeof(this); }
+	virtual int size() const { return sizeof(*this); }
+	virtual bool plainData() const { return true; }
 	virtual int length() const { return nDescriptorLength; }
+
+	virtual int vectorLength() const { return nDescriptorLength; }
+	virtual void getVector(float * afVector) const { for(int i=0;i<nDescriptorLength;i++) afVector[i] = (float)aDescriptorVector[i]; }
+	virtual void setVector(const float * afVector) { for(int i=0;i<nDescriptorLength;i++) aDescriptorVector[i] = (elementType)(((elementType)0.5 > 0) ? afVector[i] : floor(afVector[i] + 0.5f)); }
 };
 
 /*//Specialisation for char: Template Class Partial Specialization http://www.iis.sinica.edu.tw/~kathy/vcstl/templates.htm
@@ -133,7 +156,7 @@ public:
 
     void Push(CDescriptor * pDescriptor);
     void Push(CDescriptorSet * pDescriptorSet);
-    void Clear() { vDescriptors.clear(); };
+    void Clear() { vDescriptors.clear(); invalidateIndex(); };
 
 	CDescriptor * operator[](int i) { return vDescriptors[i]; };
 	const CDescriptor * operator[](int i) const { return vDescriptors[i]; };
@@ -166,11 +189,14 @@ protected:
 	CDynArray<CDescriptor * > vDescriptors;
 
 private:
-	CClusterSet * kMedoidCluster(int nClusters, const CCluster * pParentCluster) const HOT;
+	class CKMedoids;
+	CClusterSet * kMedoidCluster(int nClusters, const CCluster * pParentCluster, CThreadpool_base * pThreadpool) const HOT;
+	class CMiniBatchKMeans;
+	CClusterSet * miniBatchKMeansCluster(int nClusters, const CCluster * pParentCluster, CThreadpool_base * pThreadpool) const HOT;
 	CClusterSet * kMeansCluster(int nClusters, const CCluster * pParentCluster) HOT;
 	CClusterSet * RandomCluster(int nClusters, const CCluster * pParentCluster, bool bDuplicate);
 
-	CClusterSet * cluster_int(unsigned int nClusters, const CCluster * pParentCluster, int nAssignSpeedup);
+	CClusterSet * cluster_int(unsigned int nClusters, const CCluster * pParentCluster, int nAssignSpeedup, CThreadpool_base * pThreadpool);
 
     void AssignMSDescriptorSets(CClusterSet * pClusters) const;
 
@@ -185,7 +211,7 @@ public:
 
     void Push(CDescriptor * pDescriptor) ;
     void Push(CDescriptorSet * pDescriptorSet);
-    void Clear() { vDescriptors.clear(); };
+    void Clear() { vDescriptors.clear(); invalidateIndex(); };
 
     int Count() const { return  vDescriptors.size(); }
 
@@ -412,6 +438,7 @@ void CTVectorSpaceDescriptorSet::Push(CDescriptor * pDescriptor)
     const descriptorType * pVSDescriptor = CAST<const descriptorType *>(pDescriptor);
     if(IS_DEBUG) CHECK(!pVSDescriptor, "CTVectorSpaceDescriptorSet::Push: Cast failed");
 	vDescriptors.push_back(pVSDescriptor);
+	invalidateIndex();
 }
 
 templateVSSet
@@ -422,6 +449,7 @@ void CTVectorSpaceDescriptorSet::Push(CDescriptorSet * pDescriptorSet)
     if(IS_DEBUG) CHECK(!pVSDescriptorSet, "CTVectorSpaceDescriptorSet::Push: Cast failed");
 	vDescriptors.reserve(vDescriptors.size()+pDescriptorSet->Count());
 	vDescriptors.insert(vDescriptors.end(), pVSDescriptorSet->vDescriptors.begin(), pVSDescriptorSet->vDescriptors.end());
+	invalidateIndex();
 }
 
 templateVS
@@ -461,12 +489,12 @@ CDescriptor::TDist CTVectorSpaceDescriptor::distance(const CDescriptor * d) cons
     switch(eNormToUse)
     {
         case eEuclidSquared:
-            return (CDescriptor::TDist)euclidDist<elementType>(aDescriptorVector, pd->aDescriptorVector, nDescriptorLength);
+            return (CDescriptor::TDist)fastEuclidDist(aDescriptorVector, pd->aDescriptorVector, nDescriptorLength);
         case eCosine:
-            return (CDescriptor::TDist)intLookup::Sqrt(euclidDist<elementType>(aDescriptorVector, pd->aDescriptorVector, nDescriptorLength));
+            return (CDescriptor::TDist)intLookup::Sqrt(fastEuclidDist(aDescriptorVector, pd->aDescriptorVector, nDescriptorLength));
 //            return (CDescriptor::TDist)cosDist(aDescriptorVector, pd->aDescriptorVector, nDescriptorLength);
         case e1Norm:
-            return (CDescriptor::TDist)L1Dist<elementType>(aDescriptorVector, pd->aDescriptorVector, nDescriptorLength);
+            return (CDescriptor::TDist)fastL1Dist(aDescriptorVector, pd->aDescriptorVector, nDescriptorLength);
         case eMaxNorm:
             return (CDescriptor::TDist)MaxDist<elementType>(aDescriptorVector, pd->aDescriptorVector, nDescriptorLength);
         /*case eEuclidParallel:
@@ -516,7 +544,7 @@ public:
     CVectorLocationDescriptor(const float * aDescriptor, float dScale, CLocation loc) : CTVectorSpaceDescriptor(aDescriptor, dScale), Location(loc) {}
     virtual CLocation location() const { return Location; }
 
-	virtual int size() const { return sizeof(this); }
+	virtual int size() const { return sizeof(*this); }
 };
 
 templateVS
@@ -528,5 +556,5 @@ public:
     CVectorLocationOrientationDescriptor(const float * aDescriptor, float dScale, double orientationAngle, CLocation loc) : CTVectorLocationDescriptor(aDescriptor, dScale, loc), orientationAngle(orientationAngle) {}
 	virtual double orientation() const { return orientationAngle; }
 
-	virtual int size() const { return sizeof(this); }
+	virtual int size() const { return sizeof(*this); }
 };
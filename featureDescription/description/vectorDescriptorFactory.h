@@ -23,22 +23,23 @@ typedef CVectorLocationOrientationDescriptor<char, 128, eEuclidSquared> TVectorO
 class CVectorDescriptorFactory
 {
 public:
-	static CDescriptor * makeDescriptor(const float * pfDesc, int size, const CLocation loc)
+	//Allocated from pArena if given (see CDescriptorSet::arena)
+	static CDescriptor * makeDescriptor(const float * pfDesc, int size, const CLocation loc, CDescriptorArena * pArena = 0)
 	{
 		if(size==64)
-			return new TVectorDescriptor64(pfDesc, 127.99f, loc);
+			return CDescriptorArena::make<TVectorDescriptor64>(pArena, pfDesc, 127.99f, loc);
 		else if(size==128)
-			return new TVectorDescriptor128(pfDesc, 127.99f, loc);
+			return CDescriptorArena::make<TVectorDescriptor128>(pArena, pfDesc, 127.99f, loc);
 		else
 			THROW( "Size not supported")
 	}
 
-	static CDescriptor * makeDescriptor(const float * pfDesc, int size, double orientation, const CLocation loc)
+	static CDescriptor * makeDescriptor(const float * pfDesc, int size, double orientation, const CLocation loc, CDescriptorArena * pArena = 0)
 	{
 		if(size==64)
-			return new TVectorOrientationDescriptor64(pfDesc, 127.99f, orientation, loc);
+			return CDescriptorArena::make<TVectorOrientationDescriptor64>(pArena, pfDesc, 127.99f, orientation, loc);
 		else if(size==128)
-			return new TVectorOrientationDescriptor128(pfDesc, 127.99f, orientation, loc);
+			return CDescriptorArena::make<TVectorOrientationDescriptor128>(pArena, pfDesc, 127.99f, orientation, loc);
 		else
 			THROW( "Size not supported")
 	}
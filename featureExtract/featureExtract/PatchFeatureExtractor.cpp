@@ -34,7 +34,7 @@ CDescriptorSet * CPatchFeatureExtractor::getDescriptors_int(const IplImage * pIm
     CStopWatch s;
     s.startTimer();
 
-    pCornerDetector->getCorners(pGreyImg, nCorners, aCorners);
+    pCornerDetector->getCorners(*pPyramid, nCorners, aCorners);
 
     s.stopTimer();
     cout << "Extract corners took " << s.getElapsedTime() << " seconds" << endl;
@@ -51,7 +51,7 @@ CDescriptorSet * CPatchFeatureExtractor::getDescriptors_int(const IplImage * pIm
 
     for (int i = 0; i < nCorners; i++) {
         CHECK(PATCH_PARAMS.Patch.MONO_DESCRIPTOR && !pGreyImg, "Mono descriptor selected but no grey image here");
-        CDescriptor * pDescriptor = TDescriptorFactory::makeDescriptor(PATCH_PARAMS.Patch.MONO_DESCRIPTOR ? pGreyImg : pImage, aCorners[i], 1.0, PATCH_PARAMS);
+        CDescriptor * pDescriptor = TDescriptorFactory::makeDescriptor(PATCH_PARAMS.Patch.MONO_DESCRIPTOR ? pGreyImg : pImage, aCorners[i], 1.0, PATCH_PARAMS, pDS->arena());
 
         pDS->Push(pDescriptor);
         pDescriptor = 0;
@@ -62,37 +62,21 @@ CDescriptorSet * CPatchFeatureExtractor::getDescriptors_int(const IplImage * pIm
     return pDS;
 }
 
-CDSPatchFeatureExtractor::CDSPatchFeatureExtractor(const int MAX_FEATURES, const CImParams & IM_PARAMS, CCornerDetector ** ppCornerDetector, CPatchDescriptorParams & PATCH_PARAMS, const CDescriptorSetClusteringParams & DSC_PARAMS) : CPatchFeatureExtractor(MAX_FEATURES, IM_PARAMS, ppCornerDetector, PATCH_PARAMS, DSC_PARAMS), pDownsampledImage(0), nScale(PATCH_PARAMS.Patch.PATCH_SCALE) {
-    //if(nScale > 1)
-    {
-        CvSize DSSize = cvSize(IM_PARAMS.IM_WIDTH / nScale, IM_PARAMS.IM_HEIGHT / nScale);
-        pDownsampledImage = cvCreateImage(DSSize, IPL_DEPTH_32S, PATCH_PARAMS.Patch.MONO_DESCRIPTOR ? 1 : 3);
-    }
-
+CDSPatchFeatureExtractor::CDSPatchFeatureExtractor(const int MAX_FEATURES, const CImParams & IM_PARAMS, CCornerDetector ** ppCornerDetector, CPatchDescriptorParams & PATCH_PARAMS, const CDescriptorSetClusteringParams & DSC_PARAMS) : CPatchFeatureExtractor(MAX_FEATURES, IM_PARAMS, ppCornerDetector, PATCH_PARAMS, DSC_PARAMS), nScale(PATCH_PARAMS.Patch.PATCH_SCALE) {
     THROW("TODO: Need the next line:PATCH_PARAMS.PATCH_SCALE = 1")
             //PATCH_PARAMS.PATCH_SCALE = 1; //Set globally
 }
 
 CDSPatchFeatureExtractor::~CDSPatchFeatureExtractor() {
-    if (pDownsampledImage)
-        cvReleaseImage(&pDownsampledImage);
 }
 
 CDescriptorSet * CDSPatchFeatureExtractor::getDescriptors_int(const IplImage * pImage) {
     int nCorners = MAX_FEATURES;
 
-    pCornerDetector->getCorners(pGreyImg, nCorners, aCorners);
+    pCornerDetector->getCorners(*pPyramid, nCorners, aCorners);
 
     const double dScaleInv = 1.0 / nScale;
-    /*if(nScale > 1)
-    {*/
-    if (!PATCH_PARAMS.Patch.MONO_DESCRIPTOR)
-        doDownSample(nScale, pImage, pDownsampledImage);
-    else
-        doDownSample(nScale, pGreyImg, pDownsampledImage);
-    /*}
-    else
-            pDownsampledImage = bColour ? pImage : pGreyImg;*/
+    const IplImage * pDownsampledImage = pPyramid->level(nScale, PATCH_PARAMS.Patch.MONO_DESCRIPTOR);
 
     CStopWatch s;
     s.startTimer();
@@ -101,7 +85,7 @@ CDescriptorSet * CDSPatchFeatureExtractor::getDescriptors_int(const IplImage * p
 
     for (int i = 0; i < nCorners; i++) {
         CHECK(!pDownsampledImage, "No downsampled image");
-        CDescriptor * pDescriptor = TDescriptorFactory::makeDescriptor(pDownsampledImage, aCorners[i], dScaleInv, PATCH_PARAMS);
+        CDescriptor * pDescriptor = TDescriptorFactory::makeDescriptor(pDownsampledImage, aCorners[i], dScaleInv, PATCH_PARAMS, pDS->arena());
         pDS->Push(pDescriptor);
         pDescriptor = 0;
     }
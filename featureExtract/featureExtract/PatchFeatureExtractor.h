@@ -27,7 +27,6 @@ public:
 
 class CDSPatchFeatureExtractor: public CPatchFeatureExtractor
 {
-	IplImage * pDownsampledImage;
 	virtual CDescriptorSet * getDescriptors_int(const IplImage * pImage);
 	const int nScale;
 public:
@@ -106,7 +106,7 @@ CDescriptorSet * CSURFFeatureExtractor::getDescriptors_int(const IplImage * pIma
         //if(!detectDuplicates.insert(loc.id()))
         if (!pointBin.isTooClose((int) x, (int) y, nRad)) {
             //TODO: use laplacian (prob won't actually make much difference)
-            pDS->Push(CVectorDescriptorFactory::makeDescriptor(aSortedKeypoints[i].second, SURFParams.SURF_LENGTH(), pKeyPoint->dir, loc));
+            pDS->Push(CVectorDescriptorFactory::makeDescriptor(aSortedKeypoints[i].second, SURFParams.SURF_LENGTH(), pKeyPoint->dir, loc, pDS->arena()));
         }
     }
 
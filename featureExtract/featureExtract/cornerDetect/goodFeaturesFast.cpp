@@ -0,0 +1,482 @@
+/* Code by Tom Botterill. Documentation and license at http://www.hilandtom.com/tombotterill/code */
+
+/*
+ * goodFeaturesFast.cpp
+ *
+ * Shi-Tomasi/Harris corner map, corner selection and subpixel refinement, replacing the OpenCV 1.1-derived code in
+ * cvcorner.cpp, cvfeatureselect.cpp and cvcornersubpix.cpp (which no longer builds with new OpenCV). Each stage is
+ * split into fixed-size strips of rows or batches of corners which run on the threadpool if one is given, so results
+ * don't depend on the number of threads.
+ */
+
+#include "goodFeaturesFast.h"
+#include "util/dynArray.h"
+#include "geom/threadpool.h"
+#include <boost/bind.hpp>
+#include <boost/scoped_array.hpp>
+#include <algorithm>
+#include <math.h>
+
+#if defined(__GNUC__) && defined(__SSE2__)
+#  define HAVE_SSE2_CORNERS 1
+#  include <emmintrin.h>
+#else
+#  define HAVE_SSE2_CORNERS 0
+#endif
+
+using namespace std;
+
+#define CORNER_STRIP_ROWS 32 //Rows per job
+#define SUBPIX_BATCH 32 //Corners per job
+
+struct CCornerCandidate
+{
+	float val;
+	int x, y;
+};
+
+//Best first; ties in raster order so the order is well defined
+class CBetterCandidate
+{
+public:
+	bool operator()(const CCornerCandidate & a, const CCornerCandidate & b) const
+	{
+		if(a.val != b.val) return a.val > b.val;
+		if(a.y != b.y) return a.y < b.y;
+		return a.x < b.x;
+	}
+};
+
+static inline int clampInt(const int x, const int nMax) { return x < 0 ? 0 : (x > nMax ? nMax : x); }
+
+//Min eigenvalue (or Harris response) of the gradient covariance matrix summed over a nBlock x nBlock window, for rows
+//[y0, y1). 3x3 Sobel gradients, borders replicated, scaled as cvCornerMinEigenVal with aperture 3.
+class CCornerStrip
+{
+	const uchar * src;
+	float * dst;
+	const uchar * mask;
+	int srcStep, dstStep, maskStep, w, h, y0, y1, nBlock;
+	bool bHarris;
+	float k;
+
+	//dx*dx, dx*dy, dy*dy for one row, box filtered horizontally. pPadded has space for the row plus nBlock/2 either side
+	void boxFilteredProducts(const int y, float * pPadded, float * pOut) const
+	{
+		const int r = nBlock/2, nPaddedWidth = w + 2*r;
+		const float factor = (float)(1.0/(4.0*nBlock*255.0));
+
+		const uchar * pAbove = src + clampInt(y-1, h-1)*srcStep, * pRow = src + y*srcStep, * pBelow = src + clampInt(y+1, h-1)*srcStep;
+		float * aXX = pPadded, * aXY = pPadded + nPaddedWidth, * aYY = pPadded + 2*nPaddedWidth;
+		for(int x=0; x<w; x++)
+		{
+			const int xl = x > 0 ? x-1 : 0, xr = x < w-1 ? x+1 : w-1;
+			const float dx = factor*(float)((pAbove[xr] - pAbove[xl]) + 2*(pRow[xr] - pRow[xl]) + (pBelow[xr] - pBelow[xl]));
+			const float dy = factor*(float)((pBelow[xl] + 2*pBelow[x] + pBelow[xr]) - (pAbove[xl] + 2*pAbove[x] + pAbove[xr]));
+			aXX[x+r] = dx*dx;
+			aXY[x+r] = dx*dy;
+			aYY[x+r] = dy*dy;
+		}
+
+		for(int nProduct=0; nProduct<3; nProduct++)
+		{
+			float * pIn = pPadded + nProduct*nPaddedWidth;
+			for(int i=0; i<r; i++)
+			{
+				pIn[i] = pIn[r];
+				pIn[w+r+i] = pIn[w+r-1];
+			}
+
+			float * pSum = pOut + nProduct*w;
+			int x = 0;
+#if HAVE_SSE2_CORNERS
+			for(; x+4 <= w; x += 4)
+			{
+				__m128 sum = _mm_loadu_ps(pIn + x);
+				for(int j=1; j<nBlock; j++)
+					sum = _mm_add_ps(sum, _mm_loadu_ps(pIn + x + j));
+				_mm_storeu_ps(pSum + x, sum);
+			}
+#endif
+			for(; x<w; x++)
+			{
+				float sum = pIn[x];
+				for(int j=1; j<nBlock; j++)
+					sum += pIn[x + j];
+				pSum[x] = sum;
+			}
+		}
+	}
+
+	//Sum the nBlock rows around y (ring holds them, first row at slot nFirstSlot) and compute the corner response
+	void cornerRow(const int y, const float * pRing, const int nFirstSlot)
+	{
+		float * pDst = (float *)((char *)dst + y*dstStep);
+		const int nRowFloats = 3*w;
+		int x = 0;
+#if HAVE_SSE2_CORNERS
+		const __m128 half = _mm_set1_ps(0.5f), kk = _mm_set1_ps(k);
+		__m128 maxVal = _mm_set1_ps(fMax);
+		for(; x+4 <= w; x += 4)
+		{
+			__m128 a = _mm_setzero_ps(), b = _mm_setzero_ps(), c = _mm_setzero_ps();
+			for(int i=0; i<nBlock; i++)
+			{
+				const float * pRow = pRing + ((nFirstSlot + i) % nBlock)*nRowFloats + x;
+				a = _mm_add_ps(a, _mm_loadu_ps(pRow));
+				b = _mm_add_ps(b, _mm_loadu_ps(pRow + w));
+				c = _mm_add_ps(c, _mm_loadu_ps(pRow + 2*w));
+			}
+			__m128 val;
+			if(bHarris)
+			{
+				const __m128 apc = _mm_add_ps(a, c);
+				val = _mm_sub_ps(_mm_sub_ps(_mm_mul_ps(a, c), _mm_mul_ps(b, b)), _mm_mul_ps(kk, _mm_mul_ps(apc, apc)));
+			}
+			else
+			{
+				const __m128 amc = _mm_mul_ps(half, _mm_sub_ps(a, c));
+				val = _mm_sub_ps(_mm_mul_ps(half, _mm_add_ps(a, c)), _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(amc, amc), _mm_mul_ps(b, b))));
+			}
+			_mm_storeu_ps(pDst + x, val);
+			maxVal = _mm_max_ps(maxVal, val);
+		}
+		float afMax[4];
+		_mm_storeu_ps(afMax, maxVal);
+		fMax = max(max(afMax[0], afMax[1]), max(afMax[2], afMax[3]));
+#endif
+		for(; x<w; x++)
+		{
+			float a = 0, b = 0, c = 0;
+			for(int i=0; i<nBlock; i++)
+			{
+				const float * pRow = pRing + ((nFirstSlot + i) % nBlock)*nRowFloats + x;
+				a += pRow[0];
+				b += pRow[w];
+				c += pRow[2*w];
+			}
+			const float val = bHarris ? a*c - b*b - k*(a+c)*(a+c) : 0.5f*(a+c) - sqrtf(0.25f*(a-c)*(a-c) + b*b);
+			pDst[x] = val;
+			if(val > fMax)
+				fMax = val;
+		}
+	}
+
+public:
+	float fMax;
+	CDynArray<CCornerCandidate> candidates;
+
+	void setup(const uchar * src_in, int srcStep_in, float * dst_in, int dstStep_in, const uchar * mask_in, int maskStep_in, int w_in, int h_in, int y0_in, int y1_in, int nBlock_in, bool bHarris_in, double k_in)
+	{
+		src = src_in; srcStep = srcStep_in; dst = dst_in; dstStep = dstStep_in; mask = mask_in; maskStep = maskStep_in;
+		w = w_in; h = h_in; y0 = y0_in; y1 = y1_in; nBlock = nBlock_in; bHarris = bHarris_in; k = (float)k_in;
+		fMax = 0;
+	}
+
+	void cornerMap()
+	{
+		const int r = nBlock/2, nRowFloats = 3*w;
+		CDynArray<float> aRing(nBlock*nRowFloats), aPadded(3*(w + 2*r));
+
+		fMax = 0;
+		for(int yy = y0-r; yy < y1+r; yy++)
+		{
+			const int nSlot = (yy - y0 + r) % nBlock;
+			boxFilteredProducts(clampInt(yy, h-1), aPadded.begin(), aRing.begin() + nSlot*nRowFloats);
+
+			const int y = yy - r;
+			if(y >= y0)
+				cornerRow(y, aRing.begin(), (nSlot + 1) % nBlock);
+		}
+	}
+
+	//3x3 local maxima at least fThresh (and positive), best first
+	void findCandidates(const float fThresh)
+	{
+		const int nStartRow = max<int>(y0, 1), nEndRow = min<int>(y1, h-1);
+		for(int y=nStartRow; y<nEndRow; y++)
+		{
+			const float * pAbove = (const float *)((const char *)dst + (y-1)*dstStep);
+			const float * pRow = (const float *)((const char *)dst + y*dstStep);
+			const float * pBelow = (const float *)((const char *)dst + (y+1)*dstStep);
+			const uchar * pMask = mask ? mask + y*maskStep : 0;
+			for(int x=1; x<w-1; x++)
+			{
+				const float val = pRow[x];
+				if(val < fThresh || val <= 0 || (pMask && !pMask[x]))
+					continue;
+				if(val >= pRow[x-1] && val >= pRow[x+1] && val >= pAbove[x-1] && val >= pAbove[x] && val >= pAbove[x+1]
+				        && val >= pBelow[x-1] && val >= pBelow[x] && val >= pBelow[x+1])
+				{
+					const CCornerCandidate candidate = { val, x, y };
+					candidates.push_back(candidate);
+				}
+			}
+		}
+		std::sort(candidates.begin(), candidates.end(), CBetterCandidate());
+	}
+};
+
+//Min eigenvalue or Harris map of an 8-bit image into a 32-bit float image. Returns the strips (for selection)
+static CCornerStrip * cornerMap(const uchar * src, const int srcStep, float * dst, const int dstStep, const int w, const int h, const int block_size, const bool bHarris, const double harris_k, const uchar * mask, const int maskStep, int & nStrips, CThreadpool_base * pThreadpool)
+{
+	CHECK(block_size < 3 || !(block_size & 1), "Averaging window size must be an odd number >= 3");
+	CHECK(w < 1 || h < 1, "Empty image");
+
+	nStrips = (h + CORNER_STRIP_ROWS - 1)/CORNER_STRIP_ROWS;
+	CCornerStrip * aStrips = new CCornerStrip[nStrips];
+	for(int nStrip=0; nStrip<nStrips; nStrip++)
+	{
+		const int y0 = nStrip*CORNER_STRIP_ROWS;
+		aStrips[nStrip].setup(src, srcStep, dst, dstStep, mask, maskStep, w, h, y0, min<int>(y0 + CORNER_STRIP_ROWS, h), block_size, bHarris, harris_k);
+		if(pThreadpool && nStrips > 1)
+		{
+			TNullaryFnObj fn = boost::bind(&CCornerStrip::cornerMap, aStrips + nStrip);
+			pThreadpool->addJob(fn);
+		}
+		else
+			aStrips[nStrip].cornerMap();
+	}
+	if(pThreadpool && nStrips > 1)
+		pThreadpool->waitForAll();
+
+	return aStrips;
+}
+
+void fastCvCornerMinEigenVal( const CvMat* srcarr, CvMat* eigenvarr,
+                     int block_size, int aperture_size )
+{
+	CHECK(aperture_size != 3, "fastCvCornerMinEigenVal: Only 3x3 Sobel supported");
+	CHECK(srcarr->rows != eigenvarr->rows || srcarr->cols != eigenvarr->cols, "fastCvCornerMinEigenVal: Sizes differ");
+
+	int nStrips = 0;
+	boost::scoped_array<CCornerStrip> aStrips(cornerMap(srcarr->data.ptr, srcarr->step, eigenvarr->data.fl, eigenvarr->step, srcarr->cols, srcarr->rows, block_size, false, 0, 0, 0, nStrips, 0));
+}
+
+//Orders strips by their next candidate, for merging
+class CWorseStripHead
+{
+	const CCornerStrip * aStrips;
+	const int * anNext;
+public:
+	CWorseStripHead(const CCornerStrip * aStrips, const int * anNext) : aStrips(aStrips), anNext(anNext) {}
+	bool operator()(const int s1, const int s2) const
+	{
+		return CBetterCandidate()(aStrips[s2].candidates[anNext[s2]], aStrips[s1].candidates[anNext[s1]]);
+	}
+};
+
+void fastCvGoodFeaturesToTrack( const IplImage* image, IplImage* eigImage, IplImage* /*tempImage*/,
+                       CvPoint2D64f* corners, int *corner_count,
+                       double quality_level, double min_distance,
+                       const IplImage* maskImage, int block_size,
+                       int use_harris, double harris_k, CPointBin<32, 32, 16> & pointBin, CThreadpool_base * pThreadpool )
+{
+	CHECK(!image || !eigImage || !corners || !corner_count, "fastCvGoodFeaturesToTrack: Null pointer");
+	CHECK(image->nChannels != 1 || image->depth != 8, "fastCvGoodFeaturesToTrack: 8-bit grey image required");
+	CHECK(eigImage->nChannels != 1 || eigImage->depth != 32 || eigImage->width < image->width || eigImage->height < image->height, "fastCvGoodFeaturesToTrack: 32-bit float eigenvalue image required, at least as big as the image");
+	CHECK(*corner_count <= 0, "fastCvGoodFeaturesToTrack: maximal corners number is non positive");
+	CHECK(quality_level <= 0 || min_distance < 0, "fastCvGoodFeaturesToTrack: quality level or min distance are non positive");
+
+	const int max_count = *corner_count;
+	*corner_count = 0;
+	pointBin.reset();
+
+	const int w = image->width, h = image->height;
+	const uchar * mask = maskImage ? (const uchar *)maskImage->imageData : 0;
+	int nStrips = 0;
+	boost::scoped_array<CCornerStrip> aStrips(cornerMap((const uchar *)image->imageData, image->widthStep, (float *)eigImage->imageData, eigImage->widthStep,
+			w, h, block_size, use_harris != 0, harris_k, mask, maskImage ? maskImage->widthStep : 0, nStrips, pThreadpool));
+
+	float fMax = 0;
+	for(int nStrip=0; nStrip<nStrips; nStrip++)
+		fMax = max(fMax, aStrips[nStrip].fMax);
+	const float fThresh = (float)(fMax*quality_level);
+
+	//Candidates per strip, sorted in parallel
+	for(int nStrip=0; nStrip<nStrips; nStrip++)
+	{
+		if(pThreadpool && nStrips > 1)
+		{
+			TNullaryFnObj fn = boost::bind(&CCornerStrip::findCandidates, aStrips.get() + nStrip, fThresh);
+			pThreadpool->addJob(fn);
+		}
+		else
+			aStrips[nStrip].findCandidates(fThresh);
+	}
+	if(pThreadpool && nStrips > 1)
+		pThreadpool->waitForAll();
+
+	//Merge the sorted strips, keeping the strongest corners with min_distance seperation
+	const int min_dist = doubleToInt(min_distance);
+	CDynArray<int> anNext(nStrips, 0), anHeap(nStrips);
+	int nHeap = 0;
+	for(int nStrip=0; nStrip<nStrips; nStrip++)
+		if(aStrips[nStrip].candidates.size())
+			anHeap[nHeap++] = nStrip;
+
+	const CWorseStripHead worse(aStrips.get(), anNext.begin());
+	std::make_heap(anHeap.begin(), anHeap.begin() + nHeap, worse);
+
+	int count = 0;
+	while(nHeap > 0 && count < max_count)
+	{
+		std::pop_heap(anHeap.begin(), anHeap.begin() + nHeap, worse);
+		const int nStrip = anHeap[nHeap-1];
+		const CCornerCandidate & candidate = aStrips[nStrip].candidates[anNext[nStrip]];
+		if(!pointBin.isTooClose(candidate.x, candidate.y, min_dist))
+		{
+			corners[count].x = candidate.x;
+			corners[count].y = candidate.y;
+			count++;
+		}
+
+		anNext[nStrip]++;
+		if(anNext[nStrip] < aStrips[nStrip].candidates.size())
+			std::push_heap(anHeap.begin(), anHeap.begin() + nHeap, worse);
+		else
+			nHeap--;
+	}
+
+	*corner_count = count;
+}
+
+//Subpixel refinement of a batch of corners, as cvFindCornerSubPix. Each corner moves to where the image gradients in a
+//(Gaussian weighted) window around it are orthogonal to the vectors to it.
+class CSubPixBatch
+{
+	const uchar * src;
+	int srcStep, w, h, nWinW, nWinH, nMaxIters;
+	double dEpsSq;
+	const double * aMask;
+	CvPoint2D64f * aCorners;
+	int nCorners;
+
+	inline double pixel(const int x, const int y) const
+	{
+		return (double)src[clampInt(y, h-1)*srcStep + clampInt(x, w-1)];
+	}
+
+	//Bilinear samples of the (2*nWinW+3) x (2*nWinH+3) window centred on c. Borders replicated
+	void sampleWindow(const CvPoint2D64f & c, double * aSamples) const
+	{
+		const int nSampleW = 2*nWinW + 3, nSampleH = 2*nWinH + 3;
+		const double x0 = c.x - (nWinW + 1), y0 = c.y - (nWinH + 1);
+		const int ix = (int)floor(x0), iy = (int)floor(y0);
+		const double a = x0 - ix, b = y0 - iy;
+		const double w00 = (1-a)*(1-b), w10 = a*(1-b), w01 = (1-a)*b, w11 = a*b;
+		for(int i=0; i<nSampleH; i++)
+			for(int j=0; j<nSampleW; j++)
+			{
+				const int x = ix + j, y = iy + i;
+				*aSamples = w00*pixel(x, y) + w10*pixel(x+1, y) + w01*pixel(x, y+1) + w11*pixel(x+1, y+1);
+				aSamples++;
+			}
+	}
+
+public:
+	void setup(const uchar * src_in, int srcStep_in, int w_in, int h_in, int nWinW_in, int nWinH_in, int nMaxIters_in, double dEpsSq_in, const double * aMask_in, CvPoint2D64f * aCorners_in, int nCorners_in)
+	{
+		src = src_in; srcStep = srcStep_in; w = w_in; h = h_in; nWinW = nWinW_in; nWinH = nWinH_in;
+		nMaxIters = nMaxIters_in; dEpsSq = dEpsSq_in; aMask = aMask_in; aCorners = aCorners_in; nCorners = nCorners_in;
+	}
+
+	void refine()
+	{
+		const int nSampleW = 2*nWinW + 3, nSampleH = 2*nWinH + 3;
+		CDynArray<double> aSamples(nSampleW*nSampleH);
+
+		for(int nCorner=0; nCorner<nCorners; nCorner++)
+		{
+			const CvPoint2D64f cT = aCorners[nCorner];
+			CvPoint2D64f cI = cT;
+			for(int nIter=0; nIter<nMaxIters; nIter++)
+			{
+				sampleWindow(cI, aSamples.begin());
+
+				double a = 0, b = 0, c = 0, bb1 = 0, bb2 = 0;
+				const double * pMask = aMask;
+				for(int i=1; i<nSampleH-1; i++)
+				{
+					const double py = i - 1 - nWinH;
+					const double * pSample = aSamples.begin() + i*nSampleW;
+					for(int j=1; j<nSampleW-1; j++, pMask++)
+					{
+						const double px = j - 1 - nWinW;
+						const double gx = 0.5*(pSample[j+1] - pSample[j-1]), gy = 0.5*(pSample[j+nSampleW] - pSample[j-nSampleW]);
+						const double gxx = gx*gx**pMask, gxy = gx*gy**pMask, gyy = gy*gy**pMask;
+						a += gxx;
+						b += gxy;
+						c += gyy;
+						bb1 += gxx*px + gxy*py;
+						bb2 += gxy*px + gyy*py;
+					}
+				}
+
+				const double det = a*c - b*b;
+				if(fabs(det) < 0.0001)
+					break;
+				const double det_inv = 1.0/det;
+				const double dx = (c*bb1 - b*bb2)*det_inv, dy = (a*bb2 - b*bb1)*det_inv;
+				cI.x += dx;
+				cI.y += dy;
+				if(dx*dx + dy*dy <= dEpsSq)
+					break;
+			}
+
+			//Poor convergence: keep the original corner
+			if(fabs(cI.x - cT.x) > nWinW || fabs(cI.y - cT.y) > nWinH)
+				cI = cT;
+			aCorners[nCorner] = cI;
+		}
+	}
+};
+
+void fastCvFindCornerSubPix( const IplImage* image, CvPoint2D64f* corners,
+                    int count, CvSize win, CvSize zeroZone,
+                    CvTermCriteria criteria, CThreadpool_base * pThreadpool )
+{
+	CHECK(!image || (!corners && count > 0), "fastCvFindCornerSubPix: Null pointer");
+	CHECK(image->nChannels != 1 || image->depth != 8, "fastCvFindCornerSubPix: 8-bit grey image required");
+	CHECK(win.width <= 0 || win.height <= 0, "fastCvFindCornerSubPix: Bad window size");
+	if(count <= 0)
+		return;
+
+	const int MAX_ITERS = 100;
+	int nMaxIters = MAX_ITERS;
+	double dEps = 0;
+	if(criteria.type & CV_TERMCRIT_ITER)
+		nMaxIters = min<int>(max<int>(criteria.max_iter, 1), MAX_ITERS);
+	if(criteria.type & CV_TERMCRIT_EPS)
+		dEps = max<double>(criteria.epsilon, 0);
+
+	//Gaussian weights, shared by all corners
+	const int nWinW = 2*win.width + 1, nWinH = 2*win.height + 1;
+	CDynArray<double> aMask(nWinW*nWinH);
+	for(int i=0; i<nWinH; i++)
+		for(int j=0; j<nWinW; j++)
+		{
+			const double dy = (i - win.height)/(double)win.height, dx = (j - win.width)/(double)win.width;
+			const bool bZeroZone = zeroZone.width >= 0 && zeroZone.height >= 0 && 2*zeroZone.width + 1 < nWinW && 2*zeroZone.height + 1 < nWinH
+					&& abs(i - win.height) <= zeroZone.height && abs(j - win.width) <= zeroZone.width;
+			aMask[i*nWinW + j] = bZeroZone ? 0 : exp(-dx*dx)*exp(-dy*dy);
+		}
+
+	const int nBatches = (count + SUBPIX_BATCH - 1)/SUBPIX_BATCH;
+	boost::scoped_array<CSubPixBatch> aBatches(new CSubPixBatch[nBatches]);
+	for(int nBatch=0; nBatch<nBatches; nBatch++)
+	{
+		const int nFirst = nBatch*SUBPIX_BATCH;
+		aBatches[nBatch].setup((const uchar *)image->imageData, image->widthStep, image->width, image->height, win.width, win.height, nMaxIters, dEps*dEps,
+				aMask.begin(), corners + nFirst, min<int>(SUBPIX_BATCH, count - nFirst));
+		if(pThreadpool && nBatches > 1)
+		{
+			TNullaryFnObj fn = boost::bind(&CSubPixBatch::refine, aBatches.get() + nBatch);
+			pThreadpool->addJob(fn);
+		}
+		else
+			aBatches[nBatch].refine();
+	}
+	if(pThreadpool && nBatches > 1)
+		pThreadpool->waitForAll();
+}
@@ -128,19 +128,21 @@ public:
 
 };
 
-void fastCvGoodFeaturesToTrack( const void* image, void* eigImage, void* tempImage,
+class CThreadpool_base;
+
+//Shi-Tomasi (or Harris) corners, as cvGoodFeaturesToTrack but with pointBin enforcing min_distance. tempImage is unused.
+//The corner map, and finding and sorting candidates, are split into strips of rows run on pThreadpool (if given)
+void fastCvGoodFeaturesToTrack( const IplImage* image, IplImage* eigImage, IplImage* tempImage,
                        CvPoint2D64f* corners, int *corner_count,
                        double quality_level, double min_distance,
-                       const void* maskImage, int block_size,
-                       int use_harris, double harris_k, CPointBin<32, 32, 16> & pointBin );
+                       const IplImage* maskImage, int block_size,
+                       int use_harris, double harris_k, CPointBin<32, 32, 16> & pointBin, CThreadpool_base * pThreadpool = 0 );
 
 void fastCvCornerMinEigenVal( const CvMat* srcarr, CvMat* eigenvarr,
                      int block_size, int aperture_size );
-void
-fastIcvCornerEigenValsVecs( const CvMat* src, CvMat* eigenv, int block_size,
-                        int aperture_size, int op_type, double k=0. );
 
-void fastCvFindCornerSubPix( const void* srcarr, CvPoint2D64f* corners,
+//As cvFindCornerSubPix, with batches of corners run on pThreadpool (if given)
+void fastCvFindCornerSubPix( const IplImage* image, CvPoint2D64f* corners,
                     int count, CvSize win, CvSize zeroZone,
-                    CvTermCriteria criteria );
+                    CvTermCriteria criteria, CThreadpool_base * pThreadpool = 0 );
 
@@ -10,6 +10,7 @@
 #include "openCVCornerDetector.h"
 #include "description/descriptor.h"
 #include "time/SpeedTest.h"
+#include "geom/threadpool.h"
 #include <iomanip>
 
 using namespace std;
@@ -19,7 +20,10 @@ COpenCVCornerDetector::COpenCVCornerDetector(const CImParams & IM_PARAMS, int MA
 	tempImg(cvCreateImage(cvSize(IM_PARAMS.IM_WIDTH - 2*MARGIN, IM_PARAMS.IM_HEIGHT - 2*MARGIN), IPL_DEPTH_32F, 1)),
     aCvPointCorners(new CvPoint2D64f[FEATURE_PARAMS.MAX_FEATURES]),
     pointBin(IM_PARAMS.IM_WIDTH - 2*MARGIN, IM_PARAMS.IM_HEIGHT - 2*MARGIN), CORNER_PARAMS(FEATURE_PARAMS.CornerDetector)
-{}
+{
+	if(CORNER_PARAMS.CORNER_THREADS > 1)
+		pThreadpool.reset(CThreadpool_base::makeThreadpool(CORNER_PARAMS.CORNER_THREADS));
+}
 
 COpenCVCornerDetector::~COpenCVCornerDetector()
 {
@@ -35,7 +39,7 @@ void COpenCVCornerDetector::getCorners(IplImage * pGreyImgUse, int & nCorners, C
 	CIplPx<uchar>::cropImage(greySubImage, (int)MARGIN);
 
 	CStopWatch s; s.startTimer();
-    fastCvGoodFeaturesToTrack(&greySubImage, eigImg, tempImg, aCvPointCorners, &nCorners, CORNER_PARAMS.CORNER_QUAL, CORNER_PARAMS.CORNER_MIN_DIST, 0, CORNER_PARAMS.CORNER_BLOCK_RAD*2+1, CORNER_PARAMS.USE_HARRIS, CORNER_PARAMS.CORNER_HARRIS_K, pointBin);
+    fastCvGoodFeaturesToTrack(&greySubImage, eigImg, tempImg, aCvPointCorners, &nCorners, CORNER_PARAMS.CORNER_QUAL, CORNER_PARAMS.CORNER_MIN_DIST, 0, CORNER_PARAMS.CORNER_BLOCK_RAD*2+1, CORNER_PARAMS.USE_HARRIS, CORNER_PARAMS.CORNER_HARRIS_K, pointBin, pThreadpool.get());
 	s.stopTimer();
     cout << setprecision(6) << "Corner detect took " << s.getElapsedTime() << " secs, " << nCorners << " detected\n";
 
@@ -47,7 +51,7 @@ void COpenCVCornerDetector::getCorners(IplImage * pGreyImgUse, int & nCorners, C
     	s.startTimer();
     	fastCvFindCornerSubPix( &greySubImage, aCvPointCorners,
 								 nCorners, cvSize(SUBPIX_SIZE, SUBPIX_SIZE), cvSize(ZZ_SIZE, ZZ_SIZE),
-								 cvTermCriteria(CV_TERMCRIT_ITER | CV_TERMCRIT_EPS, 8, 0.15) );
+								 cvTermCriteria(CV_TERMCRIT_ITER | CV_TERMCRIT_EPS, 8, 0.15), pThreadpool.get() );
     	s.stopTimer();
         cout << "Subpix took " << s.getElapsedTime()/nCorners << " secs per corner (" << s.getElapsedTime() << " total)\n";
     }
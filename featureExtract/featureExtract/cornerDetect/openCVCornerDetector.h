@@ -12,6 +12,9 @@
 
 #include "goodFeaturesFast.h"
 #include "../cornerDetector.h"
+#include <boost/scoped_ptr.hpp>
+
+class CThreadpool_base;
 
 class COpenCVCornerDetector: public CCornerDetector
 {
@@ -21,6 +24,7 @@ class COpenCVCornerDetector: public CCornerDetector
     CvPoint2D64f * aCvPointCorners;
     CPointBin<32, 32, 16> pointBin;
     const CCornerParams::CCornerDetectorParams & CORNER_PARAMS;
+    boost::scoped_ptr<CThreadpool_base> pThreadpool; //If CORNER_THREADS > 1
 public:
 	COpenCVCornerDetector(const CImParams & IM_PARAMS, int MARGIN, const CCornerParams &);
 	virtual ~COpenCVCornerDetector();
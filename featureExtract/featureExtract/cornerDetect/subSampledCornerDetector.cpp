@@ -10,6 +10,7 @@
 #include "subSampledCornerDetector.h"
 #include "description/descriptor.h"
 #include "time/SpeedTest.h"
+#include "geom/threadpool.h"
 #include <iomanip>
 
 using namespace std;
@@ -18,46 +19,46 @@ CSubSampledCornerDetector::CSubSampledCornerDetector(const CImParams & IM_PARAMS
 	eigImg(cvCreateImage(cvSize(IM_PARAMS.IM_WIDTH/2 - MARGIN, IM_PARAMS.IM_HEIGHT/2 - MARGIN), IPL_DEPTH_32F, 1)),
 	tempImg(cvCreateImage(cvSize(IM_PARAMS.IM_WIDTH/2 - MARGIN, IM_PARAMS.IM_HEIGHT/2 - MARGIN), IPL_DEPTH_32F, 1)),
     aCvPointCorners(new CvPoint2D64f[FEATURE_PARAMS.MAX_FEATURES]),
-    pointBin(IM_PARAMS.IM_WIDTH/2 - MARGIN, IM_PARAMS.IM_HEIGHT/2 - MARGIN), CORNER_PARAMS(FEATURE_PARAMS.CornerDetector)
+    pointBin(IM_PARAMS.IM_WIDTH/2 - MARGIN, IM_PARAMS.IM_HEIGHT/2 - MARGIN), CORNER_PARAMS(FEATURE_PARAMS.CornerDetector), ownPyramid(0, 0)
 {
-	pGreySSImage = cvCreateImage(cvSize(IM_PARAMS.IM_WIDTH/2-MARGIN, IM_PARAMS.IM_HEIGHT/2-MARGIN), IPL_DEPTH_8U, 1);
+	if(CORNER_PARAMS.CORNER_THREADS > 1)
+		pThreadpool.reset(CThreadpool_base::makeThreadpool(CORNER_PARAMS.CORNER_THREADS));
 }
 
 CSubSampledCornerDetector::~CSubSampledCornerDetector()
 {
 	delete [] aCvPointCorners;
-	cvReleaseImage(&pGreySSImage);
 }
 
 #define PRINTWH(im) cout << #im " width=" << (im)->width << " height=" << (im)->height << endl;
 void CSubSampledCornerDetector::getCorners(IplImage * pGreyImgUse, int & nCorners, CLocation * aCorners)
 {
 	CHECK( pGreyImgUse->nChannels != 1, "Grey image required");
-	//if(IS_DEBUG) CHECK(pGreySSImage->width != pGreySSImage->widthStep, "Width assumption failed");
+	ownPyramid.setImage(pGreyImgUse);
+	getCorners(ownPyramid, nCorners, aCorners);
+	ownPyramid.setImage(0);
+}
+
+void CSubSampledCornerDetector::getCorners(CImagePyramid & pyramid, int & nCorners, CLocation * aCorners)
+{
+	IplImage * pGreyImgUse = pyramid.grey();
 
 	CStopWatch s; s.startTimer();
-	char * pcRowStart = pGreyImgUse->imageData + MARGIN_INT * pGreyImgUse->widthStep + MARGIN_INT;
-	char * pcDest = pGreySSImage->imageData;
-	for(int r = 0; r < IM_PARAMS.IM_HEIGHT/2-MARGIN_INT; r++)
-	{
-		char * pcRow = pcRowStart + r * 2 * pGreyImgUse->widthStep;
-		char * pcDestRow = pcDest + r * pGreySSImage->widthStep;
-		for(int c = IM_PARAMS.IM_WIDTH/2-MARGIN_INT; c>0; c--)
-		{
-			*pcDestRow = *pcRow; //Sampling 'top left' of 4--need to change below +0.5 as well if interpolate.
-			pcRow += 2;
-			pcDestRow++;
-		}
-	}
+	//Half-size level (2x2 means), cropped to the margin. Each pixel's centre is at 2x+0.5 in the full image
+	const int nCropOffset = MARGIN_INT/2;
+	IplImage greySSImage = *pyramid.level(2, true);
+	CIplPx<uchar>::cropImageToRect(greySSImage, cvRect(nCropOffset, nCropOffset, IM_PARAMS.IM_WIDTH/2-MARGIN_INT, IM_PARAMS.IM_HEIGHT/2-MARGIN_INT));
+	IplImage * pGreySSImage = &greySSImage;
+
 	int nPatchSize = CORNER_PARAMS.CORNER_BLOCK_RAD > 1 ? (CORNER_PARAMS.CORNER_BLOCK_RAD/2)*2+1 : 3;
 	
-    fastCvGoodFeaturesToTrack(pGreySSImage, eigImg, tempImg, aCvPointCorners, &nCorners, CORNER_PARAMS.CORNER_QUAL, CORNER_PARAMS.CORNER_MIN_DIST/2, 0, nPatchSize,  CORNER_PARAMS.USE_HARRIS, CORNER_PARAMS.CORNER_HARRIS_K, pointBin);
+    fastCvGoodFeaturesToTrack(pGreySSImage, eigImg, tempImg, aCvPointCorners, &nCorners, CORNER_PARAMS.CORNER_QUAL, CORNER_PARAMS.CORNER_MIN_DIST/2, 0, nPatchSize,  CORNER_PARAMS.USE_HARRIS, CORNER_PARAMS.CORNER_HARRIS_K, pointBin, pThreadpool.get());
 
     CvPoint2D64f * pCvPointFloat = aCvPointCorners;
     for (int n=nCorners; n>0; n--)
     {
-		pCvPointFloat->x = pCvPointFloat->x*2 + MARGIN + 0.5;
-		pCvPointFloat->y = pCvPointFloat->y*2 + MARGIN + 0.5;
+		pCvPointFloat->x = (pCvPointFloat->x + nCropOffset)*2 + 0.5;
+		pCvPointFloat->y = (pCvPointFloat->y + nCropOffset)*2 + 0.5;
 		pCvPointFloat++;
 	}
 	s.stopTimer();
@@ -69,7 +70,7 @@ void CSubSampledCornerDetector::getCorners(IplImage * pGreyImgUse, int & nCorner
 	s.startTimer();
 	fastCvFindCornerSubPix( pGreyImgUse, aCvPointCorners,
 							 nCorners, cvSize(SUBPIX_SIZE, SUBPIX_SIZE), cvSize(ZZ_SIZE, ZZ_SIZE),
-							 cvTermCriteria(CV_TERMCRIT_ITER | CV_TERMCRIT_EPS, 8, 0.15) );
+							 cvTermCriteria(CV_TERMCRIT_ITER | CV_TERMCRIT_EPS, 8, 0.15), pThreadpool.get() );
 	s.stopTimer();
     cout << "Subpix took " << s.getElapsedTime()/nCorners << " secs per corner (" << s.getElapsedTime() << " total)\n";
 
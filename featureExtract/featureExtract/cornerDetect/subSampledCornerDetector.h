@@ -12,6 +12,9 @@
 
 #include "goodFeaturesFast.h"
 #include "../cornerDetector.h"
+#include <boost/scoped_ptr.hpp>
+
+class CThreadpool_base;
 
 class CSubSampledCornerDetector: public CCornerDetector
 {
@@ -20,14 +23,16 @@ class CSubSampledCornerDetector: public CCornerDetector
     IplImage * eigImg;
     IplImage * tempImg;
     CvPoint2D64f * aCvPointCorners;
-    IplImage * pGreySSImage;
     CPointBin<32, 32, 16> pointBin;
     const CCornerParams::CCornerDetectorParams & CORNER_PARAMS;
+    boost::scoped_ptr<CThreadpool_base> pThreadpool; //If CORNER_THREADS > 1
+    CImagePyramid ownPyramid; //For frames passed in as images
 public:
 	CSubSampledCornerDetector(const CImParams & IM_PARAMS, int MARGIN, const CCornerParams &);
 	virtual ~CSubSampledCornerDetector();
 
 	virtual void getCorners(IplImage * pImage, int & nCorners, CLocation * aCorners);
+	virtual void getCorners(CImagePyramid & pyramid, int & nCorners, CLocation * aCorners);
 };
 
 #endif /* SSCORNERDETECTOR_H_ */
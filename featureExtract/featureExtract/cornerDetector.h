@@ -14,6 +14,7 @@
 #include "util/opencv.h"
 #include "util/location.h"
 #include "params/param.h"
+#include "imagePyramid.h"
 
 class CCornerDetector
 {
@@ -22,6 +23,7 @@ protected:
 public:
 	CCornerDetector(const CImParams & IM_PARAMS) : IM_PARAMS(IM_PARAMS) {}
 	virtual void getCorners(IplImage * pImage, int & nCorners, CLocation * aCorners) = 0;
+	virtual void getCorners(CImagePyramid & pyramid, int & nCorners, CLocation * aCorners) { getCorners(pyramid.grey(), nCorners, aCorners); } //Override to use other levels
 	virtual ~CCornerDetector() {};
 };
 
@@ -42,10 +44,14 @@ PARAMCLASS(Corner)
 		PARAM(CORNER_HARRIS_K, 0.003, 0.1, 0.01, "k param for Harris corners")
 		PARAMB(USE_SUBPIX, true, "Subpixel refinement. Improves localisation accuracy slightly but not to accuracy of FAST")
 		PARAMB(USE_HARRIS, false, "Harris corners rather than OpenCV. Hardly actually faster.")
+		PARAM(CORNER_THREADS, 1, 64, 1, "Threads for the Shi-Tomasi/Harris corner map, selection and subpixel refinement")
 		PARAM(FASTCORNER_T, 1,255,21, "Min strength of Harris corners (min grey level difference between centre and circle)")
 		PARAM(FASTCORNER_MIN_SEPERATION, 1,64,4, "5 works well, repeatability drops if worse corners let through")
 		PARAMB(FASTCORNER_TWO_PASS_BINNING, false, "Slightly more repeatable false, true improves geometry")
 		PARAM(FASTCORNER_LOCALISATION_SD, 1e-6, 5, 0.6 , "Expected localisation error in pixels. 0.6 derived from test imges")
+		PARAMB(FASTCORNER_TILED, false, "Detect FAST corners in bands of rows, in parallel, with a SIMD segment test (same corners), then share MAX_FEATURES between grid cells")
+		PARAM(FASTCORNER_THREADS, 1, 64, 1, "Threads for FASTCORNER_TILED")
+		PARAM(FASTCORNER_GRID, 1, 32, 8, "With FASTCORNER_TILED, corners are spread over this many cells across and down the image")
 		{}
 
 		MAKEENUMPARAM3(CORNER_MODE, FasterOpenCVGoodFeatures, SubSampledCorners, OpenCVGoodFeatures);
@@ -54,13 +60,16 @@ PARAMCLASS(Corner)
 		CNumParam<int> CORNER_BLOCK_RAD;
 		CNumParam<double> CORNER_HARRIS_K;
 		CNumParam<bool> USE_SUBPIX, USE_HARRIS;
+		CNumParam<int> CORNER_THREADS;
 		CNumParam<int> FASTCORNER_T, FASTCORNER_MIN_SEPERATION;
 		CNumParam<bool> FASTCORNER_TWO_PASS_BINNING;
 		CNumParam<double> FASTCORNER_LOCALISATION_SD;
+		CNumParam<bool> FASTCORNER_TILED;
+		CNumParam<int> FASTCORNER_THREADS, FASTCORNER_GRID;
 	};
 
 
-	MAKEENUMPARAM2(SALIENT_FEATURE_TYPE, SURFBlobs /*deprecated , ShiTomasiCorners*/, FastCorners);
+	MAKEENUMPARAM3(SALIENT_FEATURE_TYPE, SURFBlobs, ShiTomasiCorners, FastCorners);
 	CNumParam<int> MAX_FEATURES;
 	MAKECHILDCLASS(CornerDetector);
 
@@ -94,6 +103,7 @@ PARAMCLASS(Corner)
 		switch(SALIENT_FEATURE_TYPE)
 		{
 		case eFastCorners:
+		case eShiTomasiCorners:
 			return CornerDetector.FASTCORNER_LOCALISATION_SD;
 		case eSURFBlobs:
 			return SURF.BLOB_LOCALISATION_SD;
@@ -9,6 +9,8 @@
 
 #include "FASTCornerDetector.h"
 #include "fast.h"
+#include "fastTiled.h"
+#include "geom/threadpool.h"
 #include "description/descriptor.h"
 #include <boost/thread/mutex.hpp>
 #include "../cornerDetect/goodFeaturesFast.h"
@@ -116,6 +118,39 @@ xy* getFastCorners(const IplImage & im, const int FASTCORNER_T, const CCornerPar
 
 CFASTCornerDetector::CFASTCornerDetector(const CImParams& IM_PARAMS, int MARGIN, const CCornerParams::CCornerDetectorParams & CORNER_PARAMS) : CCornerDetector(IM_PARAMS), CORNER_PARAMS(CORNER_PARAMS), MARGIN(MARGIN)
 {
+	if(CORNER_PARAMS.FASTCORNER_TILED && CORNER_PARAMS.FASTCORNER_THREADS > 1)
+		pThreadpool.reset(CThreadpool_base::makeThreadpool(CORNER_PARAMS.FASTCORNER_THREADS));
+}
+
+void CFASTCornerDetector::getTiledCorners(const IplImage & greySubImage, int & nCorners, CLocation * aCorners)
+{
+	const int w = greySubImage.width, h = greySubImage.height, stride = greySubImage.widthStep;
+	const byte * data = (const byte *)greySubImage.imageData;
+
+	//Lower the threshold until there are enough corners (as fast9_detect_nonmax_binned)
+	xy * axy = 0;
+	int * anScores = 0;
+	int nFastCorners = 0;
+	for(int FASTCORNER_T = CORNER_PARAMS.FASTCORNER_T; ; FASTCORNER_T /= 2)
+	{
+		free(axy);
+		free(anScores);
+		axy = fast9_detect_nonmax_tiled(data, w, h, stride, FASTCORNER_T, &nFastCorners, &anScores, pThreadpool.get());
+		if(nFastCorners >= nCorners/2 || FASTCORNER_T <= 1)
+			break;
+	}
+
+	fast_select_bucketed(axy, anScores, nFastCorners, w, h, CORNER_PARAMS.FASTCORNER_GRID, CORNER_PARAMS.FASTCORNER_MIN_SEPERATION, &nCorners);
+
+	for(int i=0; i<nCorners; i++)
+	{
+		double x = axy[i].x+MARGIN;
+		double y = axy[i].y+MARGIN;
+		aCorners[i] = CLocation(x, y);
+	}
+
+	free(axy);
+	free(anScores);
 }
 
 void CFASTCornerDetector::getCorners(IplImage * pImage, int & nCorners, CLocation * aCorners)
@@ -133,7 +168,11 @@ void CFASTCornerDetector::getCorners(IplImage * pImage, int & nCorners, CLocatio
 
 	int nFastCorners = nCorners;
 
-	if(CORNER_PARAMS.FASTCORNER_MIN_SEPERATION <= 1)
+	if(CORNER_PARAMS.FASTCORNER_TILED)
+	{
+		getTiledCorners(greySubImage, nCorners, aCorners);
+	}
+	else if(CORNER_PARAMS.FASTCORNER_MIN_SEPERATION <= 1)
 	{
 		xy * axy = getFastCorners(greySubImage, CORNER_PARAMS.FASTCORNER_T, CORNER_PARAMS, &nFastCorners);
 		if (nFastCorners < nCorners / 2)
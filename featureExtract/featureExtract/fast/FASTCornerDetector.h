@@ -11,11 +11,17 @@
 #define FASTCORNERDETECTOR_H_
 
 #include "../cornerDetector.h"
+#include <boost/scoped_ptr.hpp>
+
+class CThreadpool_base;
 
 class CFASTCornerDetector: public CCornerDetector
 {
 	const CCornerParams::CCornerDetectorParams & CORNER_PARAMS;
 	const int MARGIN;
+	boost::scoped_ptr<CThreadpool_base> pThreadpool; //For FASTCORNER_TILED
+
+	void getTiledCorners(const IplImage & greySubImage, int & nCorners, CLocation * aCorners);
 public:
 	CFASTCornerDetector(const CImParams& IM_PARAMS, int MARGIN, const CCornerParams::CCornerDetectorParams & CORNER_PARAMS);
 	virtual ~CFASTCornerDetector();
@@ -0,0 +1,264 @@
+/* Code by Tom Botterill. Documentation and license at http://www.hilandtom.com/tombotterill/code */
+
+/*
+ * fastTiled.cpp
+ */
+
+#include "fastTiled.h"
+#include "../cornerDetect/goodFeaturesFast.h"
+#include "util/dynArray.h"
+#include "geom/threadpool.h"
+#include <boost/bind.hpp>
+#include <boost/scoped_array.hpp>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#if defined(__GNUC__) && defined(__SSE2__)
+#  define HAVE_SSE2_FAST 1
+#  include <emmintrin.h>
+#else
+#  define HAVE_SSE2_FAST 0
+#endif
+
+using namespace std;
+
+#define FAST_BAND_ROWS 32 //Rows per job. Fixed, so the corners don't depend on the number of threads
+
+//Bresenham circle of radius 3, in the same order as fast_9.c
+static void makeOffsets(int anPixel[16], const int nStride)
+{
+	static const int anX[16] = {0, 1, 2, 3, 3, 3, 2, 1, 0, -1, -2, -3, -3, -3, -2, -1};
+	static const int anY[16] = {3, 3, 2, 1, 0, -1, -2, -3, -3, -3, -2, -1, 0, 1, 2, 3};
+	for(int i=0; i<16; i++)
+		anPixel[i] = anX[i] + nStride*anY[i];
+}
+
+//At least 9 contiguous pixels on the circle all brighter than *p+b, or all darker than *p-b
+static inline bool segmentTest(const byte * p, const int b, const int * anPixel)
+{
+	const int cb = *p + b, c_b = *p - b;
+	int nBright = 0, nDark = 0;
+	for(int k=0; k<25; k++)
+	{
+		const int v = p[anPixel[k & 15]];
+		nBright = (v > cb) ? nBright+1 : 0;
+		nDark = (v < c_b) ? nDark+1 : 0;
+		if(nBright >= 9 || nDark >= 9)
+			return true;
+	}
+	return false;
+}
+
+//Corners on row y, for x in [3, xsize-3)
+static void segmentTestRow(const byte * im, const int xsize, const int y, const int stride, const int b, const int * anPixel, CDynArray<xy> & corners)
+{
+	const byte * pRow = im + y*stride;
+	const int xEnd = xsize - 3;
+	int x = 3;
+
+#if HAVE_SSE2_FAST
+	//Unsigned compares are done as signed compares after flipping the top bit. Thresholds saturate, which matches the
+	//int comparisons in fast_9.c because no pixel is brighter than 255 or darker than 0
+	const __m128i delta = _mm_set1_epi8((char)0x80), threshold = _mm_set1_epi8((char)min<int>(b, 255)), eight = _mm_set1_epi8(8);
+	for(; x + 16 <= xEnd; x += 16)
+	{
+		const byte * p = pRow + x;
+		const __m128i c = _mm_loadu_si128((const __m128i *)p);
+		const __m128i bright = _mm_xor_si128(_mm_adds_epu8(c, threshold), delta), dark = _mm_xor_si128(_mm_subs_epu8(c, threshold), delta);
+
+		//Any arc of 9 contains two adjacent compass points
+		__m128i aBright[4], aDark[4];
+		for(int i=0; i<4; i++)
+		{
+			const __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(p + anPixel[4*i])), delta);
+			aBright[i] = _mm_cmpgt_epi8(v, bright);
+			aDark[i] = _mm_cmplt_epi8(v, dark);
+		}
+		__m128i possible = _mm_setzero_si128();
+		for(int i=0; i<4; i++)
+		{
+			possible = _mm_or_si128(possible, _mm_and_si128(aBright[i], aBright[(i+1) & 3]));
+			possible = _mm_or_si128(possible, _mm_and_si128(aDark[i], aDark[(i+1) & 3]));
+		}
+		if(!_mm_movemask_epi8(possible))
+			continue;
+
+		//Longest run of brighter/darker pixels around the circle (wrapping round)
+		__m128i runBright = _mm_setzero_si128(), runDark = _mm_setzero_si128(), maxRun = _mm_setzero_si128();
+		for(int k=0; k<25; k++)
+		{
+			const __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(p + anPixel[k & 15])), delta);
+			const __m128i isBright = _mm_cmpgt_epi8(v, bright), isDark = _mm_cmplt_epi8(v, dark);
+			runBright = _mm_and_si128(_mm_sub_epi8(runBright, isBright), isBright); //+1 if brighter, else 0
+			runDark = _mm_and_si128(_mm_sub_epi8(runDark, isDark), isDark);
+			maxRun = _mm_max_epu8(maxRun, _mm_max_epu8(runBright, runDark));
+		}
+
+		int nMask = _mm_movemask_epi8(_mm_cmpgt_epi8(maxRun, eight));
+		while(nMask)
+		{
+			const xy corner = { x + __builtin_ctz(nMask), y };
+			corners.push_back(corner);
+			nMask &= nMask - 1;
+		}
+	}
+#endif
+
+	for(; x < xEnd; x++)
+		if(segmentTest(pRow + x, b, anPixel))
+		{
+			const xy corner = { x, y };
+			corners.push_back(corner);
+		}
+}
+
+//One band of rows, [y0, y1). Corners are detected one row either side too, so non-max suppression is the same as for the whole image
+class CFASTBand
+{
+	const byte * im;
+	int xsize, ysize, stride, b, y0, y1;
+public:
+	CDynArray<xy> corners;
+	CDynArray<int> scores;
+
+	void setup(const byte * im_in, int xsize_in, int ysize_in, int stride_in, int b_in, int y0_in, int y1_in)
+	{
+		im = im_in; xsize = xsize_in; ysize = ysize_in; stride = stride_in; b = b_in; y0 = y0_in; y1 = y1_in;
+	}
+
+	void detect()
+	{
+		int anPixel[16];
+		makeOffsets(anPixel, stride);
+
+		CDynArray<xy> candidates;
+		const int yStart = max<int>(3, y0-1), yEnd = min<int>(ysize-3, y1+1);
+		for(int y=yStart; y<yEnd; y++)
+			segmentTestRow(im, xsize, y, stride, b, anPixel, candidates);
+
+		const int nCandidates = candidates.size();
+		if(nCandidates == 0)
+			return;
+
+		int * anCandidateScores = fast9_score(im, stride, candidates.begin(), nCandidates, b);
+		int nNonmax = 0;
+		xy * aNonmax = nonmax_suppression(candidates.begin(), anCandidateScores, nCandidates, &nNonmax);
+
+		//Survivors are in the same order as the candidates, so we can find their scores
+		int nCandidate = 0;
+		for(int i=0; i<nNonmax; i++)
+		{
+			const xy & corner = aNonmax[i];
+			while(candidates[nCandidate].x != corner.x || candidates[nCandidate].y != corner.y)
+				nCandidate++;
+
+			if(corner.y >= y0 && corner.y < y1)
+			{
+				corners.push_back(corner);
+				scores.push_back(anCandidateScores[nCandidate]);
+			}
+		}
+		free(aNonmax);
+		free(anCandidateScores);
+	}
+};
+
+xy* fast9_detect_nonmax_tiled(const byte* im, int xsize, int ysize, int stride, int b, int* ret_num_corners, int** pScores, CThreadpool_base * pThreadpool)
+{
+	const int nRows = max<int>(ysize - 6, 0);
+	const int nBands = (nRows + FAST_BAND_ROWS - 1)/FAST_BAND_ROWS;
+	boost::scoped_array<CFASTBand> aBands(new CFASTBand[nBands]);
+
+	for(int nBand=0; nBand<nBands; nBand++)
+	{
+		const int y0 = 3 + nBand*FAST_BAND_ROWS;
+		aBands[nBand].setup(im, xsize, ysize, stride, b, y0, min<int>(y0 + FAST_BAND_ROWS, ysize-3));
+		if(pThreadpool && nBands > 1)
+		{
+			TNullaryFnObj fn = boost::bind(&CFASTBand::detect, &aBands[nBand]);
+			pThreadpool->addJob(fn);
+		}
+		else
+			aBands[nBand].detect();
+	}
+	if(pThreadpool && nBands > 1)
+		pThreadpool->waitForAll();
+
+	//Bands are in order, so corners stay in raster order
+	int nCorners = 0;
+	for(int nBand=0; nBand<nBands; nBand++)
+		nCorners += aBands[nBand].corners.size();
+
+	xy * corners = (xy *)malloc(max<int>(nCorners, 1)*sizeof(xy));
+	int * scores = (int *)malloc(max<int>(nCorners, 1)*sizeof(int));
+	int nCorner = 0;
+	for(int nBand=0; nBand<nBands; nBand++)
+	{
+		const int nBandCorners = aBands[nBand].corners.size();
+		if(nBandCorners)
+		{
+			memcpy(corners + nCorner, aBands[nBand].corners.begin(), nBandCorners*sizeof(xy));
+			memcpy(scores + nCorner, aBands[nBand].scores.begin(), nBandCorners*sizeof(int));
+			nCorner += nBandCorners;
+		}
+	}
+
+	*ret_num_corners = nCorners;
+	*pScores = scores;
+	return corners;
+}
+
+class CBetterFASTCorner
+{
+	const int * scores;
+public:
+	CBetterFASTCorner(const int * scores) : scores(scores) {}
+	bool operator()(const int i, const int j) const { return scores[i] > scores[j] || (scores[i] == scores[j] && i < j); }
+};
+
+void fast_select_bucketed(xy* corners, const int* scores, int num_corners, int xsize, int ysize, int nGrid, int nMinSeperation, int* pnTargetFeaturesInOut)
+{
+	const int nTarget = *pnTargetFeaturesInOut;
+
+	CDynArray<int> anIndices(num_corners);
+	for(int i=0; i<num_corners; i++)
+		anIndices[i] = i;
+	std::sort(anIndices.begin(), anIndices.end(), CBetterFASTCorner(scores));
+
+	CPointBin<32, 32, 100> pointBin(xsize, ysize);
+	pointBin.reset();
+
+	CDynArray<xy> aChosen;
+	aChosen.reserve(nTarget);
+
+	//FIRST PASS: the best corners in each cell, up to an equal share
+	const int nCells = nGrid*nGrid, nCellQuota = (nTarget + nCells - 1)/nCells;
+	CDynArray<int> anCellCounts(nCells, 0);
+	for(int i=0; i<num_corners && aChosen.size() < nTarget; i++)
+	{
+		const xy & corner = corners[anIndices[i]];
+		int & nCellCount = anCellCounts[(corner.x*nGrid)/xsize + nGrid*((corner.y*nGrid)/ysize)];
+		if(nCellCount < nCellQuota && !pointBin.isTooClose(corner.x, corner.y, nMinSeperation))
+		{
+			aChosen.push_back(corner);
+			nCellCount++;
+			anIndices[i] = -1;
+		}
+	}
+
+	//SECOND PASS: the best of the rest
+	for(int i=0; i<num_corners && aChosen.size() < nTarget; i++)
+	{
+		if(anIndices[i] >= 0)
+		{
+			const xy & corner = corners[anIndices[i]];
+			if(!pointBin.isTooClose(corner.x, corner.y, nMinSeperation))
+				aChosen.push_back(corner);
+		}
+	}
+
+	*pnTargetFeaturesInOut = aChosen.size();
+	if(aChosen.size())
+		memcpy(corners, aChosen.begin(), aChosen.size()*sizeof(xy));
+}
@@ -0,0 +1,25 @@
+/* Code by Tom Botterill. Documentation and license at http://www.hilandtom.com/tombotterill/code */
+
+/*
+ * fastTiled.h
+ *
+ * FAST-9 with non-max suppression, like fast9_detect_nonmax, but the image is split into bands of rows which are
+ * processed in parallel, and the segment test is done on 16 pixels at once (SSE2). Gives the same corners as
+ * fast9_detect_nonmax.
+ */
+
+#ifndef FASTTILED_H_
+#define FASTTILED_H_
+
+#include "fast.h"
+
+class CThreadpool_base;
+
+//Corners in raster order; *pScores are their fast9 scores. Both malloc'd. pThreadpool may be 0
+xy* fast9_detect_nonmax_tiled(const byte* im, int xsize, int ysize, int stride, int b, int* ret_num_corners, int** pScores, CThreadpool_base * pThreadpool);
+
+//Choose up to *pnTargetFeaturesInOut corners, spread over a nGrid x nGrid grid: each cell first gets an equal share of its best corners,
+//then the best of the rest make up the number. Corners within nMinSeperation are never both chosen. Chosen corners are moved to the front
+void fast_select_bucketed(xy* corners, const int* scores, int num_corners, int xsize, int ysize, int nGrid, int nMinSeperation, int* pnTargetFeaturesInOut);
+
+#endif /* FASTTILED_H_ */
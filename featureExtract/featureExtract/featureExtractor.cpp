@@ -12,6 +12,7 @@
 #include "description/vectorDescriptor.h"
 #include "image/convert_OpenCV.h"
 #include "time/SpeedTest.h"
+#include "geom/threadpool.h"
 
 using namespace std;
 
@@ -23,23 +24,24 @@ CDescriptorSet * CFeatureExtractor::newDescriptorSet(int nDescriptorEstimate)
 }
 
 CDescriptorSet * CFeatureExtractor::getDescriptors(const IplImage * pImage)
+{
+	pyramid.setImage(pImage);
+	CDescriptorSet * pDS = getDescriptors(pyramid);
+	pyramid.setImage(0);
+	return pDS;
+}
+
+CDescriptorSet * CFeatureExtractor::getDescriptors(CImagePyramid & framePyramid)
 {
 	CStopWatch s; s.startTimer();
 
-	const int nChannels = pImage->nChannels;
+	pPyramid = &framePyramid;
+	pGreyImg = framePyramid.grey();
 
-	if(nChannels == 1)
-	{
-		pGreyImg = const_cast<IplImage *>(pImage);
-	}
-	else
-	{
-		CHECK(!pGreyImg, "Haven't created a grey image for corner detection");
-		//cvCvtColor(pImage, pGreyImg, CV_RGB2GRAY);
-		greyScaler.greyScale(pImage, pGreyImg);
-	}
+	CDescriptorSet * pDS = getDescriptors_int(framePyramid.image());
 
-	CDescriptorSet * pDS = getDescriptors_int(pImage);
+	pPyramid = 0;
+	pGreyImg = 0;
 
 	s.stopTimer();
 	REPEAT(20, cout << "Extract corners and describe features took " << s.getElapsedTime() << " seconds\n");
@@ -48,16 +50,14 @@ CDescriptorSet * CFeatureExtractor::getDescriptors(const IplImage * pImage)
 }
 
 CFeatureExtractor::CFeatureExtractor(const int MAX_FEATURES, const CImParams & IM_PARAMS_IN, const CDescriptorSetClusteringParams & DSC_PARAMS) :
-	greyScaler(IM_PARAMS_IN.IM_CHANNELS>1, IM_PARAMS_IN.Greyscale.R, IM_PARAMS_IN.Greyscale.G, IM_PARAMS_IN.Greyscale.B, IM_PARAMS_IN.Greyscale.GAMMA), DSC_PARAMS(DSC_PARAMS), MAX_FEATURES(MAX_FEATURES), IM_PARAMS(IM_PARAMS_IN), pGreyImg(0)
+	greyScaler(IM_PARAMS_IN.IM_CHANNELS>1, IM_PARAMS_IN.Greyscale.R, IM_PARAMS_IN.Greyscale.G, IM_PARAMS_IN.Greyscale.B, IM_PARAMS_IN.Greyscale.GAMMA), DSC_PARAMS(DSC_PARAMS),
+	pPyramidThreadpool(IM_PARAMS_IN.PYRAMID_THREADS > 1 ? CThreadpool_base::makeThreadpool(IM_PARAMS_IN.PYRAMID_THREADS) : 0),
+	pyramid(IM_PARAMS_IN.IM_CHANNELS>1 ? &greyScaler : 0, pPyramidThreadpool.get()), MAX_FEATURES(MAX_FEATURES), IM_PARAMS(IM_PARAMS_IN), pGreyImg(0), pPyramid(0)
 {
-	if(IM_PARAMS.IM_CHANNELS == 3)
-		pGreyImg = cvCreateImage(cvSize(IM_PARAMS.IM_WIDTH, IM_PARAMS.IM_HEIGHT), IPL_DEPTH_8U, 1);
 }
 
 CFeatureExtractor::~CFeatureExtractor()
 {
-	if(IM_PARAMS.IM_CHANNELS == 3)
-		cvReleaseImage(&pGreyImg);
 }
 
 void markDescriptors(IplImage * pImage, const CDescriptorSet * pDesc)
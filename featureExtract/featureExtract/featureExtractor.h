@@ -15,25 +15,32 @@
 #include "image/imageAccess.h"
 #include "image/convert_OpenCV.h"
 #include "description/patchParams.h"
+#include "imagePyramid.h"
+#include <boost/scoped_ptr.hpp>
 
 class CPatchDescriptorParams;
 class CDescriptorSetClusteringParams;
+class CThreadpool_base;
 
 class CFeatureExtractor
 {
 	const CGreyscaler greyScaler;
 	const CDescriptorSetClusteringParams & DSC_PARAMS;
+	boost::scoped_ptr<CThreadpool_base> pPyramidThreadpool;
+	CImagePyramid pyramid; //For frames passed in as images
 protected:
 	virtual CDescriptorSet * newDescriptorSet(int nDescriptorEstimate);
 	const int MAX_FEATURES;
 	const CImParams & IM_PARAMS;
 	IplImage * pGreyImg;
+	CImagePyramid * pPyramid; //This frame's, for detectors and descriptors to share
 	virtual CDescriptorSet * getDescriptors_int(const IplImage * pImage) = 0;
 
 public:
 	CFeatureExtractor(const int MAX_FEATURES, const CImParams & IM_PARAMS, const CDescriptorSetClusteringParams & DSC_PARAMS);
 	virtual ~CFeatureExtractor();
 	CDescriptorSet * getDescriptors(const IplImage * pImage);
+	CDescriptorSet * getDescriptors(CImagePyramid & framePyramid); //If the caller needs the pyramid too
 
 	static CFeatureExtractor * makeFeatureExtractor(const CImParams & IMPARAMS, const CCornerParams & CORNERPARAMS,
 			const CPatchDescriptorParams & PATCHDESCRIPTORPARAMS, const CDescriptorSetClusteringParams & DSCPARAMS);
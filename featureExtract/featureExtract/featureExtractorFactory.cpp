@@ -25,24 +25,20 @@ CFeatureExtractor * CFeatureExtractor::makeFeatureExtractor(const CImParams & IM
 
 	switch(CORNERPARAMS.SALIENT_FEATURE_TYPE)
 	{
-	/*case CCornerParams::eShiTomasiCorners:
+	case CCornerParams::eShiTomasiCorners:
 		switch(CORNERPARAMS.CornerDetector.CORNER_MODE)
 		{
 		case CCornerParams::CCornerDetectorParams::eFasterOpenCVGoodFeatures:
-			//pCornerDetector = new COpenCVCornerDetector(IMPARAMS, PATCHDESCRIPTORPARAMS.margin(), CORNERPARAMS);
-			//TODO: Faster corners...
-			//break;
-		case CCornerParams::CCornerDetectorParams::eSubSampledCorners:
-			//pCornerDetector = new CSubSampledCornerDetector(IMPARAMS, PATCHDESCRIPTORPARAMS.margin(), CORNERPARAMS);
-			//break;
-			cout << "TODO: Restore faster corner detection code...\n";
 		case CCornerParams::CCornerDetectorParams::eOpenCVGoodFeatures:
-			//pCornerDetector = (new COpenCVGoodFeaturesCornerDetector(IMPARAMS, PATCHDESCRIPTORPARAMS.margin(), CORNERPARAMS));
-			//break;
+			pCornerDetector = new COpenCVCornerDetector(IMPARAMS, PATCHDESCRIPTORPARAMS.margin(), CORNERPARAMS);
+			break;
+		case CCornerParams::CCornerDetectorParams::eSubSampledCorners:
+			pCornerDetector = new CSubSampledCornerDetector(IMPARAMS, PATCHDESCRIPTORPARAMS.margin(), CORNERPARAMS);
+			break;
 		default:
 			THROW("Unhandled corner detection mode");
 		}
-		break;*/
+		break;
 	case CCornerParams::eFastCorners:
 		pCornerDetector = (new CFASTCornerDetector(IMPARAMS, PATCHDESCRIPTORPARAMS.margin(), CORNERPARAMS.CornerDetector));
 		break;
@@ -0,0 +1,158 @@
+/* Code by Tom Botterill. Documentation and license at http://www.hilandtom.com/tombotterill/code */
+
+/*
+ * imagePyramid.cpp
+ */
+
+#include "imagePyramid.h"
+#include "geom/threadpool.h"
+#include <boost/bind.hpp>
+
+#if defined(__GNUC__) && defined(__SSE2__)
+#  define HAVE_SSE2_PYRAMID 1
+#  include <emmintrin.h>
+#else
+#  define HAVE_SSE2_PYRAMID 0
+#endif
+
+#define PYRAMID_STRIP_ROWS 32 //Output rows per job
+
+//Rows [y0, y1) of a sub-image (header only)
+static IplImage rowStrip(const IplImage * pIm, const int y0, const int y1)
+{
+	IplImage strip = *pIm;
+	strip.imageData += y0*pIm->widthStep;
+	strip.height = y1 - y0;
+	return strip;
+}
+
+static void greyScaleRows(const CGreyscaler * pGreyscaler, const IplImage * pSrc, IplImage * pDest, const int y0, const int y1)
+{
+	const IplImage srcStrip = rowStrip(pSrc, y0, y1);
+	IplImage destStrip = rowStrip(pDest, y0, y1);
+	pGreyscaler->greyScale(&srcStrip, &destStrip);
+}
+
+//Output rows [y0, y1): each pixel the mean (rounded down) of the nScale x nScale pixels it covers
+static void downSampleRows(const int nScale, const IplImage * pSrc, IplImage * pDest, const int y0, const int y1)
+{
+	const int nChannels = pSrc->nChannels, nDestWidth = pDest->width*nChannels, nArea = nScale*nScale;
+	for(int y=y0; y<y1; y++)
+	{
+		const uchar * pSrcRow = (const uchar *)pSrc->imageData + y*nScale*pSrc->widthStep;
+		uchar * pDestRow = (uchar *)pDest->imageData + y*pDest->widthStep;
+		int x = 0;
+
+#if HAVE_SSE2_PYRAMID
+		if(nScale == 2 && nChannels == 1)
+		{
+			const __m128i zero = _mm_setzero_si128(), ones = _mm_set1_epi16(1);
+			const uchar * pSrcRow2 = pSrcRow + pSrc->widthStep;
+			for(; x+8 <= nDestWidth; x += 8)
+			{
+				const __m128i r0 = _mm_loadu_si128((const __m128i *)(pSrcRow + 2*x)), r1 = _mm_loadu_si128((const __m128i *)(pSrcRow2 + 2*x));
+				const __m128i sumLo = _mm_add_epi16(_mm_unpacklo_epi8(r0, zero), _mm_unpacklo_epi8(r1, zero));
+				const __m128i sumHi = _mm_add_epi16(_mm_unpackhi_epi8(r0, zero), _mm_unpackhi_epi8(r1, zero));
+				const __m128i totalLo = _mm_srli_epi32(_mm_madd_epi16(sumLo, ones), 2), totalHi = _mm_srli_epi32(_mm_madd_epi16(sumHi, ones), 2);
+				const __m128i words = _mm_packs_epi32(totalLo, totalHi);
+				_mm_storel_epi64((__m128i *)(pDestRow + x), _mm_packus_epi16(words, words));
+			}
+		}
+#endif
+
+		for(; x<nDestWidth; x++)
+		{
+			const int nChannel = x % nChannels, nSrcCol = (x / nChannels)*nScale;
+			int nTotal = 0;
+			for(int i=0; i<nScale; i++)
+			{
+				const uchar * pSrcPx = pSrcRow + i*pSrc->widthStep + nSrcCol*nChannels + nChannel;
+				for(int j=0; j<nScale; j++, pSrcPx += nChannels)
+					nTotal += *pSrcPx;
+			}
+			pDestRow[x] = (uchar)(nTotal/nArea);
+		}
+	}
+}
+
+CImagePyramid::CImagePyramid(const CGreyscaler * pGreyscaler, CThreadpool_base * pThreadpool) : pGreyscaler(pGreyscaler), pThreadpool(pThreadpool), pImage(0)
+{
+}
+
+CImagePyramid::~CImagePyramid()
+{
+	setImage(0);
+	for(int i=0; i<apFree.size(); i++)
+		cvReleaseImage(&(apFree[i]));
+}
+
+void CImagePyramid::setImage(const IplImage * pImage_in)
+{
+	for(int i=0; i<aLevels.size(); i++)
+		apFree.push_back(aLevels[i].pIm);
+	aLevels.resize(0);
+	pImage = pImage_in;
+}
+
+IplImage * CImagePyramid::getImage(const CvSize size, const int nChannels)
+{
+	for(int i=0; i<apFree.size(); i++)
+	{
+		IplImage * pIm = apFree[i];
+		if(pIm->width == size.width && pIm->height == size.height && pIm->nChannels == nChannels)
+		{
+			apFree[i] = apFree.back();
+			apFree.resize(apFree.size()-1);
+			return pIm;
+		}
+	}
+	return cvCreateImage(size, IPL_DEPTH_8U, nChannels);
+}
+
+IplImage * CImagePyramid::grey()
+{
+	return level(1, true);
+}
+
+IplImage * CImagePyramid::level(const int nScale, const bool bGrey)
+{
+	CHECK(!pImage, "CImagePyramid: No frame set");
+	CHECK(nScale < 1, "CImagePyramid: Bad scale");
+	CHECK(pImage->depth != IPL_DEPTH_8U, "CImagePyramid: 8-bit images only");
+
+	const bool bSourceGrey = (pImage->nChannels == 1);
+	if(nScale == 1 && (bSourceGrey || !bGrey))
+		return const_cast<IplImage *>(pImage);
+
+	for(int i=0; i<aLevels.size(); i++)
+		if(aLevels[i].nScale == nScale && aLevels[i].bGrey == (bGrey || bSourceGrey))
+			return aLevels[i].pIm;
+
+	//Downsample the grey frame for grey levels
+	const IplImage * pSrc = pImage;
+	if(bGrey && !bSourceGrey && nScale > 1)
+		pSrc = grey();
+
+	const int nChannels = bGrey ? 1 : pImage->nChannels;
+	IplImage * pIm = getImage(cvSize(pImage->width/nScale, pImage->height/nScale), nChannels);
+
+	if(nScale == 1)
+		CHECK(!pGreyscaler, "CImagePyramid: Need a greyscaler for colour frames");
+
+	const int nRows = pIm->height, nStrips = (nRows + PYRAMID_STRIP_ROWS - 1)/PYRAMID_STRIP_ROWS;
+	for(int nStrip=0; nStrip<nStrips; nStrip++)
+	{
+		const int y0 = nStrip*PYRAMID_STRIP_ROWS, y1 = std::min<int>(y0 + PYRAMID_STRIP_ROWS, nRows);
+		TNullaryFnObj fn = (nScale == 1) ? (TNullaryFnObj)boost::bind(greyScaleRows, pGreyscaler, pSrc, pIm, y0, y1) : (TNullaryFnObj)boost::bind(downSampleRows, nScale, pSrc, pIm, y0, y1);
+		if(pThreadpool && nStrips > 1)
+			pThreadpool->addJob(fn);
+		else
+			fn();
+	}
+	if(pThreadpool && nStrips > 1)
+		pThreadpool->waitForAll();
+
+	const CLevel newLevel = { nScale, bGrey || bSourceGrey, pIm };
+	aLevels.push_back(newLevel);
+	return pIm;
+}
@@ -0,0 +1,55 @@
+/* Code by Tom Botterill. Documentation and license at http://www.hilandtom.com/tombotterill/code */
+
+/*
+ * imagePyramid.h
+ *
+ * One frame's greyscale image and downsampled levels, shared by the corner detector and descriptor extractors so
+ * each is only made once. Levels are built when first asked for (in strips of rows on the threadpool, if there is
+ * one). Level images are kept in a pool and reused for the next frame, so nothing is allocated once the level
+ * sizes are known.
+ */
+
+#ifndef IMAGEPYRAMID_H_
+#define IMAGEPYRAMID_H_
+
+#include "image/convert_OpenCV.h"
+#include "util/dynArray.h"
+#include <boost/noncopyable.hpp>
+
+class CThreadpool_base;
+
+class CImagePyramid : boost::noncopyable
+{
+	const CGreyscaler * pGreyscaler;
+	CThreadpool_base * pThreadpool;
+	const IplImage * pImage;
+
+	struct CLevel
+	{
+		int nScale;
+		bool bGrey;
+		IplImage * pIm;
+	};
+	CDynArray<CLevel> aLevels; //Built for this frame
+	CDynArray<IplImage *> apFree; //Pool of images from previous frames
+
+	IplImage * getImage(const CvSize size, const int nChannels);
+
+public:
+	//pGreyscaler is needed for colour frames; both it and pThreadpool may be 0, and aren't owned
+	CImagePyramid(const CGreyscaler * pGreyscaler, CThreadpool_base * pThreadpool);
+	~CImagePyramid();
+
+	//Start a new frame. pImage must stay valid (and unchanged) until the next frame
+	void setImage(const IplImage * pImage);
+
+	const IplImage * image() const { return pImage; }
+
+	//Greyscale frame (the frame itself if it's already grey)
+	IplImage * grey();
+
+	//Frame downsampled by nScale (box filter, nScale*nScale pixels averaged), greyscale or with the frame's channels
+	IplImage * level(const int nScale, const bool bGrey);
+};
+
+#endif /* IMAGEPYRAMID_H_ */
@@ -201,6 +201,7 @@ PARAM(IM_CHANNELS, 1, 3, 3, "Set automatically by image loader. Num channels in
 PARAME(IM_SOURCE, ImageDir, "Frame source")
 PARAMB(CALIBRATION_INIT, false, "Flag whether calibration matrix is initialised (set automatically, not always needed)")
 PARAM(SCALE_DOWN, 1, 10, 1, "Scale down images in image loader by this factor")
+PARAM(PYRAMID_THREADS, 1, 64, 1, "Threads for greyscaling and downsampling each frame for feature extraction")
 PARAME(ILLUMINATION_CORRECTION, NoIlluminationCorrection, "Correction--can also set SAVE_FRAMES to save correced frames for next run")
 PARAMB(GREYSCALE_ON_LOAD, false, "Greyscale images in image loader (not good if colour frames for video needed). Turned on if ILLUMINATION_CORRECTION is set.")
 PARAME(SAVE_FRAMES, DontSave, "Dumps all frames used to 'frames' folder, *includes illumination corrections, resizeing, etc.")
@@ -224,7 +225,7 @@ private:
 CNumParamDerived<bool> CALIBRATION_INIT;
 CCamCalibMatrix K;
 public:
-CNumParam<int> SCALE_DOWN;
+CNumParam<int> SCALE_DOWN, PYRAMID_THREADS;
 MAKEENUMPARAM3(ILLUMINATION_CORRECTION, NoIlluminationCorrection, /*EqualiseHist,*/ EqualiseMean, EqualiseMeanSD)
 CNumParam<bool> GREYSCALE_ON_LOAD;
 MAKEENUMPARAM4(SAVE_FRAMES, DontSave, SaveBMP, SavePNG, SaveJPG)
@@ -235,6 +235,17 @@ void CSimpleTerminator::reset()
 	resetCount();
 }
 
+//Only touches this thread's counts, so other threads can carry on testing their models
+void CSimpleTerminator::reset(int nThread)
+{
+	if(IS_DEBUG) CHECK(nThread < 0 || nThread >= MAX_THREADS, "CSimpleTerminator::reset: Too many threads");
+	int nBest = nBestInlierCount;
+	while(anInliers[nThread] > nBest && !nBestInlierCount.compare_exchange_weak(nBest, anInliers[nThread]))
+		;
+
+	anCount[nThread] = anInliers[nThread] = 0;
+}
+
 void CSimpleTerminator::resetCount()
 {
 	for(int i=0; i< MAX_THREADS; i++)
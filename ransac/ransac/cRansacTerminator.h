@@ -14,6 +14,7 @@
 
 #include "util/exception.h"
 #include "math.h"
+#include <boost/atomic.hpp>
 
 class CRansacTerminator {
 public:
@@ -22,6 +23,7 @@ public:
 	virtual bool observeStatus(bool bStatus) { return false; }
 	virtual bool observeStatus(int nThread, bool bStatus) { return false; }
 	virtual void reset() { }
+	virtual void reset(int nThread) { reset(); } //Start testing a new model on thread nThread
 	virtual int bestGoodCount() { return -1; } //For debug output
 	virtual bool isThreadsafe() const { return true; }
 };
@@ -110,7 +112,7 @@ class CSimpleTerminator : public CRansacTerminator
 {
 	const int nTotalCount;
 	const int nBelowParCutoff;
-	int nBestInlierCount;
+	boost::atomic<int> nBestInlierCount; //Shared by all threads
 
 	static const int MAX_THREADS = 16; //Can be increased
 	int anInliers[MAX_THREADS], anCount[MAX_THREADS];
@@ -122,6 +124,7 @@ public:
 	//virtual bool observeStatus(bool bStatus);
 	virtual bool observeStatus(int nThread, bool bStatus);
 	virtual void reset();
+	virtual void reset(int nThread);
 	void resetCount();
 	virtual int bestGoodCount() { return nBestInlierCount; } //For debug output
 	virtual bool isThreadsafe() const { return true; }
@@ -18,6 +18,10 @@
 
  CModels * pModels = levMarBasisHypothesisGenerator.getModels(anHypSet);
  // A set of the models (essential matrices) is returned (see models.h)
+
+ // Or, to avoid allocating a model set for every hypothesis set, make one and refill it:
+ scoped_ptr<CModels> pModels(levMarBasisHypothesisGenerator.makeModels());
+ levMarBasisHypothesisGenerator.getModels(anHypSet, *pModels);
  
 
  *
@@ -52,6 +56,15 @@ public:
 	//Return a set of models compatible with the hypothesis set anHypSet (a set of indices for data points).
 	virtual const CModels * getModels(const TSubSet & anHypSet) = 0;
 
+	//Same, but replaces the models in a set from makeModels(), so nothing is allocated per hypothesis set
+	virtual void getModels(const TSubSet & anHypSet, CModels & models) = 0;
+
+	//A model set big enough for the models from one hypothesis set. Caller deletes
+	virtual CModels * makeModels() const = 0;
+
+	//nSets model sets like makeModels(), allocated together. Caller deletes
+	virtual CModelsArray * makeModelsArray(const int nSets) const = 0;
+
 	int numPoints() const { return nPoints; }
 
     virtual int modelsPerIteration() const = 0; //These are used to compute the threshholds used in WaldSAC
@@ -74,6 +87,9 @@ public:
 
 	//Return models
 	virtual const CModels * getModels(const TSubSet & anHypSet);
+	virtual void getModels(const TSubSet & anHypSet, CModels & models);
+	virtual CModels * makeModels() const;
+	virtual CModelsArray * makeModelsArray(const int nSets) const;
 };
 
 #endif /* HYPOTHESISER_H_ */
@@ -7,8 +7,88 @@
 
 #include <Eigen/Core>
 
+//The AVX versions are compiled for AVX only here, and used if the CPU has it (like fastnorms), so no special build flags are needed
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define HAVE_AVX_INLIERS 1
+#  define TARGET_AVX __attribute__((target("avx")))
+#  include <immintrin.h>
+#else
+#  define HAVE_AVX_INLIERS 0
+#endif
+#if defined(__GNUC__) && defined(__SSE2__)
+#  define HAVE_SSE2_INLIERS 1
+#  include <emmintrin.h>
+#else
+#  define HAVE_SSE2_INLIERS 0
+#endif
+
 using namespace std;
 
+CCorrespondenceArrays::CCorrespondenceArrays(const T2dPoints & ap, const T2dPoints & ap_prime) : nPoints((int) ap.size()) {
+    CHECK(ap_prime.size() != ap.size(), "Correspondence arrays must be the same size");
+    nPadded = BLOCK * ((nPoints + BLOCK - 1) / BLOCK);
+
+    //4 arrays, plus 3 doubles of slack to align the first (CDynArray zeros them, so the padding is zero)
+    aBuffer.resize(4 * nPadded + 3);
+    double * pAligned = aBuffer.begin();
+    while (((size_t) pAligned) % (BLOCK * sizeof (double)))
+        pAligned++;
+
+    ax0 = pAligned;
+    ay0 = ax0 + nPadded;
+    ax1 = ay0 + nPadded;
+    ay1 = ax1 + nPadded;
+
+    for (int i = 0; i < nPoints; i++) {
+        ax0[i] = ap[i].getX();
+        ay0[i] = ap[i].getY();
+        ax1[i] = ap_prime[i].getX();
+        ay1[i] = ap_prime[i].getY();
+    }
+}
+
+//Record a block of statuses (bit j for point nFirst+j) in order, stopping when the terminator says so. Returns true if it did
+static inline bool observeBlock(const int nInlierBits, const int nFirst, const int nBlockPoints, const double * adErr, CRansacTerminator * pTerminator, const int nThread, CMask & mask, double * adResiduals, int & nInlierCount) {
+    for (int j = 0; j < nBlockPoints; j++) {
+        const bool bStatus = (nInlierBits >> j) & 1;
+        mask[nFirst + j] = bStatus;
+        nInlierCount += bStatus;
+        if (adResiduals)
+            adResiduals[nFirst + j] = adErr[j];
+
+        if (pTerminator->observeStatus(nThread, bStatus))
+            return true;
+    }
+    return false;
+}
+
+//Returns a bit per inlier in points [i, i+BLOCK), and the errors if adErr isn't 0
+typedef int (*TBlockInliersFn)(const double * M, const CCorrespondenceArrays & points, const int i, const double dThreshold_sq_use, double * adErr);
+
+//Count inliers a block at a time until the terminator says stop. Instantiated (and the block function inlined) once per instruction set
+template<TBlockInliersFn BLOCK_INLIERS>
+static inline void countBlockInliers(const double * M, const CCorrespondenceArrays & points, const double dThreshold_sq_use, CRansacTerminator * pTerminator, const int nThread, CMask & mask, double * adResiduals, int & nInlierCount) HARD_INLINE;
+template<TBlockInliersFn BLOCK_INLIERS>
+static inline void countBlockInliers(const double * M, const CCorrespondenceArrays & points, const double dThreshold_sq_use, CRansacTerminator * pTerminator, const int nThread, CMask & mask, double * adResiduals, int & nInlierCount) {
+    const int nPoints = points.size();
+    const int BLOCK = CCorrespondenceArrays::BLOCK;
+    double adErr[BLOCK];
+    for (int nPoint = 0; nPoint < nPoints; nPoint += BLOCK) {
+        const int nInlierBits = BLOCK_INLIERS(M, points, nPoint, dThreshold_sq_use, adResiduals ? adErr : 0);
+
+        if (observeBlock(nInlierBits, nPoint, std::min<int>(BLOCK, nPoints - nPoint), adErr, pTerminator, nThread, mask, adResiduals, nInlierCount))
+            return;
+    }
+}
+
+#if HAVE_AVX_INLIERS
+static bool cpuHasAVX() {
+    __builtin_cpu_init(); //CPUID (and checks the OS saves AVX registers)
+    return __builtin_cpu_supports("avx");
+}
+static const bool s_bAVXInliers = cpuHasAVX();
+#endif
+
 inline bool CEssentialMatInlierCounter::isInlier_old(const C3x3MatModel & f, const CSimple2dPoint & p1, const CSimple2dPoint & p2, double * pdResidual, const double dThreshold_sq_use) const {
     double d0, d1, s0, s1;
     volatile const double m0x = p1.getX();
@@ -237,97 +317,123 @@ void CEssentialMatInlierCounter::timeInlierCounter() const {
     cout << test << " time=" << s.getElapsedTime() << " nanoseconds" << endl;
 }
 
+//Sampson's error (as isInlier_SE) for one point; the error is only computed if pdErr isn't 0
+static inline bool essentialMatInlier(const double * f, const double m0x, const double m0y, const double m1x, const double m1y, const double dThreshold_sq_use, double * pdErr) HOT HARD_INLINE;
+static inline bool essentialMatInlier(const double * f, const double m0x, const double m0y, const double m1x, const double m1y, const double dThreshold_sq_use, double * pdErr) {
+    double a = f[0] * m0x + f[1] * m0y + f[2]; //(a,b,c) = E*p1
+    double b = f[3] * m0x + f[4] * m0y + f[5];
+    const double c = f[6] * m0x + f[7] * m0y + f[8];
+    const double s1 = a * a + b * b;
+    const double d1 = m1x * a + m1y * b + c; //p2 * (a,b,c)
+    const double d1_squared = d1 * d1;
+
+    a = f[0] * m1x + f[3] * m1y + f[6]; //(a,b,c) = p2*E^T
+    b = f[1] * m1x + f[4] * m1y + f[7];
+    const double s = a * a + b * b + s1;
+
+    if (pdErr) {
+        *pdErr = d1_squared / s;
+        return *pdErr < dThreshold_sq_use;
+    }
+    return d1_squared < dThreshold_sq_use * s;
+}
+
+//Sampson's error (as isInlier_SE) for points [i, i+BLOCK). Returns a bit per inlier, and the errors if adErr isn't 0
+static inline int essentialMatInliers(const double * f, const CCorrespondenceArrays & points, const int i, const double dThreshold_sq_use, double * adErr) HOT HARD_INLINE;
+static inline int essentialMatInliers(const double * f, const CCorrespondenceArrays & points, const int i, const double dThreshold_sq_use, double * adErr) {
+    const double * x0 = points.x0() + i, * y0 = points.y0() + i, * x1 = points.x1() + i, * y1 = points.y1() + i;
+    int nInlierBits = 0;
+    int j = 0;
+
+#if HAVE_SSE2_INLIERS
+    for (; j < CCorrespondenceArrays::BLOCK; j += 2) {
+        const __m128d m0x = _mm_load_pd(x0 + j), m0y = _mm_load_pd(y0 + j), m1x = _mm_load_pd(x1 + j), m1y = _mm_load_pd(y1 + j);
+        __m128d a = _mm_add_pd(_mm_add_pd(_mm_mul_pd(_mm_set1_pd(f[0]), m0x), _mm_mul_pd(_mm_set1_pd(f[1]), m0y)), _mm_set1_pd(f[2])); //(a,b,c) = E*p1
+        __m128d b = _mm_add_pd(_mm_add_pd(_mm_mul_pd(_mm_set1_pd(f[3]), m0x), _mm_mul_pd(_mm_set1_pd(f[4]), m0y)), _mm_set1_pd(f[5]));
+        const __m128d c = _mm_add_pd(_mm_add_pd(_mm_mul_pd(_mm_set1_pd(f[6]), m0x), _mm_mul_pd(_mm_set1_pd(f[7]), m0y)), _mm_set1_pd(f[8]));
+        const __m128d s1 = _mm_add_pd(_mm_mul_pd(a, a), _mm_mul_pd(b, b));
+        const __m128d d1 = _mm_add_pd(_mm_add_pd(_mm_mul_pd(m1x, a), _mm_mul_pd(m1y, b)), c); //p2 * (a,b,c)
+        const __m128d d1_squared = _mm_mul_pd(d1, d1);
+
+        a = _mm_add_pd(_mm_add_pd(_mm_mul_pd(_mm_set1_pd(f[0]), m1x), _mm_mul_pd(_mm_set1_pd(f[3]), m1y)), _mm_set1_pd(f[6])); //(a,b,c) = p2*E^T
+        b = _mm_add_pd(_mm_add_pd(_mm_mul_pd(_mm_set1_pd(f[1]), m1x), _mm_mul_pd(_mm_set1_pd(f[4]), m1y)), _mm_set1_pd(f[7]));
+        const __m128d s = _mm_add_pd(_mm_add_pd(_mm_mul_pd(a, a), _mm_mul_pd(b, b)), s1);
+
+        if (adErr) {
+            const __m128d err = _mm_div_pd(d1_squared, s);
+            _mm_storeu_pd(adErr + j, err);
+            nInlierBits |= _mm_movemask_pd(_mm_cmplt_pd(err, _mm_set1_pd(dThreshold_sq_use))) << j;
+        } else
+            nInlierBits |= _mm_movemask_pd(_mm_cmplt_pd(d1_squared, _mm_mul_pd(_mm_set1_pd(dThreshold_sq_use), s))) << j;
+    }
+#endif
+
+    for (; j < CCorrespondenceArrays::BLOCK; j++)
+        nInlierBits |= (int) essentialMatInlier(f, x0[j], y0[j], x1[j], y1[j], dThreshold_sq_use, adErr ? adErr + j : 0) << j;
+
+    return nInlierBits;
+}
+
+#if HAVE_AVX_INLIERS
+//As essentialMatInliers, 4 points at a time. Not HARD_INLINE: it can only be inlined into AVX code
+TARGET_AVX static inline int essentialMatInliers_avx(const double * f, const CCorrespondenceArrays & points, const int i, const double dThreshold_sq_use, double * adErr) HOT;
+TARGET_AVX static inline int essentialMatInliers_avx(const double * f, const CCorrespondenceArrays & points, const int i, const double dThreshold_sq_use, double * adErr) {
+    const double * x0 = points.x0() + i, * y0 = points.y0() + i, * x1 = points.x1() + i, * y1 = points.y1() + i;
+    const __m256d m0x = _mm256_load_pd(x0), m0y = _mm256_load_pd(y0), m1x = _mm256_load_pd(x1), m1y = _mm256_load_pd(y1);
+    __m256d a = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(f[0]), m0x), _mm256_mul_pd(_mm256_set1_pd(f[1]), m0y)), _mm256_set1_pd(f[2])); //(a,b,c) = E*p1
+    __m256d b = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(f[3]), m0x), _mm256_mul_pd(_mm256_set1_pd(f[4]), m0y)), _mm256_set1_pd(f[5]));
+    const __m256d c = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(f[6]), m0x), _mm256_mul_pd(_mm256_set1_pd(f[7]), m0y)), _mm256_set1_pd(f[8]));
+    const __m256d s1 = _mm256_add_pd(_mm256_mul_pd(a, a), _mm256_mul_pd(b, b));
+    const __m256d d1 = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(m1x, a), _mm256_mul_pd(m1y, b)), c); //p2 * (a,b,c)
+    const __m256d d1_squared = _mm256_mul_pd(d1, d1);
+
+    a = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(f[0]), m1x), _mm256_mul_pd(_mm256_set1_pd(f[3]), m1y)), _mm256_set1_pd(f[6])); //(a,b,c) = p2*E^T
+    b = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(f[1]), m1x), _mm256_mul_pd(_mm256_set1_pd(f[4]), m1y)), _mm256_set1_pd(f[7]));
+    const __m256d s = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(a, a), _mm256_mul_pd(b, b)), s1);
+
+    if (adErr) {
+        const __m256d err = _mm256_div_pd(d1_squared, s);
+        _mm256_storeu_pd(adErr, err);
+        return _mm256_movemask_pd(_mm256_cmp_pd(err, _mm256_set1_pd(dThreshold_sq_use), _CMP_LT_OQ));
+    }
+    return _mm256_movemask_pd(_mm256_cmp_pd(d1_squared, _mm256_mul_pd(_mm256_set1_pd(dThreshold_sq_use), s), _CMP_LT_OQ));
+}
+
+TARGET_AVX static void essentialMatCountInliers_avx(const double * f, const CCorrespondenceArrays & points, const double dThreshold_sq_use, CRansacTerminator * pTerminator, const int nThread, CMask & mask, double * adResiduals, int & nInlierCount) HOT;
+TARGET_AVX static void essentialMatCountInliers_avx(const double * f, const CCorrespondenceArrays & points, const double dThreshold_sq_use, CRansacTerminator * pTerminator, const int nThread, CMask & mask, double * adResiduals, int & nInlierCount) {
+    countBlockInliers<essentialMatInliers_avx>(f, points, dThreshold_sq_use, pTerminator, nThread, mask, adResiduals, nInlierCount);
+}
+#endif
+
 void CEssentialMatInlierCounter::countInliers(const CModel & model_in, CRansacTerminator * pTerminator, const int nThread, const int nBGC, CMask & mask, double * adResiduals, int & nInlierCount, double dThresholdScale) const {
     //timeInlierCounter();
     const C3x3MatModel & model = dynamic_cast<const C3x3MatModel &> (model_in);
-    pTerminator->reset();
-    int nPoints = (int) ap.size();
+    pTerminator->reset(nThread);
+    const int nPoints = points.size();
     double dThreshold_sq_use = dThreshold_sq * dThresholdScale; //Allow threshhold to be adapted when doing topdown refinement
     if(IS_DEBUG) CHECK(mask.size() != nPoints, "Mask size must match number of points")
     if(IS_DEBUG) CHECK(mask.countInliers() != 0, "Mask should be zero'd before counting inliers")
 
     nInlierCount = 0;
 
-    //For each point call isInlier
-    T2dPoints::const_iterator pPoint1 = ap.begin();
-    T2dPoints::const_iterator pPoint2 = ap_prime.begin();
-    double * pdResiduals = adResiduals;
-    CMask::iterator pMask = mask.begin();
-
-    const bool TEST_TERMINATOR = false;
-
-    ofstream * pInlierFile = 0;
-    static CStats aSuccesses, aNumTrials;
-    static int nBestInlierCount = 0;
-
-    if (TEST_TERMINATOR) {
-        pInlierFile = new ofstream("ransacTerminationLog.tsv", ios_base::app);
-        if (pTerminator->bestGoodCount() == 0) {
-            aSuccesses.add((nBestInlierCount > 20) ? 1 : 0);
-            nBestInlierCount = 0;
-
-            *pInlierFile << "RESET\n";
-            *pInlierFile << "Av num trials: ";
-            aNumTrials.writeTSVdata(*pInlierFile);
-            *pInlierFile << endl << "Success rate: ";
-            aSuccesses.writeTSVdata(*pInlierFile);
-            *pInlierFile << endl;
-        }
-    }
-
-    ofstream & inlierFile = *pInlierFile;
-    bool bTerminated = false;
-
-    for (int nPoint = nPoints; nPoint > 0; nPoint--, pPoint1++, pPoint2++, pMask++) {
-        const bool bStatus = isInlier_SE<double>(model.asDouble9(), *pPoint1, *pPoint2, adResiduals ? pdResiduals++ : 0, dThreshold_sq_use);
-
-        *pMask = bStatus;
-        
-        if (bStatus) {
-            nInlierCount++;
-            
-            if(false){ // Just verify that everything is the correct way around...
-                Eigen::Matrix3d E;
-                for(int r=0;r<3;r++)
-                    for(int c=0;c<3;c++)
-                        E(r,c) = model(r,c);
-                
-                Eigen::Vector3d x(pPoint1->getX(), pPoint1->getY(), 1);
-                Eigen::Vector3d xp(pPoint2->getX(), pPoint2->getY(), 1);
-                cout << xp.transpose() * E * x << endl;
-            }
-        }
-
-        if (!TEST_TERMINATOR) {
-            if (pTerminator->observeStatus(nThread, bStatus)) {
-                break;
-            }
-        } else {
-            if (nPoint == 1) break; //at the end already
-
-            if (pTerminator->observeStatus(nThread, bStatus)) {
-                bTerminated = true;
-                const int nTerminateAt = nPoints - (nPoint - 1);
-
-                inlierFile << "T\t" << nInlierCount << '\t' << nTerminateAt << endl;
-                aNumTrials.add(nTerminateAt);
-                break;
-            }
-        }
-    }
-
-    if (TEST_TERMINATOR) {
-        if (!bTerminated) {
-            inlierFile << "E\t" << nInlierCount << '\t' << nPoints << endl;
-            aNumTrials.add(nPoints);
-        }
+#if HAVE_AVX_INLIERS
+    if (s_bAVXInliers)
+        essentialMatCountInliers_avx(model.asDouble9(), points, dThreshold_sq_use, pTerminator, nThread, mask, adResiduals, nInlierCount);
+    else
+#endif
+        countBlockInliers<essentialMatInliers>(model.asDouble9(), points, dThreshold_sq_use, pTerminator, nThread, mask, adResiduals, nInlierCount);
+}
 
-        if (nInlierCount > nBestInlierCount)
-            nBestInlierCount = nInlierCount;
+int CEssentialMatInlierCounter::countInliers(const CModel & model_in, const int * anPoints, const int nPoints, double dThresholdScale) const {
+    const double * f = dynamic_cast<const C3x3MatModel &> (model_in).asDouble9();
+    const double dThreshold_sq_use = dThreshold_sq * dThresholdScale;
 
-        inlierFile.close();
-        delete pInlierFile;
+    int nInlierCount = 0;
+    for (int i = 0; i < nPoints; i++) {
+        const int nPoint = anPoints[i];
+        nInlierCount += essentialMatInlier(f, points.x0()[nPoint], points.y0()[nPoint], points.x1()[nPoint], points.y1()[nPoint], dThreshold_sq_use, 0);
     }
+    return nInlierCount;
 }
 
 inline bool CHomographyInlierCounter::isInlier(const C3x3MatModel & H, const CSimple2dPoint & p1, const CSimple2dPoint & p2, double * pdResidual, const double dThreshold_sq_use) const {
@@ -351,10 +457,74 @@ inline bool CHomographyInlierCounter::isInlier(const C3x3MatModel & H, const CSi
               (y'i-(h21*xi + h22*yi + h23)/(h31*xi + h32*yi + h33))2) -> min*/
 }
 
+//Reprojection error squared (as isInlier) for one point
+static inline bool homographyInlier(const double * H, const double m0x, const double m0y, const double m1x, const double m1y, const double dThreshold_sq_use, double * pdErr) HOT HARD_INLINE;
+static inline bool homographyInlier(const double * H, const double m0x, const double m0y, const double m1x, const double m1y, const double dThreshold_sq_use, double * pdErr) {
+    const double predictW_inv = 1.0 / (H[6] * m0x + H[7] * m0y + H[8]);
+    const double predictX = (H[0] * m0x + H[1] * m0y + H[2]) * predictW_inv;
+    const double predictY = (H[3] * m0x + H[4] * m0y + H[5]) * predictW_inv;
+    const double reproj_err = sqr(m1x - predictX) + sqr(m1y - predictY);
+
+    if (pdErr) *pdErr = reproj_err;
+
+    return dThreshold_sq_use > reproj_err;
+}
+
+//Reprojection error squared (as isInlier) for points [i, i+BLOCK). Returns a bit per inlier, and the errors if adErr isn't 0
+static inline int homographyInliers(const double * H, const CCorrespondenceArrays & points, const int i, const double dThreshold_sq_use, double * adErr) HOT HARD_INLINE;
+static inline int homographyInliers(const double * H, const CCorrespondenceArrays & points, const int i, const double dThreshold_sq_use, double * adErr) {
+    const double * x0 = points.x0() + i, * y0 = points.y0() + i, * x1 = points.x1() + i, * y1 = points.y1() + i;
+    int nInlierBits = 0;
+    int j = 0;
+
+#if HAVE_SSE2_INLIERS
+    for (; j < CCorrespondenceArrays::BLOCK; j += 2) {
+        const __m128d m0x = _mm_load_pd(x0 + j), m0y = _mm_load_pd(y0 + j);
+        const __m128d predictW_inv = _mm_div_pd(_mm_set1_pd(1.0), _mm_add_pd(_mm_add_pd(_mm_mul_pd(_mm_set1_pd(H[6]), m0x), _mm_mul_pd(_mm_set1_pd(H[7]), m0y)), _mm_set1_pd(H[8])));
+        const __m128d predictX = _mm_mul_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(_mm_set1_pd(H[0]), m0x), _mm_mul_pd(_mm_set1_pd(H[1]), m0y)), _mm_set1_pd(H[2])), predictW_inv);
+        const __m128d predictY = _mm_mul_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(_mm_set1_pd(H[3]), m0x), _mm_mul_pd(_mm_set1_pd(H[4]), m0y)), _mm_set1_pd(H[5])), predictW_inv);
+        const __m128d dx = _mm_sub_pd(_mm_load_pd(x1 + j), predictX), dy = _mm_sub_pd(_mm_load_pd(y1 + j), predictY);
+        const __m128d reproj_err = _mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy));
+
+        if (adErr)
+            _mm_storeu_pd(adErr + j, reproj_err);
+        nInlierBits |= _mm_movemask_pd(_mm_cmpgt_pd(_mm_set1_pd(dThreshold_sq_use), reproj_err)) << j;
+    }
+#endif
+
+    for (; j < CCorrespondenceArrays::BLOCK; j++)
+        nInlierBits |= (int) homographyInlier(H, x0[j], y0[j], x1[j], y1[j], dThreshold_sq_use, adErr ? adErr + j : 0) << j;
+
+    return nInlierBits;
+}
+
+#if HAVE_AVX_INLIERS
+//As homographyInliers, 4 points at a time
+TARGET_AVX static inline int homographyInliers_avx(const double * H, const CCorrespondenceArrays & points, const int i, const double dThreshold_sq_use, double * adErr) HOT;
+TARGET_AVX static inline int homographyInliers_avx(const double * H, const CCorrespondenceArrays & points, const int i, const double dThreshold_sq_use, double * adErr) {
+    const double * x0 = points.x0() + i, * y0 = points.y0() + i, * x1 = points.x1() + i, * y1 = points.y1() + i;
+    const __m256d m0x = _mm256_load_pd(x0), m0y = _mm256_load_pd(y0);
+    const __m256d predictW_inv = _mm256_div_pd(_mm256_set1_pd(1.0), _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(H[6]), m0x), _mm256_mul_pd(_mm256_set1_pd(H[7]), m0y)), _mm256_set1_pd(H[8])));
+    const __m256d predictX = _mm256_mul_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(H[0]), m0x), _mm256_mul_pd(_mm256_set1_pd(H[1]), m0y)), _mm256_set1_pd(H[2])), predictW_inv);
+    const __m256d predictY = _mm256_mul_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(H[3]), m0x), _mm256_mul_pd(_mm256_set1_pd(H[4]), m0y)), _mm256_set1_pd(H[5])), predictW_inv);
+    const __m256d dx = _mm256_sub_pd(_mm256_load_pd(x1), predictX), dy = _mm256_sub_pd(_mm256_load_pd(y1), predictY);
+    const __m256d reproj_err = _mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy));
+
+    if (adErr)
+        _mm256_storeu_pd(adErr, reproj_err);
+    return _mm256_movemask_pd(_mm256_cmp_pd(_mm256_set1_pd(dThreshold_sq_use), reproj_err, _CMP_GT_OQ));
+}
+
+TARGET_AVX static void homographyCountInliers_avx(const double * H, const CCorrespondenceArrays & points, const double dThreshold_sq_use, CRansacTerminator * pTerminator, const int nThread, CMask & mask, double * adResiduals, int & nInlierCount) HOT;
+TARGET_AVX static void homographyCountInliers_avx(const double * H, const CCorrespondenceArrays & points, const double dThreshold_sq_use, CRansacTerminator * pTerminator, const int nThread, CMask & mask, double * adResiduals, int & nInlierCount) {
+    countBlockInliers<homographyInliers_avx>(H, points, dThreshold_sq_use, pTerminator, nThread, mask, adResiduals, nInlierCount);
+}
+#endif
+
 void CHomographyInlierCounter::countInliers(const CModel & model_in, CRansacTerminator * pTerminator, const int nThread, const int nBGC, CMask & mask, double * adResiduals, int & nInlierCount, double dThresholdScale) const {
     const C3x3MatModel & model = dynamic_cast<const C3x3MatModel &> (model_in);
-    pTerminator->reset();
-    int nPoints = (int) ap.size();
+    pTerminator->reset(nThread);
+    const int nPoints = points.size();
     if(IS_DEBUG) CHECK(mask.size() != nPoints, "Mask size must match number of points")
     if(IS_DEBUG) CHECK(mask.countInliers() != 0, "Mask should be zero'd before counting inliers")
 
@@ -362,15 +532,22 @@ void CHomographyInlierCounter::countInliers(const CModel & model_in, CRansacTerm
 
     double dThreshold_sq_use = dThreshold_sq * dThresholdScale; //Allow threshhold to be adapted when doing topdown refinement
 
-    //For each point call isInlier
-    for (int nPoint = 0; nPoint < nPoints; nPoint++) {
-        bool bStatus = isInlier(model, ap[nPoint], ap_prime[nPoint], adResiduals ? adResiduals + nPoint : 0, dThreshold_sq_use);
+#if HAVE_AVX_INLIERS
+    if (s_bAVXInliers)
+        homographyCountInliers_avx(model.asDouble9(), points, dThreshold_sq_use, pTerminator, nThread, mask, adResiduals, nInlierCount);
+    else
+#endif
+        countBlockInliers<homographyInliers>(model.asDouble9(), points, dThreshold_sq_use, pTerminator, nThread, mask, adResiduals, nInlierCount);
+}
 
-        if (bStatus) {
-            mask[nPoint] = 1;
-            nInlierCount++;
-        }
+int CHomographyInlierCounter::countInliers(const CModel & model_in, const int * anPoints, const int nPoints, double dThresholdScale) const {
+    const double * H = dynamic_cast<const C3x3MatModel &> (model_in).asDouble9();
+    const double dThreshold_sq_use = dThreshold_sq * dThresholdScale;
 
-        if (pTerminator->observeStatus(nThread, bStatus)) return;
+    int nInlierCount = 0;
+    for (int i = 0; i < nPoints; i++) {
+        const int nPoint = anPoints[i];
+        nInlierCount += homographyInlier(H, points.x0()[nPoint], points.y0()[nPoint], points.x1()[nPoint], points.y1()[nPoint], dThreshold_sq_use, 0);
     }
+    return nInlierCount;
 }
@@ -18,6 +18,24 @@
 #include "models.h"
 #include "cRansacTerminator.h"
 #include <Eigen/Core>
+#include <boost/noncopyable.hpp>
+
+//Correspondences copied into x/y arrays (32-byte aligned, zero padded to a multiple of BLOCK) so inlier counters can test a block of points at once
+class CCorrespondenceArrays : boost::noncopyable {
+    CDynArray<double> aBuffer;
+    int nPoints, nPadded;
+    double * ax0, * ay0, * ax1, * ay1;
+public:
+    static const int BLOCK = 4;
+
+    CCorrespondenceArrays(const T2dPoints & ap, const T2dPoints & ap_prime);
+
+    int size() const { return nPoints; }
+    const double * x0() const { return ax0; }
+    const double * y0() const { return ay0; }
+    const double * x1() const { return ax1; }
+    const double * y1() const { return ay1; }
+};
 
 class CInlierCounter {
 protected:
@@ -25,15 +43,19 @@ protected:
 
     const T2dPoints & ap;
     const T2dPoints & ap_prime;
+    const CCorrespondenceArrays points; //Copy of ap and ap_prime, made once per RANSAC run
 
 public:
 
-    CInlierCounter(const double dThreshold, const T2dPoints & ap, const T2dPoints & ap_prime) : dThreshold_sq(sqr(dThreshold)), ap(ap), ap_prime(ap_prime) {
+    CInlierCounter(const double dThreshold, const T2dPoints & ap, const T2dPoints & ap_prime) : dThreshold_sq(sqr(dThreshold)), ap(ap), ap_prime(ap_prime), points(ap, ap_prime) {
     }
 
     //void so can be boost::bound. 
     virtual void countInliers(const CModel & model, CRansacTerminator * pTerminator, const int nThread, const int nBGC, CMask & mask, double * adResiduals, int & nInlierCount, double dThresholdScale) const = 0;
 
+    //Number of the points anPoints[0..nPoints-1] that are inliers (for scoring hypotheses on part of the data)
+    virtual int countInliers(const CModel & model, const int * anPoints, const int nPoints, double dThresholdScale) const = 0;
+
     double threshold_sq() const {
         return dThreshold_sq;
     };
@@ -58,6 +80,7 @@ public:
 
     //void so can be boost::bound. NOT VIRTUAL also for bind
     virtual void countInliers(const CModel & model, CRansacTerminator * pTerminator, const int nThread, const int nBGC, CMask & mask, double * adResiduals, int & nInlierCount, double dThresholdScale) const HOT;
+    virtual int countInliers(const CModel & model, const int * anPoints, const int nPoints, double dThresholdScale) const HOT;
 };
 
 class CHomographyInlierCounter : public CInlierCounter {
@@ -70,5 +93,6 @@ public:
     }
 
     virtual void countInliers(const CModel & model, CRansacTerminator * pTerminator, const int nThread, const int nBGC, CMask & mask, double * adResiduals, int & nInlierCount, double dThresholdScale) const HOT;
+    virtual int countInliers(const CModel & model, const int * anPoints, const int nPoints, double dThresholdScale) const HOT;
 };
 #endif /* INLIERCOUNTER_H_ */
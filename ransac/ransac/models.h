@@ -65,6 +65,7 @@ public:
     virtual int numModels() const = 0;
     virtual CModel & addModel() = 0;
     virtual const CModel & getData(int n) const = 0;
+    virtual void reset() = 0; //Empty, but keep the storage so it can be refilled without allocating
 
     virtual ~CModels() {
     };
@@ -86,7 +87,7 @@ public:
         nNumModels = 0;
     }
 
-    void reset() {
+    virtual void reset() {
         nNumModels = 0;
     }
 
@@ -116,7 +117,7 @@ public:
         aModels.reserve(100);
     }
 
-    void reset() {
+    virtual void reset() {
         aModels.clear();
     }
 
@@ -132,4 +133,40 @@ public:
 
 typedef CModelVector<C3x3MatModel> TEModels;
 
+//Many model sets in one allocation, for when every hypothesis set is made before any is tested (preemptive RANSAC)
+class CModelsArray {
+public:
+    virtual int size() const = 0;
+    virtual CModels & operator[](int n) = 0;
+
+    virtual ~CModelsArray() {
+    };
+};
+
+template<typename TModels>
+class CModelsArray_t : public CModelsArray {
+    TModels * aModels;
+    const int nSize;
+
+    CModelsArray_t(const CModelsArray_t &);
+    void operator=(const CModelsArray_t &);
+public:
+
+    CModelsArray_t(const int nSize) : aModels(new TModels[nSize]), nSize(nSize) {
+    }
+
+    virtual ~CModelsArray_t() {
+        delete [] aModels;
+    }
+
+    int size() const {
+        return nSize;
+    }
+
+    virtual CModels & operator[](int n) {
+        if(IS_DEBUG) CHECK(n < 0 || n >= nSize, "CModelsArray: Index OOB");
+        return aModels[n];
+    }
+};
+
 #endif /* MODELS_H_ */
@@ -24,13 +24,13 @@ int COpenCV4ptHomography::getModels_int(const TSubSet & anHypSet, CModels & pMod
 
 	//CvMat H = cvMat(3, 3, CV_64FC1, const_cast<double *>(model.asDouble9()));
 
-	//double adPoints1_data[2*4];
-	//double adPoints2_data[2*4];
+	//Point matrices on the stack, so only findHomography allocates
+	if(IS_DEBUG) CHECK(nPoints != 4, "COpenCV4ptHomography: 4 points expected");
+	double adPoints1_data[2*4];
+	double adPoints2_data[2*4];
 
-	//CvMat CvMat1 = cvMat(nPoints, 2, CV_64FC1, adPoints1_data);
-	//CvMat CvMat2 = cvMat(nPoints, 2, CV_64FC1, adPoints2_data);
-	cv::Mat CvMat1(nPoints, 2, CV_64FC1);
-	cv::Mat CvMat2(nPoints, 2, CV_64FC1);
+	cv::Mat CvMat1(nPoints, 2, CV_64FC1, adPoints1_data);
+	cv::Mat CvMat2(nPoints, 2, CV_64FC1, adPoints2_data);
 
 	for(int i=0; i<nPoints; i++)
 	{
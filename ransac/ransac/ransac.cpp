@@ -18,7 +18,11 @@
 #include <boost/bind.hpp>
 #include <boost/thread/thread.hpp>
 #include <boost/function.hpp>
+#include <boost/thread/tss.hpp>
+#include <boost/atomic.hpp>
+#include "geom/threadpool.h"
 #include <fstream>
+#include <algorithm>
 
 using namespace std;
 
@@ -41,102 +45,299 @@ void printModel(const CModel & model_in) {
 
 DEBUGONLY(CDynArray<int> vChosen;) //hacky...
 
-typedef boost::function<void( const CModel &, const int, const int, CMask &, double *, int &) > TInlierCounterFn;
-
 int MODELS; //Hack to enable the collection of stats about model counts
 
-void testOneHypothesisSetMT(
-        CSampler * pSampler, //Does not need to be TS
-        CModelHypothesiser * pHypothesise, //Must be TS
-        CIterTerminator * pIterTerminator, // Does NOT need to be TS
-        TInlierCounterFn & inlierCounter, //Does need to be TS
-        CFindBestMatching * pRefineMatches, //Does NOT need to be TS
-        CModel & bestModel, CMask & bestMask, const int nThread, boost::mutex & mxUpdateBGC) {
-    const int nHypSetSize = pSampler->hypSetSize();
-    const int nNumPoints = pSampler->numPoints();
-
-    ////////START MT
-
-    TSubSet anSample(nHypSetSize);
-    //		CHECK(5 != nHypSetSize, "Windows array size mismatch");
-    //        int anSample[5];
-
-    {
-        boost::unique_lock<boost::mutex> lock(mxUpdateBGC); //Could use a different mutex here
-        if (!pSampler->choose(anSample)) return;
+static const int MAX_RANSAC_THREADS = 16; //CSimpleTerminator keeps counts for this many threads
+static const int SAMPLE_BATCH = 4; //Samples each worker takes from the sampler at once
+
+//State shared by the workers in one doRansac call. The best good count, max iterations and iteration count are
+//atomic; mxPublish is only taken to publish a new best model, and mxSampler only to take a batch of samples.
+class CRansacShared
+{
+public:
+    CSampler * pSampler; //Does not need to be TS
+    CModelHypothesiser * pHypothesise; //Must be TS
+    CIterTerminator * pIterTerminator; //Does NOT need to be TS
+    CRansacTerminator * pTerminator; //Must be TS
+    CInlierCounter * pCounter; //Must be TS
+    CFindBestMatching * pRefineMatches; //Does NOT need to be TS
+    CModel & bestModel;
+    CMask & bestMask;
+
+    boost::mutex mxSampler, mxPublish;
+    boost::atomic<int> nBGC, nMaxIters, nItersStarted;
+
+    CRansacShared(CSampler * pSampler, CModelHypothesiser * pHypothesise, CIterTerminator * pIterTerminator, CRansacTerminator * pTerminator, CInlierCounter * pCounter, CFindBestMatching * pRefineMatches, CModel & bestModel, CMask & bestMask)
+    : pSampler(pSampler), pHypothesise(pHypothesise), pIterTerminator(pIterTerminator), pTerminator(pTerminator), pCounter(pCounter), pRefineMatches(pRefineMatches), bestModel(bestModel), bestMask(bestMask),
+    nBGC(pIterTerminator->BGC()), nMaxIters(pIterTerminator->maxIters()), nItersStarted(0) {
     }
+};
+
+//One worker's scratch space (made once per doRansac call and reused for every hypothesis set, so testing hypotheses
+//doesn't allocate) and its stream of samples
+class CRansacWorker
+{
+    CRansacShared * pShared;
+    int nThread, nBatch;
+    TSubSet anSample, anSampleStream;
+    int nStreamPos, nStreamSize;
+    boost::scoped_ptr<CModels> pModels;
+    CMask mask;
+    CDynArray<double> adResiduals;
+
+    //Refill the sample stream. Samples don't depend on the hypotheses tested, so taking several at once doesn't change them.
+    void takeSamples() {
+        const int nHypSetSize = pShared->pSampler->hypSetSize();
+        nStreamPos = nStreamSize = 0;
+
+        boost::unique_lock<boost::mutex> lock(pShared->mxSampler);
+        for (int nSample = 0; nSample < nBatch; nSample++) {
+            if (!pShared->pSampler->choose(anSample))
+                break;
 
 #ifdef _DEBUG
-    if (nNumPoints > 10 * nHypSetSize) {
-        boost::unique_lock<boost::mutex> lock(mxUpdateBGC);
+            if (pShared->pSampler->numPoints() > 10 * nHypSetSize) {
+                bool bDumpOut = false;
 
-        bool bDumpOut = false;
+                for (int i = 0; i < nHypSetSize; i++)
+                    if (vChosen.count(anSample[i]) > 2) {
+                        cout << "Warning: RANSAC sampler choosing same data point repeatedly\n";
+                        bDumpOut = true;
+                    }
 
-        for (int i = 0; i < nHypSetSize; i++)
-            if (vChosen.count(anSample[i]) > 2) {
-                cout << "Warning: RANSAC sampler choosing same data point repeatedly\n";
-                bDumpOut = true;
+                if (vChosen.size() >= nHypSetSize * 5)
+                    vChosen.popN(nHypSetSize);
+
+                for (int i = 0; i < nHypSetSize; i++)
+                    vChosen.push_back(anSample[i]);
+
+                if (bDumpOut) {
+                    for (int i = 0; i < nHypSetSize; i++)
+                        cout << anSample[i] << ' ';
+                    cout << endl;
+                }
             }
+#endif
+            for (int i = 0; i < nHypSetSize; i++)
+                anSampleStream[nStreamSize * nHypSetSize + i] = anSample[i];
+            nStreamSize++;
+        }
+    }
 
-        if (vChosen.size() >= nHypSetSize * 5)
-            vChosen.popN(nHypSetSize);
+    //False if the sampler can't choose a sample
+    bool nextSample() {
+        if (nStreamPos == nStreamSize)
+            takeSamples();
+        if (nStreamPos == nStreamSize)
+            return false;
 
+        const int nHypSetSize = anSample.size();
         for (int i = 0; i < nHypSetSize; i++)
-            vChosen.push_back(anSample[i]);
+            anSample[i] = anSampleStream[nStreamPos * nHypSetSize + i];
+        nStreamPos++;
+        return true;
+    }
 
-        if (bDumpOut) {
-            for (int i = 0; i < nHypSetSize; i++)
-                cout << anSample[i] << ' ';
-            cout << endl;
+    void testOneHypothesisSet() {
+        if (!nextSample()) return;
+
+        pShared->pHypothesise->getModels(anSample, *pModels);
+
+        nModels += pModels->numModels();
+
+        double *pdResiduals = 0;
+        if (pShared->pRefineMatches->supplyResiduals())
+            pdResiduals = adResiduals.begin();
+
+        for (int nModel = 0; nModel < pModels->numModels(); nModel++) {
+            mask.setZero();
+
+            const CModel & model = pModels->getData(nModel);
+
+            int nNewGC = 0;
+            pShared->pCounter->countInliers(model, pShared->pTerminator, nThread, pShared->nBGC, mask, pdResiduals, nNewGC, 1.0);
+
+            if (pShared->nBGC < nNewGC) {
+                boost::unique_lock<boost::mutex> lock(pShared->mxPublish);
+                pShared->pRefineMatches->refine(mask, nNewGC, pdResiduals);
+
+                if (pShared->pIterTerminator->updateBGC(nNewGC)) {
+                    model.copyInto(pShared->bestModel);
+                    mask.copyInto(pShared->bestMask);
+                    pShared->nBGC = pShared->pIterTerminator->BGC();
+                    pShared->nMaxIters = pShared->pIterTerminator->maxIters();
+                }
+            }
         }
     }
-#endif
 
-    /*bool bOdd = false;
-    for(int i=0; i< nHypSetSize; i++)
-    {
-            cout << anSample[i] << ' ';
-            if(anSample[i] % 2 == 1) bOdd = true;
+public:
+    int nIters, nModels;
+
+    CRansacWorker(CRansacShared * pShared, const int nThread, const int nBatch) : pShared(pShared), nThread(nThread), nBatch(nBatch),
+    anSample(pShared->pSampler->hypSetSize()), anSampleStream(nBatch * pShared->pSampler->hypSetSize()), nStreamPos(0), nStreamSize(0),
+    pModels(pShared->pHypothesise->makeModels()), mask(pShared->pSampler->numPoints()), adResiduals(pShared->pSampler->numPoints()), nIters(0), nModels(0) {
     }
-    cout << "=sample\n";
-    bOdd || cout << "INLIER SET\n";
-     */
 
+    //Test hypotheses until the iteration terminator's max iterations have been started (by all workers)
+    void run() {
+        //At least one iteration, as before
+        for (int nIter = pShared->nItersStarted++; nIter == 0 || nIter < pShared->nMaxIters; nIter = pShared->nItersStarted++) {
+            testOneHypothesisSet();
+            nIters++;
+        }
+    }
+};
 
-    boost::scoped_ptr<const CModels> pModels(pHypothesise->getModels(anSample));
+//Each thread calling doRansac keeps its own workers, so concurrent RANSAC calls (e.g. linking several frames at once) don't share
+//a pool. They're deleted when that thread exits, or replaced if a job throws
+static boost::thread_specific_ptr<CSharedThreadpool> s_pRansacThreadpool;
 
-    MODELS += pModels->numModels();
+static CSharedThreadpool & ransacThreadpool(const int nThreads) {
+    if (!s_pRansacThreadpool.get())
+        s_pRansacThreadpool.reset(new CSharedThreadpool(nThreads));
+    else
+        s_pRansacThreadpool->setNumThreads(nThreads);
+    return *s_pRansacThreadpool;
+}
 
-    CMask mask(nNumPoints);
+//Test hypotheses one at a time (on nThreads workers) until the iteration terminator says stop. Returns the number of iterations
+static int depthFirstRansac(CRansacShared & shared, int nThreads) {
+    if (nThreads > 1 && (!shared.pHypothesise->isThreadsafe() || !shared.pTerminator->isThreadsafe())) {
+        REPEAT(1, cout << "MT RANSAC needs a threadsafe hypothesiser and terminator, using 1 thread.\n");
+        nThreads = 1;
+    }
+    nThreads = std::min<int>(nThreads, MAX_RANSAC_THREADS);
+
+    CDynArrayOwner<CRansacWorker> apWorkers;
+    for (int nThread = 0; nThread < nThreads; nThread++)
+        apWorkers.push_back(new CRansacWorker(&shared, nThread, nThreads > 1 ? SAMPLE_BATCH : 1));
+
+    if (nThreads == 1)
+        apWorkers[0]->run();
+    else {
+        CSharedThreadpool::CLock threadpoolLock(ransacThreadpool(nThreads));
+        CThreadpool_base * pThreadpool = threadpoolLock.threadpool();
+        for (int nThread = 0; nThread < nThreads; nThread++) {
+            TNullaryFnObj fn = boost::bind(&CRansacWorker::run, apWorkers[nThread]);
+            pThreadpool->addJob(fn);
+        }
+        pThreadpool->waitForAll();
+    }
 
-    for (int nModel = 0; nModel < pModels->numModels(); nModel++) {
-        if (nModel > 0)
-            mask.setZero();
+    int nItersTotal = 0;
+    for (int nThread = 0; nThread < nThreads; nThread++) {
+        nItersTotal += apWorkers[nThread]->nIters;
+        MODELS += apWorkers[nThread]->nModels;
+    }
+    return nItersTotal;
+}
 
-        const CModel & model = pModels->getData(nModel);
+//Add each hypothesis's inlier count on anPoints[0..nPoints-1] to its score, for survivors [nFirst, nLast)
+static void scoreHypotheses(const CInlierCounter * pCounter, const CModel * const * apHypotheses, const int * anSurvivors, const int nFirst, const int nLast, const int * anPoints, const int nPoints, int * anScores) {
+    for (int nSurvivor = nFirst; nSurvivor < nLast; nSurvivor++) {
+        const int nHypothesis = anSurvivors[nSurvivor];
+        anScores[nHypothesis] += pCounter->countInliers(*apHypotheses[nHypothesis], anPoints, nPoints, 1.0);
+    }
+}
 
-        ARRAY(double, adResiduals, nNumPoints);
-        double *pdResiduals = 0;
-        if (pRefineMatches->supplyResiduals())
-            pdResiduals = PTR(adResiduals);
+struct CHigherScore {
+    const int * anScores;
 
-        int nNewGC = 0;
-        inlierCounter(model, nThread, pIterTerminator->BGC(), mask, pdResiduals, nNewGC);
+    CHigherScore(const int * anScores) : anScores(anScores) {
+    }
 
-        if (pIterTerminator->BGC() < nNewGC) {
-            //Prob need to lock here, but not for pIterTerminator. TODO: Reduce num of locks
-            boost::unique_lock<boost::mutex> lock(mxUpdateBGC); //Could use a different mutex here
-            pRefineMatches->refine(mask, nNewGC, pdResiduals);
+    bool operator()(int nHyp1, int nHyp2) const {
+        return anScores[nHyp1] > anScores[nHyp2];
+    }
+};
+
+//Breadth-first preemptive RANSAC: make all the hypotheses, then score the survivors on successive blocks of points
+//(in random order), keeping the best (pPreemptive->survivors) after each block. The best survivor is then tested on
+//all the points. Returns the number of iterations (hypothesis sets)
+static int preemptiveRansac(CRansacShared & shared, CPreemptiveIterTerminator * pPreemptive, int nThreads) {
+    nThreads = std::min<int>(nThreads, MAX_RANSAC_THREADS);
+    pPreemptive->startTimer();
+
+    //Hypotheses. Stop at half the budget so there's time to score them. Every model set is allocated at once, then filled
+    boost::scoped_ptr<CModelsArray> pModelSets(shared.pHypothesise->makeModelsArray(pPreemptive->maxIters()));
+    CDynArray<const CModel *> apHypotheses;
+    apHypotheses.reserve(pPreemptive->maxIters() * shared.pHypothesise->modelsPerIteration());
+    TSubSet anSample(shared.pSampler->hypSetSize());
+    int nIters = 0, nModelSets = 0;
+    for (; nIters < pPreemptive->maxIters() && pPreemptive->budgetUsed() < 0.5; nIters++) {
+        if (!shared.pSampler->choose(anSample))
+            continue;
+
+        CModels & models = (*pModelSets)[nModelSets++];
+        shared.pHypothesise->getModels(anSample, models);
+        for (int nModel = 0; nModel < models.numModels(); nModel++)
+            apHypotheses.push_back(&models.getData(nModel));
+    }
 
-            if (pIterTerminator->updateBGC(nNewGC)) {
-                model.copyInto(bestModel);
-                mask.copyInto(bestMask);
+    const int nHypotheses = apHypotheses.size();
+    MODELS += nHypotheses;
+    if (nHypotheses == 0)
+        return nIters;
+
+    //Points in random order, so each block is a random subset
+    const int nPoints = shared.pSampler->numPoints();
+    CDynArray<int> anOrder(nPoints);
+    for (int i = 0; i < nPoints; i++)
+        anOrder[i] = i;
+    for (int i = nPoints - 1; i > 0; i--)
+        std::swap(anOrder[i], anOrder[CRandom::Uniform(i + 1)]);
+
+    CDynArray<int> anScores(nHypotheses, 0), anSurvivors(nHypotheses);
+    for (int i = 0; i < nHypotheses; i++)
+        anSurvivors[i] = i;
+
+    int nSurvivors = nHypotheses;
+    const int nBlockSize = pPreemptive->blockSize();
+    for (int nBlock = 0, nFirstPoint = 0; nFirstPoint < nPoints && nSurvivors > 1; nBlock++, nFirstPoint += nBlockSize) {
+        if (nBlock > 0 && pPreemptive->budgetUsed() >= 1)
+            break; //Out of time; survivors have all been scored on the same points, so the best so far is used
+
+        const int nBlockPoints = std::min<int>(nBlockSize, nPoints - nFirstPoint);
+        const int nJobs = std::min<int>(nThreads, nSurvivors);
+        if (nJobs <= 1)
+            scoreHypotheses(shared.pCounter, apHypotheses.begin(), anSurvivors.begin(), 0, nSurvivors, anOrder.begin() + nFirstPoint, nBlockPoints, anScores.begin());
+        else {
+            CSharedThreadpool::CLock threadpoolLock(ransacThreadpool(nThreads));
+            CThreadpool_base * pThreadpool = threadpoolLock.threadpool();
+            for (int nJob = 0; nJob < nJobs; nJob++) {
+                TNullaryFnObj fn = boost::bind(scoreHypotheses, shared.pCounter, apHypotheses.begin(), anSurvivors.begin(), (nJob * nSurvivors) / nJobs, ((nJob + 1) * nSurvivors) / nJobs, anOrder.begin() + nFirstPoint, nBlockPoints, anScores.begin());
+                pThreadpool->addJob(fn);
             }
+            pThreadpool->waitForAll();
+        }
+
+        const int nKeep = std::min<int>(nSurvivors, CPreemptiveIterTerminator::survivors(nHypotheses, nBlock + 1));
+        if (nKeep < nSurvivors) {
+            std::nth_element(anSurvivors.begin(), anSurvivors.begin() + nKeep - 1, anSurvivors.begin() + nSurvivors, CHigherScore(anScores.begin()));
+            nSurvivors = nKeep;
         }
     }
-    ////////END MT
+
+    const int nBest = *std::min_element(anSurvivors.begin(), anSurvivors.begin() + nSurvivors, CHigherScore(anScores.begin()));
+    const CModel & bestHypothesis = *apHypotheses[nBest];
+
+    //Full inlier set for the best
+    CRansacTerminator noTerminator;
+    CMask mask(nPoints);
+    CDynArray<double> adResiduals(nPoints);
+    double * pdResiduals = shared.pRefineMatches->supplyResiduals() ? adResiduals.begin() : 0;
+    int nGC = 0;
+    shared.pCounter->countInliers(bestHypothesis, &noTerminator, 0, 0, mask, pdResiduals, nGC, 1.0);
+    shared.pRefineMatches->refine(mask, nGC, pdResiduals);
+
+    if (shared.pIterTerminator->updateBGC(nGC)) {
+        bestHypothesis.copyInto(shared.bestModel);
+        mask.copyInto(shared.bestMask);
+    }
+
+    return nIters;
 }
-//void f(int, int, int, int, int, int, int, int, int);
 
 int doRansac(
         CSampler * pSampler,
@@ -155,52 +356,11 @@ int doRansac(
 
     DEBUGONLY(vChosen.clear();) //Todo member...
 
-    if (nThreads > 1) {
-        REPEAT(1, cout << "MT RANSAC disabled (is not generally worthwhile anyway).\n");
-        nThreads = 1;
-    }
+    CRansacShared shared(pSampler, pHypothesise, pIterTerminator, pTerminator, pCounter, pRefineMatches, bestModel, bestMask);
 
-    if (nThreads > 1) {
-        CHECK(!(pHypothesise->isThreadsafe()), "getE: For multithreaded operation hypothesiser must be threadsafe");
-        CHECK(!(pTerminator->isThreadsafe()), "getE: For multithreaded operation terminator must be threadsafe");
-    }
-
-    //at most 9 args to boost::bind
-    boost::mutex mxUpdateBGC;
-    TInlierCounterFn countInliers = boost::bind(&CInlierCounter::countInliers, pCounter, _1, pTerminator, _2, _3, _4, _5, _6, 1.0);
-
-    CDynArrayOwner<boost::thread> apThreads(nThreads - 1);
-
-    do {
-        apThreads.clear();
-
-        for (int nThread = 0; nThread < nThreads - 1; nThread++) {
-            apThreads.push_back(new boost::thread(
-                    boost::bind(testOneHypothesisSetMT,
-                    pSampler,
-                    pHypothesise,
-                    pIterTerminator,
-                    boost::ref(countInliers),
-                    pRefineMatches,
-                    boost::ref(bestModel),
-                    boost::ref(bestMask),
-                    nThread,
-                    boost::ref(mxUpdateBGC))));
-        }
-
-        //Use this thread too...
-        testOneHypothesisSetMT(
-                pSampler,
-                pHypothesise,
-                pIterTerminator,
-                countInliers,
-                pRefineMatches,
-                bestModel, bestMask, 0, mxUpdateBGC);
-
-        for (int nThread = 0; nThread < nThreads - 1; nThread++) {
-            apThreads[nThread]->join();
-        }
-    } while (!pIterTerminator->terminate(nThreads)); //Tell terminator how many samples we have tried, possibly terminate.
+    CPreemptiveIterTerminator * pPreemptive = dynamic_cast<CPreemptiveIterTerminator *> (pIterTerminator);
+    const int nItersTotal = pPreemptive ? preemptiveRansac(shared, pPreemptive, nThreads) : depthFirstRansac(shared, nThreads);
+    pIterTerminator->terminate(nItersTotal); //Tell terminator how many samples we have tried
 
     /*static int s_nItersTotal = 0, s_nInliers = 0, s_nWrongInliers = 0, s_nInliersMissed = 0;
     s_nItersTotal += pIterTerminator->numIters();
@@ -276,21 +436,36 @@ int doRansac(
 //Return models
 
 const CModels * CImCorrModelHypothesiser::getModels(const TSubSet & anHypSet) {
-    CModels * pModels;
+    CModels * pModels = makeModels(); //Return a ptr to keep threadsafe
+    getModels(anHypSet, *pModels);
+    return pModels;
+}
+
+CModels * CImCorrModelHypothesiser::makeModels() const {
     if (modelsPerIteration() <= 10)
-        pModels = new T3x3MatModels; //Return a ptr to keep threadsafe
+        return new T3x3MatModels;
     else
-        pModels = new TEModels;
+        return new TEModels;
+}
+
+CModelsArray * CImCorrModelHypothesiser::makeModelsArray(const int nSets) const {
+    if (modelsPerIteration() <= 10)
+        return new CModelsArray_t<T3x3MatModels>(nSets);
+    else
+        return new CModelsArray_t<TEModels>(nSets);
+}
+
+void CImCorrModelHypothesiser::getModels(const TSubSet & anHypSet, CModels & models) {
+    models.reset();
 
-    if(IS_DEBUG) CHECK(pModels->numModels() != 0, "CModelHypothesiser::fitModel: Bad out param");
     if(IS_DEBUG) CHECK(nPoints > (int) p1.size(), "CModelHypothesiser::fitModel: Size mismatch");
     if(IS_DEBUG) CHECK(nPoints > (int) p2.size(), "CModelHypothesiser::fitModel: Size mismatch");
-    getModels_int(anHypSet, *pModels);
+    getModels_int(anHypSet, models);
 
     if (false && IS_DEBUG) {
         static int s_nFails = 0, s_nSuccesses = 0;
-        for (int nModel = 0; nModel < pModels->numModels(); nModel++) {
-            const C3x3MatModel & m = static_cast<const C3x3MatModel &> (pModels->getData(nModel));
+        for (int nModel = 0; nModel < models.numModels(); nModel++) {
+            const C3x3MatModel & m = static_cast<const C3x3MatModel &> (models.getData(nModel));
             for (int nPoint = 0; nPoint < anHypSet.size(); nPoint++) {
                 if (!CEssentialMatInlierCounter::isInlier_SE<double>(m.asDouble9(), p1[anHypSet[nPoint]], p2[anHypSet[nPoint]], 0, 0.01)) {
                     s_nFails++;
@@ -309,6 +484,4 @@ const CModels * CImCorrModelHypothesiser::getModels(const TSubSet & anHypSet) {
             }
         }
     }
-
-    return pModels;
 }
@@ -28,6 +28,9 @@ class CRANSACHomographyParams;
 
 
 //Returns number of inliers (0 on failure), fills dE with refined matrix (E11, E12, E13, E21....)
+//With nThreads > 1, hypotheses are tested by workers kept by the calling thread; the hypothesiser and terminator must
+//be threadsafe, otherwise 1 thread is used. With a CPreemptiveIterTerminator, hypotheses are scored breadth-first instead
+//(preemptive RANSAC), within its time budget.
 int doRansac(CSampler * pSampler,
 		CModelHypothesiser * pHypothesise,
 		CModelRefiner * pRefine,
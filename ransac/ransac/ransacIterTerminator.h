@@ -16,6 +16,7 @@
 #include "util/exception.h"
 #include "util/convert.h"
 #include <algorithm>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
 
 //Decide when to stop iterating (this one stops after maxiters)
 class CIterTerminator
@@ -134,4 +135,33 @@ public:
 	CPPIterTerminator(int nMaxIters, const CInlierProbs & adPriorProbs, int nChoose, double pProbSuccess) : CRansacIterTerminator(nMaxIters,  getRealisticInlierCount(adPriorProbs), nChoose, pProbSuccess) {};
 };
 
+//Breadth-first preemptive RANSAC (Nister 2005): nMaxIters hypothesis sets are generated first, then all their models are
+//scored on blocks of nBlockSize points, keeping the best half after each block. doRansac uses this scheme instead of
+//testing hypotheses one at a time when given this terminator. At most half the time budget (ms, 0 for no budget) is
+//spent generating hypotheses, and scoring stops when it's all used, so the time taken is bounded.
+class CPreemptiveIterTerminator : public CIterTerminator
+{
+	const int nBlockSize;
+	const double dTimeBudgetMs;
+	boost::posix_time::ptime start;
+
+public:
+	CPreemptiveIterTerminator(int nMaxIters, int nBlockSize, double dTimeBudgetMs) : CIterTerminator(nMaxIters), nBlockSize(nBlockSize), dTimeBudgetMs(dTimeBudgetMs) { startTimer(); }
+
+	int blockSize() const { return nBlockSize; }
+
+	//Number of the nHypotheses hypotheses kept after scoring nBlocks blocks (the preemption function)
+	static int survivors(const int nHypotheses, const int nBlocks) { return std::max<int>(1, nHypotheses >> std::min<int>(nBlocks, 30)); }
+
+	void startTimer() { start = boost::posix_time::microsec_clock::universal_time(); }
+
+	//Proportion of the time budget used since startTimer() (0 if there's no budget)
+	double budgetUsed() const
+	{
+		if(dTimeBudgetMs <= 0)
+			return 0;
+		return 0.001*(double)(boost::posix_time::microsec_clock::universal_time() - start).total_microseconds() / dTimeBudgetMs;
+	}
+};
+
 #endif /* RANSACITERTERMINATOR_H_ */
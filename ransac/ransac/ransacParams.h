@@ -21,12 +21,14 @@ PARAMCLASS(RANSAC)
 	PARAM(E_INLIER_THRESH_PX, 0.001, HUGE, 3, "E inlier threshhold in pixels. Focal length from camera calibration matrix used to translate to image coordinates. Can be set huge to change RANSAC to a simple least-squares fit (a bit hacky)")
 	PARAM(E_8PT_CUTOFF, 1, 1000000, 5, "Reject essential matrix candidates from 8pt algorithm where the singular values of F differ by this factor (they would be equal if F was a good estimate for E).")
 	PARAM(TOPDOWN_ITERS, 0, 1000, 3, "Remove outliers, then re-fit model to remaining inliers this many times.")
-	PARAME(RANSACSampler, BaySAC, "Sampling method")
+	PARAME(RANSACSampler, BaySAC, "Sampling method. PROSAC and NaiveBayes sample the most likely correspondences first, by prior prob")
 	PARAME(HypothesiseAlg, 5PtE, "Choose a hypothesis-generation algorithm, also chooses whether to find Essential or Fundamental matrix")
 	PARAM(TOPDOWN_EXPAND, .2, 10, 1.0, "Experimental: Scale up inlier threshhold when finding additional inliers (topdown refinement)")
 	PARAM(TOPDOWN_SCALEDOWN, 0.1, 1.2, 1.0, "Experimental: Reduce inlier threshhold for each topdown refinement iteration")
 	PARAME(RANSACTerminator, SimpleTerminator, "Algorithm to decide when to give up testing data points (when the inlier rate is low). WaldSAC-based terminators are too slow, NoTestTerminator or SimpleTerminator should be used.")
-	PARAME(RANSACIterTerminator, ClassicRANSAC, "Algorithm to decide when to stop iterating (because an adequate solution has been found). F+B's paper includes a simple formula (ClassicRANSAC), otherwise terminate only after MAX_ITERS")
+	PARAME(RANSACIterTerminator, ClassicRANSAC, "Algorithm to decide when to stop iterating (because an adequate solution has been found). F+B's paper includes a simple formula (ClassicRANSAC), otherwise terminate only after MAX_ITERS. Preemptive generates MAX_ITERS hypothesis sets then scores them breadth-first, within TIME_BUDGET_MS")
+	PARAM(PREEMPTIVE_BLOCK, 1, 100000, 100, "Preemptive RANSAC: number of points each hypothesis is scored on before the worst half are dropped")
+	PARAM(TIME_BUDGET_MS, 0, 100000, 0, "Preemptive RANSAC: time limit (ms) for generating and scoring hypotheses, 0 for none. Refinement of the best model is extra")
 	PARAMB(VERBOSE, false, "Output debugging info to cout")
 	PARAMB(TERMINATOR_LOG, false, "Output data on when the 'test' stage terminates (e.g. when using WaldSAC)")
 	{}
@@ -36,12 +38,14 @@ PARAMCLASS(RANSAC)
 	//CNumParamDerived<double> E_INLIER_THRESH; //This is now COMPUTED from the E_INLIER_THRESH_PX and the calibration data
 	CNumParam<double> E_INLIER_THRESH_PX, E_8PT_CUTOFF;
 	CNumParam<int> TOPDOWN_ITERS;
-	MAKEENUMPARAM3(RANSACSampler, RANSAC, BaySAC, SimSAC);
+	MAKEENUMPARAM5(RANSACSampler, RANSAC, BaySAC, SimSAC, PROSAC, NaiveBayes);
 	MAKEENUMPARAM11(HypothesiseAlg, 5PtE, 7PtE, 7PtF, 2PtE, MCE, 1PtE, 5Pt_GradientDesc, 4Pt_GradientDesc, 3Pt_GradientDesc, 7PtEFast, 5PtRt);
 	CNumParam<double> TOPDOWN_EXPAND, TOPDOWN_SCALEDOWN;
 
 	MAKEENUMPARAM5(RANSACTerminator, NoTestTerminator, SimpleTerminator, WaldSAC, BrownianBridge, BrownianBridgeLinear);
-	MAKEENUMPARAM3(RANSACIterTerminator, MaxIters, ClassicRANSAC, TerminateOnPropInliers);
+	MAKEENUMPARAM4(RANSACIterTerminator, MaxIters, ClassicRANSAC, TerminateOnPropInliers, Preemptive);
+	CNumParam<int> PREEMPTIVE_BLOCK;
+	CNumParam<double> TIME_BUDGET_MS;
 
 	CNumParam<bool> VERBOSE, TERMINATOR_LOG;
 };
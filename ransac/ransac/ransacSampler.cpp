@@ -116,30 +116,24 @@ bool CGuidedMLESACSampler::choose(TSubSet & anSample) {
     return true;
 }
 
+//Orders indices by decreasing aProb. Holds its own pointer so concurrent samplers can sort at once
 template<class dataType>
 struct orderPred {
-    static boost::mutex mxSortLock;
-    static dataType * aProb;
+    const dataType * aProb;
+
+    orderPred(const dataType * aProb) : aProb(aProb) {
+    }
 
     bool operator()(int idx1, int idx2) const {
         return aProb[idx1] > aProb[idx2];
     }
 };
 
-template<> double * orderPred<double>::aProb = 0;
-template<> int * orderPred<int>::aProb = 0;
-//Should be template<> boost::mutex orderPred<double>::mxSortLock;
-template<class dataType> boost::mutex orderPred<dataType>::mxSortLock;
-
 void CPROSACSampler::init() {
     for (int i = 0; i < N; i++)
         anOrderedIndices[i] = i;
 
-    {
-        boost::mutex::scoped_lock scoped_lock(orderPred<double>::mxSortLock); //cos we're using the sort's static
-        orderPred<double>::aProb = adPriorProb.begin();
-        std::sort(anOrderedIndices.begin(), anOrderedIndices.end(), orderPred<double>());
-    }
+    std::sort(anOrderedIndices.begin(), anOrderedIndices.end(), orderPred<double>(adPriorProb.begin()));
 
     if (bSystematic) {
         //Set up systematic ordering--add to a vector, then shuffle, :
@@ -552,8 +546,7 @@ bool chooseFromPartiallySorted(const CPointIdentifiers & pointIds, TSubSet & anS
             i--;
 
         //Now choose n-i random el's with prob lastSortVal
-        static std::vector<int> anIndices;
-        anIndices.clear();
+        std::vector<int> anIndices;
         for (int idx = 0; idx < N; idx++) {
             if (aSortVals[idx] == lastSortVal)
                 anIndices.push_back(idx);
@@ -601,8 +594,7 @@ bool chooseFromPartiallySorted(const CPointIdentifiers & pointIds, TSubSet & anS
         }
 
         //Now choose n-i random el's with prob lastSortVal
-        static std::vector<int> anIndices;
-        anIndices.clear();
+        std::vector<int> anIndices;
         for (int idx = 0; idx < N; idx++) {
             if (aSortVals[idx] == lastSortVal)
                 anIndices.push_back(idx);
@@ -646,9 +638,6 @@ bool CSimSACSampler::chooseML(TSubSet & anSample) {
 
     //Now find n peaks in histogram
     {
-        boost::mutex::scoped_lock scoped_lock(orderPred<int>::mxSortLock); //cos we're using the sort's static
-        orderPred<int>::aProb = anSampleHist.begin();
-
         CDynArray<int>::iterator endIter = anAllIndices.begin();
         if (bDisjoint) {
             endIter += min<int>(anAllIndices.size(), n * 2 * NN_MAX);
@@ -657,7 +646,7 @@ bool CSimSACSampler::chooseML(TSubSet & anSample) {
             if (endIter != anAllIndices.end()) endIter++;
         }
 
-        std::partial_sort(anAllIndices.begin(), endIter, anAllIndices.end(), orderPred<int>());
+        std::partial_sort(anAllIndices.begin(), endIter, anAllIndices.end(), orderPred<int>(anSampleHist.begin()));
     }
 
     //Essentially reverts to normal ransac when few samples have nonzero likelihood
@@ -676,8 +665,6 @@ void CNaiveBayesSampler::init() {
 bool CNaiveBayesSampler::choose(TSubSet & anSample) {
     //Choose n most likely...
     {
-        boost::mutex::scoped_lock scoped_lock(orderPred<double>::mxSortLock); //cos we're using the sort's static
-        orderPred<double>::aProb = adPriorProb.begin();
         CDynArray<int>::iterator endIter = anOrderedIndices.begin();
         if (bDisjoint) {
             endIter += min<int>(anOrderedIndices.size(), n * 2 * NN_MAX);
@@ -692,10 +679,10 @@ bool CNaiveBayesSampler::choose(TSubSet & anSample) {
         int * begin = beginIt;
         int * end = endIt;
         int * mid = endIter;
-        std::partial_sort(begin, mid, end, orderPred<double>());
+        std::partial_sort(begin, mid, end, orderPred<double>(adPriorProb.begin()));
     }
 
-    if (!chooseFromPartiallySorted<double>(pointIds, anSample, anOrderedIndices, orderPred<double>::aProb, bDisjoint)) return false;
+    if (!chooseFromPartiallySorted<double>(pointIds, anSample, anOrderedIndices, adPriorProb.begin(), bDisjoint)) return false;
 
     //...and update probs
     double dProbAllInliers = 1.0;
@@ -1071,8 +1058,7 @@ bool CBaySACSampler::choose(TSubSet & anSample) {
             pEndEquiprobRange++;
 
         //Now push all candidate indices onto a vector and sample randomly.
-        static vector<int> anEquiprobIndices;
-        anEquiprobIndices.clear();
+        vector<int> anEquiprobIndices;
 
         for (;;) {
             pEndEquiprobRange--;
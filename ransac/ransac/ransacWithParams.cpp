@@ -80,6 +80,12 @@ int getE(const T2dPoints & points0, const T2dPoints & points1, CInlierProbs & ad
         case CRANSACParams::eRANSAC:
             pSampler.reset(new CDisjointRANSACSampler(nSampleSize, pointIds));
             break;
+        case CRANSACParams::ePROSAC:
+            pSampler.reset(new CPROSACSampler(nSampleSize, pointIds, adPriorProbs, false, false));
+            break;
+        case CRANSACParams::eNaiveBayes:
+            pSampler.reset(new CNaiveBayesSampler(nSampleSize, pointIds, adPriorProbs, false));
+            break;
         default:
             THROW("RANSAC sampler parameter val not handled")
     }
@@ -123,6 +129,9 @@ int getE(const T2dPoints & points0, const T2dPoints & points1, CInlierProbs & ad
         case CRANSACParams::eTerminateOnPropInliers:
             pIterTerminator.reset(new CPropIterTerminator(PARAMS.MAX_ITERS, nCount /2));
             break;
+        case CRANSACParams::ePreemptive:
+            pIterTerminator.reset(new CPreemptiveIterTerminator(PARAMS.MAX_ITERS, PARAMS.PREEMPTIVE_BLOCK, PARAMS.TIME_BUDGET_MS));
+            break;
     }
 
     scoped_ptr<CModelRefiner> pSimpleRefiner(new COpenCV8PtEssentialMatModified(points0, points1, PARAMS.E_8PT_CUTOFF, !bFindE));
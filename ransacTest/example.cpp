@@ -14,6 +14,9 @@ Code by Tom Botterill. Documentation and license at http://www.hilandtom.com/tom
 #include "ransac/essentialMat_Eigen.h"
 #include "ransac/openCV8PtEssentialMatModified.h"
 #include <boost/smart_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
 #include <Eigen/Core>
 #include <Eigen/Geometry>
 #include <Eigen/LU>
@@ -1174,7 +1177,90 @@ void testMatMulSpeed() {
 
 }
 
-int main() {
+//Correspondences from a random camera motion, with about (1-dInlierRate)*nCount outliers
+void makeCorrespondences(const int nCount, const double dInlierRate, T2dPoints & points0, T2dPoints & points1, CPointIdentifiers & pointIds, CInlierProbs & adPriorProbs) {
+    Vector3d axis, translation;
+    axis << CRandom::Normal(), CRandom::Normal(), CRandom::Normal();
+    translation << CRandom::Normal(), CRandom::Normal(), CRandom::Normal();
+    translation.normalize();
+    C3dRotation R(axis, CRandom::Uniform(-.75, .75));
+    Matrix3d rotMat;
+    R.asMat(rotMat);
+
+    for (int i = 0; i < nCount; i++) {
+        Vector3d X = Vector3d::Random();
+        X(2) += 3; //In front
+        const Vector3d x1 = rotMat * X + translation;
+        points0[i] = CSimple2dPoint(X(0) / X(2), X(1) / X(2));
+        if (CRandom::Uniform(1.0) < dInlierRate)
+            points1[i] = CSimple2dPoint(x1(0) / x1(2) + CRandom::Normal(0, 0.001), x1(1) / x1(2) + CRandom::Normal(0, 0.001));
+        else
+            points1[i] = CSimple2dPoint(CRandom::Uniform(-1.0, 1.0), CRandom::Uniform(-1.0, 1.0));
+        pointIds[i] = CPointIds(i, i);
+        adPriorProbs[i] = CRandom::Uniform(0.1, 0.9);
+    }
+}
+
+//One thread's share of testConcurrentGetE: nCalls getE calls, each with its own copy of the prior probs (which the sampler sorts by)
+void getERepeatedly(const T2dPoints * pPoints0, const T2dPoints * pPoints1, const CPointIdentifiers * pPointIds, const CInlierProbs * pPriorProbs, const CRANSACParams * pPARAMS, const int nCalls, int * pnInliers) {
+    const int nCount = pPoints0->size();
+    *pnInliers = 0;
+    for (int nCall = 0; nCall < nCalls; nCall++) {
+        CInlierProbs adPriorProbs(nCount);
+        pPriorProbs->copyInto(adPriorProbs);
+
+        C3x3MatModel E;
+        CMask mask(nCount);
+        *pnInliers += getE(*pPoints0, *pPoints1, adPriorProbs, *pPointIds, *pPARAMS, E, mask, -1, 1, 1);
+    }
+}
+
+//Stress test for concurrent RANSAC: runs getE from 1, 2, 4, ... threads at once and prints calls per second, which
+//should scale with the number of cores (nothing is shared between RANSAC runs). Uses samplers that sort by prior prob
+void testConcurrentGetE(const int nCount, const int nCallsPerThread, const int nMaxThreads, const CRANSACParams::eRANSACSampler sampler) {
+    T2dPoints points0(nCount), points1(nCount);
+    CPointIdentifiers pointIds(nCount);
+    CInlierProbs adPriorProbs(nCount);
+    makeCorrespondences(nCount, 0.5, points0, points1, pointIds, adPriorProbs);
+
+    CRANSACParams PARAMS(0, 0);
+    PARAMS.VERBOSE = false;
+    PARAMS.E_INLIER_THRESH_PX = 0.01;
+    PARAMS.RANSACSampler = sampler;
+    PARAMS.RANSACTerminator = CRANSACParams::eSimpleTerminator;
+    PARAMS.RANSACIterTerminator = CRANSACParams::eMaxIters;
+    PARAMS.MAX_ITERS = 200;
+
+    double dCallsPerSec1Thread = 0;
+    for (int nThreads = 1; nThreads <= nMaxThreads; nThreads *= 2) {
+        std::vector<int> anInliers(nThreads);
+        const boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+        boost::thread_group threads;
+        for (int nThread = 0; nThread < nThreads; nThread++)
+            threads.create_thread(boost::bind(getERepeatedly, &points0, &points1, &pointIds, &adPriorProbs, &PARAMS, nCallsPerThread, &anInliers[nThread]));
+        threads.join_all();
+        const double dSecs = 1e-6 * (double) (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds();
+
+        const double dCallsPerSec = nThreads * nCallsPerThread / dSecs;
+        if (nThreads == 1)
+            dCallsPerSec1Thread = dCallsPerSec;
+
+        cout << nThreads << " threads: " << dCallsPerSec << " getE calls/sec (" << dCallsPerSec / dCallsPerSec1Thread << "x 1 thread), mean inliers ";
+        for (int nThread = 0; nThread < nThreads; nThread++)
+            cout << anInliers[nThread] / nCallsPerThread << ' ';
+        cout << endl;
+    }
+}
+
+int main(int argc, char ** argv) {
+
+    if (argc > 1 && std::string(argv[1]) == "--concurrent") {
+        cout << "PROSAC:\n";
+        testConcurrentGetE(500, 200, 16, CRANSACParams::ePROSAC);
+        cout << "Naive Bayes:\n";
+        testConcurrentGetE(500, 200, 16, CRANSACParams::eNaiveBayes);
+        return 0;
+    }
 
     //test5ptRoots();
     //return 0;
@@ -243,4 +243,57 @@ int testFastNorms() {
     testFastNorms_int<char, false>();
     testFastNorms_int<unsigned char, true>();
     return testFastNorms_int<char, true>();
-}
\ No newline at end of file
+}
+
+//Throughput of each SIMD norm kernel this CPU supports (fastnorms.cpp), on descriptor-sized vectors
+template<typename T, typename TResult>
+static void timeNormKernel(const char * szKernel, const char * szNorm, TResult (*pfnNorm)(const T *, const T *, int), const T * a1, const T * a2, const int LENGTH, const int VECTORS)
+{
+    const int REPEATS = 200;
+    CStopWatch s;
+    s.startTimer();
+    TResult total = 0;
+    for(int nRepeat = 0; nRepeat < REPEATS; nRepeat++)
+        for(int i=0; i<VECTORS; i++)
+            total += pfnNorm(a1 + i*LENGTH, a2 + i*LENGTH, LENGTH);
+    s.stopTimer();
+
+    const double dTime = s.getElapsedTime();
+    const double dBytes = (double)REPEATS*VECTORS*LENGTH*sizeof(T);
+    cout << szKernel << ' ' << szNorm << ": " << (dTime > 0 ? (double)REPEATS*VECTORS/dTime : 0) << " distances/s, " << (dTime > 0 ? dBytes/(dTime*1024*1024) : 0) << " MB/s (total=" << total << ")" << endl;
+}
+
+void testNormKernels()
+{
+    const int LENGTH=128, VECTORS=4096;
+
+    unsigned char * ac1 = new unsigned char[LENGTH*VECTORS], * ac2 = new unsigned char[LENGTH*VECTORS];
+    float * af1 = new float[LENGTH*VECTORS], * af2 = new float[LENGTH*VECTORS];
+    for(int i=0;i<LENGTH*VECTORS;i++)
+    {
+        ac1[i] = (unsigned char)rand();
+        ac2[i] = (unsigned char)rand();
+        af1[i] = ac1[i] / 255.0f;
+        af2[i] = ac2[i] / 255.0f;
+    }
+    const signed char * sc1 = (const signed char *)ac1, * sc2 = (const signed char *)ac2;
+
+    cout << "Using " << g_pNormKernels->szName << " norm kernels" << endl;
+    for(int eKernels = eScalarNorms; eKernels < eNumNormKernels; eKernels++)
+    {
+        const CNormKernels * pKernels = normKernels((eNormKernels)eKernels);
+        if(!pKernels)
+            continue;
+
+        timeNormKernel(pKernels->szName, "L1 uint8", pKernels->L1_u8, ac1, ac2, LENGTH, VECTORS);
+        timeNormKernel(pKernels->szName, "L1 int8", pKernels->L1_s8, sc1, sc2, LENGTH, VECTORS);
+        timeNormKernel(pKernels->szName, "SSD uint8", pKernels->SSD_u8, ac1, ac2, LENGTH, VECTORS);
+        timeNormKernel(pKernels->szName, "SSD int8", pKernels->SSD_s8, sc1, sc2, LENGTH, VECTORS);
+        timeNormKernel(pKernels->szName, "L1 float", pKernels->L1_f32, af1, af2, LENGTH, VECTORS);
+        timeNormKernel(pKernels->szName, "SSD float", pKernels->SSD_f32, af1, af2, LENGTH, VECTORS);
+        timeNormKernel(pKernels->szName, "Hamming 256-bit", pKernels->Hamming_u64, (const unsigned long long *)(void *)ac1, (const unsigned long long *)(void *)ac2, 256/64, VECTORS);
+    }
+
+    delete [] ac1; delete [] ac2;
+    delete [] af1; delete [] af2;
+}
@@ -58,5 +58,6 @@ public:
 
 void testTiming();
 int testFastNorms();
+void testNormKernels();
 
 #endif //_SPEED_TEST
\ No newline at end of file
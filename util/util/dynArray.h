@@ -111,6 +111,10 @@ public:
         return nCount;
     }
 
+    int capacity() const {
+        return nAllocated;
+    }
+
     void setConst(const T & t) {
         for (iterator pd = begin(); pd != end(); pd++)
             *pd = t;
@@ -0,0 +1,348 @@
+/* Code by Tom Botterill. Documentation and license at http://www.hilandtom.com/tombotterill/code */
+
+#include "fastnorms.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define HAVE_X86_SIMD 1
+#  include <immintrin.h>
+#  define TARGET_AVX2 __attribute__((target("avx2")))
+#  define TARGET_POPCNT __attribute__((target("popcnt")))
+#else
+#  define HAVE_X86_SIMD 0
+#endif
+
+//Scalar versions (also used for the leftovers after the last full SIMD vector)
+
+template<class CHAR>
+static int L1_scalar(const CHAR * ac1, const CHAR * ac2, int nLen)
+{
+    int d = 0;
+    for(int i=0; i<nLen; i++)
+    {
+        const int dist = (int)ac1[i] - (int)ac2[i];
+        d += dist > 0 ? dist : -dist;
+    }
+    return d;
+}
+
+template<class CHAR>
+static int SSD_scalar(const CHAR * ac1, const CHAR * ac2, int nLen)
+{
+    int d = 0;
+    for(int i=0; i<nLen; i++)
+    {
+        const int dist = (int)ac1[i] - (int)ac2[i];
+        d += dist*dist;
+    }
+    return d;
+}
+
+static int sumSquares_u8_scalar(const unsigned char * ac1, int nLen)
+{
+    int nSS = 0;
+    for(int i=0; i<nLen; i++)
+        nSS += (int)ac1[i] * (int)ac1[i];
+    return nSS;
+}
+
+static float L1_f32_scalar(const float * af1, const float * af2, int nLen)
+{
+    float d = 0;
+    for(int i=0; i<nLen; i++)
+        d += fabsf(af1[i] - af2[i]);
+    return d;
+}
+
+static float SSD_f32_scalar(const float * af1, const float * af2, int nLen)
+{
+    float d = 0;
+    for(int i=0; i<nLen; i++)
+    {
+        const float dist = af1[i] - af2[i];
+        d += dist*dist;
+    }
+    return d;
+}
+
+//Without -mpopcnt this is a bit-twiddling library call
+static int Hamming_u64_scalar(const unsigned long long * an1, const unsigned long long * an2, int nWords)
+{
+    int d = 0;
+    for(int i=0; i<nWords; i++)
+        d += __builtin_popcountll(an1[i] ^ an2[i]);
+    return d;
+}
+
+static const CNormKernels s_scalarKernels = {
+    &L1_scalar<unsigned char>, &L1_scalar<signed char>, &SSD_scalar<unsigned char>, &SSD_scalar<signed char>,
+    &sumSquares_u8_scalar, &L1_f32_scalar, &SSD_f32_scalar, &Hamming_u64_scalar, "Scalar" };
+
+#if HAVE_X86_SIMD
+
+//Signed bytes are offset by 128 into unsigned bytes; differences are unchanged
+
+static inline __m128i toUnsigned_sse2(__m128i x) { return _mm_xor_si128(x, _mm_set1_epi8((char)0x80)); }
+static inline int hsum_epi32_sse2(__m128i x)
+{
+    x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(1, 0, 3, 2)));
+    x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(x);
+}
+static inline float hsum_ps_sse2(__m128 x)
+{
+    x = _mm_add_ps(x, _mm_movehl_ps(x, x));
+    x = _mm_add_ss(x, _mm_shuffle_ps(x, x, _MM_SHUFFLE(1, 1, 1, 1)));
+    return _mm_cvtss_f32(x);
+}
+
+//Sum of squared differences of 16 unsigned bytes, as 4 ints
+static inline __m128i SSD16_sse2(__m128i a, __m128i b)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i diffLo = _mm_sub_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+    const __m128i diffHi = _mm_sub_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+    return _mm_add_epi32(_mm_madd_epi16(diffLo, diffLo), _mm_madd_epi16(diffHi, diffHi));
+}
+
+template<bool bSigned>
+static int L1_sse2(const unsigned char * ac1, const unsigned char * ac2, int nLen)
+{
+    __m128i sum = _mm_setzero_si128();
+    int i=0;
+    for(; i+16 <= nLen; i+=16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(ac1+i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(ac2+i));
+        if(bSigned) { a = toUnsigned_sse2(a); b = toUnsigned_sse2(b); }
+        sum = _mm_add_epi32(sum, _mm_sad_epu8(a, b)); //Two 16-bit sums in 64-bit lanes
+    }
+    const int d = hsum_epi32_sse2(sum);
+    if(bSigned)
+        return d + L1_scalar((const signed char *)ac1+i, (const signed char *)ac2+i, nLen-i);
+    return d + L1_scalar(ac1+i, ac2+i, nLen-i);
+}
+
+template<bool bSigned>
+static int SSD_sse2(const unsigned char * ac1, const unsigned char * ac2, int nLen)
+{
+    __m128i sum = _mm_setzero_si128();
+    int i=0;
+    for(; i+16 <= nLen; i+=16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(ac1+i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(ac2+i));
+        if(bSigned) { a = toUnsigned_sse2(a); b = toUnsigned_sse2(b); }
+        sum = _mm_add_epi32(sum, SSD16_sse2(a, b));
+    }
+    const int d = hsum_epi32_sse2(sum);
+    if(bSigned)
+        return d + SSD_scalar((const signed char *)ac1+i, (const signed char *)ac2+i, nLen-i);
+    return d + SSD_scalar(ac1+i, ac2+i, nLen-i);
+}
+
+static int L1_u8_sse2(const unsigned char * ac1, const unsigned char * ac2, int nLen) { return L1_sse2<false>(ac1, ac2, nLen); }
+static int L1_s8_sse2(const signed char * ac1, const signed char * ac2, int nLen) { return L1_sse2<true>((const unsigned char *)ac1, (const unsigned char *)ac2, nLen); }
+static int SSD_u8_sse2(const unsigned char * ac1, const unsigned char * ac2, int nLen) { return SSD_sse2<false>(ac1, ac2, nLen); }
+static int SSD_s8_sse2(const signed char * ac1, const signed char * ac2, int nLen) { return SSD_sse2<true>((const unsigned char *)ac1, (const unsigned char *)ac2, nLen); }
+
+static int sumSquares_u8_sse2(const unsigned char * ac1, int nLen)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sum = zero;
+    int i=0;
+    for(; i+16 <= nLen; i+=16)
+        sum = _mm_add_epi32(sum, SSD16_sse2(_mm_loadu_si128((const __m128i *)(ac1+i)), zero));
+
+    return hsum_epi32_sse2(sum) + sumSquares_u8_scalar(ac1+i, nLen-i);
+}
+
+static float L1_f32_sse2(const float * af1, const float * af2, int nLen)
+{
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+    __m128 sum = _mm_setzero_ps();
+    int i=0;
+    for(; i+4 <= nLen; i+=4)
+        sum = _mm_add_ps(sum, _mm_and_ps(absMask, _mm_sub_ps(_mm_loadu_ps(af1+i), _mm_loadu_ps(af2+i))));
+
+    return hsum_ps_sse2(sum) + L1_f32_scalar(af1+i, af2+i, nLen-i);
+}
+
+static float SSD_f32_sse2(const float * af1, const float * af2, int nLen)
+{
+    __m128 sum = _mm_setzero_ps();
+    int i=0;
+    for(; i+4 <= nLen; i+=4)
+    {
+        const __m128 diff = _mm_sub_ps(_mm_loadu_ps(af1+i), _mm_loadu_ps(af2+i));
+        sum = _mm_add_ps(sum, _mm_mul_ps(diff, diff));
+    }
+    return hsum_ps_sse2(sum) + SSD_f32_scalar(af1+i, af2+i, nLen-i);
+}
+
+//POPCNT isn't part of any SIMD tier (most SSE2-only CPUs since Nehalem have it), so the Hamming kernel is chosen separately. One per 64 bits is faster than a vector popcount for short strings
+TARGET_POPCNT static int Hamming_u64_popcnt(const unsigned long long * an1, const unsigned long long * an2, int nWords)
+{
+    int d = 0;
+    for(int i=0; i<nWords; i++)
+        d += __builtin_popcountll(an1[i] ^ an2[i]);
+    return d;
+}
+
+static const CNormKernels s_SSE2Kernels = {
+    &L1_u8_sse2, &L1_s8_sse2, &SSD_u8_sse2, &SSD_s8_sse2,
+    &sumSquares_u8_sse2, &L1_f32_sse2, &SSD_f32_sse2, &Hamming_u64_scalar, "SSE2" };
+
+static const CNormKernels s_SSE2PopcntKernels = {
+    &L1_u8_sse2, &L1_s8_sse2, &SSD_u8_sse2, &SSD_s8_sse2,
+    &sumSquares_u8_sse2, &L1_f32_sse2, &SSD_f32_sse2, &Hamming_u64_popcnt, "SSE2+POPCNT" };
+
+//AVX2: same as SSE2 with 32 bytes at a time. Compiled for AVX2 only here, so the rest of the program still runs anywhere
+
+TARGET_AVX2 static inline __m256i toUnsigned_avx2(__m256i x) { return _mm256_xor_si256(x, _mm256_set1_epi8((char)0x80)); }
+TARGET_AVX2 static inline int hsum_epi32_avx2(__m256i x)
+{
+    return hsum_epi32_sse2(_mm_add_epi32(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1)));
+}
+TARGET_AVX2 static inline float hsum_ps_avx2(__m256 x)
+{
+    return hsum_ps_sse2(_mm_add_ps(_mm256_castps256_ps128(x), _mm256_extractf128_ps(x, 1)));
+}
+
+TARGET_AVX2 static inline __m256i SSD32_avx2(__m256i a, __m256i b)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i diffLo = _mm256_sub_epi16(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero));
+    const __m256i diffHi = _mm256_sub_epi16(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero));
+    return _mm256_add_epi32(_mm256_madd_epi16(diffLo, diffLo), _mm256_madd_epi16(diffHi, diffHi));
+}
+
+template<bool bSigned>
+TARGET_AVX2 static int L1_avx2(const unsigned char * ac1, const unsigned char * ac2, int nLen)
+{
+    __m256i sum = _mm256_setzero_si256();
+    int i=0;
+    for(; i+32 <= nLen; i+=32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(ac1+i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(ac2+i));
+        if(bSigned) { a = toUnsigned_avx2(a); b = toUnsigned_avx2(b); }
+        sum = _mm256_add_epi32(sum, _mm256_sad_epu8(a, b));
+    }
+    const int d = hsum_epi32_avx2(sum);
+    _mm256_zeroupper(); //Tail is non-VEX code
+    return d + L1_sse2<bSigned>(ac1+i, ac2+i, nLen-i);
+}
+
+template<bool bSigned>
+TARGET_AVX2 static int SSD_avx2(const unsigned char * ac1, const unsigned char * ac2, int nLen)
+{
+    __m256i sum = _mm256_setzero_si256();
+    int i=0;
+    for(; i+32 <= nLen; i+=32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(ac1+i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(ac2+i));
+        if(bSigned) { a = toUnsigned_avx2(a); b = toUnsigned_avx2(b); }
+        sum = _mm256_add_epi32(sum, SSD32_avx2(a, b));
+    }
+    const int d = hsum_epi32_avx2(sum);
+    _mm256_zeroupper(); //Tail is non-VEX code
+    return d + SSD_sse2<bSigned>(ac1+i, ac2+i, nLen-i);
+}
+
+TARGET_AVX2 static int L1_u8_avx2(const unsigned char * ac1, const unsigned char * ac2, int nLen) { return L1_avx2<false>(ac1, ac2, nLen); }
+TARGET_AVX2 static int L1_s8_avx2(const signed char * ac1, const signed char * ac2, int nLen) { return L1_avx2<true>((const unsigned char *)ac1, (const unsigned char *)ac2, nLen); }
+TARGET_AVX2 static int SSD_u8_avx2(const unsigned char * ac1, const unsigned char * ac2, int nLen) { return SSD_avx2<false>(ac1, ac2, nLen); }
+TARGET_AVX2 static int SSD_s8_avx2(const signed char * ac1, const signed char * ac2, int nLen) { return SSD_avx2<true>((const unsigned char *)ac1, (const unsigned char *)ac2, nLen); }
+
+TARGET_AVX2 static int sumSquares_u8_avx2(const unsigned char * ac1, int nLen)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i sum = zero;
+    int i=0;
+    for(; i+32 <= nLen; i+=32)
+        sum = _mm256_add_epi32(sum, SSD32_avx2(_mm256_loadu_si256((const __m256i *)(ac1+i)), zero));
+
+    const int d = hsum_epi32_avx2(sum);
+    _mm256_zeroupper(); //Tail is non-VEX code
+    return d + sumSquares_u8_sse2(ac1+i, nLen-i);
+}
+
+TARGET_AVX2 static float L1_f32_avx2(const float * af1, const float * af2, int nLen)
+{
+    const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+    __m256 sum = _mm256_setzero_ps();
+    int i=0;
+    for(; i+8 <= nLen; i+=8)
+        sum = _mm256_add_ps(sum, _mm256_and_ps(absMask, _mm256_sub_ps(_mm256_loadu_ps(af1+i), _mm256_loadu_ps(af2+i))));
+
+    const float d = hsum_ps_avx2(sum);
+    _mm256_zeroupper(); //Tail is non-VEX code
+    return d + L1_f32_sse2(af1+i, af2+i, nLen-i);
+}
+
+TARGET_AVX2 static float SSD_f32_avx2(const float * af1, const float * af2, int nLen)
+{
+    __m256 sum = _mm256_setzero_ps();
+    int i=0;
+    for(; i+8 <= nLen; i+=8)
+    {
+        const __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(af1+i), _mm256_loadu_ps(af2+i));
+        sum = _mm256_add_ps(sum, _mm256_mul_ps(diff, diff));
+    }
+    const float d = hsum_ps_avx2(sum);
+    _mm256_zeroupper(); //Tail is non-VEX code
+    return d + SSD_f32_sse2(af1+i, af2+i, nLen-i);
+}
+
+static const CNormKernels s_AVX2Kernels = {
+    &L1_u8_avx2, &L1_s8_avx2, &SSD_u8_avx2, &SSD_s8_avx2,
+    &sumSquares_u8_avx2, &L1_f32_avx2, &SSD_f32_avx2, &Hamming_u64_scalar, "AVX2" };
+
+static const CNormKernels s_AVX2PopcntKernels = {
+    &L1_u8_avx2, &L1_s8_avx2, &SSD_u8_avx2, &SSD_s8_avx2,
+    &sumSquares_u8_avx2, &L1_f32_avx2, &SSD_f32_avx2, &Hamming_u64_popcnt, "AVX2+POPCNT" };
+
+#endif
+
+const CNormKernels * normKernels(eNormKernels eKernels)
+{
+    switch(eKernels)
+    {
+    case eScalarNorms:
+        return &s_scalarKernels;
+#if HAVE_X86_SIMD
+    case eSSE2Norms:
+        __builtin_cpu_init();
+        if(!__builtin_cpu_supports("sse2"))
+            return 0;
+        return __builtin_cpu_supports("popcnt") ? &s_SSE2PopcntKernels : &s_SSE2Kernels;
+    case eAVX2Norms:
+        __builtin_cpu_init(); //CPUID (and checks the OS saves AVX registers)
+        if(!__builtin_cpu_supports("avx2"))
+            return 0;
+        return __builtin_cpu_supports("popcnt") ? &s_AVX2PopcntKernels : &s_AVX2Kernels;
+#endif
+    default:
+        return 0;
+    }
+}
+
+static const CNormKernels * bestNormKernels()
+{
+    for(int eKernels = eNumNormKernels-1; eKernels > eScalarNorms; eKernels--)
+    {
+        const CNormKernels * pKernels = normKernels((eNormKernels)eKernels);
+        if(pKernels)
+            return pKernels;
+    }
+    return &s_scalarKernels;
+}
+
+//Constant-initialised, so distances computed by other static initialisers before the CPU check are still right
+const CNormKernels * g_pNormKernels = &s_scalarKernels;
+
+static struct CChooseNormKernels
+{
+    CChooseNormKernels() { g_pNormKernels = bestNormKernels(); }
+} s_chooseNormKernels;
@@ -10,8 +10,6 @@
 #ifndef FASTNORMS_H_
 #define FASTNORMS_H_
 
-//TODO: use <mmintrin.h>
-
 #include <iostream>
 #include "convert.h"
 
@@ -27,7 +25,7 @@ int L1dist(T * ac1, T * ac2, const int LENGTH)
     for(int i=LENGTH; i>0; i--)
     {
         //cout << (int)*ac1 << ' ' << (int)*ac2 << ' ';
-        volatile int dist = (int)*ac1-(int)*ac2;
+        const int dist = (int)*ac1-(int)*ac2;
         //cout << i << ':' << dist << endl;
 
         if(norm == eL1)
@@ -114,20 +112,6 @@ inline int L2distParallel(const unsigned char * ac1, const unsigned char * ac2,
     return nDist;
 }
 
-inline int L2distParallel(const unsigned char * ac1, const unsigned char * ac2, const int LENGTH, const int nac1SS2, const int nac2SS2)  HOT HARD_INLINE;
-
-inline int L2distParallel(const unsigned char * ac1, const unsigned char * ac2, const int LENGTH, const int nac1SS2, const int nac2SS2)
-{
-    int nSumSquared = 0;
-    if(is64bit())
-        nSumSquared = L2distParallel<unsigned long long>(ac1, ac2, LENGTH);
-    else
-        nSumSquared = L2distParallel<unsigned int>(ac1, ac2, LENGTH);
-
-    //L2distParallel returns a.^2 + 2a.b + b.^2
-    //We want a.^2 - 2a.b + b.^2 = 2a.^2 + 2b.^2 - L2distCos
-    return nac1SS2 + nac2SS2 - nSumSquared;
-}
 
 inline void GET_SETUP_MASK(unsigned long long & SETUP)
 {
@@ -208,13 +192,91 @@ inline int L1distNew(const unsigned char * ac1, const unsigned char * ac2, const
         return nDist;
 }
 
+//SIMD versions of the norms above (fastnorms.cpp). One set of kernels per instruction set; the best one the CPU supports
+//is chosen with CPUID at startup. Integer kernels give exactly the same result as the scalar versions.
+enum eNormKernels {eScalarNorms, eSSE2Norms, eAVX2Norms, eNumNormKernels};
+
+struct CNormKernels //essentially a struct
+{
+    int (*L1_u8)(const unsigned char * ac1, const unsigned char * ac2, int nLen);
+    int (*L1_s8)(const signed char * ac1, const signed char * ac2, int nLen);
+    int (*SSD_u8)(const unsigned char * ac1, const unsigned char * ac2, int nLen);
+    int (*SSD_s8)(const signed char * ac1, const signed char * ac2, int nLen);
+    int (*sumSquares_u8)(const unsigned char * ac1, int nLen);
+    float (*L1_f32)(const float * af1, const float * af2, int nLen);
+    float (*SSD_f32)(const float * af1, const float * af2, int nLen);
+    int (*Hamming_u64)(const unsigned long long * an1, const unsigned long long * an2, int nWords);
+    const char * szName;
+};
+
+extern const CNormKernels * g_pNormKernels; //Scalar until the CPU has been checked (during static initialisation)
+
+const CNormKernels * normKernels(eNormKernels eKernels); //0 if this CPU doesn't support them. For benchmarking
+
+//Drop-in replacements for L1Dist and euclidDist (convert.h) that use the SIMD kernels for byte vectors
+
+template<class CHAR>
+inline int fastL1Dist(const CHAR * ac1, const CHAR * ac2, int nLen)
+{
+    return L1Dist<CHAR>(ac1, ac2, nLen);
+}
+
+template<class CHAR>
+inline int fastEuclidDist(const CHAR * ac1, const CHAR * ac2, int nLen)
+{
+    return euclidDist<CHAR>(ac1, ac2, nLen);
+}
+
+inline int fastL1Dist(const unsigned char * ac1, const unsigned char * ac2, int nLen)
+{
+    return g_pNormKernels->L1_u8(ac1, ac2, nLen);
+}
+
+inline int fastL1Dist(const signed char * ac1, const signed char * ac2, int nLen)
+{
+    return g_pNormKernels->L1_s8(ac1, ac2, nLen);
+}
+
+inline int fastL1Dist(const char * ac1, const char * ac2, int nLen)
+{
+    if((char)-1 < 0)
+        return g_pNormKernels->L1_s8((const signed char *)ac1, (const signed char *)ac2, nLen);
+    else
+        return g_pNormKernels->L1_u8((const unsigned char *)ac1, (const unsigned char *)ac2, nLen);
+}
+
+inline int fastEuclidDist(const unsigned char * ac1, const unsigned char * ac2, int nLen)
+{
+    return g_pNormKernels->SSD_u8(ac1, ac2, nLen);
+}
+
+inline int fastEuclidDist(const signed char * ac1, const signed char * ac2, int nLen)
+{
+    return g_pNormKernels->SSD_s8(ac1, ac2, nLen);
+}
+
+inline int fastEuclidDist(const char * ac1, const char * ac2, int nLen)
+{
+    if((char)-1 < 0)
+        return g_pNormKernels->SSD_s8((const signed char *)ac1, (const signed char *)ac2, nLen);
+    else
+        return g_pNormKernels->SSD_u8((const unsigned char *)ac1, (const unsigned char *)ac2, nLen);
+}
+
+//Patches are quantised to 0..127 for these so the SWAR versions don't overflow. Same results from the SIMD kernels
 inline int L1distParallel(const unsigned char * ac1, const unsigned char * ac2, const int LENGTH) HOT HARD_INLINE;
 inline int L1distParallel(const unsigned char * ac1, const unsigned char * ac2, const int LENGTH)
 {
-    if(is64bit())
-        return L1distNew<unsigned long long, eL1>(ac1, ac2, LENGTH);
-    else
-        return L1distNew<unsigned int, eL1>(ac1, ac2, LENGTH);
+    return g_pNormKernels->L1_u8(ac1, ac2, LENGTH);
+}
+
+inline int L2distParallel(const unsigned char * ac1, const unsigned char * ac2, const int LENGTH)  HOT HARD_INLINE;
+
+//The SWAR version returned a.^2 + 2a.b + b.^2, and needed precomputed sums of squares to get a.^2 - 2a.b + b.^2. The SIMD
+//kernels compute a.^2 - 2a.b + b.^2 directly
+inline int L2distParallel(const unsigned char * ac1, const unsigned char * ac2, const int LENGTH)
+{
+    return g_pNormKernels->SSD_u8(ac1, ac2, LENGTH);
 }
 
 #endif /* FASTNORMS_H_ */